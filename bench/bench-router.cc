@@ -0,0 +1,651 @@
+/*
+ * Copyright (c) 2017, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+/*
+ * bench-router.cc  in-process shuffle_router for benchmarks
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mercury-progressor/mercury-progressor.h>
+
+#include "bench-router.h"
+
+/*
+ * bnx_hg: one mercury instance (class+context+progressor)
+ */
+struct bnx_hg {
+  hg_class_t *cls;
+  hg_context_t *ctx;
+  progressor_handle_t *phand;
+  char addrstr[256];               /* our self address as a string */
+};
+
+/*
+ * bnx_rank: routing state for one simulated rank (our router arg).
+ * laddrs[] is indexed by core# on our node, raddrs[] by node# (only
+ * set for the remote nodes we are the SRCREP for).
+ */
+struct bnx_rank {
+  struct bnx_world *w;             /* world we belong to */
+  int issink;                      /* we are the sink */
+  int grank;                       /* our global rank */
+  int node;                        /* our node# */
+  int core;                        /* our core# (local rank) */
+  struct bnx_hg lhg;               /* local mercury */
+  struct bnx_hg rhg;               /* remote mercury (unused if single) */
+  progressor_handle_t *rphand;     /* remote progressor handle */
+  hg_addr_t *laddrs;               /* local class addrs of local ranks */
+  hg_addr_t *raddrs;               /* remote class addrs of DSTREPs */
+  hg_addr_t *daddrs;               /* remote class addrs, by grank */
+  int routing;                     /* SHUFFLE_ROUTE_* mode */
+  int nreps;                       /* #SRCREPs per remote node (0 = 1) */
+  hg_addr_t lsink;                 /* sink mode: sink's local addr */
+  hg_addr_t rsink;                 /* sink mode: sink's remote addr */
+  shuffle_t sh;                    /* memory mode: our shuffle */
+};
+
+/*
+ * bnx_world: all the ranks
+ */
+struct bnx_world {
+  int nnodes;                      /* number of simulated nodes */
+  int ncores;                      /* ranks per node */
+  int nranks;                      /* nnodes * ncores */
+  int single;                      /* one mercury per rank */
+  int nrails;                      /* contexts for remote class (rails) */
+  int mem;                         /* memory mode (no mercury) */
+  int nreal;                       /* #ranks in ranks[] */
+  struct bnx_rank *ranks;          /* real ranks (all, or just 0 if sink) */
+  struct bnx_rank *sink;           /* the sink (sink mode only) */
+};
+
+/*
+ * bnx_hginit: start a mercury instance and get its address
+ *
+ * @param hg the bnx_hg to init
+ * @param proto mercury proto to use
+ * @param nctx number of contexts the class must allow (for rails)
+ * @return 0 or -1 on error
+ */
+static int bnx_hginit(struct bnx_hg *hg, const char *proto, int nctx) {
+  struct hg_init_info hii;
+  hg_addr_t self;
+  hg_size_t sz = sizeof(hg->addrstr);
+
+  memset(&hii, 0, sizeof(hii));
+  hii.na_init_info.max_contexts = (nctx > 1) ? nctx : 1;
+  hg->cls = HG_Init_opt(proto, HG_TRUE, &hii);
+  if (hg->cls == NULL) {
+    fprintf(stderr, "bnx_hginit: HG_Init(%s) failed\n", proto);
+    return(-1);
+  }
+  hg->ctx = HG_Context_create(hg->cls);
+  if (hg->ctx == NULL) {
+    fprintf(stderr, "bnx_hginit: HG_Context_create failed\n");
+    return(-1);
+  }
+  if (HG_Addr_self(hg->cls, &self) != HG_SUCCESS) {
+    fprintf(stderr, "bnx_hginit: HG_Addr_self failed\n");
+    return(-1);
+  }
+  if (HG_Addr_to_string(hg->cls, hg->addrstr, &sz, self) != HG_SUCCESS) {
+    fprintf(stderr, "bnx_hginit: HG_Addr_to_string failed\n");
+    HG_Addr_free(hg->cls, self);
+    return(-1);
+  }
+  HG_Addr_free(hg->cls, self);
+  hg->phand = mercury_progressor_init(hg->cls, hg->ctx);
+  if (hg->phand == NULL) {
+    fprintf(stderr, "bnx_hginit: mercury_progressor_init failed\n");
+    return(-1);
+  }
+  return(0);
+}
+
+/*
+ * bnx_hgfree: shutdown a mercury instance (ok if partly init'd)
+ *
+ * @param hg the bnx_hg to free
+ */
+static void bnx_hgfree(struct bnx_hg *hg) {
+  if (hg->phand)
+    mercury_progressor_freehandle(hg->phand);
+  if (hg->ctx)
+    HG_Context_destroy(hg->ctx);
+  if (hg->cls)
+    HG_Finalize(hg->cls);
+  memset(hg, 0, sizeof(*hg));
+}
+
+/*
+ * memory mode addresses: a token that encodes the global rank (+1 so
+ * that it is never NULL).  in sink mode each simulated rank still gets
+ * its own token, so rank 0 has one outqueue per peer.
+ */
+#define BNX_MEMADDR(R) ((hg_addr_t)(uintptr_t)((R) + 1))
+#define BNX_MEMRANK(A) ((int)((uintptr_t)(A)) - 1)
+
+/*
+ * bnx_remhg: get the mercury instance a rank uses for remote traffic
+ */
+static struct bnx_hg *bnx_remhg(struct bnx_rank *br) {
+  return((br->w->single) ? &br->lhg : &br->rhg);
+}
+
+/*
+ * bnx_dstrep: global rank of the DSTREP on node "n" for traffic
+ * from node "s" (see top of bench-router.h)
+ */
+static int bnx_dstrep(struct bnx_world *w, int s, int n) {
+  return(n * w->ncores + (s % w->ncores));
+}
+
+/*
+ * bnx_rankinit: start mercury for a rank (or the sink)
+ *
+ * @param br the rank to init
+ * @param lproto local proto
+ * @param rproto remote proto (NULL if single)
+ * @return 0 or -1 on error
+ */
+static int bnx_rankinit(struct bnx_rank *br, const char *lproto,
+                        const char *rproto) {
+  if (br->w->mem)
+    return(0);
+  /* the remote class (lhg if single) holds the shuffle's rails */
+  if (bnx_hginit(&br->lhg, lproto, (rproto) ? 1 : br->w->nrails) < 0)
+    return(-1);
+  if (rproto && bnx_hginit(&br->rhg, rproto, br->w->nrails) < 0)
+    return(-1);
+  br->rphand = mercury_progressor_duphandle(bnx_remhg(br)->phand);
+  return((br->rphand) ? 0 : -1);
+}
+
+/*
+ * bnx_lookup: lookup a peer's address.  in sink mode the sink plays
+ * many peers, so we look it up once and give each peer its own dup
+ * (the shuffle keys its outqueues by hg_addr_t).
+ *
+ * @param br the rank doing the lookup
+ * @param remote lookup the remote (1) or local (0) address
+ * @param peer the peer to lookup
+ * @param grank the global rank peer is playing
+ * @param out the result is placed here
+ * @return 0 or -1 on error
+ */
+static int bnx_lookup(struct bnx_rank *br, int remote, struct bnx_rank *peer,
+                      int grank, hg_addr_t *out) {
+  struct bnx_hg *hg = (remote) ? bnx_remhg(br) : &br->lhg;
+  struct bnx_hg *phg = (remote) ? bnx_remhg(peer) : &peer->lhg;
+  hg_addr_t *cache;
+
+  if (br->w->mem) {
+    *out = BNX_MEMADDR(grank);
+    return(0);
+  }
+  if (!peer->issink) {
+    if (HG_Addr_lookup2(hg->cls, phg->addrstr, out) != HG_SUCCESS)
+      goto err;
+    return(0);
+  }
+
+  cache = (remote) ? &br->rsink : &br->lsink;
+  if (*cache == NULL &&
+      HG_Addr_lookup2(hg->cls, phg->addrstr, cache) != HG_SUCCESS)
+    goto err;
+  if (HG_Addr_dup(hg->cls, *cache, out) != HG_SUCCESS)
+    goto err;
+  return(0);
+
+err:
+  fprintf(stderr, "bnx_lookup: %s lookup %s failed\n",
+          (remote) ? "remote" : "local", phg->addrstr);
+  return(-1);
+}
+
+/*
+ * bnx_peer: get the bnx_rank that plays a global rank
+ */
+static struct bnx_rank *bnx_peer(struct bnx_world *w, int grank) {
+  return((w->sink && grank != 0) ? w->sink : &w->ranks[grank]);
+}
+
+/*
+ * bnx_create: create a world of simulated ranks
+ */
+struct bnx_world *bnx_create(int nnodes, int ncores, const char *lproto,
+                             const char *rproto, int sink, int nrails) {
+  struct bnx_world *w;
+  struct bnx_rank *br;
+  int lcv, c, n, peer;
+
+  if (nnodes < 1 || ncores < 1 || nrails > SHUFFLE_MAXRAILS)
+    return(NULL);
+  w = (struct bnx_world *)calloc(1, sizeof(*w));
+  if (!w)
+    return(NULL);
+  w->nnodes = nnodes;
+  w->ncores = ncores;
+  w->nranks = nnodes * ncores;
+  w->single = (rproto == NULL);
+  w->nrails = (nrails > 1) ? nrails : 1;
+  w->mem = (lproto == NULL);
+  w->nreal = (sink) ? 1 : w->nranks;
+  w->ranks = (struct bnx_rank *)calloc(w->nreal, sizeof(*w->ranks));
+  if (!w->ranks)
+    goto err;
+  if (sink) {
+    w->sink = (struct bnx_rank *)calloc(1, sizeof(*w->sink));
+    if (!w->sink)
+      goto err;
+    w->sink->w = w;
+    w->sink->issink = 1;
+    w->sink->grank = w->nranks;
+    if (bnx_rankinit(w->sink, lproto, rproto) < 0)
+      goto err;
+  }
+
+  /* pass 1: start all the mercury instances */
+  for (lcv = 0 ; lcv < w->nreal ; lcv++) {
+    br = &w->ranks[lcv];
+    br->w = w;
+    br->grank = lcv;
+    br->node = lcv / ncores;
+    br->core = lcv % ncores;
+    br->laddrs = (hg_addr_t *)calloc(ncores, sizeof(hg_addr_t));
+    br->raddrs = (hg_addr_t *)calloc(nnodes, sizeof(hg_addr_t));
+    if (!br->laddrs || !br->raddrs)
+      goto err;
+    if (bnx_rankinit(br, lproto, rproto) < 0)
+      goto err;
+  }
+
+  /* pass 2: lookup all the addresses we need */
+  for (lcv = 0 ; lcv < w->nreal ; lcv++) {
+    br = &w->ranks[lcv];
+    for (c = 0 ; c < ncores ; c++) {
+      peer = br->node * ncores + c;
+      if (bnx_lookup(br, 0, bnx_peer(w, peer), peer, &br->laddrs[c]) < 0)
+        goto err;
+    }
+    for (n = 0 ; n < nnodes ; n++) {
+      if (n == br->node || (n % ncores) != br->core)
+        continue;           /* not our remote node */
+      peer = bnx_dstrep(w, br->node, n);
+      if (bnx_lookup(br, 1, bnx_peer(w, peer), peer, &br->raddrs[n]) < 0)
+        goto err;
+    }
+  }
+
+  return(w);
+
+err:
+  bnx_destroy(w);
+  return(NULL);
+}
+
+/*
+ * bnx_arg: get the router arg for a rank in a world
+ */
+void *bnx_arg(struct bnx_world *w, int rank) {
+  if (rank == BNX_SINK)
+    return(w->sink);
+  if (rank < 0 || rank >= w->nreal)
+    return(NULL);
+  return(&w->ranks[rank]);
+}
+
+/*
+ * bnx_setshuffle: set the shuffle that plays a rank (memory mode)
+ */
+void bnx_setshuffle(struct bnx_world *w, int rank, shuffle_t sh) {
+  struct bnx_rank *br = (struct bnx_rank *)bnx_arg(w, rank);
+
+  if (br)
+    br->sh = sh;
+}
+
+/*
+ * bnx_rankaddrs: free a rank's peer addresses
+ */
+static void bnx_rankaddrs(struct bnx_rank *br) {
+  struct bnx_world *w = br->w;
+  int c, n;
+
+  if (w->mem) {           /* just tokens */
+    free(br->laddrs);
+    free(br->raddrs);
+    free(br->daddrs);
+    return;
+  }
+  if (br->laddrs) {
+    for (c = 0 ; c < w->ncores ; c++)
+      if (br->laddrs[c]) HG_Addr_free(br->lhg.cls, br->laddrs[c]);
+    free(br->laddrs);
+  }
+  if (br->raddrs) {
+    for (n = 0 ; n < w->nnodes ; n++)
+      if (br->raddrs[n]) HG_Addr_free(bnx_remhg(br)->cls, br->raddrs[n]);
+    free(br->raddrs);
+  }
+  if (br->daddrs) {
+    for (n = 0 ; n < w->nranks ; n++)
+      if (br->daddrs[n]) HG_Addr_free(bnx_remhg(br)->cls, br->daddrs[n]);
+    free(br->daddrs);
+  }
+  if (br->lsink)
+    HG_Addr_free(br->lhg.cls, br->lsink);
+  if (br->rsink)
+    HG_Addr_free(bnx_remhg(br)->cls, br->rsink);
+  if (br->rphand)
+    mercury_progressor_freehandle(br->rphand);
+}
+
+/*
+ * bnx_destroy: free a world
+ */
+void bnx_destroy(struct bnx_world *w) {
+  int lcv;
+
+  if (w->ranks) {
+    for (lcv = 0 ; lcv < w->nreal ; lcv++) {
+      if (w->ranks[lcv].w)
+        bnx_rankaddrs(&w->ranks[lcv]);
+    }
+  }
+  if (w->sink && w->sink->rphand)
+    mercury_progressor_freehandle(w->sink->rphand);
+
+  /* finalize only after every rank has freed its peer addrs */
+  if (w->ranks) {
+    for (lcv = 0 ; lcv < w->nreal ; lcv++) {
+      bnx_hgfree(&w->ranks[lcv].rhg);
+      bnx_hgfree(&w->ranks[lcv].lhg);
+    }
+    free(w->ranks);
+  }
+  if (w->sink) {
+    bnx_hgfree(&w->sink->rhg);
+    bnx_hgfree(&w->sink->lhg);
+    free(w->sink);
+  }
+  free(w);
+}
+
+/*
+ * bnx_direct_addr: remote addr of any rank, for direct queues and 2
+ * hop routing.  we look them up on demand and keep them until the
+ * world is destroyed.
+ */
+static int bnx_direct_addr(void *rarg, int rank, hg_addr_t *addr) {
+  struct bnx_rank *br = (struct bnx_rank *)rarg;
+  struct bnx_world *w = br->w;
+
+  if (br->issink || rank < 0 || rank >= w->nranks)
+    return(-1);
+  if (br->daddrs == NULL) {
+    br->daddrs = (hg_addr_t *)calloc(w->nranks, sizeof(hg_addr_t));
+    if (br->daddrs == NULL)
+      return(-1);
+  }
+  if (br->daddrs[rank] == NULL &&
+      bnx_lookup(br, 1, bnx_peer(w, rank), rank, &br->daddrs[rank]) < 0)
+    return(-1);
+  *addr = br->daddrs[rank];
+  return(0);
+}
+
+/*
+ * bnx_isrep: are we a SRCREP for remote node "n"?  node n's SRCREPs
+ * are cores (n + i) % M for i < nreps.  the first is the usual nexus
+ * choice.
+ */
+static int bnx_isrep(struct bnx_rank *br, int n) {
+  int m = br->w->ncores;
+  int k = (br->nreps > 1) ? br->nreps : 1;
+
+  return((br->core - n % m + m) % m < k);
+}
+
+/*
+ * bnx_netpeer: is "peer" one of our network peers in a 2 hop mode?
+ * NOSRCREP: the rank with our core# on every other node.
+ * NODSTREP: every rank on the nodes we are SRCREP for.
+ */
+static int bnx_netpeer(struct bnx_rank *br, int peer) {
+  struct bnx_world *w = br->w;
+  int pnode = peer / w->ncores;
+
+  if (pnode == br->node)
+    return(0);
+  if (br->routing == SHUFFLE_ROUTE_NOSRCREP)
+    return(peer % w->ncores == br->core);
+  return(bnx_isrep(br, pnode));
+}
+
+/*
+ * bnx_set_routing: switch to a 2 hop mode and lookup the extra
+ * network addrs it needs (so next_hop still never blocks)
+ */
+static int bnx_set_routing(void *rarg, int routing) {
+  struct bnx_rank *br = (struct bnx_rank *)rarg;
+  hg_addr_t addr;
+  int peer;
+
+  if (routing != SHUFFLE_ROUTE_3HOP && routing != SHUFFLE_ROUTE_NOSRCREP &&
+      routing != SHUFFLE_ROUTE_NODSTREP)
+    return(-1);
+  br->routing = routing;
+  if (br->issink || routing == SHUFFLE_ROUTE_3HOP)
+    return(0);
+  for (peer = 0 ; peer < br->w->nranks ; peer++) {
+    if (bnx_netpeer(br, peer) && bnx_direct_addr(br, peer, &addr) < 0)
+      return(-1);
+  }
+  return(0);
+}
+
+/*
+ * bnx_set_srcreps: serve each remote node with nreps SRCREPs and
+ * lookup the addrs of the extra nodes we now serve
+ */
+static int bnx_set_srcreps(void *rarg, int nreps) {
+  struct bnx_rank *br = (struct bnx_rank *)rarg;
+  struct bnx_world *w = br->w;
+  hg_addr_t addr;
+  int n, peer;
+
+  if (nreps < 1 || nreps > w->ncores)
+    return(-1);
+  br->nreps = nreps;
+  if (br->issink)
+    return(0);
+  for (n = 0 ; n < w->nnodes ; n++) {
+    if (n == br->node || !bnx_isrep(br, n))
+      continue;
+    if (br->routing == SHUFFLE_ROUTE_NODSTREP) {
+      for (peer = n * w->ncores ; peer < (n + 1) * w->ncores ; peer++)
+        if (bnx_direct_addr(br, peer, &addr) < 0)
+          return(-1);
+    } else if (br->raddrs[n] == NULL) {
+      peer = bnx_dstrep(w, br->node, n);
+      if (bnx_lookup(br, 1, bnx_peer(w, peer), peer, &br->raddrs[n]) < 0)
+        return(-1);
+    }
+  }
+  return(0);
+}
+
+/*
+ * router functions
+ */
+static nexus_ret_t bnx_next_hop(void *rarg, int dest, int *rank,
+                                hg_addr_t *addr) {
+  struct bnx_rank *br = (struct bnx_rank *)rarg;
+  struct bnx_world *w = br->w;
+  int dnode, rep;
+
+  if (br->issink)
+    return(NX_DONE);          /* sink takes everything */
+  if (dest < 0 || dest >= w->nranks)
+    return(NX_NOTFOUND);
+  if (dest == br->grank)
+    return(NX_DONE);
+
+  dnode = dest / w->ncores;
+  if (dnode == br->node) {
+    *rank = dest;
+    *addr = br->laddrs[dest % w->ncores];
+    return(NX_ISLOCAL);
+  }
+
+  if (br->routing == SHUFFLE_ROUTE_NOSRCREP) {
+    *rank = dnode * w->ncores + br->core;
+    *addr = br->daddrs[*rank];
+    return(NX_DESTREP);
+  }
+
+  rep = dnode % w->ncores;
+  if (!bnx_isrep(br, dnode)) {
+    *rank = br->node * w->ncores + rep;
+    *addr = br->laddrs[rep];
+    return(NX_SRCREP);
+  }
+
+  if (br->routing == SHUFFLE_ROUTE_NODSTREP) {
+    *rank = dest;
+    *addr = br->daddrs[dest];
+    return(NX_DESTREP);
+  }
+  *rank = bnx_dstrep(w, br->node, dnode);
+  *addr = br->raddrs[dnode];
+  return(NX_DESTREP);
+}
+
+static int bnx_global_rank(void *rarg) {
+  return(((struct bnx_rank *)rarg)->grank);
+}
+
+static int bnx_global_size(void *rarg) {
+  struct bnx_rank *br = (struct bnx_rank *)rarg;
+  return(br->w->nranks + br->issink);     /* sink's rank is nranks */
+}
+
+static int bnx_iterate(void *rarg, int local, shuffle_peerfn_t fn,
+                       void *fnarg) {
+  struct bnx_rank *br = (struct bnx_rank *)rarg;
+  struct bnx_world *w = br->w;
+  int lcv, rv, peer;
+
+  if (br->issink)
+    return(0);                /* sink never sends */
+
+  if (local) {
+    for (lcv = 0 ; lcv < w->ncores ; lcv++) {
+      rv = fn(fnarg, br->laddrs[lcv], br->node * w->ncores + lcv, lcv);
+      if (rv != 0)
+        return(rv);
+    }
+    return(0);
+  }
+
+  if (br->routing != SHUFFLE_ROUTE_3HOP) {
+    for (peer = 0 ; br->daddrs && peer < w->nranks ; peer++) {
+      if (br->daddrs[peer] == NULL || !bnx_netpeer(br, peer))
+        continue;             /* not one of ours */
+      rv = fn(fnarg, br->daddrs[peer], peer, peer / w->ncores);
+      if (rv != 0)
+        return(rv);
+    }
+    return(0);
+  }
+
+  for (lcv = 0 ; lcv < w->nnodes ; lcv++) {
+    if (br->raddrs[lcv] == NULL)
+      continue;               /* not one of ours */
+    rv = fn(fnarg, br->raddrs[lcv], bnx_dstrep(w, br->node, lcv), lcv);
+    if (rv != 0)
+      return(rv);
+  }
+  return(0);
+}
+
+static progressor_handle_t *bnx_localprogressor(void *rarg) {
+  return(((struct bnx_rank *)rarg)->lhg.phand);
+}
+
+static progressor_handle_t *bnx_remoteprogressor(void *rarg) {
+  return(((struct bnx_rank *)rarg)->rphand);
+}
+
+static int bnx_srcreps(void *rarg, int dest, int *ranks, hg_addr_t *addrs) {
+  struct bnx_rank *br = (struct bnx_rank *)rarg;
+  struct bnx_world *w = br->w;
+  int dnode, lcv, core;
+
+  if (br->issink || dest < 0 || dest >= w->nranks)
+    return(0);
+  dnode = dest / w->ncores;
+  if (dnode == br->node)
+    return(0);
+  for (lcv = 0 ; lcv < br->nreps ; lcv++) {
+    core = (dnode + lcv) % w->ncores;
+    ranks[lcv] = br->node * w->ncores + core;
+    addrs[lcv] = br->laddrs[core];
+  }
+  return(lcv);
+}
+
+static struct shuffle *bnx_memdst(void *rarg, hg_addr_t addr) {
+  struct bnx_rank *br = (struct bnx_rank *)rarg;
+  int rank = BNX_MEMRANK(addr);
+
+  if (rank < 0 || rank >= br->w->nranks)
+    return(NULL);
+  return(bnx_peer(br->w, rank)->sh);
+}
+
+const struct shuffle_router bnx_router = {
+  bnx_next_hop, bnx_global_rank, bnx_global_size, bnx_iterate,
+  bnx_localprogressor, bnx_remoteprogressor, NULL, bnx_direct_addr,
+  bnx_set_routing, bnx_set_srcreps, bnx_srcreps,
+};
+
+const struct shuffle_router bnx_memrouter = {
+  bnx_next_hop, bnx_global_rank, bnx_global_size, bnx_iterate,
+  NULL, NULL, bnx_memdst, bnx_direct_addr, bnx_set_routing,
+  bnx_set_srcreps, bnx_srcreps,
+};
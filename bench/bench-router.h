@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2017, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+/*
+ * bench-router.h  in-process shuffle_router for benchmarks
+ */
+
+/*
+ * the real nexus bootstraps over MPI and gives each process one
+ * nexus_ctx_t.  for single process benchmarks we instead create a
+ * "world" of N nodes x M cores simulated ranks (rank = node*M + core),
+ * each with its own mercury instance(s), and route between them with
+ * bnx_router (passed to shuffle_init_router()).  routing follows the
+ * nexus 3 hop scheme: remote node "n" is served by local core (n % M)
+ * as SRCREP, and the DSTREP on node "n" for traffic from node "s" is
+ * core (s % M).  all addresses are looked up when the world is
+ * created, so next_hop never blocks.  the remote addrs of other ranks
+ * (for the shuffle's direct queues) are looked up on first use.  the
+ * 2 hop routing modes are supported too: with NOSRCREP the DSTREP on
+ * node "n" is the rank with our core# and with NODSTREP the SRCREP
+ * sends straight to dest (their addrs are looked up at shuffle_init).
+ * with shuffle_opts srcreps > 1, node "n" is served by local cores
+ * (n + i) % M for i < srcreps, all sending to the usual DSTREP.
+ * for shuffle_opts remoterails, each rank's remote mercury class is
+ * set up to allow "nrails" contexts (the shuffle creates the rails).
+ *
+ * in "sink" mode only rank 0 is real.  every other rank is played by
+ * a single sink instance whose router delivers everything it gets
+ * locally (next_hop always returns NX_DONE).  rank 0 still has one
+ * outqueue per peer (each with its own dup of the sink's address), so
+ * the batching, flow control and flush logic of one rank can be
+ * driven at e.g. 10k simulated nodes without 10k mercury instances.
+ * relay traffic into rank 0 and the epoch protocol are not exercised
+ * in sink mode.
+ *
+ * in "memory" mode (lproto is NULL) there is no mercury at all: the
+ * router provides shuffle_router.memdst and the shuffles hand their
+ * batches directly to each other (see shuffle_api.h).  addresses are
+ * just tokens and each shuffle must be registered with bnx_setshuffle()
+ * before any traffic is sent.  use bnx_memrouter for memory worlds.
+ */
+
+#pragma once
+
+#include <deltafs-shuffle/shuffle_api.h>
+
+#define BNX_SINK (-1)   /* bnx_arg() rank value for the sink */
+
+struct bnx_world;   /* opaque */
+
+/*
+ * bnx_router: router functions, use with bnx_arg()
+ */
+extern const struct shuffle_router bnx_router;
+extern const struct shuffle_router bnx_memrouter;   /* memory mode */
+
+/*
+ * bnx_create: create a world of simulated ranks.  if rproto is NULL
+ * each rank uses a single mercury instance for both local and remote
+ * traffic (the shuffle's single_hgmode).
+ *
+ * @param nnodes number of simulated nodes
+ * @param ncores number of ranks per node
+ * @param lproto mercury proto for local traffic (NULL: memory mode)
+ * @param rproto mercury proto for remote traffic (or NULL, see above)
+ * @param sink non-zero for sink mode (see above)
+ * @param nrails number of network rails per rank (0/1 = one)
+ * @return the new world or NULL on error
+ */
+struct bnx_world *bnx_create(int nnodes, int ncores, const char *lproto,
+                             const char *rproto, int sink, int nrails);
+
+/*
+ * bnx_arg: get the router arg for a rank in a world
+ *
+ * @param w the world
+ * @param rank the global rank (or BNX_SINK for the sink)
+ * @return the router arg, NULL if the rank isn't real in this world
+ */
+void *bnx_arg(struct bnx_world *w, int rank);
+
+/*
+ * bnx_setshuffle: tell a memory mode world which shuffle plays a rank
+ *
+ * @param w the world
+ * @param rank the global rank (or BNX_SINK for the sink)
+ * @param sh the shuffle (from shuffle_init_router())
+ */
+void bnx_setshuffle(struct bnx_world *w, int rank, shuffle_t sh);
+
+/*
+ * bnx_destroy: free a world and shutdown its mercury instances.
+ * all shuffles using the world must be shutdown first.
+ *
+ * @param w the world to free
+ */
+void bnx_destroy(struct bnx_world *w);
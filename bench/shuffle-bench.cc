@@ -0,0 +1,739 @@
+/*
+ * Copyright (c) 2017, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+/*
+ * shuffle-bench.cc  in-process shuffle benchmark (no MPI needed)
+ */
+
+/*
+ * usage: shuffle-bench [options]
+ *
+ *  -n nodes     number of simulated nodes (default 2)
+ *  -c cores     number of ranks per node (default 4)
+ *  -m count     messages sent per rank (default 100000)
+ *  -s size      message size in bytes (default 64)
+ *  -w workload  a2a, skew, or bcast (default a2a)
+ *  -z alpha     zipf exponent for the skew workload (default 1.0)
+ *  -p proto     mercury proto for remote traffic (default na+sm)
+ *  -1           use one mercury instance per rank (single_hgmode)
+ *  -b bytes     override lo/lr/r buftarget
+ *  -S           sink mode: only rank 0 is real (see bench-router.h)
+ *  -M           memory mode: no mercury, shuffles hand batches
+ *               directly to each other (isolates library overhead)
+ *  -R prefix    replay enqueue record files prefix.RANK (workload=replay)
+ *  -x speedup   replay pacing: 1 = recorded timing (default), 2 = twice
+ *               as fast, 0 = as fast as possible
+ *  -r prefix    record our enqueue calls to prefix.RANK
+ *  -D max[:b]   allow up to max direct (one hop) queues per rank, for
+ *               dsts we've sent at least b bytes (default 1MB) to
+ *  -H hops      routing: 3 (default), 2s (no SRCREP hop), or 2d (no
+ *               DSTREP hop)
+ *  -K n[:sel]   use n SRCREPs per remote node, picked by "hash" of dst
+ *               (default) or queue "depth"
+ *  -N rails     stripe each rank's remote queues over this many
+ *               network rails (mercury contexts/progress threads)
+ *  -W workers   hand inbound batches to this many relay worker threads
+ *               per rank instead of routing them on the progress thread
+ *  -T threads   app threads per rank (default 1).  the rank's -m msgs
+ *               are split over the threads, which enqueue concurrently
+ *  -E bytes     set the enqstage option (per-thread enqueue staging)
+ *
+ * runs nodes*cores shuffle instances in one process, routed by the
+ * in-process router in bench-router.cc.  local traffic always uses
+ * na+sm (or memory, with -M).  each rank gets an app thread that sends its messages and
+ * (with -T) starts more threads to help it, then calls
+ * shuffle_epoch_end() to wait for global delivery (in sink
+ * mode rank 0 flushes its queues and the sink's delivery queue
+ * instead).  sink mode allows very large worlds (e.g. -n 10000).
+ * workloads:
+ *
+ *  a2a   - rank r sends its i'th message to rank (r + 1 + i % (N-1)) % N
+ *  skew  - dsts are drawn from a zipf(alpha) distribution over the
+ *          ranks (rank 0 is the hottest), so a few DSTREPs get most
+ *          of the traffic
+ *  bcast - each message is a shuffle_enqueue_broadcast() to all
+ *          the other ranks
+ *  replay - each rank re-issues the calls in its record file (-R,
+ *          made with the shuffle_opts recordfile option).  -m, -s,
+ *          -z and -T are ignored
+ *
+ * we report send/delivery rates and the enqueue-to-delivery latency
+ * percentiles from the shuffle's latstamp histogram.
+ */
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <deltafs-shuffle/shuffle_api.h>
+
+#include "bench-router.h"
+
+#define WL_A2A   0     /* all to all */
+#define WL_SKEW  1     /* zipf distributed dsts */
+#define WL_BCAST 2     /* broadcast */
+#define WL_REPLAY 3    /* replay record files */
+
+/*
+ * bcfg: benchmark config (from the command line)
+ */
+static struct bcfg {
+  int nnodes;          /* -n */
+  int ncores;          /* -c */
+  uint64_t nmsg;       /* -m */
+  int size;            /* -s */
+  int workload;        /* -w */
+  double alpha;        /* -z */
+  const char *proto;   /* -p */
+  int single;          /* -1 */
+  int buftarget;       /* -b */
+  int sink;            /* -S */
+  int mem;             /* -M */
+  const char *replay;  /* -R */
+  double speedup;      /* -x */
+  const char *record;  /* -r */
+  int dirmax;          /* -D max */
+  int dirbytes;        /* -D :bytes */
+  int routing;         /* -H */
+  int srcreps;         /* -K n */
+  int repsel;          /* -K :sel */
+  int rails;           /* -N */
+  int relayworkers;    /* -W */
+  int nthreads;        /* -T */
+  int enqstage;        /* -E */
+} bcfg = { 2, 4, 100000, 64, WL_A2A, 1.0, "na+sm", 0, 0, 0, 0, NULL, 1.0,
+           NULL, 0, 1024 * 1024, SHUFFLE_ROUTE_3HOP, 1,
+           SHUFFLE_REPSEL_HASH, 1, 0, 1, 0 };
+
+/*
+ * brank: state for a simulated rank
+ */
+struct brank {
+  int rank;            /* our global rank */
+  shuffle_t sh;        /* our shuffle */
+  pthread_t app;       /* our app thread */
+  hg_return_t rv;      /* first failure from the app thread */
+  uint64_t nsent;      /* messages we sent */
+  uint64_t nexpect;    /* deliveries our sends should generate */
+  uint64_t nrecv;      /* messages delivered to us (atomic) */
+  uint64_t brecv;      /* bytes delivered to us (atomic) */
+};
+
+/*
+ * bsender: one of a rank's app threads.  thread 0 is the rank's
+ * app thread, the others are started by it (-T).
+ */
+struct bsender {
+  struct brank *br;    /* the rank we send for */
+  int idx;             /* our thread index in the rank */
+  char *buf;           /* msg data (shared, read only) */
+  pthread_t thr;       /* our thread (idx > 0) */
+  hg_return_t rv;      /* first failure */
+  uint64_t nsent;      /* messages we sent */
+  uint64_t nexpect;    /* deliveries our sends should generate */
+};
+
+static int nranks;               /* nnodes * ncores */
+static int nreal;                /* ranks with a shuffle (1 if sink) */
+static struct brank *ranks;      /* array of nreal */
+static struct brank sinkr;       /* the sink (sink mode only) */
+static double *zcdf;             /* zipf cdf for skew workload */
+static pthread_barrier_t gobar;  /* start all app threads together */
+
+/*
+ * now_ns: monotonic clock in nsec
+ */
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return(ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+/*
+ * bench_deliver: handler for all our types.  runs on the rank's
+ * delivery thread.
+ */
+static void bench_deliver(void *arg, int src, int dst, uint32_t type,
+                          void *d, uint32_t datalen) {
+  struct brank *br = (struct brank *)arg;
+
+  (void)src; (void)type; (void)d;
+  if (br->rank >= 0 && dst != br->rank)
+    fprintf(stderr, "bench_deliver: rank %d got msg for %d!\n",
+            br->rank, dst);
+  __atomic_add_fetch(&br->nrecv, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&br->brecv, datalen, __ATOMIC_RELAXED);
+}
+
+/*
+ * zipf_init: build the cdf for the skew workload
+ */
+static void zipf_init() {
+  double sum = 0;
+  int lcv;
+
+  zcdf = (double *)malloc(nranks * sizeof(*zcdf));
+  if (!zcdf) {
+    fprintf(stderr, "zipf_init: malloc failed\n");
+    exit(1);
+  }
+  for (lcv = 0 ; lcv < nranks ; lcv++) {
+    sum += 1.0 / pow(lcv + 1, bcfg.alpha);
+    zcdf[lcv] = sum;
+  }
+  for (lcv = 0 ; lcv < nranks ; lcv++) {
+    zcdf[lcv] /= sum;
+  }
+}
+
+/*
+ * zipf_pick: draw a rank from the zipf distribution
+ */
+static int zipf_pick(unsigned int *seed) {
+  double u = rand_r(seed) / ((double)RAND_MAX + 1);
+  int lo = 0, hi = nranks - 1, mid;
+
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (zcdf[mid] <= u)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return(lo);
+}
+
+/*
+ * replay: re-issue the calls in a rank's record file
+ *
+ * @param br the rank
+ * @return status
+ */
+static hg_return_t replay(struct brank *br) {
+  struct shuffle_rec_hdr hdr;
+  struct shuffle_rec r;
+  char fn[1024], *buf = NULL, *nbuf;
+  uint32_t bufsz = 0;
+  uint64_t start, due;
+  FILE *fp;
+  hg_return_t rv = HG_SUCCESS;
+  int64_t ahead;
+  struct timespec ts;
+
+  snprintf(fn, sizeof(fn), "%s.%d", bcfg.replay, br->rank);
+  fp = fopen(fn, "r");
+  if (!fp) {
+    perror(fn);
+    return(HG_NOENTRY);
+  }
+  if (fread(&hdr, sizeof(hdr), 1, fp) != 1 || hdr.magic != SHUFFLE_REC_MAGIC ||
+      hdr.version != SHUFFLE_REC_VERSION) {
+    fprintf(stderr, "replay: %s: bad header\n", fn);
+    fclose(fp);
+    return(HG_INVALID_PARAM);
+  }
+  if (hdr.nranks != nranks) {
+    fprintf(stderr, "replay: %s: recorded with %d ranks, we have %d\n",
+            fn, hdr.nranks, nranks);
+    fclose(fp);
+    return(HG_INVALID_PARAM);
+  }
+
+  due = 0;
+  start = now_ns();
+  while (fread(&r, sizeof(r), 1, fp) == 1) {
+    if (r.len > bufsz) {
+      nbuf = (char *)realloc(buf, r.len);
+      if (!nbuf) {
+        rv = HG_NOMEM_ERROR;
+        break;
+      }
+      buf = nbuf;
+      memset(buf + bufsz, br->rank & 0xff, r.len - bufsz);
+      bufsz = r.len;
+    }
+
+    /* pace the calls (sleep if we are ahead of the recording) */
+    if (bcfg.speedup > 0) {
+      due += r.dt_us * 1000.0 / bcfg.speedup;
+      ahead = (int64_t)(start + due - now_ns());
+      if (ahead > 0) {
+        ts.tv_sec = ahead / 1000000000;
+        ts.tv_nsec = ahead % 1000000000;
+        nanosleep(&ts, NULL);
+      }
+    }
+
+    if (r.dst == SHUFFLE_REC_BCAST || r.dst == SHUFFLE_REC_BCASTSELF) {
+      if (bcfg.sink) {
+        fprintf(stderr, "replay: %s: no bcast in sink mode\n", fn);
+        rv = HG_INVALID_PARAM;
+        break;
+      }
+      rv = shuffle_enqueue_broadcast(br->sh, r.type, buf, r.len,
+                          (r.dst == SHUFFLE_REC_BCASTSELF) ?
+                          SHUFFLE_BCAST_SELF : 0);
+      br->nexpect += (r.dst == SHUFFLE_REC_BCASTSELF) ? nranks : nranks - 1;
+    } else {
+      rv = shuffle_enqueue(br->sh, r.dst, r.type, buf, r.len);
+      br->nexpect++;
+    }
+    if (rv != HG_SUCCESS)
+      break;
+    br->nsent++;
+  }
+
+  fclose(fp);
+  free(buf);
+  return(rv);
+}
+
+/*
+ * send_main: send one thread's share of a rank's messages
+ */
+static void *send_main(void *arg) {
+  struct bsender *bs = (struct bsender *)arg;
+  struct brank *br = bs->br;
+  unsigned int seed = br->rank + 1 + bs->idx * nranks;
+  uint64_t lcv, end;
+  int dst;
+  hg_return_t rv;
+
+  lcv = bcfg.nmsg * bs->idx / bcfg.nthreads;
+  end = bcfg.nmsg * (bs->idx + 1) / bcfg.nthreads;
+  for ( ; lcv < end ; lcv++) {
+    if (bcfg.workload == WL_BCAST) {
+      rv = shuffle_enqueue_broadcast(br->sh, 0, bs->buf, bcfg.size, 0);
+    } else {
+      if (bcfg.workload == WL_SKEW)
+        dst = zipf_pick(&seed);
+      else
+        dst = (br->rank + 1 + lcv % (nranks - 1)) % nranks;
+      rv = shuffle_enqueue(br->sh, dst, 0, bs->buf, bcfg.size);
+    }
+    if (rv != HG_SUCCESS) {
+      bs->rv = rv;
+      break;
+    }
+    bs->nsent++;
+    bs->nexpect += (bcfg.workload == WL_BCAST) ? nranks - 1 : 1;
+  }
+
+  return(NULL);
+}
+
+/*
+ * app_main: app thread for a rank
+ */
+static void *app_main(void *arg) {
+  struct brank *br = (struct brank *)arg;
+  struct bsender *bs;
+  char *buf;
+  int lcv, nstarted;
+  hg_return_t rv;
+
+  buf = (char *)malloc(bcfg.size ? bcfg.size : 1);
+  bs = (struct bsender *)calloc(bcfg.nthreads, sizeof(*bs));
+  if (!buf || !bs) {
+    br->rv = HG_NOMEM_ERROR;
+    pthread_barrier_wait(&gobar);
+    free(buf);
+    free(bs);
+    return(NULL);
+  }
+  memset(buf, br->rank & 0xff, bcfg.size);
+  for (lcv = 0 ; lcv < bcfg.nthreads ; lcv++) {
+    bs[lcv].br = br;
+    bs[lcv].idx = lcv;
+    bs[lcv].buf = buf;
+    bs[lcv].rv = HG_SUCCESS;
+  }
+
+  pthread_barrier_wait(&gobar);
+
+  if (bcfg.workload == WL_REPLAY) {
+    br->rv = replay(br);
+    goto flush;
+  }
+  for (nstarted = 1 ; nstarted < bcfg.nthreads ; nstarted++) {
+    if (pthread_create(&bs[nstarted].thr, NULL, send_main,
+                       &bs[nstarted]) != 0) {
+      br->rv = HG_OTHER_ERROR;
+      break;
+    }
+  }
+  send_main(&bs[0]);
+  for (lcv = 0 ; lcv < nstarted ; lcv++) {
+    if (lcv > 0)
+      pthread_join(bs[lcv].thr, NULL);
+    br->nsent += bs[lcv].nsent;
+    br->nexpect += bs[lcv].nexpect;
+    if (bs[lcv].rv != HG_SUCCESS && br->rv == HG_SUCCESS)
+      br->rv = bs[lcv].rv;
+  }
+
+flush:
+  if (bcfg.sink) {
+    rv = shuffle_flush_originqs(br->sh);
+    if (rv == HG_SUCCESS)
+      rv = shuffle_flush_remoteqs(br->sh);
+    if (rv == HG_SUCCESS)
+      rv = shuffle_flush_delivery(sinkr.sh);
+    if (rv == HG_SUCCESS)
+      rv = shuffle_flush_delivery(br->sh);
+  } else {
+    /* collective, so we must do it even if we failed */
+    rv = shuffle_epoch_end(br->sh);
+  }
+  if (rv != HG_SUCCESS && br->rv == HG_SUCCESS)
+    br->rv = rv;
+
+  free(buf);
+  free(bs);
+  return(NULL);
+}
+
+/*
+ * usage: print usage and exit
+ */
+static void usage(const char *prog) {
+  fprintf(stderr, "usage: %s [-n nodes] [-c cores] [-m count] [-s size]\n"
+          "\t[-w a2a|skew|bcast] [-z alpha] [-p proto] [-1] [-b bytes] [-S] [-M]\n"
+          "\t[-R prefix] [-x speedup] [-r prefix] [-D max[:bytes]]\n"
+          "\t[-H 3|2s|2d] [-K n[:hash|depth]] [-N rails]\n"
+          "\t[-W workers] [-T threads] [-E bytes]\n", prog);
+  exit(1);
+}
+
+/*
+ * main program
+ */
+int main(int argc, char **argv) {
+  static const char *wlnames[] = { "a2a", "skew", "bcast", "replay" };
+  static const char *rtnames[] = { "3", "2s", "2d" };
+  struct bnx_world *w;
+  struct brank *br;
+  struct shuffle_opts so;
+  struct shuffle_hist hall, h;
+  struct shuffle_stats st;
+  char funname[] = "shuffle_bench";
+  char *cp;
+  uint64_t start, nsec, sent, expect, nrecv, brecv, dqs, dreqs, rlyb;
+  uint64_t stgr, stgm;
+  uint64_t rmin, rmax, rsum;
+  double secs;
+  int ch, lcv, b, bad;
+
+  while ((ch = getopt(argc, argv, "n:c:m:s:w:z:p:1b:SMR:x:r:D:H:K:N:W:T:E:")) != -1) {
+    switch (ch) {
+      case 'n':
+        bcfg.nnodes = atoi(optarg);
+        break;
+      case 'c':
+        bcfg.ncores = atoi(optarg);
+        break;
+      case 'm':
+        bcfg.nmsg = strtoull(optarg, NULL, 0);
+        break;
+      case 's':
+        bcfg.size = atoi(optarg);
+        break;
+      case 'w':
+        for (bcfg.workload = 0 ; bcfg.workload < 3 ; bcfg.workload++) {
+          if (strcmp(optarg, wlnames[bcfg.workload]) == 0)
+            break;
+        }
+        if (bcfg.workload >= 3) usage(argv[0]);
+        break;
+      case 'z':
+        bcfg.alpha = atof(optarg);
+        break;
+      case 'p':
+        bcfg.proto = optarg;
+        break;
+      case '1':
+        bcfg.single = 1;
+        break;
+      case 'b':
+        bcfg.buftarget = atoi(optarg);
+        break;
+      case 'S':
+        bcfg.sink = 1;
+        break;
+      case 'M':
+        bcfg.mem = 1;
+        break;
+      case 'R':
+        bcfg.replay = optarg;
+        bcfg.workload = WL_REPLAY;
+        break;
+      case 'x':
+        bcfg.speedup = atof(optarg);
+        if (bcfg.speedup < 0) usage(argv[0]);
+        break;
+      case 'r':
+        bcfg.record = optarg;
+        break;
+      case 'D':
+        bcfg.dirmax = strtol(optarg, &cp, 0);
+        if (*cp == ':')
+          bcfg.dirbytes = atoi(cp + 1);
+        if (bcfg.dirmax < 0 || bcfg.dirbytes < 0) usage(argv[0]);
+        break;
+      case 'H':
+        for (bcfg.routing = 0 ; bcfg.routing < 3 ; bcfg.routing++) {
+          if (strcmp(optarg, rtnames[bcfg.routing]) == 0)
+            break;
+        }
+        if (bcfg.routing >= 3) usage(argv[0]);
+        break;
+      case 'K':
+        bcfg.srcreps = strtol(optarg, &cp, 0);
+        if (strcmp(cp, ":depth") == 0)
+          bcfg.repsel = SHUFFLE_REPSEL_DEPTH;
+        else if (*cp && strcmp(cp, ":hash") != 0)
+          usage(argv[0]);
+        if (bcfg.srcreps < 1) usage(argv[0]);
+        break;
+      case 'N':
+        bcfg.rails = atoi(optarg);
+        if (bcfg.rails < 1 || bcfg.rails > SHUFFLE_MAXRAILS) usage(argv[0]);
+        break;
+      case 'W':
+        bcfg.relayworkers = atoi(optarg);
+        if (bcfg.relayworkers < 0 ||
+            bcfg.relayworkers > SHUFFLE_MAXRELAYWORKERS) usage(argv[0]);
+        break;
+      case 'T':
+        bcfg.nthreads = atoi(optarg);
+        if (bcfg.nthreads < 1) usage(argv[0]);
+        break;
+      case 'E':
+        bcfg.enqstage = atoi(optarg);
+        if (bcfg.enqstage < 0) usage(argv[0]);
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (bcfg.nnodes < 1 || bcfg.ncores < 1 || bcfg.size < 0 ||
+      bcfg.buftarget < 0) usage(argv[0]);
+  nranks = bcfg.nnodes * bcfg.ncores;
+  if (nranks < 2) {
+    fprintf(stderr, "%s: need at least 2 ranks\n", argv[0]);
+    exit(1);
+  }
+  if (bcfg.sink && bcfg.workload == WL_BCAST) {
+    fprintf(stderr, "%s: no bcast in sink mode\n", argv[0]);
+    exit(1);
+  }
+  nreal = (bcfg.sink) ? 1 : nranks;
+  if (bcfg.workload == WL_SKEW)
+    zipf_init();
+
+  printf("shuffle-bench: %d nodes x %d cores, workload=%s, %" PRIu64
+         " msgs/rank, %d bytes, hops=%s, remote=%s%s%s\n", bcfg.nnodes,
+         bcfg.ncores, wlnames[bcfg.workload], bcfg.nmsg, bcfg.size,
+         rtnames[bcfg.routing],
+         (bcfg.mem) ? "memory" : bcfg.proto,
+         (bcfg.single && !bcfg.mem) ? " (single)" : "",
+         (bcfg.sink) ? " (sink)" : "");
+  if (bcfg.workload == WL_REPLAY)
+    printf("replay: %s.RANK, speedup %g\n", bcfg.replay, bcfg.speedup);
+  if (bcfg.dirmax)
+    printf("direct: up to %d queues/rank, after %d bytes\n", bcfg.dirmax,
+           bcfg.dirbytes);
+  if (bcfg.srcreps > 1)
+    printf("srcreps: %d per remote node, by %s\n", bcfg.srcreps,
+           (bcfg.repsel == SHUFFLE_REPSEL_DEPTH) ? "depth" : "hash");
+  if (bcfg.rails > 1)
+    printf("rails: %d network rails per rank\n", bcfg.rails);
+  if (bcfg.relayworkers)
+    printf("relay: %d worker threads per rank\n", bcfg.relayworkers);
+  if (bcfg.nthreads > 1 || bcfg.enqstage)
+    printf("app: %d threads per rank, enqstage %d bytes\n", bcfg.nthreads,
+           bcfg.enqstage);
+
+  w = bnx_create(bcfg.nnodes, bcfg.ncores, (bcfg.mem) ? NULL : "na+sm",
+                 (bcfg.single) ? NULL : bcfg.proto, bcfg.sink, bcfg.rails);
+  if (!w) {
+    fprintf(stderr, "%s: bnx_create failed\n", argv[0]);
+    exit(1);
+  }
+  ranks = (struct brank *)calloc(nreal, sizeof(*ranks));
+  if (!ranks) {
+    fprintf(stderr, "%s: calloc failed\n", argv[0]);
+    exit(1);
+  }
+
+  shuffle_opts_init(&so);
+  so.latstamp = 1;
+  so.recordfile = bcfg.record;
+  so.directmax = bcfg.dirmax;
+  so.directbytes = bcfg.dirbytes;
+  so.routing = bcfg.routing;
+  so.srcreps = bcfg.srcreps;
+  so.repsel = bcfg.repsel;
+  so.remoterails = bcfg.rails;
+  so.relayworkers = bcfg.relayworkers;
+  so.enqstage = bcfg.enqstage;
+  if (bcfg.buftarget)
+    so.lobuftarget = so.lrbuftarget = so.rbuftarget = bcfg.buftarget;
+
+  for (lcv = -1 ; lcv < nreal ; lcv++) {
+    br = (lcv < 0) ? &sinkr : &ranks[lcv];
+    if (lcv < 0 && !bcfg.sink)
+      continue;
+    br->rank = lcv;      /* -1 for sink */
+    br->sh = shuffle_init_router((bcfg.mem) ? &bnx_memrouter : &bnx_router,
+                                 bnx_arg(w, (lcv < 0) ? BNX_SINK : lcv),
+                                 funname, NULL, &so);
+    if (!br->sh) {
+      fprintf(stderr, "%s: shuffle_init rank %d failed\n", argv[0], lcv);
+      exit(1);
+    }
+    bnx_setshuffle(w, (lcv < 0) ? BNX_SINK : lcv, br->sh);
+    if (shuffle_register_handler(br->sh, 0, SHUFFLE_RTYPE_USRBITS,
+                                 bench_deliver, br) != HG_SUCCESS) {
+      fprintf(stderr, "%s: register_handler failed\n", argv[0]);
+      exit(1);
+    }
+  }
+
+  if (pthread_barrier_init(&gobar, NULL, nreal + 1) != 0) {
+    fprintf(stderr, "%s: pthread_barrier_init failed\n", argv[0]);
+    exit(1);
+  }
+  for (lcv = 0 ; lcv < nreal ; lcv++) {
+    if (pthread_create(&ranks[lcv].app, NULL, app_main, &ranks[lcv]) != 0) {
+      fprintf(stderr, "%s: pthread_create failed\n", argv[0]);
+      exit(1);
+    }
+  }
+  pthread_barrier_wait(&gobar);
+  start = now_ns();
+  for (lcv = 0 ; lcv < nreal ; lcv++) {
+    pthread_join(ranks[lcv].app, NULL);
+  }
+  nsec = now_ns() - start;
+  secs = nsec / 1000000000.0;
+
+  /* collect results */
+  sent = expect = nrecv = brecv = dqs = dreqs = rlyb = stgr = stgm = 0;
+  rmin = UINT64_MAX;
+  rmax = rsum = 0;
+  bad = 0;
+  memset(&hall, 0, sizeof(hall));
+  for (lcv = -1 ; lcv < nreal ; lcv++) {
+    br = (lcv < 0) ? &sinkr : &ranks[lcv];
+    if (br->sh == NULL)
+      continue;          /* no sink */
+    if (br->rv != HG_SUCCESS) {
+      fprintf(stderr, "rank %d: error %d\n", lcv, br->rv);
+      bad++;
+    }
+    sent += br->nsent;
+    expect += br->nexpect;
+    nrecv += __atomic_load_n(&br->nrecv, __ATOMIC_RELAXED);
+    brecv += __atomic_load_n(&br->brecv, __ATOMIC_RELAXED);
+    if (shuffle_get_stats(br->sh, &st) == HG_SUCCESS) {
+      dqs += st.directqs;
+      dreqs += st.directreqs;
+      rlyb += st.relaybatches;
+      stgr += st.stagereqs;
+      stgm += st.stagemerges;
+      if (lcv >= 0) {
+        rsum += st.srcrepreqs;
+        if (st.srcrepreqs < rmin) rmin = st.srcrepreqs;
+        if (st.srcrepreqs > rmax) rmax = st.srcrepreqs;
+      }
+    }
+    if (shuffle_get_hist(br->sh, SHUFFLE_HIST_E2E,
+                         &h, 0) != HG_SUCCESS)
+      continue;
+    hall.count += h.count;
+    hall.sum += h.sum;
+    if (h.max > hall.max) hall.max = h.max;
+    for (b = 0 ; b < SHUFFLE_HIST_NBUCKETS ; b++)
+      hall.buckets[b] += h.buckets[b];
+  }
+
+  printf("elapsed:   %.3f sec\n", secs);
+  printf("sent:      %" PRIu64 " msgs\n", sent);
+  printf("delivered: %" PRIu64 " msgs, %" PRIu64 " bytes (expected %"
+         PRIu64 " msgs)\n", nrecv, brecv, expect);
+  printf("rate:      %.0f msgs/sec, %.2f MB/sec\n", nrecv / secs,
+         brecv / secs / (1024.0 * 1024.0));
+  if (hall.count) {
+    printf("latency:   avg %" PRIu64 " p50 %" PRIu64 " p90 %" PRIu64
+           " p99 %" PRIu64 " p99.9 %" PRIu64 " max %" PRIu64 " usec\n",
+           hall.sum / hall.count, shuffle_hist_percentile(&hall, 50.0),
+           shuffle_hist_percentile(&hall, 90.0),
+           shuffle_hist_percentile(&hall, 99.0),
+           shuffle_hist_percentile(&hall, 99.9), hall.max);
+  }
+  if (bcfg.dirmax)
+    printf("direct:    %" PRIu64 " queues, %" PRIu64 " msgs\n", dqs, dreqs);
+  if (bcfg.relayworkers)
+    printf("relay:     %" PRIu64 " batches run by relay workers\n", rlyb);
+  if (bcfg.enqstage)
+    printf("stage:     %" PRIu64 " msgs staged, %" PRIu64 " merges (%.1f "
+           "msgs/merge)\n", stgr, stgm, (stgm) ? stgr / (double)stgm : 0.0);
+  if (rsum)
+    printf("srcrep:    relayed min %" PRIu64 " avg %" PRIu64 " max %" PRIu64
+           " msgs/rank (max/avg %.2f)\n", rmin, rsum / nreal, rmax,
+           rmax / ((double)rsum / nreal));
+  if (nrecv != expect)
+    bad++;
+
+  /* quiesce: wait for replies still in flight before any shutdown */
+  for (lcv = 0 ; lcv < nreal ; lcv++) {
+    shuffle_flush_originqs(ranks[lcv].sh);
+    shuffle_flush_relayqs(ranks[lcv].sh);
+    shuffle_flush_remoteqs(ranks[lcv].sh);
+  }
+  for (lcv = 0 ; lcv < nreal ; lcv++) {
+    shuffle_shutdown(ranks[lcv].sh);
+  }
+  if (sinkr.sh)
+    shuffle_shutdown(sinkr.sh);
+  bnx_destroy(w);
+  pthread_barrier_destroy(&gobar);
+  free(ranks);
+  free(zcdf);
+  exit((bad) ? 1 : 0);
+}
@@ -0,0 +1,179 @@
+/*
+ * Copyright (c) 2017, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * shuffle-mlog-bench.cc  per-call cost of shuffle debug logging
+ */
+
+/*
+ * usage: shuffle-mlog-bench [-n count] [-l logfile] [-q qlen]
+ *
+ * times a small stand-in for a hot path function (e.g.
+ * append_req_to_locked_outqueue) that has the same kind of debug
+ * mlog() calls as the real thing, built three ways:
+ *
+ *  - compiled out (as with -DSHUFFLE_MLOG_MINLEVEL=INFO)
+ *  - compiled in but filtered at runtime (default build, level WARN)
+ *  - compiled in and enabled (all debug levels to the message buffer,
+ *    and to logfile if -l is given; -q uses the async log writer)
+ *
+ * and prints the average cost per call in nsec.
+ */
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "shuf_mlog.h"
+
+/*
+ * hstate: state updated by the hot path stand-in
+ */
+struct hstate {
+  uint64_t seq;     /* seq# of last request */
+  uint64_t bytes;   /* total bytes */
+  int loadsize;     /* current batch size */
+};
+
+/* hot path body, so we can compile it under different log levels */
+#define HOT_BODY(HS, SZ) do {                                          \
+  mlog(SHUF_CALL, "append_req: seq=%" PRIu64 " sz=%d", (HS)->seq, (SZ)); \
+  (HS)->seq++;                                                         \
+  (HS)->bytes += (SZ);                                                 \
+  (HS)->loadsize += (SZ);                                              \
+  if ((HS)->loadsize >= 16384) {                                       \
+    mlog(SHUF_D1, "append_req: load=%d, send", (HS)->loadsize);        \
+    (HS)->loadsize = 0;                                                \
+  }                                                                    \
+} while (0)
+
+/*
+ * hot_logged: debug logging compiled in (default SHUF_MLOG_MINPRI)
+ */
+static void __attribute__((noinline)) hot_logged(struct hstate *hs, int sz) {
+  HOT_BODY(hs, sz);
+}
+
+/*
+ * note: shuf_mlog_compiled() expands SHUF_MLOG_MINPRI where mlog()
+ * is used, so we can change it here to get the compiled out version.
+ */
+#undef SHUF_MLOG_MINPRI
+#define SHUF_MLOG_MINPRI MLOG_INFO
+
+/*
+ * hot_nolog: debug logging compiled out
+ */
+static void __attribute__((noinline)) hot_nolog(struct hstate *hs, int sz) {
+  HOT_BODY(hs, sz);
+}
+
+/*
+ * now_ns: monotonic clock in nsec
+ */
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return(ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+/*
+ * runit: run a hot path function n times and report nsec per call
+ */
+static void runit(const char *tag, void (*fn)(struct hstate *, int),
+                  uint64_t n) {
+  struct hstate hs = { 0, 0, 0 };
+  uint64_t lcv, start, nsec;
+
+  start = now_ns();
+  for (lcv = 0 ; lcv < n ; lcv++) {
+    fn(&hs, 64 + (lcv & 63));
+  }
+  nsec = now_ns() - start;
+  printf("%-14s %10" PRIu64 " calls  %8.2f ns/call  (bytes=%" PRIu64 ")\n",
+         tag, n, (double)nsec / n, hs.bytes);
+}
+
+/*
+ * usage: print usage and exit
+ */
+static void usage(const char *prog) {
+  fprintf(stderr, "usage: %s [-n count] [-l logfile] [-q qlen]\n", prog);
+  exit(1);
+}
+
+/*
+ * main program
+ */
+int main(int argc, char **argv) {
+  uint64_t n = 10000000;
+  char *logfile = NULL;
+  int ch, qlen = 0;
+
+  while ((ch = getopt(argc, argv, "n:l:q:")) != -1) {
+    switch (ch) {
+      case 'n':
+        n = strtoull(optarg, NULL, 0);
+        break;
+      case 'l':
+        logfile = optarg;
+        break;
+      case 'q':
+        qlen = atoi(optarg);
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (n < 1) usage(argv[0]);
+
+  if (shuf::mlog_open("bench", SHUF_MAXFAC, MLOG_WARN, 0, logfile,
+                      64 * 1024, 0, 0) < 0) {
+    fprintf(stderr, "%s: mlog_open failed\n", argv[0]);
+    exit(1);
+  }
+  if (qlen > 0 && shuf::mlog_async(qlen) < 0) {
+    fprintf(stderr, "%s: mlog_async failed\n", argv[0]);
+    exit(1);
+  }
+
+  runit("compiled-out", hot_nolog, n);
+  runit("filtered", hot_logged, n);
+
+  /* logging really costs, so do fewer of these */
+  shuf::mlog_setlogmask(SHUF_MLOG, MLOG_DBG);
+  runit("enabled", hot_logged, (n / 100) ? n / 100 : 1);
+
+  shuf::mlog_close();
+  exit(0);
+}
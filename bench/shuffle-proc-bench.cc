@@ -0,0 +1,325 @@
+/*
+ * Copyright (c) 2017, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * shuffle-proc-bench.cc  encode/decode cost of the shuffle RPC batch
+ */
+
+/*
+ * usage: shuffle-proc-bench [-c counts] [-s sizes] [-t secs] [-p proto] [-T]
+ *
+ *  -c counts    comma separated list of msgs per batch (default 1,16,256)
+ *  -s sizes     comma separated list of msg sizes (default 0,16,64,1024)
+ *  -t secs      minimum time to run each case (default 0.5)
+ *  -p proto     mercury proto used to create an hg_class (default na+sm)
+ *  -T           set REQ_HF_TSTAMP on each msg (like latstamp)
+ *
+ * runs hg_proc_rpcin_t() on a standalone hg_proc (no RPC, no network)
+ * for every count x size pair.  encode serializes a prebuilt rpcin_t
+ * into a buffer, decode parses that buffer back into malloc'd
+ * requests (which we free, as HG_Free_input() would).  each case is
+ * repeated until it has run for at least -t seconds and we print
+ * one line per case and op, in the style of google benchmark:
+ *
+ *   name                 iters    ns/batch    ns/msg      GB/s
+ *
+ * where GB/s is the rate of encoded bytes.
+ */
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <mercury.h>
+#include <mercury_proc.h>
+#include <deltafs-shuffle/shuffle_api.h>
+
+#include "shuffle_internal.h"
+#include "shuf_proc.h"
+
+#define MAXLIST 32     /* max entries in -c/-s lists */
+
+/*
+ * pcfg: benchmark config (from the command line)
+ */
+static struct pcfg {
+  int counts[MAXLIST];    /* -c */
+  int ncounts;
+  int sizes[MAXLIST];     /* -s */
+  int nsizes;
+  double mintime;         /* -t */
+  const char *proto;      /* -p */
+  int tstamp;             /* -T */
+} pcfg;
+
+/*
+ * now_ns: monotonic clock in nsec
+ */
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return(ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+/*
+ * parselist: parse a comma separated list of ints
+ *
+ * @param str the list
+ * @param out results placed here
+ * @return number of entries, -1 on error
+ */
+static int parselist(const char *str, int *out) {
+  char *ep;
+  int n = 0;
+
+  while (*str) {
+    if (n >= MAXLIST)
+      return(-1);
+    out[n] = strtol(str, &ep, 0);
+    if (ep == str || out[n] < 0 || (*ep != ',' && *ep != '\0'))
+      return(-1);
+    n++;
+    str = (*ep == ',') ? ep + 1 : ep;
+  }
+  return(n);
+}
+
+/*
+ * mkbatch: build an rpcin_t with "cnt" requests of "sz" bytes
+ *
+ * @param in the rpcin_t to fill in
+ * @param cnt number of requests
+ * @param sz size of each request
+ * @return 0 or -1 on error
+ */
+static int mkbatch(rpcin_t *in, int cnt, int sz) {
+  struct request *rp;
+  int lcv;
+
+  in->iseq = 1;
+  in->forwardrank = 0;
+  XSIMPLEQ_INIT(&in->inreqs);
+  for (lcv = 0 ; lcv < cnt ; lcv++) {
+    rp = (struct request *)malloc(sizeof(*rp) + sz);
+    if (!rp)
+      return(-1);
+    rp->datalen = sz;
+    /* type 1: a 0 byte type 0 msg would look like the end of list */
+    rp->type = 1;
+    rp->src = lcv;
+    rp->dst = lcv + 1;
+    rp->hflags = REQ_HF_EPOCH | ((pcfg.tstamp) ? REQ_HF_TSTAMP : 0);
+    rp->epoch = 0;
+    rp->tstamp = lcv;
+    rp->data = (char *)rp + sizeof(*rp);
+    memset(rp->data, lcv & 0xff, sz);
+    rp->owner = NULL;
+    rp->crrank = -1;
+    XSIMPLEQ_INSERT_TAIL(&in->inreqs, rp, next);
+  }
+  return(0);
+}
+
+/*
+ * freebatch: free the requests on an rpcin_t
+ *
+ * @param in the rpcin_t to clear
+ * @return number of requests freed
+ */
+static int freebatch(rpcin_t *in) {
+  struct request *rp, *nrp;
+  int cnt = 0;
+
+  XSIMPLEQ_FOREACH_SAFE(rp, &in->inreqs, next, nrp) {
+    free(rp);
+    cnt++;
+  }
+  XSIMPLEQ_INIT(&in->inreqs);
+  return(cnt);
+}
+
+/*
+ * report: print a result line
+ */
+static void report(const char *op, int cnt, int sz, uint64_t iters,
+                   uint64_t nsec, hg_size_t enclen) {
+  char name[64];
+  double per = (double)nsec / iters;
+
+  snprintf(name, sizeof(name), "%s/%d/%d", op, cnt, sz);
+  printf("%-24s %10" PRIu64 " %12.1f %9.2f %9.3f\n", name, iters, per,
+         (cnt) ? per / cnt : 0.0, enclen / per);
+}
+
+/*
+ * runcase: time encode and decode for one count x size pair
+ *
+ * @param cls the hg_class for the proc
+ * @param cnt msgs per batch
+ * @param sz msg size
+ * @return 0 or -1 on error
+ */
+static int runcase(hg_class_t *cls, int cnt, int sz) {
+  uint64_t mintime = pcfg.mintime * 1000000000.0;
+  uint64_t start, nsec, iters;
+  rpcin_t in, out;
+  hg_proc_t proc = NULL;
+  hg_size_t buflen, enclen;
+  void *buf = NULL;
+  int rv = -1;
+
+  XSIMPLEQ_INIT(&out.inreqs);
+  if (mkbatch(&in, cnt, sz) < 0) {
+    fprintf(stderr, "runcase: mkbatch failed\n");
+    goto done;
+  }
+  /* header + per-req header/epoch/tstamp/data + end of list marker */
+  buflen = 8 + (hg_size_t)cnt * (17 + 4 + 8 + sz) + 8;
+  buf = malloc(buflen);
+  if (!buf ||
+      hg_proc_create_set(cls, buf, buflen, HG_ENCODE, HG_NOHASH,
+                         &proc) != HG_SUCCESS) {
+    fprintf(stderr, "runcase: proc setup failed\n");
+    goto done;
+  }
+
+  /* encode */
+  iters = 0;
+  start = now_ns();
+  do {
+    if (hg_proc_reset(proc, buf, buflen, HG_ENCODE) != HG_SUCCESS ||
+        hg_proc_rpcin_t(proc, &in) != HG_SUCCESS) {
+      fprintf(stderr, "runcase: encode failed\n");
+      goto done;
+    }
+    iters++;
+  } while ((nsec = now_ns() - start) < mintime);
+  enclen = hg_proc_get_size_used(proc);
+  report("encode", cnt, sz, iters, nsec, enclen);
+
+  /* decode (includes malloc/free of each request) */
+  iters = 0;
+  start = now_ns();
+  do {
+    if (hg_proc_reset(proc, buf, enclen, HG_DECODE) != HG_SUCCESS ||
+        hg_proc_rpcin_t(proc, &out) != HG_SUCCESS) {
+      fprintf(stderr, "runcase: decode failed\n");
+      goto done;
+    }
+    if (freebatch(&out) != cnt) {
+      fprintf(stderr, "runcase: decode count mismatch\n");
+      goto done;
+    }
+    iters++;
+  } while ((nsec = now_ns() - start) < mintime);
+  report("decode", cnt, sz, iters, nsec, enclen);
+  rv = 0;
+
+done:
+  if (proc)
+    hg_proc_free(proc);
+  free(buf);
+  freebatch(&in);
+  freebatch(&out);
+  return(rv);
+}
+
+/*
+ * usage: print usage and exit
+ */
+static void usage(const char *prog) {
+  fprintf(stderr, "usage: %s [-c counts] [-s sizes] [-t secs] [-p proto] "
+          "[-T]\n", prog);
+  exit(1);
+}
+
+/*
+ * main program
+ */
+int main(int argc, char **argv) {
+  hg_class_t *cls;
+  int ch, c, s, bad = 0;
+
+  pcfg.ncounts = parselist("1,16,256", pcfg.counts);
+  pcfg.nsizes = parselist("0,16,64,1024", pcfg.sizes);
+  pcfg.mintime = 0.5;
+  pcfg.proto = "na+sm";
+  pcfg.tstamp = 0;
+
+  while ((ch = getopt(argc, argv, "c:s:t:p:T")) != -1) {
+    switch (ch) {
+      case 'c':
+        pcfg.ncounts = parselist(optarg, pcfg.counts);
+        if (pcfg.ncounts < 1) usage(argv[0]);
+        break;
+      case 's':
+        pcfg.nsizes = parselist(optarg, pcfg.sizes);
+        if (pcfg.nsizes < 1) usage(argv[0]);
+        break;
+      case 't':
+        pcfg.mintime = atof(optarg);
+        if (pcfg.mintime <= 0) usage(argv[0]);
+        break;
+      case 'p':
+        pcfg.proto = optarg;
+        break;
+      case 'T':
+        pcfg.tstamp = 1;
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+
+  cls = HG_Init(pcfg.proto, HG_FALSE);
+  if (cls == NULL) {
+    fprintf(stderr, "%s: HG_Init(%s) failed\n", argv[0], pcfg.proto);
+    exit(1);
+  }
+
+  printf("shuffle-proc-bench: tstamp=%d, min %.2f sec per case\n",
+         pcfg.tstamp, pcfg.mintime);
+  printf("%-24s %10s %12s %9s %9s\n", "op/msgs/size", "iters",
+         "ns/batch", "ns/msg", "GB/s");
+  for (c = 0 ; c < pcfg.ncounts ; c++) {
+    for (s = 0 ; s < pcfg.nsizes ; s++) {
+      if (runcase(cls, pcfg.counts[c], pcfg.sizes[s]) < 0)
+        bad++;
+    }
+  }
+
+  HG_Finalize(cls);
+  exit((bad) ? 1 : 0);
+}
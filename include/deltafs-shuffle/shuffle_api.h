@@ -113,6 +113,91 @@
  *                        batches (to avoid context switching overhead
  *                        when the request size is small).
  *
+ * for flow control between hops, we have:
+ *  - creditwin: if non-zero, each receiver allows every sender to
+ *               have up to "creditwin" bytes of requests parked on
+ *               its waitqs.  RPCs that fit are responded to right
+ *               away and the reply tells the sender how much credit
+ *               is left.  senders stop launching batches to a dest
+ *               when their in-flight bytes reach the advertised
+ *               credit.  RPCs that do not fit fall back to delaying
+ *               the reply until their requests clear the waitqs.
+ *  - aimd:      if enabled for an outset, maxrpc and the senderlimit
+ *               are starting points rather than fixed values.   the
+ *               windows grow by one RPC per window of completions while
+ *               round trip times stay flat and are halved on failures or
+ *               latency spikes, capped at aimdmaxrpc/aimdsenderlimit.
+ *
+ * for heavy src/dst pairs, we have:
+ *  - directmax:   if non-zero, a SRC may set up to "directmax" extra
+ *                 network queues that send straight to a remote dst
+ *                 (one hop instead of three).  a dst gets one once the
+ *                 SRC has sent it "directbytes" bytes.  this trades some
+ *                 of the connection savings of 3 hop routing for lower
+ *                 per-msg cost on the pairs that carry the most data.
+ *                 needs a router with direct_addr (shuffle_init fails
+ *                 without one, e.g. with the nexus router).  msgs sent
+ *                 to a dst just before and after it goes direct may be
+ *                 delivered out of order.
+ *
+ * for routing, we have:
+ *  - routing:     the default (SHUFFLE_ROUTE_3HOP) is the normal 3 hop
+ *                 path.  the two 2 hop modes drop one of the na+sm
+ *                 hops at the cost of more network peers per rank:
+ *                 NOSRCREP has each SRC talk to one DSTREP on every
+ *                 remote node, NODSTREP has each SRCREP talk to every
+ *                 rank on its remote nodes.  needs a router with
+ *                 set_routing.  the nexus router only does 3 hops,
+ *                 shuffle_init fails if it is asked for a 2 hop mode.
+ *  - srcreps:     spread each remote node's traffic over "srcreps"
+ *                 local SRCREPs instead of one (they all send to the
+ *                 same DSTREP).  the SRC picks one per msg with
+ *                 "repsel": by hash of dst, or the SRCREP whose origin
+ *                 queue has the least bytes queued (this may reorder
+ *                 msgs to a dst).  needs a router with set_srcreps and
+ *                 srcreps: shuffle_init fails if srcreps > 1 with the
+ *                 nexus router (repsel is then unused).  ignored for
+ *                 SHUFFLE_ROUTE_NOSRCREP.
+ *
+ * for network processing, we have:
+ *  - remoterails: stripe the remote output queues over "remoterails"
+ *                 mercury contexts (each with its own progress thread
+ *                 and rpc registration) instead of one, so that the
+ *                 encode/forward/trigger/rpchand work for the network
+ *                 is spread over several cores.  rail 0 is the remote
+ *                 progressor's context, we create rails 1 to N-1 on
+ *                 the same mercury class with HG_Context_create_id(),
+ *                 so peers keep their one network addr and a handle
+ *                 picks the peer's rail with HG_Set_target_id().  the
+ *                 class must allow N contexts (e.g. na_init_info
+ *                 max_contexts), and context ids 1 to N-1 must be
+ *                 free.  queues are assigned to rails round robin at
+ *                 init and inbound batches are handled on the rail
+ *                 they arrive on.  all ranks must use the same number
+ *                 of rails.
+ *  - relayworkers: if non-zero, inbound batches are decoded on the
+ *                 progress thread but then handed to a pool of
+ *                 "relayworkers" threads that route them (deliver to
+ *                 self or append to the next hop's output queue) and
+ *                 reply.  this leaves the progress threads free to
+ *                 progress and trigger when relay load is high.
+ *                 batches from a given sender always go to the same
+ *                 worker, so they are still processed in order.
+ *
+ * for multi-threaded applications, we have:
+ *  - enqstage:    if non-zero, each app thread that calls
+ *                 shuffle_enqueue() stages its msgs in a private
+ *                 per-queue list and merges a queue's list into the
+ *                 output queue once it holds "enqstage" bytes (or
+ *                 SHUFFLE_STAGEMAXREQS msgs).  this takes the queue's
+ *                 lock once per merge rather than once per msg.  a
+ *                 thread's msgs stay in order.  staged msgs are pushed by
+ *                 the flush calls (origin, remote and dst),
+ *                 shuffle_epoch_end(), and the calling thread's
+ *                 shuffle_enqueue_broadcast().  flow control happens
+ *                 at merge time, so a merge may block.  a value close
+ *                 to the buftarget of the queues works well.
+ *
  * note that we identify endpoints by a global rank number.
  * 3 hop routing info is provided by deltafs-nexus (internally
  * nexus uses MPI to determine the topology, rank numbers, and
@@ -130,6 +215,7 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>                            /* for FILE */
 
 #include <deltafs-nexus/deltafs-nexus_api.h> /* for nexus_ctx_t */
 #include <mercury_types.h>                   /* for hg_return_t */
@@ -149,6 +235,237 @@ struct shuffle_opts {
   int rbuftarget;         /* target #bytes for remote RPC */
   int deliverq_max;       /* max# requests in delivery q before flow ctrl */
   int deliverq_threshold; /* wake delivery thread when threshold# reqs q'd */
+  int creditwin;          /* per-sender byte credit window (0=off) */
+  int aimd;               /* adaptive RPC windows (SHUFFLE_AIMD_* bits) */
+  int aimdmaxrpc;         /* ceiling for adaptive maxrpc (0=4x maxrpc) */
+  int aimdsenderlimit;    /* ceiling for adaptive senderlimit (0=4x start) */
+  int latstamp;           /* stamp reqs to measure enqueue-to-delivery */
+  int sample_ms;          /* sampler period in msec (0=off) */
+  const char *samplefile; /* sampler CSV file (we append the rank#) */
+  const char *recordfile; /* enqueue record file (we append the rank#) */
+  int directmax;          /* max# of direct (one hop) queues (0=off) */
+  int directbytes;        /* bytes sent to a dst before going direct */
+  int routing;            /* SHUFFLE_ROUTE_* (default 3 hop) */
+  int srcreps;            /* #local SRCREPs per remote node (0/1=one) */
+  int repsel;             /* how SRC picks a SRCREP (SHUFFLE_REPSEL_*) */
+  int remoterails;        /* #mercury contexts for the network (0/1=one) */
+  int relayworkers;       /* #relay worker threads (0=progress thread) */
+  int enqstage;           /* per-thread enqueue staging bytes (0=off) */
+};
+
+/*
+ * shuffle_opts routing modes.  all ranks must use the same mode.
+ */
+#define SHUFFLE_ROUTE_3HOP     0  /* SRC -> SRCREP -> DSTREP -> DST */
+#define SHUFFLE_ROUTE_NOSRCREP 1  /* SRC -net-> DSTREP -> DST */
+#define SHUFFLE_ROUTE_NODSTREP 2  /* SRC -> SRCREP -net-> DST */
+
+/*
+ * shuffle_opts SRCREP selection (when srcreps > 1)
+ */
+#define SHUFFLE_MAXSRCREPS     16 /* max value for srcreps */
+#define SHUFFLE_REPSEL_HASH    0  /* by hash of dst (keeps msg order) */
+#define SHUFFLE_REPSEL_DEPTH   1  /* SRCREP with the least queued bytes */
+
+#define SHUFFLE_MAXRAILS       8  /* max value for remoterails */
+#define SHUFFLE_MAXRELAYWORKERS 16 /* max value for relayworkers */
+#define SHUFFLE_STAGEMAXREQS  128 /* enqstage merges at this many msgs */
+
+/*
+ * enqueue record file format (see shuffle_opts recordfile).  the file
+ * starts with a shuffle_rec_hdr followed by one shuffle_rec for each
+ * shuffle_enqueue() or shuffle_enqueue_broadcast() call made by the
+ * application, in call order (successful or not).  all values are in
+ * host byte order.  shuffle-bench can replay a set of these files.
+ */
+#define SHUFFLE_REC_MAGIC     0x43455253  /* "SREC" */
+#define SHUFFLE_REC_VERSION   1
+#define SHUFFLE_REC_BCAST     (-1)        /* dst of a broadcast */
+#define SHUFFLE_REC_BCASTSELF (-2)        /* ... with SHUFFLE_BCAST_SELF */
+
+struct shuffle_rec_hdr {
+  uint32_t magic;         /* SHUFFLE_REC_MAGIC */
+  uint32_t version;       /* SHUFFLE_REC_VERSION */
+  int32_t rank;           /* global rank that made the calls */
+  int32_t nranks;         /* global size at the time */
+};
+
+struct shuffle_rec {
+  uint32_t dt_us;         /* usec since prev rec (or init), saturates */
+  int32_t dst;            /* dst rank, or SHUFFLE_REC_BCAST* */
+  uint32_t type;          /* msg type */
+  uint32_t len;           /* data length */
+};
+
+/*
+ * shuffle_opts aimd bits: select which outsets adapt their windows
+ */
+#define SHUFFLE_AIMD_LOCAL  1     /* local (na+sm) maxrpc/senderlimit */
+#define SHUFFLE_AIMD_REMOTE 2     /* remote (network) maxrpc/senderlimit */
+
+/*
+ * reasons a batch was sent (index of shuffle_outset_stats sendreason[])
+ */
+#define SHUFFLE_SEND_BUFTARGET 0  /* batch reached buftarget bytes */
+#define SHUFFLE_SEND_FLUSH     1  /* pushed out early by a flush */
+#define SHUFFLE_SEND_CTL       2  /* carried an internal control msg */
+#define SHUFFLE_SEND_NREASONS  3  /* number of reasons */
+
+/*
+ * shuffle_outset_stats: counters for one set of output queues
+ */
+struct shuffle_outset_stats {
+  uint64_t reqs;          /* #reqs queued (ours and relayed) */
+  uint64_t bytes;         /* #data bytes in those reqs */
+  uint64_t sends;         /* #batches (RPCs) sent */
+  uint64_t sendbytes;     /* #data bytes sent in batches */
+  uint64_t flushsends;    /* #batches sent early due to a flush */
+  uint64_t waits;         /* #reqs that had to wait for an outqueue */
+  uint64_t credwaits;     /* ... of those, #that waited on credits */
+  uint64_t senderlimit;   /* #times enqueue blocked at the sender limit */
+  uint64_t flushes;       /* #flush ops started */
+  uint64_t sendreason[SHUFFLE_SEND_NREASONS];  /* #batches sent, by reason */
+};
+
+/*
+ * shuffle_stats: snapshot of shuffle counters from shuffle_get_stats().
+ * counters start at zero at shuffle_init() and are always compiled in.
+ */
+struct shuffle_stats {
+  uint64_t enqueues;      /* #shuffle_enqueue() calls */
+  uint64_t enqbytes;      /* #data bytes enqueued */
+  uint64_t bcasts;        /* #shuffle_enqueue_broadcast() calls */
+  uint64_t rpcin_local;   /* #batches received on na+sm */
+  uint64_t rpcin_remote;  /* #batches received on the network */
+  uint64_t credfallback;  /* #batches received over credit */
+  uint64_t dreqs;         /* #reqs input to delivery */
+  uint64_t dwaits;        /* #reqs that had to wait for delivery */
+  uint64_t delivers;      /* #deliveries made */
+  uint64_t deliverbytes;  /* #data bytes delivered */
+  uint64_t dnocb;         /* #reqs dropped due to no callback */
+  uint64_t dflushes;      /* #delivery flush ops started */
+  uint64_t flushwaits;    /* #flush ops that queued behind another */
+  uint64_t dstflushes;    /* #shuffle_flush_dst() calls */
+  uint64_t epochs;        /* #shuffle_epoch_end() completions */
+  uint64_t stranded;      /* #reqs stranded at shutdown */
+  uint64_t directqs;      /* #direct queues set up (see directmax) */
+  uint64_t directreqs;    /* #reqs sent on direct queues */
+  uint64_t srcrepreqs;    /* #reqs we relayed as a SRCREP (na+sm->net) */
+  uint64_t srcrepbytes;   /* #data bytes in those reqs */
+  uint64_t relaybatches;  /* #inbound batches run by relay workers */
+  uint64_t stagereqs;     /* #msgs staged by app threads (see enqstage) */
+  uint64_t stagemerges;   /* #staged lists merged into output queues */
+  struct shuffle_outset_stats local_origin;  /* local origin (na+sm) */
+  struct shuffle_outset_stats local_relay;   /* local relay (na+sm) */
+  struct shuffle_outset_stats remote;        /* remote (network) */
+};
+
+/*
+ * shuffle_hist: snapshot of a log-linear histogram from shuffle_get_hist().
+ * values are in usec, except for the batch size histograms (which
+ * count reqs or bytes).  values < 16 have their own bucket, after
+ * that each power of 2 is split into 8 buckets.  use
+ * shuffle_hist_bucket_low() to get a bucket's lower bound.
+ */
+#define SHUFFLE_HIST_NBUCKETS 240 /* covers up to 2^32 usec (~71 min) */
+
+struct shuffle_hist {
+  uint64_t count;         /* #values recorded */
+  uint64_t sum;           /* sum of all values (usec) */
+  uint64_t max;           /* largest value (usec) */
+  uint64_t buckets[SHUFFLE_HIST_NBUCKETS];
+};
+
+/*
+ * histograms that shuffle_get_hist() can return
+ */
+#define SHUFFLE_HIST_RTT_ORIGIN    0 /* batch RTT, local origin outset */
+#define SHUFFLE_HIST_RTT_RELAY     1 /* batch RTT, local relay outset */
+#define SHUFFLE_HIST_RTT_REMOTE    2 /* batch RTT, remote outset */
+#define SHUFFLE_HIST_OQWAIT_ORIGIN 3 /* req time on oqwaitq, local origin */
+#define SHUFFLE_HIST_OQWAIT_RELAY  4 /* req time on oqwaitq, local relay */
+#define SHUFFLE_HIST_OQWAIT_REMOTE 5 /* req time on oqwaitq, remote */
+#define SHUFFLE_HIST_DWAIT         6 /* req time on a delivery waitq */
+#define SHUFFLE_HIST_DELIVERCB     7 /* delivery callback run time */
+#define SHUFFLE_HIST_E2E           8 /* enqueue to delivery (latstamp) */
+#define SHUFFLE_HIST_BREQS_ORIGIN  9 /* reqs per batch, local origin */
+#define SHUFFLE_HIST_BREQS_RELAY  10 /* reqs per batch, local relay */
+#define SHUFFLE_HIST_BREQS_REMOTE 11 /* reqs per batch, remote */
+#define SHUFFLE_HIST_BBYTES_ORIGIN 12 /* bytes per batch, local origin */
+#define SHUFFLE_HIST_BBYTES_RELAY 13 /* bytes per batch, local relay */
+#define SHUFFLE_HIST_BBYTES_REMOTE 14 /* bytes per batch, remote */
+#define SHUFFLE_NHIST             15 /* number of histograms */
+
+/*
+ * shuffle_peerfn_t: callback for shuffle_router iterate.  called once
+ * for each peer with its mercury address, global rank and sub-rank
+ * (local rank or node number, used only for logging).  returns 0 to
+ * continue or -1 to stop with an error.
+ */
+typedef int (*shuffle_peerfn_t)(void *fnarg, hg_addr_t addr, int grank,
+                                int subrank);
+
+/*
+ * shuffle_router: the routing interface the shuffle uses.  shuffle_init()
+ * uses a built-in nexus router, shuffle_init_router() takes any other
+ * implementation (e.g. a mock topology for benchmarks).  "rarg" is the
+ * router's state, passed back on every call.  all addrs returned must
+ * stay valid until the shuffle is shutdown, and next_hop must return
+ * the same hg_addr_t value for a peer that iterate gave.  next_hop
+ * follows nexus_next_hop() semantics: NX_DONE if dest is us,
+ * NX_ISLOCAL if dest is on our node, NX_SRCREP if dest is remote and
+ * must go via a local SRCREP first, or NX_DESTREP if we are the
+ * SRCREP and *addr is the DESTREP on dest's node.  iterate(local=1)
+ * lists every rank on our node (including us), iterate(local=0) lists
+ * the remote DESTREPs we send to.  next_hop is called concurrently
+ * from several threads.
+ *
+ * memdst is optional (NULL for normal mercury RPCs).  if it is set,
+ * the shuffle uses an in-memory transport for benchmarking: mercury
+ * is not used at all (the progressor functions may be NULL and addrs
+ * are just unique tokens), and batches are handed directly to the
+ * in-process shuffle that memdst returns for addr.  every shuffle in
+ * the world must use it, and all of them must be idle (no batches in
+ * flight, e.g. after flushing all their output queues) before any of
+ * them is shutdown.
+ *
+ * set_routing is optional (NULL if the router only does 3 hops).  if
+ * shuffle_opts routing is not SHUFFLE_ROUTE_3HOP, shuffle_init calls
+ * it once before using the router.  it switches next_hop and iterate
+ * to the given 2 hop mode: for NOSRCREP next_hop returns NX_DESTREP
+ * (the DSTREP on dest's node) for every remote dest, for NODSTREP the
+ * SRCREP gets NX_DESTREP with dest itself as the next hop.
+ * iterate(local=0) must then list those network peers.  returns 0 on
+ * success or -1 if the mode is not supported.
+ *
+ * set_srcreps and srcreps are optional (NULL if the router has one
+ * SRCREP per remote node).  if shuffle_opts srcreps is > 1,
+ * shuffle_init calls set_srcreps(nreps) once, after set_routing.  from
+ * then on every remote node is served by nreps local SRCREPs:
+ * next_hop returns NX_DESTREP on each of them and iterate(local=0)
+ * includes their DSTREPs.  srcreps fills in the global ranks and local
+ * addrs of dest's SRCREPs and returns how many there are (0 if dest
+ * is not remote).  the first one must be the SRCREP that next_hop
+ * gives, and it alone handles broadcasts for dest's node.  srcreps is
+ * called concurrently and must not block.
+ *
+ * direct_addr is optional (NULL if not supported).  it returns the
+ * network (remote class) addr of any global rank, for the direct
+ * queues of shuffle_opts directmax.  it returns 0 on success or -1
+ * on error, and is only called by one thread at a time.
+ */
+struct shuffle_router {
+  nexus_ret_t (*next_hop)(void *rarg, int dest, int *rank, hg_addr_t *addr);
+  int (*global_rank)(void *rarg);
+  int (*global_size)(void *rarg);
+  int (*iterate)(void *rarg, int local, shuffle_peerfn_t fn, void *fnarg);
+  progressor_handle_t *(*localprogressor)(void *rarg);
+  progressor_handle_t *(*remoteprogressor)(void *rarg);
+  struct shuffle *(*memdst)(void *rarg, hg_addr_t addr);
+  int (*direct_addr)(void *rarg, int rank, hg_addr_t *addr);
+  int (*set_routing)(void *rarg, int routing);
+  int (*set_srcreps)(void *rarg, int nreps);
+  int (*srcreps)(void *rarg, int dest, int *ranks, hg_addr_t *addrs);
 };
 
 /*
@@ -156,6 +473,11 @@ struct shuffle_opts {
  */
 typedef struct shuffle *shuffle_t;
 
+/*
+ * shuffle_flush_t: handle to an asynchronous flush operation
+ */
+typedef struct flush_op *shuffle_flush_t;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -168,6 +490,16 @@ extern "C" {
 typedef void (*shuffle_deliverfn_t)(int src, int dst, uint32_t type,
                                     void *d, uint32_t datalen);
 
+/*
+ * shuffle_handlerfn_t: pointer to a per-type delivery callback
+ * registered with shuffle_register_handler().  "arg" is the user
+ * context pointer given at registration time.  like the main
+ * delivery callback, this function may block if the DST is busy/full.
+ */
+typedef void (*shuffle_handlerfn_t)(void *arg, int src, int dst,
+                                    uint32_t type, void *d,
+                                    uint32_t datalen);
+
 /*
  * shuffle_opts_init: init all values in an opts structures to the defaults
  *
@@ -181,29 +513,94 @@ void shuffle_opts_init(struct shuffle_opts *sopt);
  * retry...  note that opts' lomaxrpc/lrmaxrpc/rmaxrpc is applied per dest,
  * while localsenderlimit/remotesenderlimit is applied to shuffle_send
  * calls (but not relayed reqs) across all local (or remote) dests.
+ * delivercb handles all types not covered by shuffle_register_handler()
+ * and may be NULL if handlers cover every type the app uses.
  *
  * @param nxp the nexus context (routing info, already init'd)
  * @param funname rpc function name (for making a mercury RPC id number)
- * @param delivercb application callback to deliver data
+ * @param delivercb default application callback to deliver data
  * @param sopt shuffle options
  * @return handle to shuffle (a pointer) or NULL on error
  */
 shuffle_t shuffle_init(nexus_ctx_t nxp, char *funname,
           shuffle_deliverfn_t delivercb, struct shuffle_opts *sopt);
 
+/*
+ * shuffle_init_router: inits the shuffle layer using a caller
+ * provided router rather than nexus (see struct shuffle_router).
+ * the router and its state must outlive the shuffle.
+ *
+ * @param rt the router's functions
+ * @param rarg router state passed to rt's functions
+ * @param funname rpc function name (for making a mercury RPC id number)
+ * @param delivercb default application callback to deliver data
+ * @param sopt shuffle options
+ * @return handle to shuffle (a pointer) or NULL on error
+ */
+shuffle_t shuffle_init_router(const struct shuffle_router *rt, void *rarg,
+          char *funname, shuffle_deliverfn_t delivercb,
+          struct shuffle_opts *sopt);
+
 /*
  * defines for request types
  */
 #define SHUFFLE_RTYPE_BCAST   (1 << 31)  /* req is a broadcast */
 #define SHUFFLE_RTYPE_USRBITS 0x7fffffff /* user-defined bits */
 
+/*
+ * handler flag bits
+ */
+#define SHUFFLE_HANDLER_THREAD 1  /* run handler on its own delivery thread */
+
+/*
+ * shuffle_register_handler_flags: register a delivery callback for
+ * requests whose type (ignoring SHUFFLE_RTYPE_BCAST) falls in the
+ * range [type_lo, type_hi].  ranges may not overlap.  by default the
+ * handler runs on the main delivery thread.   if SHUFFLE_HANDLER_THREAD
+ * is set it gets a private delivery queue and thread (with the same
+ * deliverq_max/deliverq_threshold flow control settings) so it cannot
+ * block delivery of other types.  handlers should be registered before
+ * any traffic of their types is sent and cannot be removed.
+ *
+ * @param sh shuffle service handle
+ * @param type_lo first type in the range
+ * @param type_hi last type in the range (inclusive)
+ * @param fn handler callback function
+ * @param arg user context pointer passed to fn
+ * @param flags handler flags (see above)
+ * @return status
+ */
+hg_return_t shuffle_register_handler_flags(shuffle_t sh, uint32_t type_lo,
+                                           uint32_t type_hi,
+                                           shuffle_handlerfn_t fn, void *arg,
+                                           int flags);
+
+/*
+ * shuffle_register_handler: register a delivery callback that runs
+ * on the main delivery thread (wrapper for shuffle_register_handler_flags)
+ *
+ * @param sh shuffle service handle
+ * @param type_lo first type in the range
+ * @param type_hi last type in the range (inclusive)
+ * @param fn handler callback function
+ * @param arg user context pointer passed to fn
+ * @return status
+ */
+#define shuffle_register_handler(S,L,H,F,A) \
+        shuffle_register_handler_flags((S), (L), (H), (F), (A), 0)
+
 /*
  * shuffle_enqueue: start the sending of a message via the shuffle.
  * this is not end-to-end, it returns success once the message has
  * been queued for the next hop (the message data is copied into
  * the output queue, so the buffer passed in as an arg can be reused
- * when this function returns).   this is called by the main client
- * thread.
+ * when this function returns).   any number of app threads may
+ * call this at the same time (see the enqstage option to keep them
+ * from contending on the output queue locks).  msgs sent by one
+ * thread to a dst arrive in order, except around the switch of that
+ * dst to a direct queue (directmax) and with SHUFFLE_REPSEL_DEPTH
+ * (msgs to a dst may take different SRCREPs).  there is no order
+ * between threads.
  *
  * @param sh shuffle service handle
  * @param dst target to send to
@@ -237,10 +634,10 @@ hg_return_t shuffle_enqueue_broadcast(shuffle_t sh, uint32_t type, void *d,
                                       uint32_t datalen, int flags);
 
 /*
- * shuffle_flush_delivery: flush the delivery queue.  this function
- * blocks until all requests currently in the delivery queues are
- * delivered.   We make no claims about requests that arrive after
- * the flush has been started.
+ * shuffle_flush_delivery: flush the delivery queues.  this function
+ * blocks until all requests currently in the delivery queues (including
+ * those of handlers with their own thread) are delivered.   We make no
+ * claims about requests that arrive after the flush has been started.
  *
  * @param sh shuffle service handle
  * @return status
@@ -253,6 +650,7 @@ hg_return_t shuffle_flush_delivery(shuffle_t sh);
 #define SHUFFLE_REMOTE_QUEUES 0    /* network queues (between nodes) */
 #define SHUFFLE_ORIGIN_QUEUES 1    /* origin/client queues (local, na+sm) */
 #define SHUFFLE_RELAY_QUEUES  2    /* relay queues (local, na+sm) */
+#define SHUFFLE_DELIVERY_QUEUES 3  /* delivery queues */
 
 /*
  * shuffle_flush_qs: flush the specified output queues.
@@ -266,6 +664,65 @@ hg_return_t shuffle_flush_delivery(shuffle_t sh);
  */
 hg_return_t shuffle_flush_qs(shuffle_t sh, int whichqs);
 
+/*
+ * shuffle_flush_dst: flush only the output queues on the path to dst.
+ * this pushes out any buffered reqs for dst at every hop on the way
+ * (origin, relay, remote) with a flush marker and blocks until dst
+ * acks the marker.  dst acks once its default delivery thread has
+ * delivered the reqs we sent to dst before the call (reqs for a
+ * handler with its own delivery thread have reached dst, but may
+ * still be queued there).  it does not wait for (or block) flushes
+ * started by shuffle_flush_qs or shuffle_flush_start.
+ *
+ * @param sh shuffle service handle
+ * @param dst global rank whose path we want to flush
+ * @return status (HG_TIMEOUT if dst did not ack in time)
+ */
+hg_return_t shuffle_flush_dst(shuffle_t sh, int dst);
+
+/*
+ * shuffle_flush_start: start an asynchronous flush of the specified
+ * queues and return a handle for it.  the flush covers all requests
+ * in the queues at the time it starts running.  flushes of the same
+ * queue set are run one at a time in the order they were started,
+ * but flushes of different queue sets run concurrently.  every handle
+ * must be released with shuffle_flush_wait().  shuffle_shutdown()
+ * cancels unfinished flushes but does not free their handles: they
+ * stay valid, and test/wait on them still works after shutdown.
+ * if the enqstage opt is on, starting an origin or remote queue flush
+ * first merges every thread's staged msgs.  the merge is subject to
+ * flow control, so in that case shuffle_flush_start() may block.
+ *
+ * @param sh shuffle service handle
+ * @param whichqs which queues to flush (see defines above)
+ * @param fhp the flush handle is returned here
+ * @return status
+ */
+hg_return_t shuffle_flush_start(shuffle_t sh, int whichqs,
+                                shuffle_flush_t *fhp);
+
+/*
+ * shuffle_flush_test: test if an asynchronous flush is done (does not
+ * release the handle).
+ *
+ * @param sh shuffle service handle
+ * @param fh flush handle from shuffle_flush_start
+ * @param donep set to 1 if the flush is done (or canceled), else 0
+ * @return status
+ */
+hg_return_t shuffle_flush_test(shuffle_t sh, shuffle_flush_t fh, int *donep);
+
+/*
+ * shuffle_flush_wait: block until an asynchronous flush is done and
+ * release its handle.
+ *
+ * @param sh shuffle service handle
+ * @param fh flush handle from shuffle_flush_start (freed on return)
+ * @return status (HG_CANCELED if the flush was canceled by shutdown,
+ *         in which case sh may already be gone and is not used)
+ */
+hg_return_t shuffle_flush_wait(shuffle_t sh, shuffle_flush_t fh);
+
 
 /*
  * shuffle_flush_originqs: flush client/origin qs (wrap for shuffle_flush_qs)
@@ -295,6 +752,25 @@ hg_return_t shuffle_flush_qs(shuffle_t sh, int whichqs);
 #define shuffle_flush_remoteqs(S) \
         shuffle_flush_qs((S), SHUFFLE_REMOTE_QUEUES)
 
+/*
+ * shuffle_epoch_end: end the current epoch.  this is a collective
+ * call: every rank must call it once per epoch.  it returns when
+ * every message enqueued (on any rank) during the epoch has been
+ * delivered everywhere.  it replaces the flush/MPI_Barrier sequence
+ * with counting-based termination detection over the shuffle RPCs.
+ * messages enqueued by delivery callbacks during the epoch are part
+ * of the epoch.   global rank 0 coordinates.  if the counts never
+ * match (e.g. msgs were lost), rank 0 gives up after a timeout and
+ * every rank ends the epoch with HG_TIMEOUT.  if a rank stops taking
+ * part (no REPORT to rank 0, or no QUERY/verdict from it within the
+ * timeout) the shuffle dumps its state and aborts, as for the other
+ * shuffle timeouts.
+ *
+ * @param sh shuffle service handle
+ * @return status (HG_TIMEOUT if termination could not be detected)
+ */
+hg_return_t shuffle_epoch_end(shuffle_t sh);
+
 
 /*
  * shuffle_shutdown: drop ref to progress threads, release memory.
@@ -337,6 +813,92 @@ int shuffle_cfglog(int max_xtra_rank, const char *defpri,
                    int alllogs, int msgbufsz, int stderrlog,
                    int xtra_stderrlog);
 
+/*
+ * shuffle_cfglogq: enable a background thread that writes the log
+ * file (if shuffle_cfglog() enabled one for this rank).  logging
+ * threads then only copy their message into a lock-free queue of
+ * qlen bytes instead of doing a write(2) under the log lock.  the
+ * in-memory message buffer is always lock-free.  call this before
+ * shuffle_init().
+ *
+ * @param qlen size of the writer's queue in bytes (0 disables)
+ * @return 0 on success, -1 on error
+ */
+int shuffle_cfglogq(int qlen);
+
+/*
+ * shuffle_cfgtrace: setup the binary event trace.  when enabled,
+ * each thread records fixed-size binary records (timestamp, event,
+ * ranks, seq#, size) at enqueue, batch send/completion, rpc receive,
+ * delivery, and flush points into its own ring (no locks, no string
+ * formatting).  the rings are process-wide and keep only the most
+ * recent "nrec" records per thread.  use tools/shuffle-trace2json
+ * to convert a dump to chrome trace JSON.  may be called at any time.
+ *
+ * @param nrec number of records per thread ring (0 turns tracing off)
+ * @param tracefile dump to this file at shutdown, if !NULL (we append
+ *                  the rank# to filename)
+ * @return 0 on success, -1 on error
+ */
+int shuffle_cfgtrace(int nrec, const char *tracefile);
+
+/*
+ * shuffle_trace_dump: dump all the trace rings to a file now.  the
+ * rings are per process, so this includes the records of every
+ * shuffle in the process (the file written at shutdown only has
+ * that shuffle's rank).
+ *
+ * @param file the file to write to (truncated)
+ * @return 0 on success, -1 on error
+ */
+int shuffle_trace_dump(const char *file);
+
+/*
+ * shuffle_get_stats: take a snapshot of the shuffle's counters.
+ * counters are updated atomically but not all at once, so a snapshot
+ * taken while traffic is flowing may be slightly skewed.  safe to
+ * call from any thread.
+ *
+ * @param sh shuffle service handle
+ * @param st the stats structure to fill out
+ * @return status
+ */
+hg_return_t shuffle_get_stats(shuffle_t sh, struct shuffle_stats *st);
+
+/*
+ * shuffle_get_hist: copy out one of the shuffle's histograms
+ * (SHUFFLE_HIST_*), optionally resetting it.  SHUFFLE_HIST_E2E only
+ * gets values if the senders set the latstamp option.  the stamp is
+ * taken from the realtime clock, so e2e latency from other nodes is
+ * only as good as the clock sync between the nodes.
+ *
+ * @param sh shuffle service handle
+ * @param which the histogram to get
+ * @param h where to put the histogram
+ * @param reset non-zero to reset the histogram after copying it
+ * @return status
+ */
+hg_return_t shuffle_get_hist(shuffle_t sh, int which,
+                             struct shuffle_hist *h, int reset);
+
+/*
+ * shuffle_hist_bucket_low: get the smallest value that maps to a bucket
+ *
+ * @param idx the bucket index
+ * @return the lower bound of the bucket (usec)
+ */
+uint64_t shuffle_hist_bucket_low(int idx);
+
+/*
+ * shuffle_hist_percentile: estimate a percentile (e.g. 99.0) from a
+ * histogram.  the answer is accurate to within a bucket (12.5%).
+ *
+ * @param h the histogram
+ * @param pct the percentile we want (0 to 100)
+ * @return the estimated value (usec), 0 if the histogram is empty
+ */
+uint64_t shuffle_hist_percentile(const struct shuffle_hist *h, double pct);
+
 /*
  * shuffle_send_stats: retrieve shuffle sender statistics
  * @param sh shuffle service handle
@@ -368,6 +930,20 @@ hg_return_t shuffle_recv_stats(shuffle_t sh, hg_uint64_t* local,
  */
 void shuffle_statedump(shuffle_t sh, int tostderr);
 
+/*
+ * shuffle_statedump_json: dump out the current state of the shuffle
+ * as a single JSON object (for aggregating dumps across ranks).
+ * includes counters, histogram summaries, credits, handlers, delivery
+ * queues, flush/epoch state, and every output queue in each outset
+ * (load, outputs in flight, wait queue length and the age of its
+ * oldest entry).  like shuffle_statedump(), it does not wait for
+ * locks held by other threads ("waslck" is set if it could not get one).
+ *
+ * @param sh shuffle service handle
+ * @param fp file to write the JSON to
+ */
+void shuffle_statedump_json(shuffle_t sh, FILE *fp);
+
 #ifdef __cplusplus
 }
 #endif
@@ -34,14 +34,14 @@
  */
 
 #include <stdlib.h>
-#include <mercury_atomic.h>
 #include "acnt_wrap.h"
 
 /*
- * actual internal defn of acnt32_t
+ * actual internal defn of acnt32_t.  we use the __atomic builtins on
+ * a plain int32_t (seq-cst, like mercury's ops, except for add).
  */
 struct acnt32_val {
-  hg_atomic_int32_t val;
+  int32_t val;
 };
 
 /*
@@ -51,7 +51,7 @@ acnt32_t acnt32_alloc(void) {
   acnt32_t rv;
   rv = (acnt32_t)malloc(sizeof(*rv));
   if (rv)
-     hg_atomic_set32(&rv->val, 0);
+     __atomic_store_n(&rv->val, 0, __ATOMIC_SEQ_CST);
   return(rv);
 }
 
@@ -69,26 +69,61 @@ void acnt32_free(acnt32_t *ac) {
  * acnt32_decr: decr the counter and return the new value
  */
 int32_t acnt32_decr(acnt32_t ac) {
-  return(hg_atomic_decr32(&ac->val));
+  return(__atomic_sub_fetch(&ac->val, 1, __ATOMIC_SEQ_CST));
 }
 
 /*
  * acnt32_get: get the current counter value
  */
 int32_t acnt32_get(acnt32_t ac) {
-  return(hg_atomic_get32(&ac->val));
+  return(__atomic_load_n(&ac->val, __ATOMIC_SEQ_CST));
 }
 
 /*
  * acnt32_decr: incr the counter and return the new value
  */
 int32_t acnt32_incr(acnt32_t ac) {
-  return(hg_atomic_incr32(&ac->val));
+  return(__atomic_add_fetch(&ac->val, 1, __ATOMIC_SEQ_CST));
+}
+
+/*
+ * acnt32_add: add a value to the counter
+ */
+void acnt32_add(acnt32_t ac, int32_t value) {
+  acnt_add(&ac->val, value);
 }
 
 /*
  * acnt32_set: set the value of a counter
  */
 void acnt32_set(acnt32_t ac, int32_t value) {
-  hg_atomic_set32(&ac->val, value);
+  __atomic_store_n(&ac->val, value, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * acnt64_alloc: allocate an array of 64 bit atomic counters set to zero.
+ * each counter is padded out to its own cache line so that counters
+ * bumped by different threads do not false share.
+ */
+acnt64_t acnt64_alloc(int n) {
+  void *vp;
+  acnt64_t rv;
+  int lcv;
+
+  if (n < 1 || posix_memalign(&vp, ACNT_CACHELINE, n * sizeof(*rv)) != 0)
+    return(NULL);
+  rv = (acnt64_t)vp;
+  for (lcv = 0 ; lcv < n ; lcv++)
+    acnt64_set(rv, lcv, 0);
+  return(rv);
+}
+
+/*
+ * acnt64_free: free an array of 64 bit counters and set pointer to NULL
+ */
+void acnt64_free(acnt64_t *ac) {
+  if (ac && *ac) {
+    free(*ac);
+    *ac = NULL;
+  }
 }
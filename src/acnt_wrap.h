@@ -56,18 +56,27 @@
  * to recreate all the portability tests that mercury has already done
  * for us.   to hack around this problem, we provide some C code that
  * wraps the mercury API and let our C++ code call that.
+ *
+ * mercury's API has no atomic add, and a cas loop is costly for
+ * counters that get bumped on every msg.  so we now use the gcc/clang
+ * __atomic builtins on plain ints instead (they work in both C and
+ * C++).  we keep acnt32_t opaque so callers do not change.
  */
 
 #include <mercury.h>          /* typedefs */
 
+/*
+ * acnt_add: relaxed atomic add to a plain int32_t or int64_t.  for
+ * counters that are only read as totals, so no ordering is needed.
+ */
+#define acnt_add(P, V) ((void) __atomic_fetch_add((P), (V), __ATOMIC_RELAXED))
+
 #if defined(__cplusplus)
 extern "C" {
 #endif
 
 /*
- * acnt32_t: wraps an hg_atomic_int32_t defn in an opaque structure
- * (the hg_atomic_int32_t may use _Atomic keywords, so it can't be
- * directly used in C++ code).
+ * acnt32_t: an opaque 32 bit atomic counter
  */
 struct acnt32_val;
 typedef struct acnt32_val *acnt32_t;
@@ -104,6 +113,13 @@ int32_t acnt32_get(acnt32_t ac);
  */
 int32_t acnt32_incr(acnt32_t ac);
 
+/**
+ * acnt32_add: add a value to the counter
+ * @param ac the counter to add to
+ * @param value the value to add
+ */
+void acnt32_add(acnt32_t ac, int32_t value);
+
 /**
  * acnt32_set: set the value of a counter
  * @param ac counter to set
@@ -111,6 +127,72 @@ int32_t acnt32_incr(acnt32_t ac);
  */
 void acnt32_set(acnt32_t ac, int32_t value);
 
+/*
+ * acnt64_t: an array of 64 bit atomic counters, each on its own
+ * cache line.  used for always-on statistics that are bumped from
+ * several threads (so plain ints would race and false share).
+ * the struct is visible so that the ops below can be inlined.
+ */
+#define ACNT_CACHELINE 64
+
+struct acnt64_val {
+  int64_t val;
+  char pad[ACNT_CACHELINE - sizeof(int64_t)];
+};
+typedef struct acnt64_val *acnt64_t;
+
+/**
+ * acnt64_alloc: allocate an array of 64 bit atomic counters set to zero
+ * @param n number of counters in the array
+ * @return NULL on falure, otherwise a pointer
+ */
+acnt64_t acnt64_alloc(int n);
+
+/**
+ * acnt64_free: free an array of 64 bit counters and set pointer to NULL
+ * @param ac pointer to the array we are freeing
+ */
+void acnt64_free(acnt64_t *ac);
+
+/**
+ * acnt64_incr: incr a counter by one
+ * @param ac the counter array
+ * @param idx index of the counter to add 1 to
+ */
+static inline void acnt64_incr(acnt64_t ac, int idx) {
+  acnt_add(&ac[idx].val, 1);
+}
+
+/**
+ * acnt64_add: add a value to a counter
+ * @param ac the counter array
+ * @param idx index of the counter to add to
+ * @param value the value to add
+ */
+static inline void acnt64_add(acnt64_t ac, int idx, int64_t value) {
+  acnt_add(&ac[idx].val, value);
+}
+
+/**
+ * acnt64_get: get the current value of a counter
+ * @param ac the counter array
+ * @param idx index of the counter
+ * @return the current value
+ */
+static inline int64_t acnt64_get(acnt64_t ac, int idx) {
+  return(__atomic_load_n(&ac[idx].val, __ATOMIC_RELAXED));
+}
+
+/**
+ * acnt64_set: set the value of a counter
+ * @param ac the counter array
+ * @param idx index of the counter to set
+ * @param value the new value
+ */
+static inline void acnt64_set(acnt64_t ac, int idx, int64_t value) {
+  __atomic_store_n(&ac[idx].val, value, __ATOMIC_RELAXED);
+}
+
 #if defined(__cplusplus)
 }  /* extern "C" */
 #endif
@@ -51,6 +51,7 @@
 #ifdef MLOG_MUTEX
 #include <pthread.h>
 #endif
+#include <sched.h>      /* for sched_yield */
 
 #include <sys/socket.h>
 #include <sys/time.h>
@@ -91,6 +92,35 @@ struct mlog_mbhead {
     uint32_t mbh_wp;    /*!< write pointer */
 };
 
+/**
+ * multi-producer byte ring.  writers reserve space by atomically
+ * advancing r_resv and copy their data in without any lock.  writers
+ * never wait for each other to commit.  the msgbuf ring overwrites old
+ * data and publishes the highest committed offset in r_done.  the async
+ * logfile ring is bounded by r_read (the writer thread's drain pointer)
+ * and frames each record with a header word that carries the commit
+ * flag (see mlog_aqput).  all offsets are 64 bit byte counts that never
+ * wrap (we take them mod r_len to index r_buf).
+ */
+struct mlog_ring {
+    char *r_buf;                    /*!< ring data */
+    uint32_t r_len;                 /*!< size of r_buf */
+    uint64_t r_resv;                /*!< bytes reserved by writers (atomic) */
+    uint64_t r_done;                /*!< highest commit, msgbuf (atomic) */
+    uint64_t r_read;                /*!< bytes drained (atomic, async only) */
+};
+
+/*
+ * async ring record header: a uint32_t at a 4 byte aligned ring
+ * offset (so it never wraps) followed by the data padded to 4 bytes.
+ * zero means the writer has not posted the length yet.
+ */
+#define MLOG_RHDR     sizeof(uint32_t)
+#define MLOG_RCOMMIT  0x80000000   /* data copied in, ready to write */
+#define MLOG_RDONE    0x40000000   /* written to logfile (reader only) */
+#define MLOG_RLENMASK 0x0fffffff
+#define MLOG_RSIZE(L) (MLOG_RHDR + (((L) + 3) & ~3))
+
 /**
  * internal global state
  */
@@ -112,8 +142,17 @@ struct mlog_state {
     mlog_aborthook_t abort_hook;    /*!< abort hook for mlog_abort() */
     int stdout_isatty;              /*!< non-zero if stdout is a tty */
     int stderr_isatty;              /*!< non-zero if stderr is a tty */
+    struct mlog_ring mbr;           /*!< lock-free writer side of mb */
 #ifdef MLOG_MUTEX
     pthread_mutex_t mlogmux;        /*!< protect mlog in threaded env */
+    /* async logfile writer state (see mlog_async()) */
+    struct mlog_ring aq;            /*!< pending logfile data [malloced] */
+    int aq_on;                      /*!< non-zero if writer thread running */
+    int aq_stop;                    /*!< tell writer thread to exit */
+    int aq_sleeping;                /*!< writer is waiting on aq_cv (atomic) */
+    pthread_t aq_thread;            /*!< the writer thread */
+    pthread_mutex_t aq_mux;         /*!< for aq_cv */
+    pthread_cond_t aq_cv;           /*!< writer waits here for data */
 #endif
 };
 
@@ -170,7 +209,8 @@ static uint32_t wswap(uint32_t);
  * based on the current value of the write pointer.   if the write pointer
  * is zero, then the entire buffer is in one and twolen is set to zero.
  * note that the _caller_ must check that mst.mb is valid, we assume it is.
- * caller must hold mlog_lock.
+ * caller must hold mlog_lock.  writers do not take the lock (see
+ * mlog_mbput), so the data may change under us if threads are logging.
  *
  * @param one pointer to first part of circular buffer
  * @param onelen length of the one buffer
@@ -180,7 +220,8 @@ static uint32_t wswap(uint32_t);
 static void mlog_getmbptrs(char **one, int *onelen, char **two, int *twolen)
 {
     uint32_t wp;
-    wp = ((struct mlog_mbhead *)mst.mb)->mbh_wp;
+    wp = __atomic_load_n(&((struct mlog_mbhead *)mst.mb)->mbh_wp,
+                         __ATOMIC_RELAXED);
     *one = ((char *) mst.mb) + sizeof(struct mlog_mbhead) + wp;
     *onelen = ((struct mlog_mbhead *)mst.mb)->mbh_len - wp;
     *two = ((char *) mst.mb) + sizeof(struct mlog_mbhead);
@@ -205,7 +246,8 @@ static void mlog_dmesg_mbuf(char **b1p, int *b1len, char **b2p, int *b2len)
     mlog_getmbptrs(b1p, b1len, b2p, b2len);
     /* if the buffer wasn't full, we need to adjust the pointers */
     skip = ((struct mlog_mbhead *)mst.mb)->mbh_len -
-           ((struct mlog_mbhead *)mst.mb)->mbh_cnt;
+           __atomic_load_n(&((struct mlog_mbhead *)mst.mb)->mbh_cnt,
+                           __ATOMIC_RELAXED);
     if (skip >= *b1len) {       /* skip entire first buffer? */
         skip -= *b1len;
         *b1p = *b2p;
@@ -435,6 +477,298 @@ static uint32_t wswap(uint32_t w)
             ((w      ) & 0xff) << 24 );
 }
 
+/**
+ * mlog_ringcopy: copy data into a ring at a reserved offset.  the
+ * caller must have reserved [off, off+len) and len must be <= r_len.
+ *
+ * @param r the ring
+ * @param off the reserved offset
+ * @param d the data to copy
+ * @param len length of data
+ */
+static void mlog_ringcopy(struct mlog_ring *r, uint64_t off,
+                          const char *d, uint32_t len)
+{
+    uint32_t idx, ncpy;
+    idx = off % r->r_len;
+    ncpy = r->r_len - idx;
+    if (ncpy > len) {
+        ncpy = len;
+    }
+    memcpy(r->r_buf + idx, d, ncpy);
+    if (len > ncpy) {
+        memcpy(r->r_buf, d + ncpy, len - ncpy);   /* wrapped */
+    }
+}
+
+/**
+ * mlog_mbput: put a log message in the message buffer.  lock free:
+ * concurrent writers each get their own slice of the buffer and do
+ * not wait for each other.  after copying we raise r_done to our end
+ * offset (if no later writer has already done so) and update the
+ * header readers use.  a reader may see the slice of a writer that
+ * is still copying (msgbuf is raw text, so there is no room for a
+ * per-record flag), but it never sees the header move backwards.
+ * if more than the size of the buffer is in flight at once, older
+ * in-flight messages may get overwritten (msgbuf is only a record of
+ * the most recent log data, so that's ok).  caller must ensure that
+ * mst.mb is valid.
+ *
+ * @param b the message
+ * @param tlen length of the message
+ */
+static void mlog_mbput(const char *b, uint32_t tlen)
+{
+    struct mlog_mbhead *mb = (struct mlog_mbhead *)mst.mb;
+    struct mlog_ring *r = &mst.mbr;
+    uint64_t off, end, cur;
+    /* wont fit?   truncate... */
+    if (tlen > r->r_len) {
+        b += tlen - r->r_len;
+        tlen = r->r_len;
+    }
+    off = __atomic_fetch_add(&r->r_resv, tlen, __ATOMIC_RELAXED);
+    mlog_ringcopy(r, off, b, tlen);
+    end = off + tlen;
+    cur = __atomic_load_n(&r->r_done, __ATOMIC_RELAXED);
+    while (cur < end) {
+        if (__atomic_compare_exchange_n(&r->r_done, &cur, end, 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+            cur = end;
+            break;
+        }
+    }
+    /*
+     * update the header from the current r_done.  a writer that stored
+     * an old value after a newer one sees r_done moved and redoes it,
+     * so the header always settles on the latest commit.
+     */
+    for (;;) {
+        __atomic_store_n(&mb->mbh_wp, (uint32_t)(cur % r->r_len),
+                         __ATOMIC_RELAXED);
+        __atomic_store_n(&mb->mbh_cnt,
+                         (uint32_t)((cur < r->r_len) ? cur : r->r_len),
+                         __ATOMIC_RELEASE);
+        end = __atomic_load_n(&r->r_done, __ATOMIC_ACQUIRE);
+        if (end == cur) {
+            break;
+        }
+        cur = end;
+    }
+}
+
+#ifdef MLOG_MUTEX
+/**
+ * mlog_aqwake: wake the async writer thread
+ */
+static void mlog_aqwake()
+{
+    pthread_mutex_lock(&mst.aq_mux);
+    pthread_cond_signal(&mst.aq_cv);
+    pthread_mutex_unlock(&mst.aq_mux);
+}
+
+/**
+ * mlog_aqput: queue a log message for the async writer thread.  if
+ * the queue is full we yield until the writer makes space (we do not
+ * drop log data).  we frame the message with a header word: we post
+ * our length right after reserving and set MLOG_RCOMMIT once the data
+ * is in, so we never have to wait for writers that reserved ahead of
+ * us (the writer thread skips over them).  caller must ensure the
+ * writer is running.
+ *
+ * @param b the message
+ * @param tlen length of the message (<= MLOG_TBSIZ)
+ */
+static void mlog_aqput(const char *b, uint32_t tlen)
+{
+    struct mlog_ring *r = &mst.aq;
+    uint64_t off, need;
+    uint32_t *hp;
+    need = MLOG_RSIZE(tlen);
+    off = __atomic_load_n(&r->r_resv, __ATOMIC_RELAXED);
+    for (;;) {
+        if (off + need - __atomic_load_n(&r->r_read, __ATOMIC_ACQUIRE) >
+            r->r_len) {                      /* full, wait for writer */
+            mlog_aqwake();
+            sched_yield();
+            off = __atomic_load_n(&r->r_resv, __ATOMIC_RELAXED);
+            continue;
+        }
+        if (__atomic_compare_exchange_n(&r->r_resv, &off, off + need, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            break;
+        }
+        /* lost a race, off has been reloaded by the CAS, retry */
+    }
+    hp = (uint32_t *)(r->r_buf + (off % r->r_len));
+    __atomic_store_n(hp, tlen, __ATOMIC_RELAXED);
+    mlog_ringcopy(r, off + MLOG_RHDR, b, tlen);
+    __atomic_store_n(hp, tlen | MLOG_RCOMMIT, __ATOMIC_SEQ_CST);
+    /* pairs with aq_sleeping/mlog_aqscan check in mlog_aqmain */
+    if (__atomic_load_n(&mst.aq_sleeping, __ATOMIC_SEQ_CST)) {
+        mlog_aqwake();
+    }
+}
+
+/**
+ * mlog_aqscan: walk the queued records from the drain pointer.  we
+ * skip records that are still being copied in and write out the
+ * committed ones (marking them MLOG_RDONE).  we stop at a header of
+ * zero (a writer that has not posted its length yet).  if we are not
+ * writing, we just report if there is anything to write.  caller must
+ * hold mlog_lock if writing.
+ *
+ * @param r the ring
+ * @param rd the drain pointer
+ * @param dowrite non-zero if we should write committed records
+ * @return number of committed records found
+ */
+static int mlog_aqscan(struct mlog_ring *r, uint64_t rd, int dowrite)
+{
+    uint64_t end;
+    uint32_t *hp, h, len, idx, n;
+    int cnt = 0;
+    end = __atomic_load_n(&r->r_resv, __ATOMIC_ACQUIRE);
+    while (rd < end) {
+        hp = (uint32_t *)(r->r_buf + (rd % r->r_len));
+        h = __atomic_load_n(hp, __ATOMIC_SEQ_CST);
+        if (h == 0) {
+            break;
+        }
+        len = h & MLOG_RLENMASK;
+        if ((h & MLOG_RCOMMIT) && !(h & MLOG_RDONE)) {
+            cnt++;
+            if (!dowrite) {
+                break;
+            }
+            idx = (rd + MLOG_RHDR) % r->r_len;
+            n = r->r_len - idx;
+            if (n > len) {
+                n = len;
+            }
+            if (mst.logfd >= 0 &&
+                    (write(mst.logfd, r->r_buf + idx, n) != (ssize_t)n ||
+                     (len > n && write(mst.logfd, r->r_buf,
+                                       len - n) != (ssize_t)(len - n)))) {
+                /*ignore it*/;
+            }
+            __atomic_store_n(hp, h | MLOG_RDONE, __ATOMIC_RELAXED);
+        }
+        rd += MLOG_RSIZE(len);
+    }
+    return(cnt);
+}
+
+/**
+ * mlog_aqmain: main routine for the async writer thread.  we write
+ * committed records from the queue to the log file, then free the
+ * written records at the head of the queue.  we hold mlog_lock while
+ * writing so that mlog_reopen can safely swap mst.logfd.
+ *
+ * @param arg unused
+ * @return NULL
+ */
+static void *mlog_aqmain(void *arg)
+{
+    struct mlog_ring *r = &mst.aq;
+    struct timespec ts;
+    uint64_t rd, nrd;
+    uint32_t *hp, h, sz, idx, n;
+    (void)arg;
+    rd = __atomic_load_n(&r->r_read, __ATOMIC_ACQUIRE);
+    for (;;) {
+        mlog_lock();
+        mlog_aqscan(r, rd, 1);
+        mlog_unlock();
+        /* free written records, zero them for the next lap's headers */
+        nrd = rd;
+        for (;;) {
+            hp = (uint32_t *)(r->r_buf + (nrd % r->r_len));
+            h = __atomic_load_n(hp, __ATOMIC_RELAXED);
+            if (!(h & MLOG_RDONE)) {
+                break;
+            }
+            sz = MLOG_RSIZE(h & MLOG_RLENMASK);
+            idx = nrd % r->r_len;
+            n = r->r_len - idx;
+            if (n > sz) {
+                n = sz;
+            }
+            memset(r->r_buf + idx, 0, n);
+            if (sz > n) {
+                memset(r->r_buf, 0, sz - n);
+            }
+            nrd += sz;
+        }
+        if (nrd != rd) {
+            rd = nrd;
+            __atomic_store_n(&r->r_read, rd, __ATOMIC_RELEASE);
+            continue;
+        }
+        if (__atomic_load_n(&mst.aq_stop, __ATOMIC_ACQUIRE) &&
+                rd == __atomic_load_n(&r->r_resv, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        pthread_mutex_lock(&mst.aq_mux);
+        __atomic_store_n(&mst.aq_sleeping, 1, __ATOMIC_SEQ_CST);
+        if (mlog_aqscan(r, rd, 0) == 0 && !mst.aq_stop) {
+            /* timeout is just a safety net, we should get a signal */
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += 100 * 1000 * 1000;
+            if (ts.tv_nsec >= 1000 * 1000 * 1000) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000 * 1000 * 1000;
+            }
+            pthread_cond_timedwait(&mst.aq_cv, &mst.aq_mux, &ts);
+        }
+        __atomic_store_n(&mst.aq_sleeping, 0, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&mst.aq_mux);
+    }
+    return(NULL);
+}
+
+/**
+ * mlog_aqdrain: wait for the async writer to write out everything
+ * that has been queued so far (e.g. before we abort).
+ */
+static void mlog_aqdrain()
+{
+    uint64_t want;
+    if (!__atomic_load_n(&mst.aq_on, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    want = __atomic_load_n(&mst.aq.r_resv, __ATOMIC_ACQUIRE);
+    while (__atomic_load_n(&mst.aq.r_read, __ATOMIC_ACQUIRE) < want) {
+        mlog_aqwake();
+        sched_yield();
+    }
+}
+
+/**
+ * mlog_aqstop: stop the async writer thread (if running) after it
+ * drains its queue, and free its resources.  caller must ensure that
+ * no other threads are logging.
+ */
+static void mlog_aqstop()
+{
+    if (!mst.aq_on) {
+        return;
+    }
+    __atomic_store_n(&mst.aq_on, 0, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&mst.aq_mux);
+    __atomic_store_n(&mst.aq_stop, 1, __ATOMIC_RELEASE);
+    pthread_cond_signal(&mst.aq_cv);
+    pthread_mutex_unlock(&mst.aq_mux);
+    pthread_join(mst.aq_thread, NULL);
+    pthread_cond_destroy(&mst.aq_cv);
+    pthread_mutex_destroy(&mst.aq_mux);
+    free(mst.aq.r_buf);
+    memset(&mst.aq, 0, sizeof(mst.aq));
+    mst.aq_stop = 0;
+}
+#endif /* MLOG_MUTEX */
+
 /**
  * mlog_cleanout: release previously allocated resources (e.g. from a
  * close or during a failed open).  this function assumes the mlogmux
@@ -448,6 +782,9 @@ static uint32_t wswap(uint32_t w)
 static void mlog_cleanout()
 {
     int lcv;
+#ifdef MLOG_MUTEX
+    mlog_aqstop();   /* must be done before we lock, writer uses lock */
+#endif
     mlog_lock();
     if (mst.logfile) {
         if (mst.logfd >= 0) {
@@ -478,6 +815,7 @@ static void mlog_cleanout()
     if (mst.mb) {
         free(mst.mb);
         mst.mb = NULL;
+        memset(&mst.mbr, 0, sizeof(mst.mbr));
     }
     if (mst.udpsock >= 0) {
         close(mst.udpsock);
@@ -503,23 +841,23 @@ static void mlog_cleanout()
  * send it to all target output logs.  the holding buffer is set to
  * MLOG_TBSIZ, if the message is too long it will be silently truncated.
  * caller should not hold mlog_lock, vmlog will grab it as needed.
+ * formatting and the message buffer do not use the lock (so threads
+ * do not serialize on them), nor does the log file if the async
+ * writer is running (see mlog_async()).
  */
 void vmlog(int flags, const char *fmt, va_list ap)
 {
 #define MLOG_TBSIZ    4096    /* bigger than any line should be */
     int fac, lvl, msk;
-    char b[MLOG_TBSIZ], *bp, *b_nopt1hdr;
+    char b[MLOG_TBSIZ], *b_nopt1hdr;
     char facstore[16], *facstr;
     struct timeval tv;
-    struct tm *tm;
+    struct tm tms, *tm;
     unsigned int hlen_pt1, hlen, mlen, tlen, thisflag;
-    unsigned int resid;
-    char *m1, *m2;
-    int m1len, m2len, ncpy;
+    int ncpy;
     //since we ignore any potential errors in MLOG let's always re-set
     //errno to its orginal value
     int save_errno = errno;
-    struct mlog_mbhead *mb;
     /*
      * make sure the mlog is open
      */
@@ -566,8 +904,8 @@ void vmlog(int flags, const char *fmt, va_list ap)
     }
     /*
      * we must log it, start computing the parts of the log we'll need.
+     * like mlog_filter(), we read the facility info without locking.
      */
-    mlog_lock();      /* lock out other threads */
     if (mlog_xst.mlog_facs[fac].fac_aname) {
         facstr = mlog_xst.mlog_facs[fac].fac_aname;
     } else {
@@ -575,7 +913,7 @@ void vmlog(int flags, const char *fmt, va_list ap)
         facstr = facstore;
     }
     (void) gettimeofday(&tv, 0);
-    tm = localtime(&tv.tv_sec);
+    tm = localtime_r(&tv.tv_sec, &tms);
     thisflag = (mst.oflags | flags);
     /*
      * ok, first, put the header into b[]
@@ -597,7 +935,6 @@ void vmlog(int flags, const char *fmt, va_list ap)
      * check for it anyway.
      */
     if (hlen + 1 >= sizeof(b)) {
-        mlog_unlock();      /* drop lock, this is the only early exit */
         fprintf(stderr, "mlog: header overflowed %zd byte buffer (%d)\n",
                 sizeof(b), hlen + 1);
         errno = save_errno;
@@ -633,71 +970,41 @@ void vmlog(int flags, const char *fmt, va_list ap)
      * multilog message is now ready to be dispatched.
      */
     /*
-     * 1: log it to the message buffer (note: mlog still locked)
+     * 1: log it to the message buffer (lock free)
      */
-    mb = (struct mlog_mbhead *)mst.mb;
-    if (mb) {
-        resid = tlen;
-        bp = b;
-        /* wont fit?   truncate... */
-        if (resid > mb->mbh_len) {
-            bp = b + resid - mb->mbh_len;
-            resid = mb->mbh_len;
-        }
-        mlog_getmbptrs(&m1, &m1len, &m2, &m2len);
-        ncpy = resid;
-        if (ncpy > m1len) {
-            ncpy = m1len;
-        }
-        memcpy(m1, bp, ncpy);
-        resid -= ncpy;
-        if (resid) {
-            bp += ncpy;
-            memcpy(m2, bp, resid);
-        }
-        /* update write pointer */
-        if (tlen < mb->mbh_len) {
-            mb->mbh_wp += tlen;
-            if (mb->mbh_wp >= mb->mbh_len) {
-                mb->mbh_wp -= mb->mbh_len;
-            }
-        }
-        if (mb->mbh_cnt < mb->mbh_len) {
-            mb->mbh_cnt += tlen;
-            if (mb->mbh_cnt > mb->mbh_len) {
-                mb->mbh_cnt = mb->mbh_len;
-            }
-        }
+    if (mst.mb) {
+        mlog_mbput(b, tlen);
     }
     /*
-     * locking options: b[] is current an auto var on the stack.
-     * this costs stack space, but means we can unlock earlier.
-     * (if b[] was static, you'd hold the lock until the end.)
-     * clearly the logfile needs mst.logfd to be stable, and the
-     * UCON walks the mst.ucons[] array...
-     *
-     * neither the stderr/out or syslog access parts of mst that
-     * change, so we don't really need it locked for that?
-     */
-    /*
-     * 2: log it to the log file
+     * 2: log it to the log file.  the async writer drains its queue
+     * under the lock, otherwise we have to write under the lock to
+     * keep mst.logfd stable (vs mlog_reopen).
      */
+#ifdef MLOG_MUTEX
+    if (__atomic_load_n(&mst.aq_on, __ATOMIC_ACQUIRE)) {
+        mlog_aqput(b, tlen);
+    } else
+#endif
     if (mst.logfd >= 0) {
-        if (write(mst.logfd, b, tlen) != tlen) {
+        mlog_lock();
+        if (mst.logfd >= 0 && write(mst.logfd, b, tlen) != tlen) {
             /*ignore it*/;   /* but put in this "if" to quiet gcc warning */
         }
+        mlog_unlock();
     }
     /*
      * 3: log it to the UCONs (UDP console)  [mst.oflags' MLOG_UCON_ON bit
-     *    can only be set if there is a valid mst.udpsock open]
+     *    can only be set if there is a valid mst.udpsock open].  the
+     *    lock keeps the mst.ucons[] array stable while we walk it.
      */
     if (mst.oflags & MLOG_UCON_ON) {
+        mlog_lock();
         for (ncpy = 0 ; ncpy < mst.ucon_cnt ; ncpy++)
             (void) sendto(mst.udpsock, b, tlen, 0,
                           (struct sockaddr *)&mst.ucons[ncpy],
                           sizeof(mst.ucons[ncpy]));
+        mlog_unlock();
     }
-    mlog_unlock();   /* drop lock here */
     /*
      * 4: log it to stderr and/or stdout.  skip part one of the header
      * if the output channel is a tty
@@ -865,6 +1172,8 @@ int mlog_open(const char *tag, int maxfac_hint, int default_mask,
         mb->mbh_len = msgbuf_len;
         mb->mbh_cnt = 0;
         mb->mbh_wp = 0;
+        mst.mbr.r_buf = (char *)mst.mb + sizeof(struct mlog_mbhead);
+        mst.mbr.r_len = msgbuf_len;
     }
     if (flags & MLOG_UCON_ON) {
         mst.udpsock = socket(PF_INET, SOCK_DGRAM, 0);
@@ -1013,6 +1322,62 @@ void mlog_close()
     mlog_cleanout();
 }
 
+/*
+ * mlog_async: start (qlen > 0) or stop (qlen == 0) a background
+ * thread that writes the log file, so that logging threads only
+ * have to copy their message into a lock-free queue of qlen bytes.
+ * stopping waits for the queue to drain.   like mlog_close, stop
+ * after all other logging threads are done.  requires MLOG_MUTEX.
+ * return 0 on success, -1 on error.
+ */
+int mlog_async(int qlen)
+{
+#ifdef MLOG_MUTEX
+    if (!mlog_xst.tag || qlen < 0) {
+        return(-1);
+    }
+    if (qlen == 0) {
+        mlog_aqstop();
+        return(0);
+    }
+    if (mst.aq_on) {
+        return(-1);    /* already running */
+    }
+    if (qlen < (int)MLOG_RSIZE(MLOG_TBSIZ)) {
+        qlen = (int)MLOG_RSIZE(MLOG_TBSIZ);  /* must hold the largest line */
+    }
+    qlen = (qlen + 3) & ~3;   /* keep record headers from wrapping */
+    /* zeroed: a zero header marks a slot with no record posted yet */
+    mst.aq.r_buf = (char *)calloc(1, qlen);
+    if (!mst.aq.r_buf) {
+        return(-1);
+    }
+    mst.aq.r_len = qlen;
+    mst.aq.r_resv = mst.aq.r_read = 0;
+    mst.aq_stop = mst.aq_sleeping = 0;
+    if (pthread_mutex_init(&mst.aq_mux, NULL) != 0) {
+        goto error;
+    }
+    if (pthread_cond_init(&mst.aq_cv, NULL) != 0) {
+        pthread_mutex_destroy(&mst.aq_mux);
+        goto error;
+    }
+    if (pthread_create(&mst.aq_thread, NULL, mlog_aqmain, NULL) != 0) {
+        pthread_cond_destroy(&mst.aq_cv);
+        pthread_mutex_destroy(&mst.aq_mux);
+        goto error;
+    }
+    __atomic_store_n(&mst.aq_on, 1, __ATOMIC_RELEASE);
+    return(0);
+error:
+    free(mst.aq.r_buf);
+    memset(&mst.aq, 0, sizeof(mst.aq));
+    return(-1);
+#else
+    return(-1);
+#endif
+}
+
 /*
  * mlog_namefacility: assign a name to a facility
  * return 0 on success, -1 on error (malloc problem).
@@ -1434,6 +1799,9 @@ void mlog_abort(int flags, const char *fmt, ...)
     va_start(ap, fmt);
     vmlog(flags|MLOG_STDERR, fmt, ap);
     va_end(ap);
+#ifdef MLOG_MUTEX
+    mlog_aqdrain();    /* get queued log data out before we go */
+#endif
     if (mlog_xst.tag && mst.abort_hook) { /* call hook? */
         mst.abort_hook();
     }
@@ -1451,6 +1819,9 @@ void mlog_exit(int status, int flags, const char *fmt, ...)
     va_start(ap, fmt);
     vmlog(flags|MLOG_STDERR, fmt, ap);
     va_end(ap);
+#ifdef MLOG_MUTEX
+    mlog_aqdrain();    /* get queued log data out before we go */
+#endif
     exit(status);
     /*NOTREACHED*/
 }
@@ -218,6 +218,18 @@ extern "C" {   /* __BEGIN_DECLS */
      */
     int mlog_allocfacility(char *aname, char *lname);
 
+    /**
+     * mlog_async: start or stop a background thread that writes the
+     * log file.  when running, logging threads copy their message into
+     * a lock-free queue rather than calling write(2) under the mlog lock.
+     * stopping drains the queue.  only stop (or mlog_close) after all
+     * other logging threads are done.
+     *
+     * @param qlen queue size in bytes (>0 to start, 0 to stop)
+     * @return 0 on success, -1 on error.
+     */
+    int mlog_async(int qlen);
+
     /**
      * mlog_close: close off an mlog and release any allocated resources.
      * if already close, this function is a noop.
@@ -0,0 +1,178 @@
+/*
+ * Copyright (c) 2017, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * shuf_hist.c  log-linear latency histograms
+ */
+
+#include <stdlib.h>
+#include "acnt_wrap.h"
+#include "shuf_hist.h"
+
+/*
+ * bucket layout: values < 16 get their own bucket.  after that each
+ * power of two [2^m, 2^(m+1)) is split into 8 equal sub-buckets
+ * (so the bucket width is never more than 1/8 of the value).
+ * values past the last bucket are clamped into it.
+ */
+#define HIST_LINEAR  16                  /* #of 1-wide buckets at start */
+#define HIST_SUBBITS 3                   /* log2(#sub-buckets per power) */
+#define HIST_MINMSB  4                   /* msb of first log bucket */
+
+/*
+ * actual internal defn of shuf_hist_t.  updated with relaxed atomics
+ * (see acnt_add), a snapshot need not be consistent across fields.
+ */
+struct shuf_hist {
+  int64_t count;                         /* #values recorded */
+  int64_t sum;                           /* sum of values recorded */
+  int64_t max;                           /* max value recorded */
+  int64_t bkt[SHUFFLE_HIST_NBUCKETS];
+};
+
+/*
+ * hist_bucket: map a value to its bucket index
+ */
+static int hist_bucket(uint64_t v) {
+  int msb, idx;
+
+  if (v < HIST_LINEAR)
+    return((int)v);
+  msb = 63 - __builtin_clzll(v);
+  idx = HIST_LINEAR + ((msb - HIST_MINMSB) << HIST_SUBBITS) +
+        (int)((v >> (msb - HIST_SUBBITS)) & ((1 << HIST_SUBBITS) - 1));
+  return((idx < SHUFFLE_HIST_NBUCKETS) ? idx : SHUFFLE_HIST_NBUCKETS - 1);
+}
+
+/*
+ * shuf_hist_alloc: allocate an empty histogram
+ */
+shuf_hist_t shuf_hist_alloc(void) {
+  shuf_hist_t rv;
+  int lcv;
+
+  rv = (shuf_hist_t)malloc(sizeof(*rv));
+  if (rv) {
+    rv->count = rv->sum = rv->max = 0;
+    for (lcv = 0 ; lcv < SHUFFLE_HIST_NBUCKETS ; lcv++)
+      rv->bkt[lcv] = 0;
+  }
+  return(rv);
+}
+
+/*
+ * shuf_hist_free: free a histogram and set pointer to NULL
+ */
+void shuf_hist_free(shuf_hist_t *hp) {
+  if (hp && *hp) {
+    free(*hp);
+    *hp = NULL;
+  }
+}
+
+/*
+ * shuf_hist_record: add a value to a histogram
+ */
+void shuf_hist_record(shuf_hist_t h, uint64_t usec) {
+  int64_t old;
+
+  acnt_add(&h->bkt[hist_bucket(usec)], 1);
+  acnt_add(&h->count, 1);
+  acnt_add(&h->sum, (int64_t)usec);
+  old = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+  while ((int64_t)usec > old &&
+         !__atomic_compare_exchange_n(&h->max, &old, (int64_t)usec, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    /* old was reloaded by the failed cas, try again */
+  }
+}
+
+/*
+ * shuf_hist_snap: copy a histogram out, optionally resetting it
+ */
+void shuf_hist_snap(shuf_hist_t h, struct shuffle_hist *out, int reset) {
+  int lcv;
+
+  out->count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+  out->sum = __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+  out->max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+  for (lcv = 0 ; lcv < SHUFFLE_HIST_NBUCKETS ; lcv++)
+    out->buckets[lcv] = __atomic_load_n(&h->bkt[lcv], __ATOMIC_RELAXED);
+
+  if (reset) {
+    acnt_add(&h->count, -(int64_t)out->count);
+    acnt_add(&h->sum, -(int64_t)out->sum);
+    __atomic_store_n(&h->max, 0, __ATOMIC_RELAXED); /* may lose a max */
+    for (lcv = 0 ; lcv < SHUFFLE_HIST_NBUCKETS ; lcv++)
+      if (out->buckets[lcv])
+        acnt_add(&h->bkt[lcv], -(int64_t)out->buckets[lcv]);
+  }
+}
+
+/*
+ * shuffle_hist_bucket_low: smallest value that maps to bucket idx
+ */
+uint64_t shuffle_hist_bucket_low(int idx) {
+  int msb, sub;
+
+  if (idx < HIST_LINEAR)
+    return((idx < 0) ? 0 : (uint64_t)idx);
+  if (idx >= SHUFFLE_HIST_NBUCKETS)
+    idx = SHUFFLE_HIST_NBUCKETS - 1;
+  msb = HIST_MINMSB + ((idx - HIST_LINEAR) >> HIST_SUBBITS);
+  sub = (idx - HIST_LINEAR) & ((1 << HIST_SUBBITS) - 1);
+  return((uint64_t)((1 << HIST_SUBBITS) + sub) << (msb - HIST_SUBBITS));
+}
+
+/*
+ * shuffle_hist_percentile: estimate a percentile from a histogram
+ */
+uint64_t shuffle_hist_percentile(const struct shuffle_hist *h, double pct) {
+  uint64_t want, seen, hi;
+  int lcv;
+
+  if (h->count == 0)
+    return(0);
+  if (pct <= 0)
+    pct = 0;
+  want = (uint64_t)(pct / 100.0 * (double)h->count + 0.5);
+  if (want < 1) want = 1;
+  for (seen = 0, lcv = 0 ; lcv < SHUFFLE_HIST_NBUCKETS ; lcv++) {
+    seen += h->buckets[lcv];
+    if (seen >= want) {
+      /* report the top of the bucket, but never more than max */
+      hi = (lcv + 1 < SHUFFLE_HIST_NBUCKETS) ?
+            shuffle_hist_bucket_low(lcv + 1) - 1 : h->max;
+      return((hi < h->max) ? hi : h->max);
+    }
+  }
+  return(h->max);
+}
@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2017, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * shuf_hist.h  log-linear latency histograms
+ */
+
+/*
+ * shuf_hist_t is an HDR-style histogram of usec values: 8 linear
+ * sub-buckets per power of two (see SHUFFLE_HIST_NBUCKETS in
+ * shuffle_api.h), plus count, sum, and max.   buckets are mercury
+ * atomics so any thread can record into a histogram without a lock.
+ * like acnt_wrap, this is C code so that C++ never sees _Atomic.
+ */
+
+#include <deltafs-shuffle/shuffle_api.h>   /* for struct shuffle_hist */
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+struct shuf_hist;
+typedef struct shuf_hist *shuf_hist_t;
+
+/**
+ * shuf_hist_alloc: allocate an empty histogram
+ * @return NULL on failure, otherwise a pointer
+ */
+shuf_hist_t shuf_hist_alloc(void);
+
+/**
+ * shuf_hist_free: free a histogram and set pointer to NULL
+ * @param hp pointer to the histogram we are freeing
+ */
+void shuf_hist_free(shuf_hist_t *hp);
+
+/**
+ * shuf_hist_record: add a value to a histogram
+ * @param h the histogram
+ * @param usec the value to add
+ */
+void shuf_hist_record(shuf_hist_t h, uint64_t usec);
+
+/**
+ * shuf_hist_snap: copy a histogram out, optionally resetting it.
+ * reset subtracts what was copied so values recorded concurrently
+ * are not lost (they show up in the next snapshot).
+ * @param h the histogram
+ * @param out where to put the copy
+ * @param reset non-zero to reset the histogram
+ */
+void shuf_hist_snap(shuf_hist_t h, struct shuffle_hist *out, int reset);
+
+#if defined(__cplusplus)
+}  /* extern "C" */
+#endif
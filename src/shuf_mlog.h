@@ -36,6 +36,29 @@
 
 #include "mlog.h"
 
+/*
+ * compile-time level filter: SHUF_MLOG_MINPRI is set from the
+ * SHUFFLE_MLOG_MINLEVEL cmake option.  mlog() calls below that level
+ * compile to nothing (no call and no mlog_filter() check of the
+ * facility masks), so debug logging in the hot path is free when it
+ * is not wanted.  0 (the default) keeps all levels.  all debug streams
+ * (MLOG_DBG*) are below MLOG_INFO.
+ */
+#ifndef SHUF_MLOG_MINPRI
+#define SHUF_MLOG_MINPRI 0
+#endif
+
+#define shuf_mlog_compiled(LEVEL) (((LEVEL) & MLOG_PRIMASK) >= SHUF_MLOG_MINPRI)
+
+#ifndef MLOG_NOMACRO_OPT
+#undef mlog
+#define mlog(LEVEL, ...) do {                                       \
+    if (shuf_mlog_compiled(LEVEL) && MLOG_NEVERLOG == 0 &&          \
+        MLOG_NSPACE::mlog_filter(LEVEL))                            \
+        MLOG_NSPACE::mlog((LEVEL), __VA_ARGS__);                    \
+    } while (0)
+#endif /* MLOG_NOMACRO_OPT */
+
 /* facilities */
 #define SHUF_MLOG 0
 #define UTIL_MLOG 1
@@ -0,0 +1,196 @@
+/*
+ * Copyright (c) 2017, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * shuf_proc.cc  mercury encode/decode for the shuffle RPC structures
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <mercury.h>
+#include <mercury_macros.h>
+#include <deltafs-nexus/deltafs-nexus_api.h>
+
+#include "deltafs-shuffle/shuffle_api.h"
+
+#include "shuffle_internal.h"
+#include "shuf_mlog.h"
+#include "shuf_proc.h"
+
+static uint32_t zero = 0;   /* for end of list marker */
+
+/*
+ * procheck: helper macro to reduce the verbage ...
+ */
+#define procheck(R,MSG) if ((R) != HG_SUCCESS) {                 \
+    mlog(UTIL_ERR, "shuffle-procheck: %s @ %d", MSG, __LINE__);  \
+    goto done;                                                   \
+}
+
+/*
+ * hg_proc_rpcin_t: encode/decode the rpcin_t structure
+ *
+ * @param proc the proc used to serialize/deserialize the data
+ * @param data pointer to the data being worked on
+ * @return HG_SUCCESS or an error code
+ */
+hg_return_t hg_proc_rpcin_t(hg_proc_t proc, void *data) {
+  hg_return_t ret = HG_SUCCESS;
+  hg_proc_op_t op = hg_proc_get_op(proc);
+  rpcin_t *struct_data = (rpcin_t *) data;
+  struct request *rp, *nrp;
+  int cnt, lcv;
+  uint32_t dlen, typ;
+  mlog(UTIL_CALL, "hg_proc_rpcin_t proc=%p op=%d", proc, op);
+
+  if (op == HG_FREE)               /* we combine free and err handling below */
+    goto done;
+
+  if (op == HG_DECODE) {           /* start with an empty inreqs list */
+    XSIMPLEQ_INIT(&struct_data->inreqs);
+  }
+
+  ret = hg_proc_hg_int32_t(proc, &struct_data->iseq);
+  procheck(ret, "Proc err iseq");
+  ret = hg_proc_hg_int32_t(proc, &struct_data->forwardrank);
+  procheck(ret, "Proc err forwardrank");
+
+  if (op == HG_ENCODE) {   /* serialize list to the proc */
+    cnt = 0;
+    XSIMPLEQ_FOREACH(rp, &struct_data->inreqs, next) {
+      ret = hg_proc_hg_uint32_t(proc, &rp->datalen);
+      procheck(ret, "Proc en err datalen");
+      ret = hg_proc_hg_uint32_t(proc, &rp->type);
+      procheck(ret, "Proc en err type");
+      ret = hg_proc_hg_int32_t(proc, &rp->src);
+      procheck(ret, "Proc en err src");
+      ret = hg_proc_hg_int32_t(proc, &rp->dst);
+      procheck(ret, "Proc en err dst");
+      ret = hg_proc_hg_uint8_t(proc, &rp->hflags);
+      procheck(ret, "Proc en err hflags");
+      if (rp->hflags & REQ_HF_EPOCH) {
+        ret = hg_proc_hg_int32_t(proc, &rp->epoch);
+        procheck(ret, "Proc en err epoch");
+      }
+      if (rp->hflags & REQ_HF_TSTAMP) {
+        ret = hg_proc_hg_uint64_t(proc, &rp->tstamp);
+        procheck(ret, "Proc en err tstamp");
+      }
+      ret = hg_proc_memcpy(proc, rp->data, rp->datalen);
+      procheck(ret, "Proc en err data");
+      cnt++;
+    }
+    /* put in the end of list marker (2 uint32_t zeros) */
+    for (lcv = 0 ; lcv < 2 ; lcv++) {
+      ret = hg_proc_hg_uint32_t(proc, &zero);
+      procheck(ret, "Proc err zero");
+    }
+    mlog(UTIL_D1, "hg_proc_rpcin_t proc %p, encoded=%d", proc, cnt);
+    goto done;
+  }
+
+  /* op == HG_DECODE */
+  cnt = 0;
+  while (1) {
+    ret = hg_proc_hg_uint32_t(proc, &dlen);  /* should err if we use up data */
+    procheck(ret, "Proc de err datalen");
+    ret = hg_proc_hg_uint32_t(proc, &typ);
+    procheck(ret, "Proc de err type");
+    if (dlen == 0 && typ == 0) break;     /* got end of list marker */
+    rp = (request*)malloc(sizeof(*rp) + dlen);
+    if (rp == NULL) ret = HG_NOMEM_ERROR;
+    procheck(ret, "Proc de malloc");
+    rp->datalen = dlen;
+    rp->type = typ;
+    ret = hg_proc_hg_int32_t(proc, &rp->src);
+    if (ret == HG_SUCCESS) ret = hg_proc_hg_int32_t(proc, &rp->dst);
+    if (ret == HG_SUCCESS) ret = hg_proc_hg_uint8_t(proc, &rp->hflags);
+    rp->epoch = 0;
+    if (ret == HG_SUCCESS && (rp->hflags & REQ_HF_EPOCH) != 0)
+      ret = hg_proc_hg_int32_t(proc, &rp->epoch);
+    rp->tstamp = 0;
+    if (ret == HG_SUCCESS && (rp->hflags & REQ_HF_TSTAMP) != 0)
+      ret = hg_proc_hg_uint64_t(proc, &rp->tstamp);
+    rp->data = ((char *)rp) + sizeof(*rp);
+    if (ret == HG_SUCCESS) ret = hg_proc_memcpy(proc, rp->data, dlen);
+    rp->owner = NULL;
+    rp->crrank = -1;
+    if (ret != HG_SUCCESS) {
+      free(rp);
+      procheck(ret, "Proc decoder");
+    }
+
+    /* got it!  put at the end of the decoded list */
+    XSIMPLEQ_INSERT_TAIL(&struct_data->inreqs, rp, next);
+    cnt++;
+  }
+  mlog(UTIL_D1, "hg_proc_rpcin_t proc %p, decoded=%d", proc, cnt);
+
+done:
+  if ( ((op == HG_DECODE && ret != HG_SUCCESS) || op == HG_FREE) &&
+       XSIMPLEQ_FIRST(&struct_data->inreqs) != NULL) {
+    XSIMPLEQ_FOREACH_SAFE(rp, &struct_data->inreqs, next, nrp) {
+      free(rp);
+    }
+    XSIMPLEQ_INIT(&struct_data->inreqs);
+  }
+  return(ret);
+}
+
+/*
+ * hg_proc_rpcout_t: encode/decode the rpcout_t structure
+ *
+ * @param proc the proc used to serialize/deserialize the data
+ * @param data pointer to the data being worked on
+ * @return HG_SUCCESS or an error code
+ */
+hg_return_t hg_proc_rpcout_t(hg_proc_t proc, void *data) {
+    hg_return_t ret = HG_SUCCESS;
+    rpcout_t *struct_data = (rpcout_t *) data;
+    /* hg_proc_op_t op = hg_proc_get_op(proc); */  /* don't need it */
+
+    mlog(UTIL_CALL, "hg_proc_rpcout_t proc=%p, op=%d", proc,
+         hg_proc_get_op(proc));
+
+    ret = hg_proc_hg_int32_t(proc, &struct_data->oseq);
+    procheck(ret, "Proc err oseq");
+    ret = hg_proc_hg_int32_t(proc, &struct_data->respondrank);
+    procheck(ret, "Proc err src");
+    ret = hg_proc_hg_int32_t(proc, &struct_data->ret);
+    procheck(ret, "Proc err ret");
+    ret = hg_proc_hg_int32_t(proc, &struct_data->credit);
+    procheck(ret, "Proc err credit");
+
+done:
+    return(ret);
+}
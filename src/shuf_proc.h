@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2017, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * shuf_proc.h  mercury encode/decode for the shuffle RPC structures
+ */
+
+/*
+ * these are the hg_proc_cb_t functions we register with mercury for
+ * the shuffle RPC (rpcin_t in, rpcout_t out, see shuffle_internal.h).
+ * they are not static so that benchmarks can drive them with a
+ * standalone hg_proc.
+ */
+
+#include <mercury_proc.h>
+
+/*
+ * hg_proc_rpcin_t: encode/decode the rpcin_t structure.  decode
+ * mallocs a request for each entry (freed by HG_FREE or on error).
+ *
+ * @param proc the proc used to serialize/deserialize the data
+ * @param data pointer to the rpcin_t being worked on
+ * @return HG_SUCCESS or an error code
+ */
+hg_return_t hg_proc_rpcin_t(hg_proc_t proc, void *data);
+
+/*
+ * hg_proc_rpcout_t: encode/decode the rpcout_t structure
+ *
+ * @param proc the proc used to serialize/deserialize the data
+ * @param data pointer to the rpcout_t being worked on
+ * @return HG_SUCCESS or an error code
+ */
+hg_return_t hg_proc_rpcout_t(hg_proc_t proc, void *data);
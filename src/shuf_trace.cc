@@ -0,0 +1,224 @@
+/*
+ * Copyright (c) 2017, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * shuf_trace.cc  low-overhead binary event trace for the shuffle
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "shuf_trace.h"
+
+/*
+ * tring: a thread's trace ring.  only the owning thread writes
+ * the ring, but shuf_trace_dump() reads "head" from another thread,
+ * so the owner publishes it with a release store.
+ */
+struct tring {
+  uint32_t tid;                 /* thread index */
+  uint32_t mask;                /* ring size - 1 (size is a power of 2) */
+  uint64_t head;                /* #records ever written (atomic) */
+  struct shuf_trace_rec *recs;  /* the ring */
+  struct tring *next;           /* next in tr_rings list */
+};
+
+int shuf_trace_nrec = 0;        /* ring size for new rings (0=off) */
+
+static pthread_mutex_t tr_lock = PTHREAD_MUTEX_INITIALIZER; /* for list */
+static struct tring *tr_rings = NULL;     /* all rings, newest first */
+static uint32_t tr_ntids = 0;             /* next thread index */
+static __thread struct tring *tr_mine = NULL;  /* this thread's ring */
+
+/*
+ * shuf_trace_config: set per-thread ring size
+ */
+void shuf_trace_config(int nrec) {
+  int sz;
+
+  for (sz = 1 ; sz < nrec ; sz <<= 1)
+    /*null*/;
+  __atomic_store_n(&shuf_trace_nrec, (nrec > 0) ? sz : 0, __ATOMIC_RELAXED);
+}
+
+/*
+ * tring_alloc: allocate and register a ring for the calling thread
+ *
+ * @return the new ring or NULL on malloc failure
+ */
+static struct tring *tring_alloc() {
+  struct tring *tr;
+  int n;
+
+  n = __atomic_load_n(&shuf_trace_nrec, __ATOMIC_RELAXED);
+  if (n < 1)
+    return(NULL);
+  tr = (struct tring *)malloc(sizeof(*tr));
+  if (tr == NULL)
+    return(NULL);
+  tr->recs = (struct shuf_trace_rec *)calloc(n, sizeof(tr->recs[0]));
+  if (tr->recs == NULL) {
+    free(tr);
+    return(NULL);
+  }
+  tr->mask = n - 1;
+  tr->head = 0;
+
+  pthread_mutex_lock(&tr_lock);
+  tr->tid = tr_ntids++;
+  tr->next = tr_rings;
+  tr_rings = tr;
+  pthread_mutex_unlock(&tr_lock);
+
+  return(tr);
+}
+
+/*
+ * shuf_trace_add: add a record to the calling thread's ring
+ */
+void shuf_trace_add(int event, int me, int peer, int seq, uint32_t size) {
+  struct tring *tr;
+  struct shuf_trace_rec *rec;
+  struct timespec ts;
+  uint64_t head;
+
+  tr = tr_mine;
+  if (tr == NULL) {
+    tr = tr_mine = tring_alloc();
+    if (tr == NULL)
+      return;                   /* malloc failed, drop the event */
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  head = __atomic_load_n(&tr->head, __ATOMIC_RELAXED);   /* we own it */
+  rec = &tr->recs[head & tr->mask];
+  rec->ts = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+  rec->event = event;
+  rec->tid = tr->tid;
+  rec->me = me;
+  rec->peer = peer;
+  rec->seq = seq;
+  rec->size = size;
+  rec->pad = 0;
+  __atomic_store_n(&tr->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * dring: a filtered copy of a ring made by shuf_trace_dump()
+ */
+struct dring {
+  uint32_t tid;                 /* thread index */
+  uint64_t nrec;                /* #records in recs */
+  struct shuf_trace_rec *recs;  /* the copied records */
+};
+
+/*
+ * shuf_trace_dump: write all rings (or just "me"'s records) to a file
+ */
+int shuf_trace_dump(const char *file, int me) {
+  FILE *fp;
+  struct tring *tr;
+  struct dring *drs;
+  struct shuf_trace_hdr hdr;
+  struct shuf_trace_ringhdr rh;
+  uint64_t head, start, lcv;
+  int nr, ndr, d, rv = 0;
+
+  /*
+   * copy the records out under the list lock first, so we know the
+   * number of (non-empty) rings and records before we write headers.
+   */
+  pthread_mutex_lock(&tr_lock);
+  nr = 0;
+  for (tr = tr_rings ; tr != NULL ; tr = tr->next)
+    nr++;
+  drs = (struct dring *)calloc((nr > 0) ? nr : 1, sizeof(*drs));
+  if (drs == NULL) {
+    pthread_mutex_unlock(&tr_lock);
+    return(-1);
+  }
+  ndr = 0;
+  for (tr = tr_rings ; tr != NULL ; tr = tr->next) {
+    head = __atomic_load_n(&tr->head, __ATOMIC_ACQUIRE); /* owner may add */
+    start = (head > tr->mask + 1) ? head - (tr->mask + 1) : 0;
+    if (head == start)
+      continue;
+    drs[ndr].tid = tr->tid;
+    drs[ndr].nrec = 0;
+    drs[ndr].recs = (struct shuf_trace_rec *)malloc((head - start) *
+                                                    sizeof(tr->recs[0]));
+    if (drs[ndr].recs == NULL) {
+      rv = -1;
+      break;
+    }
+    for (lcv = start ; lcv < head ; lcv++) {
+      if (me >= 0 && tr->recs[lcv & tr->mask].me != me)
+        continue;
+      drs[ndr].recs[drs[ndr].nrec++] = tr->recs[lcv & tr->mask];
+    }
+    if (drs[ndr].nrec)
+      ndr++;
+    else
+      free(drs[ndr].recs);
+  }
+  pthread_mutex_unlock(&tr_lock);
+
+  fp = (rv == 0) ? fopen(file, "w") : NULL;
+  if (fp == NULL)
+    rv = -1;
+
+  if (rv == 0) {
+    hdr.magic = SHUF_TRACE_MAGIC;
+    hdr.version = SHUF_TRACE_VERSION;
+    hdr.recsize = sizeof(struct shuf_trace_rec);
+    hdr.nrings = ndr;
+    if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+      rv = -1;
+  }
+  for (d = 0 ; d < ndr && rv == 0 ; d++) {
+    rh.tid = drs[d].tid;
+    rh.nrec = drs[d].nrec;
+    if (fwrite(&rh, sizeof(rh), 1, fp) != 1 ||
+        fwrite(drs[d].recs, sizeof(drs[d].recs[0]), drs[d].nrec,
+               fp) != drs[d].nrec)
+      rv = -1;
+  }
+
+  for (d = 0 ; d < ndr ; d++)
+    free(drs[d].recs);
+  free(drs);
+  if (fp && fclose(fp) != 0)
+    rv = -1;
+  return(rv);
+}
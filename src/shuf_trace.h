@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2017, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * shuf_trace.h  low-overhead binary event trace for the shuffle
+ */
+
+/*
+ * each thread that records an event gets its own fixed-size ring of
+ * binary trace records, so recording is just a clock read and a store
+ * (no locks, no formatting).  the rings are registered in a global
+ * list so that shuf_trace_dump() can write them all to a file.  the
+ * file format is:
+ *
+ *   struct shuf_trace_hdr
+ *   for each ring: struct shuf_trace_ringhdr + "nrec" shuf_trace_recs
+ *
+ * all values are in host byte order.  the offline decoder in
+ * tools/shuffle-trace2json.c converts a dump to chrome trace JSON.
+ * rings are never freed (a thread's records stay dumpable after it
+ * exits).  the rings are per process, so with several shuffles in one
+ * process a ring may hold records of more than one rank (dumps can
+ * filter on the "me" field).
+ */
+
+#include <stdint.h>
+
+#define SHUF_TRACE_MAGIC   0x52544853      /* "SHTR" */
+#define SHUF_TRACE_VERSION 1
+
+/*
+ * trace event ids
+ */
+#define SHUF_TR_ENQUEUE   1     /* shuffle_enqueue (peer=dst, seq=type) */
+#define SHUF_TR_SEND      2     /* batch sent (peer=dst, seq=outseq) */
+#define SHUF_TR_FORWCB    3     /* batch completed (peer=dst, seq=outseq) */
+#define SHUF_TR_RPCIN     4     /* batch rcvd (peer=sender, seq=iseq) */
+#define SHUF_TR_DELIVER_B 5     /* delivery cb start (peer=src, seq=type) */
+#define SHUF_TR_DELIVER_E 6     /* delivery cb end (peer=src, seq=type) */
+#define SHUF_TR_FLUSH_B   7     /* flush op started (seq=flush type) */
+#define SHUF_TR_FLUSH_E   8     /* flush op finished (seq=flush type) */
+#define SHUF_TR_NEVENTS   9
+
+/*
+ * shuf_trace_hdr: file header
+ */
+struct shuf_trace_hdr {
+  uint32_t magic;               /* SHUF_TRACE_MAGIC */
+  uint32_t version;             /* SHUF_TRACE_VERSION */
+  uint32_t recsize;             /* sizeof(struct shuf_trace_rec) */
+  uint32_t nrings;              /* number of rings that follow */
+};
+
+/*
+ * shuf_trace_ringhdr: header for one thread's records
+ */
+struct shuf_trace_ringhdr {
+  uint32_t tid;                 /* thread index (assigned at 1st event) */
+  uint32_t nrec;                /* #records that follow (oldest first) */
+};
+
+/*
+ * shuf_trace_rec: a single trace record (32 bytes)
+ */
+struct shuf_trace_rec {
+  uint64_t ts;                  /* CLOCK_MONOTONIC time, nsec */
+  uint16_t event;               /* SHUF_TR_* */
+  uint16_t tid;                 /* thread index */
+  int32_t me;                   /* our rank */
+  int32_t peer;                 /* other rank (-1 if none) */
+  int32_t seq;                  /* seq#, type, etc. (see event list) */
+  uint32_t size;                /* #bytes of data (0 if none) */
+  uint32_t pad;                 /* pad to 32 bytes */
+};
+
+#if defined(__cplusplus)
+
+/*
+ * shuf_trace_nrec: per-thread ring size (0 if tracing is off).
+ * shuf_trace_config() may change it while other threads trace, so it
+ * is only accessed with relaxed atomics (no lock on the hot path).
+ */
+extern int shuf_trace_nrec;
+
+/*
+ * SHUF_TRACE: record an event if tracing is on.  this is a macro
+ * so that the disabled case is just a load and a branch.
+ */
+#define SHUF_TRACE(EV,ME,PEER,SEQ,SZ) do {                     \
+    if (__atomic_load_n(&shuf_trace_nrec, __ATOMIC_RELAXED))   \
+      shuf_trace_add((EV), (ME), (PEER), (SEQ), (SZ));         \
+} while (0)
+
+/**
+ * shuf_trace_config: set per-thread ring size (0 turns recording off).
+ * rings that already exist keep their size.
+ * @param nrec #records per ring (rounded up to a power of 2)
+ */
+void shuf_trace_config(int nrec);
+
+/**
+ * shuf_trace_add: add a record to the calling thread's ring
+ * @param event SHUF_TR_* event id
+ * @param me our rank
+ * @param peer other rank
+ * @param seq seq#/type
+ * @param size bytes
+ */
+void shuf_trace_add(int event, int me, int peer, int seq, uint32_t size);
+
+/**
+ * shuf_trace_dump: write all rings to a file.  rings that are being
+ * written to while we dump may have a few inconsistent records at
+ * their head.  rings with no records to write are skipped.
+ * @param file the file to write to
+ * @param me only write records of this rank (-1 for all ranks)
+ * @return 0 on success, -1 on error
+ */
+int shuf_trace_dump(const char *file, int me);
+
+#endif /* __cplusplus */
@@ -55,6 +55,8 @@
 #define SHUFFLE_COUNT           /* enable/disable internal counters */
 #define SHUFFLE_TIMEOUT 300     /* API blocking timeout, in seconds */
 #include "shuffle_internal.h"
+#include "shuf_proc.h"
+#include "shuf_trace.h"
 
 /*
  * quick reminder:
@@ -109,7 +111,9 @@ static struct shufcfglog {
   int msgbufsz;            /* message buf size */
   int stderrlog;           /* always log to stderr for other ranks */
   int xtra_stderrlog;      /* always log to stderr for xtra log ranks */
-} shufcfg = { PTHREAD_MUTEX_INITIALIZER, 0 };
+  int logqlen;             /* >0: async logfile writer queue size */
+} shufcfg = { PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, 0, 0, NULL, NULL, NULL,
+              0, 0, 0, 0, 0, 0 };
 
 /*
  * shuffle_cfglog: setup logging before starting shuffle.  call
@@ -184,6 +188,21 @@ err:
   return(-1);
 }
 
+/*
+ * shuffle_cfglogq: setup the background log file writer.  call this
+ * before shuffle_init() (it is applied when the log is opened).
+ */
+int shuffle_cfglogq(int qlen) {
+  if (qlen < 0) {
+    fprintf(stderr, "shuffle_cfglogq: bad qlen %d\n", qlen);
+    return(-1);
+  }
+  pthread_mutex_lock(&shufcfg.cfglck);
+  shufcfg.logqlen = qlen;
+  pthread_mutex_unlock(&shufcfg.cfglck);
+  return(0);
+}
+
 /*
  * shuffle_openlog: start the log
  *
@@ -233,6 +252,11 @@ static void shuffle_openlog(int myrank) {
   if (usemask)
     shuf::mlog_setmasks(usemask, -1);  /* ignore errors */
 
+  if (lfile && shufcfg.logqlen > 0 &&
+      shuf::mlog_async(shufcfg.logqlen) < 0) {
+    fprintf(stderr, "shuffle_openlog: async writer failed (using sync)\n");
+  }
+
   shufcfg.opencnt++;
 
 done:
@@ -256,6 +280,69 @@ static void shuffle_closelog() {
   pthread_mutex_unlock(&shufcfg.cfglck);
 }
 
+/*
+ * binary event trace config (see shuf_trace.h)
+ */
+static struct shufcfgtrace {
+  pthread_mutex_t trlck;   /* lock data structure */
+  char *tracefile;         /* dump file at shutdown (if !NULL), add rank */
+} shuftrace = { PTHREAD_MUTEX_INITIALIZER, NULL };
+
+/*
+ * shuffle_cfgtrace: setup the binary event trace
+ */
+int shuffle_cfgtrace(int nrec, const char *tracefile) {
+  char *tf;
+
+  tf = NULL;
+  if (tracefile) {
+    tf = strdup(tracefile);
+    if (tf == NULL) {
+      fprintf(stderr, "shuffle_cfgtrace: tracefile malloc failed\n");
+      return(-1);
+    }
+  }
+  pthread_mutex_lock(&shuftrace.trlck);
+  if (shuftrace.tracefile) free(shuftrace.tracefile);
+  shuftrace.tracefile = tf;
+  shuf_trace_config(nrec);
+  pthread_mutex_unlock(&shuftrace.trlck);
+  return(0);
+}
+
+/*
+ * shuffle_trace_dump: dump the binary event trace to a file now
+ */
+int shuffle_trace_dump(const char *file) {
+  return(shuf_trace_dump(file, -1));
+}
+
+/*
+ * shuffle_closetrace: dump the trace at shutdown (if configured).
+ * we only dump our own rank's records (other shuffles in this process
+ * share the rings).
+ *
+ * @param myrank the current process' rank
+ */
+static void shuffle_closetrace(int myrank) {
+  char *fn;
+  size_t len;
+
+  pthread_mutex_lock(&shuftrace.trlck);
+  if (shuftrace.tracefile &&
+      __atomic_load_n(&shuf_trace_nrec, __ATOMIC_RELAXED)) {
+    len = strlen(shuftrace.tracefile) + 16;
+    fn = (char *)malloc(len);
+    if (fn) {
+      snprintf(fn, len, "%s.%d", shuftrace.tracefile, myrank);
+      if (shuf_trace_dump(fn, myrank) < 0)
+        fprintf(stderr, "shuffle: trace dump to %s failed\n", fn);
+      free(fn);
+    }
+  }
+  pthread_mutex_unlock(&shuftrace.trlck);
+}
+
 static void notify(int lvl, const char *fmt, ...)
   __attribute__((__format__(__printf__, 2, 3)));
 
@@ -480,11 +567,108 @@ static int do_cond_timedwait(struct shuffle *sh, pthread_cond_t *ccv,
 #define shufzero(X)    /* nothing */
 #endif
 
+/*
+ * aimd: adaptive RPC windows (see struct aimd)
+ */
+
+/*
+ * shuf_now_us: monotonic clock in usec, for RTT measurement
+ *
+ * @return current time in usec
+ */
+static uint64_t shuf_now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+/*
+ * shuf_wall_us: realtime clock in usec, for enqueue-to-delivery stamps
+ * (these go over the wire, so we can't use the monotonic clock)
+ *
+ * @return current time in usec
+ */
+static uint64_t shuf_wall_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+/*
+ * aimd_init: init an aimd window
+ *
+ * @param a the window to init
+ * @param win the starting window (clamped to [1, winmax])
+ * @param winmax the ceiling
+ */
+static void aimd_init(struct aimd *a, int win, int winmax) {
+  a->winmax = (winmax > 0) ? winmax : 1;
+  a->win = (win < 1) ? 1 : ((win > a->winmax) ? a->winmax : win);
+  a->acks = 0;
+  a->basertt = 0;
+  a->lastcut = 0;
+  a->nincr = a->ncut = 0;
+}
+
+/*
+ * aimd_update: feed one RPC completion to an aimd window.  caller
+ * must hold whatever lock protects the window.
+ *
+ * @param a the window
+ * @param rtt the round trip time of the RPC (usec)
+ * @param failed non-zero if the RPC failed
+ * @param now current time (usec)
+ * @return the new window size
+ */
+static int aimd_update(struct aimd *a, int rtt, int failed, uint64_t now) {
+  uint64_t cool;
+
+  if (!failed && (a->basertt == 0 || rtt < a->basertt)) {
+    a->basertt = (rtt > 0) ? rtt : 1;            /* new low */
+  }
+
+  if (failed || rtt > AIMD_SPIKE * a->basertt) {
+    a->acks = 0;
+    cool = (a->basertt > AIMD_MINCOOL) ? a->basertt : AIMD_MINCOOL;
+    if (now - a->lastcut >= cool) {              /* one cut per event */
+      a->win = (a->win > 1) ? a->win / 2 : 1;
+      a->lastcut = now;
+      a->ncut++;
+    }
+    return(a->win);
+  }
+
+  /* let the baseline drift up slowly so a new steady state isn't a spike */
+  if (rtt > a->basertt)
+    a->basertt += (rtt - a->basertt) / 64;
+
+  if (++a->acks >= a->win) {
+    a->acks = 0;
+    if (a->win < a->winmax) {
+      a->win++;
+      a->nincr++;
+    }
+  }
+  return(a->win);
+}
+
 /*
  * RPC handler registered with mercury
  */
 static hg_return_t shuffle_rpchand(hg_handle_t handle);
 
+/*
+ * thread main routine for the in-memory transport
+ */
+static void *memx_main(void *arg);
+static void memx_stop(struct hgprogress *hgp, const char *tag);
+
+/*
+ * thread main routine for relay workers
+ */
+static void *relay_main(void *arg);
+static void relay_stop(struct relayworker *rw);
+
 /*
  * thread main routine for delivery
  */
@@ -500,172 +684,89 @@ static bool append_req_to_locked_outqueue(struct outset *oset,
                                           struct request_queue *tosendq,
                                           struct output **newoutputp,
                                           bool flushnow);
-static hg_return_t aquire_flush(struct shuffle *sh, struct flush_op *fop,
-                                int type, struct outset *oset);
+static int oq_full(struct outset *oset, struct outqueue *oq);
 static void clean_qflush(struct shuffle *sh, struct outset *oset);
+static int32_t credit_avail(struct shuffle *sh, int rank);
+static void credit_charge(rpcin_t *rpcin, struct request *req);
+static int credit_check(struct shuffle *sh, int rank, int nbytes);
+static void credit_release(struct shuffle *sh, struct request *req);
+static void credit_unreserve(struct shuffle *sh, int rank, int nbytes);
+static void delivery_destroy(struct delivery *dlv);
+static int delivery_init(struct shuffle *sh, struct delivery *dlv, int didx);
+static void delivery_stop(struct delivery *dlv);
+static void done_dlv_flush(struct shuffle *sh);
+static bool oqflusher_done(struct outqueue *oq, struct oqflusher *of);
 static void done_oq_flush(struct outqueue *oq);
-static void drop_curflush(struct shuffle *sh);
+static int flush_finish(struct shuffle *sh, struct flush_target *ft,
+                        int status);
+static void flush_opdone(struct flush_op *fop, int status);
+static void flush_run(struct shuffle *sh, struct flush_target *ft);
+static int ctl_recv(struct shuffle *sh, struct request *req);
+static void ctl_flushack(struct shuffle *sh, struct request *req);
+static int epoch_recv(struct shuffle *sh, struct request *req, int count);
+static hg_return_t epoch_flushall(struct shuffle *sh);
 static hg_return_t forw_cb(const struct hg_cb_info *cbi);
+static void forw_done(struct output *oput, hg_return_t ret, rpcout_t *out);
 static void forw_start_next(struct outqueue *oq, struct output *oput);
 static hg_return_t forward_reqs_now(struct request_queue *tosendq,
                                     struct shuffle *sh, struct outset *oset,
                                     struct outqueue *oq, struct output *oput);
 static int purge_reqs(struct shuffle *sh);
+static void relay_destroy(struct shuffle *sh);
+static int relay_init(struct shuffle *sh, int nworkers);
+static void rpcin_handoff(struct hgprogress *inhgp, struct rpcsrc *input,
+                          rpcin_t *in);
+static int purge_reqs_delivery(struct shuffle *sh, struct delivery *dlv);
 static int purge_reqs_outset(struct shuffle *sh, struct outset *oset);
+static void *sampler_main(void *arg);
+static void sampler_stop(struct sampler *smp);
+static void stage_destroy(struct shuffle *sh);
+static hg_return_t stage_drainall(struct shuffle *sh);
+static int stage_init(struct shuffle *sh, int stagebytes);
+static int stage_purge(struct shuffle *sh);
+static void stage_release(void *arg);
 static hg_return_t req_parent_init(struct shuffle *sh,
                                    struct req_parent **parentp,
-                                   struct request *req, hg_handle_t input,
-                                   rpcin_t *rpcin);
+                                   struct request *req,
+                                   struct rpcsrc *input, rpcin_t *rpcin);
 static hg_return_t req_to_self(struct shuffle *sh, struct request *req,
-                               hg_handle_t input, rpcin_t *rpcin,
+                               struct rpcsrc *input, rpcin_t *rpcin,
                                struct req_parent **parentp);
 static hg_return_t req_via_mercury(struct shuffle *sh, struct outset *oset,
                                    struct outqueue *oq, struct request *req,
-                                   hg_handle_t input, rpcin_t *rpcin,
+                                   struct rpcsrc *input, rpcin_t *rpcin,
                                    struct req_parent **parentp);
+static void rpc_reply(struct rpcsrc *input, rpcout_t *reply);
+static void app_parent_wait(struct shuffle *sh, struct req_parent *parent,
+                            const char *who);
+static void shuffle_rpcin(struct hgprogress *inhgp, struct rpcsrc *input,
+                          rpcin_t *in);
 static void parent_dref_stopwait(struct shuffle *sh, struct req_parent *parent,
                                  int abort);
 static void parent_stopwait(struct shuffle *sh, struct req_parent *parent,
                             int abort);
 static hg_return_t shuffle_desthand_cb(const struct hg_cb_info *cbi);
 static hg_return_t shuffle_respond_cb(const struct hg_cb_info *cbi);
+static hg_return_t shuffle_bcast_raw(shuffle_t sh, uint32_t type,
+                                     int hflags, int32_t epoch, void *d,
+                                     uint32_t datalen, int flags,
+                                     int *nqueued);
+static int shuffle_deliveries(struct shuffle *sh, struct delivery **dlvs);
+static hg_return_t shuffle_enqueue_raw(shuffle_t sh, int dst, uint32_t type,
+                                       int hflags, int32_t epoch,
+                                       void *d, uint32_t datalen);
+static struct dhandler *shuffle_handler_lookup(struct shuffle *sh,
+                                               uint32_t type);
 static int start_threads(struct shuffle *sh);
 static void stop_threads(struct shuffle *sh);
-static void start_qflush(struct shuffle *sh, struct outset *oset,
-                         struct outqueue *oq);
+static int start_qflush(struct shuffle *sh, struct outset *oset,
+                        struct outqueue *oq, struct oqflusher *of,
+                        acnt32_t counter);
 
 /*
  * functions used to serialize/deserialize our RPCs args (e.g. XDR-like fn).
  */
 
-static uint32_t zero = 0;   /* for end of list marker */
-
-/*
- * procheck: helper macro to reduce the verbage ...
- */
-#define procheck(R,MSG) if ((R) != HG_SUCCESS) {                 \
-    mlog(UTIL_ERR, "shuffle-procheck: %s @ %d", MSG, __LINE__);  \
-    goto done;                                                   \
-}
-
-/*
- * hg_proc_rpcin_t: encode/decode the rpcin_t structure
- *
- * @param proc the proc used to serialize/deserialize the data
- * @param data pointer to the data being worked on
- * @return HG_SUCCESS or an error code
- */
-static hg_return_t hg_proc_rpcin_t(hg_proc_t proc, void *data) {
-  hg_return_t ret = HG_SUCCESS;
-  hg_proc_op_t op = hg_proc_get_op(proc);
-  rpcin_t *struct_data = (rpcin_t *) data;
-  struct request *rp, *nrp;
-  int cnt, lcv;
-  uint32_t dlen, typ;
-  mlog(UTIL_CALL, "hg_proc_rpcin_t proc=%p op=%d", proc, op);
-
-  if (op == HG_FREE)               /* we combine free and err handling below */
-    goto done;
-
-  if (op == HG_DECODE) {           /* start with an empty inreqs list */
-    XSIMPLEQ_INIT(&struct_data->inreqs);
-  }
-
-  ret = hg_proc_hg_int32_t(proc, &struct_data->iseq);
-  procheck(ret, "Proc err iseq");
-  ret = hg_proc_hg_int32_t(proc, &struct_data->forwardrank);
-  procheck(ret, "Proc err forwardrank");
-
-  if (op == HG_ENCODE) {   /* serialize list to the proc */
-    cnt = 0;
-    XSIMPLEQ_FOREACH(rp, &struct_data->inreqs, next) {
-      ret = hg_proc_hg_uint32_t(proc, &rp->datalen);
-      procheck(ret, "Proc en err datalen");
-      ret = hg_proc_hg_uint32_t(proc, &rp->type);
-      procheck(ret, "Proc en err type");
-      ret = hg_proc_hg_int32_t(proc, &rp->src);
-      procheck(ret, "Proc en err src");
-      ret = hg_proc_hg_int32_t(proc, &rp->dst);
-      procheck(ret, "Proc en err dst");
-      ret = hg_proc_memcpy(proc, rp->data, rp->datalen);
-      procheck(ret, "Proc en err data");
-      cnt++;
-    }
-    /* put in the end of list marker (2 uint32_t zeros) */
-    for (lcv = 0 ; lcv < 2 ; lcv++) {
-      ret = hg_proc_hg_uint32_t(proc, &zero);
-      procheck(ret, "Proc err zero");
-    }
-    mlog(UTIL_D1, "hg_proc_rpcin_t proc %p, encoded=%d", proc, cnt);
-    goto done;
-  }
-
-  /* op == HG_DECODE */
-  cnt = 0;
-  while (1) {
-    ret = hg_proc_hg_uint32_t(proc, &dlen);  /* should err if we use up data */
-    procheck(ret, "Proc de err datalen");
-    ret = hg_proc_hg_uint32_t(proc, &typ);
-    procheck(ret, "Proc de err type");
-    if (dlen == 0 && typ == 0) break;     /* got end of list marker */
-    rp = (request*)malloc(sizeof(*rp) + dlen);
-    if (rp == NULL) ret = HG_NOMEM_ERROR;
-    procheck(ret, "Proc de malloc");
-    rp->datalen = dlen;
-    rp->type = typ;
-    ret = hg_proc_hg_int32_t(proc, &rp->src);
-    if (ret == HG_SUCCESS) ret = hg_proc_hg_int32_t(proc, &rp->dst);
-    rp->data = ((char *)rp) + sizeof(*rp);
-    if (ret == HG_SUCCESS) ret = hg_proc_memcpy(proc, rp->data, dlen);
-    rp->owner = NULL;
-    if (ret != HG_SUCCESS) {
-      free(rp);
-      procheck(ret, "Proc decoder");
-    }
-
-    /* got it!  put at the end of the decoded list */
-    XSIMPLEQ_INSERT_TAIL(&struct_data->inreqs, rp, next);
-    cnt++;
-  }
-  mlog(UTIL_D1, "hg_proc_rpcin_t proc %p, decoded=%d", proc, cnt);
-
-done:
-  if ( ((op == HG_DECODE && ret != HG_SUCCESS) || op == HG_FREE) &&
-       XSIMPLEQ_FIRST(&struct_data->inreqs) != NULL) {
-    XSIMPLEQ_FOREACH_SAFE(rp, &struct_data->inreqs, next, nrp) {
-      free(rp);
-    }
-    XSIMPLEQ_INIT(&struct_data->inreqs);
-  }
-  return(ret);
-}
-
-/*
- * hg_proc_rpcout_t: encode/decode the rpcout_t structure
- *
- * @param proc the proc used to serialize/deserialize the data
- * @param data pointer to the data being worked on
- * @return HG_SUCCESS or an error code
- */
-static hg_return_t hg_proc_rpcout_t(hg_proc_t proc, void *data) {
-    hg_return_t ret = HG_SUCCESS;
-    rpcout_t *struct_data = (rpcout_t *) data;
-    /* hg_proc_op_t op = hg_proc_get_op(proc); */  /* don't need it */
-
-    mlog(UTIL_CALL, "hg_proc_rpcout_t proc=%p, op=%d", proc,
-         hg_proc_get_op(proc));
-
-    ret = hg_proc_hg_int32_t(proc, &struct_data->oseq);
-    procheck(ret, "Proc err oseq");
-    ret = hg_proc_hg_int32_t(proc, &struct_data->respondrank);
-    procheck(ret, "Proc err src");
-    ret = hg_proc_hg_int32_t(proc, &struct_data->ret);
-    procheck(ret, "Proc err ret");
-
-done:
-    return(ret);
-}
-
 /*
  * shuffle_req_dup: malloc a duplicate copy of a req.  used for broadcast.
  * caller is responsible for making sure this eventually gets freed.
@@ -682,10 +783,14 @@ static struct request *shuffle_req_dup(struct request *reqin) {
     rv->type = reqin->type;
     rv->src = reqin->src;
     rv->dst = reqin->dst;
+    rv->hflags = reqin->hflags;
+    rv->epoch = reqin->epoch;
+    rv->tstamp = reqin->tstamp;
     rv->data = ((char *)rv) + sizeof(*rv);
     if (reqin->datalen)
         memcpy(rv->data, reqin->data, reqin->datalen);
     rv->owner = NULL;
+    rv->crrank = -1;        /* dups are not covered by the sender's credit */
     /* caller will init next pointer if/when req is put on a list */
    return(rv);
 }
@@ -701,6 +806,7 @@ static const char *outset_typstr(int type) {
     case SHUFFLE_REMOTE_QUEUES: return("remote");
     case SHUFFLE_ORIGIN_QUEUES: return("orgin");
     case SHUFFLE_RELAY_QUEUES:  return("relay");
+    case SHUFFLE_DELIVERY_QUEUES: return("delivery");
   }
   return("UNKNOWN!");
 }
@@ -738,6 +844,159 @@ static void shuffle_outset_discard(struct outset *oset) {
   pthread_mutex_destroy(&oset->os_rpclimitlock);
   if (oset->oqflush_counter)
     acnt32_free(&oset->oqflush_counter);
+  if (oset->ostats)
+    acnt64_free(&oset->ostats);
+  if (oset->orttlat)
+    shuf_hist_free(&oset->orttlat);
+  if (oset->owaitlat)
+    shuf_hist_free(&oset->owaitlat);
+  if (oset->obreqs)
+    shuf_hist_free(&oset->obreqs);
+  if (oset->obbytes)
+    shuf_hist_free(&oset->obbytes);
+}
+
+/*
+ * shuffle_rail: get the hgprogress for a network rail
+ *
+ * @param sh the shuffle
+ * @param rail the rail number (0 to nrails-1)
+ * @return the rail's hgprogress (hgp_remote for rail 0)
+ */
+static struct hgprogress *shuffle_rail(struct shuffle *sh, int rail) {
+  return((rail == 0) ? &sh->hgp_remote : &sh->hgp_rails[rail - 1]);
+}
+
+/*
+ * rail_create: create the mercury context and progressor for an
+ * extra network rail.  rails share the remote class, so a peer has
+ * the same addr on every rail and a handle's target id picks the
+ * rail (context) on the peer.  the context id is the rail number.
+ *
+ * @param sh the shuffle (hgp_remote must be set up)
+ * @param rail the rail number (1 to nrails-1)
+ * @param ctxp the new context is returned here
+ * @return the rail's progressor handle, or NULL on error
+ */
+static progressor_handle_t *rail_create(struct shuffle *sh, int rail,
+                                        hg_context_t **ctxp) {
+  hg_context_t *ctx;
+  progressor_handle_t *phand;
+
+  ctx = HG_Context_create_id(sh->hgp_remote.mcls, rail);
+  if (ctx == NULL)
+    return(NULL);
+  phand = mercury_progressor_init(sh->hgp_remote.mcls, ctx);
+  if (phand == NULL) {
+    HG_Context_destroy(ctx);
+    return(NULL);
+  }
+  *ctxp = ctx;
+  return(phand);
+}
+
+/*
+ * rail_destroy: free the progressor and context that rail_create
+ * made for an extra rail.  the rail's progressor must be idle.
+ *
+ * @param hgp the rail's hgprogress
+ */
+static void rail_destroy(struct hgprogress *hgp) {
+  if (hgp->railctx == NULL)
+    return;
+  mercury_progressor_freehandle(hgp->mphand);
+  if (HG_Context_destroy(hgp->railctx) != HG_SUCCESS)
+    mlog(SHUF_WARN, "rail_destroy: rail %d context still busy", hgp->rail);
+  hgp->mphand = NULL;
+  hgp->railctx = NULL;
+}
+
+/*
+ * rail_name: format a rail's name for log messages
+ *
+ * @param rail the rail number
+ * @param buf buffer to put the name in
+ * @param bufsz size of buf
+ */
+static void rail_name(int rail, char *buf, size_t bufsz) {
+  if (rail == 0)
+    snprintf(buf, bufsz, "remote");
+  else
+    snprintf(buf, bufsz, "remote-rail%d", rail);
+}
+
+/*
+ * oqinit: args for init_outset_addoq
+ */
+struct oqinit {
+  struct outset *oset;              /* outset we are populating */
+  int maxoqrpc;                     /* starting maxrpc for each oq */
+  int rpcceil;                      /* adaptive maxrpc ceiling */
+};
+
+/*
+ * init_outset_addoq: router iterate callback that adds an outqueue
+ * for a peer to an outset.  remote queues are dealt out to the
+ * network rails round robin (a peer has the same addr on every rail).
+ *
+ * @param fnarg our struct oqinit
+ * @param ha the peer's address (router owns it)
+ * @param grank the peer's global rank
+ * @param subrank the peer's sub-rank
+ * @return 0 on success, -1 on error
+ */
+static int init_outset_addoq(void *fnarg, hg_addr_t ha, int grank,
+                             int subrank) {
+  struct oqinit *oi = (struct oqinit *)fnarg;
+  struct outset *oset = oi->oset;
+  struct shuffle *sh = oset->shuf;
+  struct outqueue *oq;
+
+  oq = new struct outqueue;
+  if (!oq) return(-1);
+  oq->myset = oset;
+  oq->dst = ha;         /* shared with router, router owns it */
+  oq->subrank = subrank;
+  oq->grank = grank;
+  oq->direct = 0;
+  oq->oqhgp = oset->myhgp;
+  oq->oqidx = sh->noqs++;
+  if (oset == &sh->remoteq && sh->nrails > 1)
+    oq->oqhgp = shuffle_rail(sh, oset->oqs.size() % sh->nrails);
+  if (pthread_mutex_init(&oq->oqlock, NULL) != 0) {
+    delete oq;
+    return(-1);
+  }
+  XSIMPLEQ_INIT(&oq->loading);
+  XTAILQ_INIT(&oq->outs);
+  oq->loadsize = oq->loadcnt = oq->nsending = 0;
+  oq->oqsetflush.ofstate = OQF_IDLE;
+  oq->oqsetflush.ofwaitcounter = 0;
+  oq->oqsetflush.ofoutput = NULL;
+  oq->oqsetflush.ofcv = NULL;
+  XTAILQ_INIT(&oq->oqflushers);
+  oq->crwin = CREDIT_NONE;     /* until dst tells us otherwise */
+  oq->crinflight = 0;
+  oq->waitbytes = 0;
+  oq->repdepth = 0;
+  oq->maxrpc = oi->maxoqrpc;
+  aimd_init(&oq->oqaimd, oi->maxoqrpc,
+            (oi->rpcceil > 0) ? oi->rpcceil : 4 * oi->maxoqrpc);
+  shufzero(&oq->cntoqreqs[0]);  shufzero(&oq->cntoqreqs[1]);
+  shufzero(&oq->cntoqsends);
+  shufzero(&oq->cntoqflushsend);
+  shufzero(&oq->cntoqwaits[0]);  shufzero(&oq->cntoqwaits[1]);
+  shufzero(&oq->cntoqmaxwait);
+  shufzero(&oq->cntoqflushes);
+  shufzero(&oq->cntoqdstflushes);
+  shufzero(&oq->cntoqflushorder);
+  shufzero(&oq->cntoqcredwait);
+
+  /* waitq init'd by ctor */
+  oset->oqs[ha] = oq;    /* map insert, malloc's under the hood */
+  mlog(UTIL_D1, "init_outset: add oq=%p rnks=%d.%d addr=%p rail=%d", oq,
+       oq->grank, oq->subrank, ha, oq->oqhgp->rail);
+  return(0);
 }
 
 /*
@@ -747,18 +1006,21 @@ static void shuffle_outset_discard(struct outset *oset) {
  * @param maxoqrpc max# of outstanding RPCs allowed on one oq
  * @param buftarget try and collect at least this many bytes into batch
  * @param sndrpclimit block shuffle_enqueue() if past limit
+ * @param adaptive adjust maxoqrpc and sndrpclimit with aimd
+ * @param rpcceil adaptive maxoqrpc ceiling (0 = 4x maxoqrpc)
+ * @param limceil adaptive sndrpclimit ceiling (0 = 4x starting limit)
  * @param shuf the shuffle that owns this oset
  * @param hgp the mercury progressor that will service us
- * @param nit nexus iterator for map
+ * @param local populate with local (1) or remote (0) peers from router
  * @return -1 on error, 0 on success
  */
 static int shuffle_init_outset(struct outset *oset, int maxoqrpc,
                                 int buftarget, int sndrpclimit,
+                                int adaptive, int rpcceil, int limceil,
                                 shuffle_t shuf,
-                                struct hgprogress *hgp, nexus_iter_t nit) {
-  int stype;
-  hg_addr_t ha;
-  struct outqueue *oq;
+                                struct hgprogress *hgp, int local) {
+  int stype, limstart;
+  struct oqinit oi;
 
   if (oset == &shuf->remoteq) {
     stype = SHUFFLE_REMOTE_QUEUES;
@@ -777,6 +1039,7 @@ static int shuffle_init_outset(struct outset *oset, int maxoqrpc,
   oset->buftarget = buftarget;
   oset->settype = stype;
   oset->shufsend_rpclimit = sndrpclimit;
+  oset->adaptive = adaptive;
   oset->shuf = shuf;
   oset->myhgp = hgp;
   if (pthread_mutex_init(&oset->os_rpclimitlock, NULL) != 0) {
@@ -785,43 +1048,36 @@ static int shuffle_init_outset(struct outset *oset, int maxoqrpc,
   }
   oset->outset_nrpcs = 0;
   XTAILQ_INIT(&oset->shufsendq);
-  shufzero(&oset->os_senderlimit);
   /* oqs init'd by ctor */
-  oset->osetflushing = 0;
   oset->oqflush_counter = acnt32_alloc();
-  if (oset->oqflush_counter == NULL)
+  oset->ostats = acnt64_alloc(OST_NSTATS);
+  oset->orttlat = shuf_hist_alloc();
+  oset->owaitlat = shuf_hist_alloc();
+  oset->obreqs = shuf_hist_alloc();
+  oset->obbytes = shuf_hist_alloc();
+  if (oset->oqflush_counter == NULL || oset->ostats == NULL ||
+      oset->orttlat == NULL || oset->owaitlat == NULL ||
+      oset->obreqs == NULL || oset->obbytes == NULL)
     goto err;
 
   /* now populate the oqs */
-  for (/*null*/ ; nexus_iter_atend(nit) == 0 ; nexus_iter_advance(nit)) {
-    ha = nexus_iter_addr(nit);
-    oq = new struct outqueue;
-    if (!oq) goto err;
-    oq->myset = oset;
-    oq->dst = ha;         /* shared with nexus, nexus owns it */
-    oq->subrank = nexus_iter_subrank(nit);
-    oq->grank = nexus_iter_globalrank(nit);
-    if (pthread_mutex_init(&oq->oqlock, NULL) != 0) {
-      delete oq;
-      goto err;
-    }
-    XSIMPLEQ_INIT(&oq->loading);
-    XTAILQ_INIT(&oq->outs);
-    oq->loadsize = oq->nsending = 0;
-    oq->oqflushing = oq->oqflush_waitcounter = 0;
-    oq->oqflush_output = NULL;
-    shufzero(&oq->cntoqreqs[0]);  shufzero(&oq->cntoqreqs[1]);
-    shufzero(&oq->cntoqsends);
-    shufzero(&oq->cntoqflushsend);
-    shufzero(&oq->cntoqwaits[0]);  shufzero(&oq->cntoqwaits[1]);
-    shufzero(&oq->cntoqmaxwait);
-    shufzero(&oq->cntoqflushes);
-    shufzero(&oq->cntoqflushorder);
-
-    /* waitq init'd by ctor */
-    oset->oqs[ha] = oq;    /* map insert, malloc's under the hood */
-    mlog(UTIL_D1, "init_outset: add oq=%p rnks=%d.%d addr=%p", oq, oq->grank,
-         oq->subrank, ha);
+  oi.oset = oset;
+  oi.maxoqrpc = maxoqrpc;
+  oi.rpcceil = rpcceil;
+  if (shuf->rt->iterate(shuf->rtarg, local, init_outset_addoq, &oi) != 0)
+    goto err;
+
+  /*
+   * adaptive sender limit: relay sets don't use a sender limit.  if no
+   * starting limit was given, start at one RPC per destination.
+   */
+  if (adaptive && stype != SHUFFLE_RELAY_QUEUES) {
+    limstart = (sndrpclimit > 0) ? sndrpclimit : (int)oset->oqs.size();
+    if (limstart < 1) limstart = 1;
+    aimd_init(&oset->osaimd, limstart, (limceil > 0) ? limceil : 4 * limstart);
+    oset->shufsend_rpclimit = oset->osaimd.win;
+  } else {
+    aimd_init(&oset->osaimd, sndrpclimit, sndrpclimit);   /* unused */
   }
 
   mlog(UTIL_D1, "init_outset: final size=%zd", oset->oqs.size());
@@ -848,7 +1104,28 @@ int shuffle_init_hgprogress(struct shuffle *sh, struct hgprogress *hgp,
                             hg_rpc_cb_t rpchand) {
   const char *myfunname = sh->funname;
   char *alloc_buf = NULL;
-  int sz;
+  int sz, rail;
+
+  /* network rails after the first are in hgp_rails[] */
+  rail = 0;
+  if (hgp >= sh->hgp_rails && hgp < sh->hgp_rails + (SHUFFLE_MAXRAILS - 1))
+    rail = (hgp - sh->hgp_rails) + 1;
+
+  /* in-memory transport: no mercury, just a queue and a thread */
+  if (sh->rt->memdst) {
+    memset(hgp, 0, sizeof(*hgp));
+    hgp->hgshuf = sh;
+    hgp->rail = rail;
+    hgp->memx = 1;
+    XSIMPLEQ_INIT(&hgp->memq);
+    if (pthread_mutex_init(&hgp->mqlock, NULL) != 0)
+      return(-1);
+    if (pthread_cond_init(&hgp->mqcv, NULL) != 0) {
+      pthread_mutex_destroy(&hgp->mqlock);
+      return(-1);
+    }
+    return(0);
+  }
 
   /*
    * if local and remote are sharing the same mercury context, then
@@ -865,9 +1142,23 @@ int shuffle_init_hgprogress(struct shuffle *sh, struct hgprogress *hgp,
       myfunname = alloc_buf;    /* update to "_loc" version */
   }
 
+  /*
+   * each extra rail gets its own rpc name too, so that rails can't
+   * mix up their rpcids if the router puts them in one mercury class.
+   */
+  if (rail != 0) {
+      sz = strlen(myfunname) + 1 + 8;  /* add space for \0 and "_r<n>" */
+      alloc_buf = (char *)malloc(sz);
+      if (!alloc_buf)
+          return(-1);
+      snprintf(alloc_buf, sz, "%s_r%d", myfunname, rail);
+      myfunname = alloc_buf;
+  }
+
   /* zero everything, sets nrunning to 0. */
   memset(hgp, 0, sizeof(*hgp));
   hgp->hgshuf = sh;
+  hgp->rail = rail;
   hgp->mphand = phand;
   hgp->mcls = mercury_progressor_hgclass(phand);
   hgp->mctx = mercury_progressor_hgcontext(phand);
@@ -888,197 +1179,1001 @@ int shuffle_init_hgprogress(struct shuffle *sh, struct hgprogress *hgp,
 }
 
 /*
- * shuffle_flush_discard: discard allocated state for flush mgt
+ * shuffle_flush_discard: discard allocated state for flush mgt.
+ * cancels all pending and running flush ops and drops the targets'
+ * references to them.  the app's handles stay valid (the ops only
+ * use their own lock) and are released by shuffle_flush_wait().
  *
  * @param sh shuffle previously init'd with shuffle_init_flush
  */
 static void shuffle_flush_discard(struct shuffle *sh) {
-  int nc = 0;
-  struct flush_op *fop;
+  int nc = 0, lcv, ndlv;
+  struct flush_target *fts[4] = { &sh->local_orq.oflush,
+                                  &sh->local_rlq.oflush,
+                                  &sh->remoteq.oflush, &sh->dflush }, *ft;
+  struct flush_op *fop, *cur;
+  struct delivery *dlvs[SHUFFLE_MAXHANDLERS+1];
   mlog(UTIL_CALL, "shuffle_flush_discard");
 
-  /* kill any pending flush ops (hopefully none) */
-  pthread_mutex_lock(&sh->flushlock);
-  while ((fop = XSIMPLEQ_FIRST(&sh->fpending)) != NULL) {
-    XSIMPLEQ_REMOVE_HEAD(&sh->fpending, fq);
-    fop->status = FLUSHQ_CANCEL;
-    pthread_cond_signal(&fop->flush_waitcv);
-    nc++;
-  }
+  for (lcv = 0 ; lcv < 4 ; lcv++) {
+    ft = fts[lcv];
+
+    /* kill any pending flush ops (hopefully none) */
+    pthread_mutex_lock(&sh->flushlock);
+    while ((fop = XSIMPLEQ_FIRST(&ft->fpending)) != NULL) {
+      XSIMPLEQ_REMOVE_HEAD(&ft->fpending, fq);
+      flush_opdone(fop, FLUSHQ_CANCEL);
+      nc++;
+    }
+    cur = ft->curflush;
+    pthread_mutex_unlock(&sh->flushlock);
+
+    if (cur == NULL)
+      continue;
+
+    /*
+     * reset the queue state of the running flush before we clear
+     * curflush so that forw_start_next's sanity check stays valid.
+     */
+    if (ft->foset) {
+      clean_qflush(sh, ft->foset);
+    } else {
+      ndlv = shuffle_deliveries(sh, dlvs);
+      while (ndlv-- > 0) {
+        pthread_mutex_lock(&dlvs[ndlv]->deliverlock);
+        dlvs[ndlv]->dflush_counter = 0;
+        pthread_mutex_unlock(&dlvs[ndlv]->deliverlock);
+      }
+      acnt32_set(sh->dflush_count, 0);
+    }
 
-  if (sh->curflush) {
-    sh->curflush->status = FLUSHQ_CANCEL;
-    pthread_cond_signal(&sh->curflush->flush_waitcv);
-    nc++;
+    /* cancel it, unless it finished while we were cleaning */
+    pthread_mutex_lock(&sh->flushlock);
+    if (ft->curflush == cur) {
+      ft->curflush = NULL;
+      flush_opdone(cur, FLUSHQ_CANCEL);
+      nc++;
+    }
+    pthread_mutex_unlock(&sh->flushlock);
   }
-  pthread_mutex_unlock(&sh->flushlock);
 
   if (nc) {
     notify(UTIL_WARN|MLOG_STDERR,
            "shuffle: flush_discard canceled %d flush op(s)", nc);
-    sleep(3);   /* yield to be safe since destroy flushlock is next */
   }
   pthread_mutex_destroy(&sh->flushlock);
+  pthread_cond_destroy(&sh->fdcv);
+  pthread_mutex_destroy(&sh->fdlock);
 }
 
 /*
- * shuffle_init_flush: init flush op management fields in shuffle
+ * shuffle_init_flush: init flush op management fields in shuffle.
+ * must be called after the outsets have been init'd.
  *
  * @param sh shuffle to init
  * @return success, normally
  */
 static hg_return_t shuffle_init_flush(struct shuffle *sh) {
+  struct outset *osets[3] = { &sh->local_orq, &sh->local_rlq, &sh->remoteq };
+  int ftypes[3] = { FLUSH_LOCAL_ORQ, FLUSH_LOCAL_RLQ, FLUSH_REMOTEQ };
+  int lcv;
   mlog(UTIL_CALL, "shuffle_init_flush");
-  XSIMPLEQ_INIT(&sh->fpending);
-  sh->curflush = NULL;
-  sh->flushdone = 0;
-  sh->flushtype = FLUSH_NONE;
-  sh->flushoset = NULL;
+
+  for (lcv = 0 ; lcv < 3 ; lcv++) {
+    osets[lcv]->oflush.ftype = ftypes[lcv];
+    osets[lcv]->oflush.foset = osets[lcv];
+    osets[lcv]->oflush.curflush = NULL;
+    XSIMPLEQ_INIT(&osets[lcv]->oflush.fpending);
+  }
+  sh->dflush.ftype = FLUSH_DELIVER;
+  sh->dflush.foset = NULL;
+  sh->dflush.curflush = NULL;
+  XSIMPLEQ_INIT(&sh->dflush.fpending);
+  acnt32_set(sh->dflush_count, 0);
 
   if (pthread_mutex_init(&sh->flushlock, NULL) != 0)
     return(HG_NOMEM_ERROR);
+  if (pthread_mutex_init(&sh->fdlock, NULL) != 0) {
+    pthread_mutex_destroy(&sh->flushlock);
+    return(HG_NOMEM_ERROR);
+  }
+  if (pthread_cond_init(&sh->fdcv, NULL) != 0) {
+    pthread_mutex_destroy(&sh->fdlock);
+    pthread_mutex_destroy(&sh->flushlock);
+    return(HG_NOMEM_ERROR);
+  }
+  sh->fdseq = 0;
   return(HG_SUCCESS);
 }
 
 /*
- * shuffle_opts_init: init all values in an opts structures to the defaults
+ * shuffle_init_epoch: init epoch termination detection state
+ *
+ * @param sh shuffle to init
+ * @return success, normally
  */
-void shuffle_opts_init(struct shuffle_opts *sopt) {
-  memset(sopt, 0, sizeof(*sopt));
-  sopt->lomaxrpc = sopt->lrmaxrpc = sopt->rmaxrpc = 1;
-  sopt->deliverq_max = 1;
+static hg_return_t shuffle_init_epoch(struct shuffle *sh) {
+  int lcv;
+  mlog(UTIL_CALL, "shuffle_init_epoch");
+
+  sh->epoch = acnt32_alloc();
+  for (lcv = 0 ; lcv < 2 ; lcv++) {
+    sh->esent[lcv] = acnt32_alloc();
+    sh->erecv[lcv] = acnt32_alloc();
+  }
+  if (!sh->epoch || !sh->esent[0] || !sh->esent[1] ||
+      !sh->erecv[0] || !sh->erecv[1])
+    goto err;
+  if (pthread_mutex_init(&sh->eplock, NULL) != 0)
+    goto err;
+  if (pthread_cond_init(&sh->epcv, NULL) != 0) {
+    pthread_mutex_destroy(&sh->eplock);
+    goto err;
+  }
+
+  acnt32_set(sh->epoch, 0);
+  for (lcv = 0 ; lcv < 2 ; lcv++) {
+    acnt32_set(sh->esent[lcv], 0);
+    acnt32_set(sh->erecv[lcv], 0);
+    sh->esum[lcv] = 0;
+  }
+  sh->eqepoch = -1;
+  sh->eqwave = 0;
+  sh->edone = 0;
+  sh->efailed = -1;
+  sh->ewave = 0;
+  sh->ereports = 0;
+  return(HG_SUCCESS);
+
+err:
+  if (sh->epoch) acnt32_free(&sh->epoch);
+  for (lcv = 0 ; lcv < 2 ; lcv++) {
+    if (sh->esent[lcv]) acnt32_free(&sh->esent[lcv]);
+    if (sh->erecv[lcv]) acnt32_free(&sh->erecv[lcv]);
+  }
+  return(HG_NOMEM_ERROR);
 }
 
 /*
- * shuffle_init: inits the shuffle layer.
+ * shuffle_epoch_discard: discard epoch state
+ *
+ * @param sh shuffle previously init'd with shuffle_init_epoch
  */
-shuffle_t shuffle_init(nexus_ctx_t nxp, char *funname,
-                       shuffle_deliverfn_t delivercb,
-                       struct shuffle_opts *so) {
-  int64_t mask, worldsize;
-  int myrank, lcv, rv;
-  shuffle_t sh;
-  nexus_iter_t nit;
-
-  /*
-   * XXX: MPI ranks are "int" ... we assume a rank fits in an int32_t
-   * in our RPC structs, but we double check it here to be safe.
-   */
-  mask = ~0x7fffffff;
-  worldsize = nexus_global_size(nxp);  /* largest possible rank */
-  if (worldsize & mask) {
-    fprintf(stderr, "shuffle_init: rank bigger than int32_t?\n");
-    abort();
+static void shuffle_epoch_discard(struct shuffle *sh) {
+  int lcv;
+  mlog(UTIL_CALL, "shuffle_epoch_discard");
+
+  pthread_cond_destroy(&sh->epcv);
+  pthread_mutex_destroy(&sh->eplock);
+  acnt32_free(&sh->epoch);
+  for (lcv = 0 ; lcv < 2 ; lcv++) {
+    acnt32_free(&sh->esent[lcv]);
+    acnt32_free(&sh->erecv[lcv]);
   }
+}
 
-  myrank = nexus_global_rank(nxp);
-  shuffle_openlog(myrank);
+/*
+ * delivery_init: init a delivery queue (but does not start its thread)
+ *
+ * @param sh the shuffle that owns the delivery
+ * @param dlv the delivery to init
+ * @param didx 0 for the default delivery, else handler# + 1
+ * @return -1 on error, 0 on success
+ */
+static int delivery_init(struct shuffle *sh, struct delivery *dlv, int didx) {
+  mlog(UTIL_CALL, "delivery_init: didx=%d", didx);
 
-  mlog(SHUF_CALL,
-       "shuffle_init maxrpc(lo/lr/r)=%d/%d/%d targ(lo/lr/r)=%d/%d/%d",
-       so->lomaxrpc, so->lrmaxrpc, so->rmaxrpc, so->lobuftarget,
-       so->lrbuftarget, so->rbuftarget);
-  mlog(SHUF_CALL, "sndrlimit(l/r)=%d/%d dqmax/th=%d/%d", so->localsenderlimit,
-       so->remotesenderlimit, so->deliverq_max, so->deliverq_threshold);
+  dlv->dshuf = sh;
+  dlv->didx = didx;
+  if (pthread_mutex_init(&dlv->deliverlock, NULL) != 0)
+    return(-1);
+  if (pthread_cond_init(&dlv->delivercv, NULL) != 0) {
+    pthread_mutex_destroy(&dlv->deliverlock);
+    return(-1);
+  }
+  /* deliverq and dwaitq init'd by ctor */
+  dlv->dflush_counter = 0;
+  dlv->dshutdown = dlv->drunning = 0;
+  shufzero(&dlv->cntdblock);
+  shufzero(&dlv->cntdeliver);
+  shufzero(&dlv->cntdreqs[0]); shufzero(&dlv->cntdreqs[1]);
+  shufzero(&dlv->cntdwait[0]); shufzero(&dlv->cntdwait[1]);
+  shufzero(&dlv->cntdmaxwait);
+  shufzero(&dlv->cntdnocb);
+  return(0);
+}
 
-  sh = new shuffle;    /* aborts w/std::bad_alloc on failure */
+/*
+ * delivery_stop: stop a delivery thread (if running) and wait for it
+ *
+ * @param dlv the delivery to stop
+ */
+static void delivery_stop(struct delivery *dlv) {
+  if (dlv->drunning) {
+    mlog(SHUF_D1, "join delivery %d", dlv->didx);
+    pthread_mutex_lock(&dlv->deliverlock);
+    dlv->dshutdown = 1;
+    pthread_cond_broadcast(&dlv->delivercv);
+    pthread_mutex_unlock(&dlv->deliverlock);
+    pthread_join(dlv->dtask, NULL);
+    dlv->dshutdown = 0;
+  }
+}
 
-  /* make sure these oqflush_counters are not pointing at garbage */
+/*
+ * delivery_destroy: release a stopped and purged delivery's lock/cv
+ *
+ * @param dlv the delivery to destroy
+ */
+static void delivery_destroy(struct delivery *dlv) {
+  pthread_mutex_destroy(&dlv->deliverlock);
+  pthread_cond_destroy(&dlv->delivercv);
+}
+
+/*
+ * shuffle_deliveries: collect pointers to all our delivery queues
+ * (the default one first, then private ones owned by handlers).
+ * registered deliveries are not freed until shutdown, so the caller
+ * can use the pointers without holding any locks.
+ *
+ * @param sh the shuffle
+ * @param dlvs array of SHUFFLE_MAXHANDLERS+1 entries to fill (OUT)
+ * @return number of entries placed in dlvs
+ */
+static int shuffle_deliveries(struct shuffle *sh, struct delivery **dlvs) {
+  int n, lcv, rv;
+
+  rv = 0;
+  dlvs[rv++] = &sh->dlv;
+  n = acnt32_get(sh->nhandlers);
+  for (lcv = 0 ; lcv < n ; lcv++) {
+    if (sh->handlers[lcv].dlv != &sh->dlv)
+      dlvs[rv++] = sh->handlers[lcv].dlv;
+  }
+  return(rv);
+}
+
+/*
+ * shuffle_handler_lookup: find the registered handler for a type
+ *
+ * @param sh the shuffle
+ * @param type request type (bcast bit is ignored)
+ * @return the handler, or NULL if the default delivercb should be used
+ */
+static struct dhandler *shuffle_handler_lookup(struct shuffle *sh,
+                                               uint32_t type) {
+  int n, lcv;
+  struct dhandler *h;
+
+  n = acnt32_get(sh->nhandlers);
+  type &= SHUFFLE_RTYPE_USRBITS;
+  for (lcv = 0 ; lcv < n ; lcv++) {
+    h = &sh->handlers[lcv];
+    if (type >= h->type_lo && type <= h->type_hi)
+      return(h);
+  }
+  return(NULL);
+}
+
+/*
+ * sampler_init: init the time-series sampler and write the CSV header
+ * (the thread is started by start_threads).  leaves it disabled if
+ * period_ms or file is not set.
+ *
+ * @param sh the shuffle
+ * @param period_ms sample period in msec
+ * @param file CSV file name (we append the rank#)
+ * @return -1 on error, 0 on success
+ */
+static int sampler_init(struct shuffle *sh, int period_ms, const char *file) {
+  static const char *onames[3] = { "lo", "lr", "rm" };
+  struct sampler *smp = &sh->smp;
+  char *fn;
+  size_t len;
+  int lcv;
+
+  smp->period_ms = 0;
+  smp->sfp = NULL;
+  smp->sshutdown = smp->srunning = 0;
+  if (period_ms <= 0 || file == NULL)
+    return(0);     /* disabled */
+
+  len = strlen(file) + 16;
+  fn = (char *)malloc(len);
+  if (fn == NULL)
+    return(-1);
+  snprintf(fn, len, "%s.%d", file, sh->grank);
+  smp->sfp = fopen(fn, "w");
+  if (smp->sfp == NULL) {
+    notify(SHUF_CRIT, "sampler_init: %s: %s", fn, strerror(errno));
+    free(fn);
+    return(-1);
+  }
+  free(fn);
+  if (pthread_mutex_init(&smp->slock, NULL) != 0) {
+    fclose(smp->sfp);
+    return(-1);
+  }
+  if (pthread_cond_init(&smp->scv, NULL) != 0) {
+    pthread_mutex_destroy(&smp->slock);
+    fclose(smp->sfp);
+    return(-1);
+  }
+  smp->period_ms = period_ms;
+  smp->t0 = shuf_now_us();
+
+  fprintf(smp->sfp, "ms");
+  for (lcv = 0 ; lcv < 3 ; lcv++) {
+    fprintf(smp->sfp, ",%s_nrpcs,%s_nsending,%s_loadsz,%s_oqwait,"
+            "%s_oqwaitmax,%s_reqs,%s_sends,%s_sendbytes", onames[lcv],
+            onames[lcv], onames[lcv], onames[lcv], onames[lcv], onames[lcv],
+            onames[lcv], onames[lcv]);
+  }
+  fprintf(smp->sfp, ",deliverq,dwaitq,enqueues,enqbytes,rpcin_local,"
+          "rpcin_remote,delivers,deliverbytes\n");
+  fflush(smp->sfp);
+  return(0);
+}
+
+/*
+ * sampler_stop: stop the sampler thread (if running) and wait for it.
+ * the sampler writes a final row before it exits.
+ *
+ * @param smp the sampler to stop
+ */
+static void sampler_stop(struct sampler *smp) {
+  if (smp->srunning) {
+    mlog(SHUF_D1, "join sampler");
+    pthread_mutex_lock(&smp->slock);
+    smp->sshutdown = 1;
+    pthread_cond_broadcast(&smp->scv);
+    pthread_mutex_unlock(&smp->slock);
+    pthread_join(smp->stask, NULL);
+    smp->srunning = 0;
+    smp->sshutdown = 0;
+  }
+}
+
+/*
+ * sampler_destroy: close a stopped sampler's file, release lock/cv
+ *
+ * @param smp the sampler to destroy
+ */
+static void sampler_destroy(struct sampler *smp) {
+  if (smp->period_ms == 0)
+    return;
+  fclose(smp->sfp);
+  smp->sfp = NULL;
+  pthread_mutex_destroy(&smp->slock);
+  pthread_cond_destroy(&smp->scv);
+  smp->period_ms = 0;
+}
+
+/*
+ * recorder_init: open the enqueue record file and write its header.
+ * leaves the recorder disabled if file is not set.
+ *
+ * @param sh the shuffle
+ * @param file record file name (we append the rank#)
+ * @return -1 on error, 0 on success
+ */
+static int recorder_init(struct shuffle *sh, const char *file) {
+  struct recorder *rec = &sh->rec;
+  struct shuffle_rec_hdr hdr;
+  char *fn;
+  size_t len;
+
+  rec->rfp = NULL;
+  rec->nrec = 0;
+  if (file == NULL)
+    return(0);     /* disabled */
+
+  len = strlen(file) + 16;
+  fn = (char *)malloc(len);
+  if (fn == NULL)
+    return(-1);
+  snprintf(fn, len, "%s.%d", file, sh->grank);
+  rec->rfp = fopen(fn, "w");
+  if (rec->rfp == NULL) {
+    notify(SHUF_CRIT, "recorder_init: %s: %s", fn, strerror(errno));
+    free(fn);
+    return(-1);
+  }
+  free(fn);
+  if (pthread_mutex_init(&rec->rlock, NULL) != 0) {
+    fclose(rec->rfp);
+    rec->rfp = NULL;
+    return(-1);
+  }
+  hdr.magic = SHUFFLE_REC_MAGIC;
+  hdr.version = SHUFFLE_REC_VERSION;
+  hdr.rank = sh->grank;
+  hdr.nranks = sh->rt->global_size(sh->rtarg);
+  fwrite(&hdr, sizeof(hdr), 1, rec->rfp);
+  rec->tlast = shuf_now_us();
+  return(0);
+}
+
+/*
+ * recorder_log: append a record for an app enqueue call
+ *
+ * @param rec the recorder (must be enabled)
+ * @param dst dst rank or SHUFFLE_REC_BCAST*
+ * @param type msg type
+ * @param len data length
+ */
+static void recorder_log(struct recorder *rec, int dst, uint32_t type,
+                         uint32_t len) {
+  struct shuffle_rec r;
+  uint64_t now, dt;
+
+  r.dst = dst;
+  r.type = type;
+  r.len = len;
+  pthread_mutex_lock(&rec->rlock);
+  now = shuf_now_us();
+  dt = now - rec->tlast;
+  r.dt_us = (dt > UINT32_MAX) ? UINT32_MAX : dt;
+  rec->tlast = now;
+  fwrite(&r, sizeof(r), 1, rec->rfp);
+  rec->nrec++;
+  pthread_mutex_unlock(&rec->rlock);
+}
+
+/*
+ * recorder_destroy: flush and close the record file
+ *
+ * @param rec the recorder to destroy
+ */
+static void recorder_destroy(struct recorder *rec) {
+  if (rec->rfp == NULL)
+    return;
+  if (fclose(rec->rfp) != 0)
+    notify(SHUF_CRIT, "recorder_destroy: close: %s", strerror(errno));
+  mlog(SHUF_INFO, "recorder: wrote %" PRIu64 " records", rec->nrec);
+  rec->rfp = NULL;
+  pthread_mutex_destroy(&rec->rlock);
+}
+
+/*
+ * direct_init: set up direct (one hop) queue state.  we add the
+ * spare queues to remoteq now, keyed by the addr of their dslots[]
+ * entry (a value no router will ever give us), so that they are
+ * covered by flush, purge, and dump like any other remote queue.
+ *
+ * @param sh the shuffle we are setting up (remoteq is ready)
+ * @param so the opts the shuffle was given
+ * @return 0 on success, -1 on error
+ */
+static int direct_init(struct shuffle *sh, struct shuffle_opts *so) {
+  struct direct *dir = &sh->dir;
+  struct oqinit oi;
+  hg_addr_t key;
+  int nranks, lcv;
+
+  dir->dmax = (so->directmax > 0) ? so->directmax : 0;
+  dir->dbytes = (so->directbytes > 0) ? so->directbytes : 0;
+  dir->dnbound = 0;
+  dir->dslots = dir->doq = NULL;
+  dir->dcount = NULL;
+  if (dir->dmax == 0)
+    return(0);
+  if (sh->rt->direct_addr == NULL) {
+    notify(SHUF_CRIT, "shuffle_init: router can't do directmax %d",
+           dir->dmax);
+    dir->dmax = 0;
+    return(-1);
+  }
+
+  nranks = sh->rt->global_size(sh->rtarg);
+  dir->dslots = (struct outqueue **)calloc(dir->dmax, sizeof(*dir->dslots));
+  dir->doq = (struct outqueue **)calloc(nranks, sizeof(*dir->doq));
+  dir->dcount = (uint64_t *)calloc(nranks, sizeof(*dir->dcount));
+  if (!dir->dslots || !dir->doq || !dir->dcount)
+    goto err;
+  if (pthread_mutex_init(&dir->dlock, NULL) != 0)
+    goto err;
+
+  oi.oset = &sh->remoteq;
+  oi.maxoqrpc = sh->remoteq.maxoqrpc;
+  oi.rpcceil = so->aimdmaxrpc;
+  for (lcv = 0 ; lcv < dir->dmax ; lcv++) {
+    key = (hg_addr_t)&dir->dslots[lcv];
+    if (init_outset_addoq(&oi, key, -1, -1) != 0) {
+      pthread_mutex_destroy(&dir->dlock);
+      goto err;
+    }
+    dir->dslots[lcv] = sh->remoteq.oqs[key];
+    dir->dslots[lcv]->direct = 1;
+  }
+
+  mlog(SHUF_INFO, "direct: max=%d queues, threshold=%" PRIu64 " bytes",
+       dir->dmax, dir->dbytes);
+  return(0);
+
+err:
+  notify(SHUF_CRIT, "shuffle: direct_init failed");
+  if (dir->dslots) free(dir->dslots);
+  if (dir->doq) free(dir->doq);
+  if (dir->dcount) free(dir->dcount);
+  dir->dslots = dir->doq = NULL;
+  dir->dcount = NULL;
+  dir->dmax = 0;
+  return(-1);
+}
+
+/*
+ * direct_destroy: free direct queue state.  the queues themselves
+ * are in remoteq and are freed with it.
+ *
+ * @param dir the direct state to free
+ */
+static void direct_destroy(struct direct *dir) {
+  if (dir->dmax == 0)
+    return;
+  mlog(SHUF_INFO, "direct: bound %d of %d queues", dir->dnbound, dir->dmax);
+  free(dir->dslots);
+  free(dir->doq);
+  free(dir->dcount);
+  dir->dslots = dir->doq = NULL;
+  dir->dcount = NULL;
+  pthread_mutex_destroy(&dir->dlock);
+  dir->dmax = 0;
+}
+
+/*
+ * direct_oq: count datalen bytes sent to remote dst and return dst's
+ * direct queue if it has one, binding a spare queue to dst if it has
+ * just gone over the threshold and we have one left.  the fast path
+ * (dst already bound, or all queues in use) takes no locks.
+ *
+ * @param sh the shuffle we are using (direct mode is on)
+ * @param dst the remote dst rank
+ * @param datalen number of bytes being sent
+ * @return dst's direct queue, or NULL to use the normal 3 hop path
+ */
+static struct outqueue *direct_oq(struct shuffle *sh, int dst,
+                                  uint32_t datalen) {
+  struct direct *dir = &sh->dir;
+  struct outqueue *oq;
+  hg_addr_t addr;
+
+  oq = __atomic_load_n(&dir->doq[dst], __ATOMIC_ACQUIRE);
+  if (oq || __atomic_load_n(&dir->dnbound, __ATOMIC_RELAXED) >= dir->dmax)
+    return(oq);
+  if (__atomic_add_fetch(&dir->dcount[dst], datalen, __ATOMIC_RELAXED) <
+      dir->dbytes)
+    return(NULL);
+
+  pthread_mutex_lock(&dir->dlock);
+  oq = dir->doq[dst];
+  if (oq == NULL && dir->dnbound < dir->dmax) {
+    oq = dir->dslots[dir->dnbound];
+    if (sh->rt->direct_addr(sh->rtarg, dst, &addr) != 0) {
+      /* try again after another threshold's worth of data */
+      mlog(SHUF_WARN, "direct: no addr for rank %d", dst);
+      __atomic_store_n(&dir->dcount[dst], 0, __ATOMIC_RELAXED);
+      oq = NULL;
+    } else {
+      pthread_mutex_lock(&oq->oqlock);
+      oq->dst = addr;           /* router owns it */
+      oq->grank = dst;
+      pthread_mutex_unlock(&oq->oqlock);
+      __atomic_store_n(&dir->dnbound, dir->dnbound + 1, __ATOMIC_RELAXED);
+      __atomic_store_n(&dir->doq[dst], oq, __ATOMIC_RELEASE);
+      acnt64_incr(sh->stats, ST_DIRECTQS);
+      mlog(SHUF_INFO, "direct: %d->%d now direct (oq=%p, %d/%d)",
+           sh->grank, dst, oq, dir->dnbound, dir->dmax);
+    }
+  }
+  pthread_mutex_unlock(&dir->dlock);
+
+  return(oq);
+}
+
+/*
+ * oq_repdepth: refresh the depth estimate that srcrep_pick reads
+ * without the oqlock.  call it with oqlock held after changing
+ * loadsize, crinflight, or waitbytes.
+ *
+ * @param oq the locked output queue
+ */
+static inline void oq_repdepth(struct outqueue *oq) {
+  __atomic_store_n(&oq->repdepth, oq->loadsize + oq->crinflight +
+                   oq->waitbytes, __ATOMIC_RELAXED);
+}
+
+/*
+ * srcrep_pick: choose one of dst's SRCREPs (when we have more than
+ * one per remote node).  by hash of dst, or by the least bytes queued
+ * on our origin queue to the SRCREP.  we read each queue's repdepth
+ * estimate without the oqlock: a stale value only makes for a less
+ * balanced choice.
+ * a caller that must cover every SRCREP (flush markers) picks the
+ * SRCREP itself with "want".
+ *
+ * @param sh the shuffle we are using
+ * @param dst the remote dst rank
+ * @param want index of the SRCREP to use, or -1 to pick one
+ * @param rank next_hop's SRCREP rank, replaced with our pick
+ * @param addr next_hop's SRCREP addr, replaced with our pick
+ */
+static void srcrep_pick(struct shuffle *sh, int dst, int want, int *rank,
+                        hg_addr_t *addr) {
+  int ranks[SHUFFLE_MAXSRCREPS], n, lcv, pick, depth, best;
+  hg_addr_t addrs[SHUFFLE_MAXSRCREPS];
+  std::map<hg_addr_t, struct outqueue *>::iterator it;
+  struct outqueue *oq;
+
+  n = sh->rt->srcreps(sh->rtarg, dst, ranks, addrs);
+  if (n <= 1)
+    return;
+  if (n > SHUFFLE_MAXSRCREPS)
+    n = SHUFFLE_MAXSRCREPS;
+
+  if (want >= 0) {
+    pick = want % n;
+  } else if (sh->repsel != SHUFFLE_REPSEL_DEPTH) {
+    pick = ((uint32_t)dst * 2654435761U) % n;    /* multiplicative hash */
+  } else {
+    pick = 0;
+    best = -1;
+    for (lcv = 0 ; lcv < n ; lcv++) {
+      it = sh->local_orq.oqs.find(addrs[lcv]);
+      if (it == sh->local_orq.oqs.end())
+        continue;
+      oq = it->second;
+      depth = __atomic_load_n(&oq->repdepth, __ATOMIC_RELAXED);
+      if (best < 0 || depth < best) {
+        best = depth;
+        pick = lcv;
+      }
+    }
+  }
+
+  *rank = ranks[pick];
+  *addr = addrs[pick];
+}
+
+/*
+ * srcrep_primary: with several SRCREPs per remote node only the
+ * first one handles broadcasts for the node (else the node would get
+ * a copy from each of them).
+ *
+ * @param sh the shuffle we are using
+ * @param grank a rank on the remote node
+ * @return non-zero if we should send broadcast copies to grank's node
+ */
+static int srcrep_primary(struct shuffle *sh, int grank) {
+  int ranks[SHUFFLE_MAXSRCREPS];
+  hg_addr_t addrs[SHUFFLE_MAXSRCREPS];
+
+  if (sh->nreps <= 1)
+    return(1);
+  return(sh->rt->srcreps(sh->rtarg, grank, ranks, addrs) < 1 ||
+         ranks[0] == sh->grank);
+}
+
+/*
+ * shuffle_opts_init: init all values in an opts structures to the defaults
+ */
+void shuffle_opts_init(struct shuffle_opts *sopt) {
+  memset(sopt, 0, sizeof(*sopt));
+  sopt->lomaxrpc = sopt->lrmaxrpc = sopt->rmaxrpc = 1;
+  sopt->deliverq_max = 1;
+}
+
+/*
+ * nexus router: the default shuffle_router, rarg is a nexus_ctx_t
+ */
+static nexus_ret_t nxr_next_hop(void *rarg, int dest, int *rank,
+                                hg_addr_t *addr) {
+  return(nexus_next_hop((nexus_ctx_t)rarg, dest, rank, addr));
+}
+
+static int nxr_global_rank(void *rarg) {
+  return(nexus_global_rank((nexus_ctx_t)rarg));
+}
+
+static int nxr_global_size(void *rarg) {
+  return(nexus_global_size((nexus_ctx_t)rarg));
+}
+
+static int nxr_iterate(void *rarg, int local, shuffle_peerfn_t fn,
+                       void *fnarg) {
+  nexus_iter_t nit;
+  int rv = 0;
+
+  nit = nexus_iter((nexus_ctx_t)rarg, local);
+  if (nit == NULL)
+    return(-1);
+  for (/*null*/ ; nexus_iter_atend(nit) == 0 ; nexus_iter_advance(nit)) {
+    rv = fn(fnarg, nexus_iter_addr(nit), nexus_iter_globalrank(nit),
+            nexus_iter_subrank(nit));
+    if (rv != 0)
+      break;
+  }
+  nexus_iter_free(&nit);
+  return(rv);
+}
+
+static progressor_handle_t *nxr_localprogressor(void *rarg) {
+  return(nexus_localprogressor((nexus_ctx_t)rarg));
+}
+
+static progressor_handle_t *nxr_remoteprogressor(void *rarg) {
+  return(nexus_remoteprogressor((nexus_ctx_t)rarg));
+}
+
+static const struct shuffle_router nexus_router = {
+  nxr_next_hop, nxr_global_rank, nxr_global_size, nxr_iterate,
+  nxr_localprogressor, nxr_remoteprogressor, NULL, NULL, NULL, NULL,
+  NULL,
+};
+
+/*
+ * shuffle_init: inits the shuffle layer.
+ */
+shuffle_t shuffle_init(nexus_ctx_t nxp, char *funname,
+                       shuffle_deliverfn_t delivercb,
+                       struct shuffle_opts *so) {
+  return(shuffle_init_router(&nexus_router, nxp, funname, delivercb, so));
+}
+
+/*
+ * shuffle_init_router: inits the shuffle layer with a given router.
+ */
+shuffle_t shuffle_init_router(const struct shuffle_router *rt, void *rarg,
+                              char *funname, shuffle_deliverfn_t delivercb,
+                              struct shuffle_opts *so) {
+  int64_t mask, worldsize;
+  int myrank, rv, lcv, nrailok;
+  progressor_handle_t *rphand;
+  hg_context_t *railctx;
+  shuffle_t sh;
+
+  /*
+   * XXX: MPI ranks are "int" ... we assume a rank fits in an int32_t
+   * in our RPC structs, but we double check it here to be safe.
+   */
+  mask = ~0x7fffffff;
+  worldsize = rt->global_size(rarg);  /* largest possible rank */
+  if (worldsize & mask) {
+    fprintf(stderr, "shuffle_init: rank bigger than int32_t?\n");
+    abort();
+  }
+
+  myrank = rt->global_rank(rarg);
+  shuffle_openlog(myrank);
+
+  mlog(SHUF_CALL,
+       "shuffle_init maxrpc(lo/lr/r)=%d/%d/%d targ(lo/lr/r)=%d/%d/%d",
+       so->lomaxrpc, so->lrmaxrpc, so->rmaxrpc, so->lobuftarget,
+       so->lrbuftarget, so->rbuftarget);
+  mlog(SHUF_CALL, "sndrlimit(l/r)=%d/%d dqmax/th=%d/%d crwin=%d",
+       so->localsenderlimit, so->remotesenderlimit, so->deliverq_max,
+       so->deliverq_threshold, so->creditwin);
+  mlog(SHUF_CALL, "aimd=%d ceil(maxrpc/sndrlimit)=%d/%d", so->aimd,
+       so->aimdmaxrpc, so->aimdsenderlimit);
+  mlog(SHUF_CALL, "routing=%d direct=%d/%d srcreps=%d/%d rails=%d relay=%d",
+       so->routing, so->directmax, so->directbytes, so->srcreps, so->repsel,
+       so->remoterails, so->relayworkers);
+  mlog(SHUF_CALL, "enqstage=%d", so->enqstage);
+
+  sh = new shuffle;    /* aborts w/std::bad_alloc on failure */
+  nrailok = 1;         /* extra rails with a context to free on err */
+
+  /* make sure these oqflush_counters are not pointing at garbage */
   sh->local_orq.oqflush_counter = NULL;
   sh->local_rlq.oqflush_counter = NULL;
   sh->remoteq.oqflush_counter = NULL;
+  sh->local_orq.ostats = NULL;
+  sh->local_rlq.ostats = NULL;
+  sh->remoteq.ostats = NULL;
+  sh->local_orq.orttlat = sh->local_orq.owaitlat = NULL;
+  sh->local_rlq.orttlat = sh->local_rlq.owaitlat = NULL;
+  sh->remoteq.orttlat = sh->remoteq.owaitlat = NULL;
+  sh->local_orq.obreqs = sh->local_orq.obbytes = NULL;
+  sh->local_rlq.obreqs = sh->local_rlq.obbytes = NULL;
+  sh->remoteq.obreqs = sh->remoteq.obbytes = NULL;
+  sh->dir.dmax = 0;
+  sh->nrelay = 0;
+  sh->relayw = NULL;
+  sh->noqs = 0;
+  sh->stagebytes = 0;
+  sh->crsize = 0;
+  sh->crheld = NULL;
 
   /* are local and remote sharing the same hg context? */
-  sh->single_hgmode =
-    mercury_progressor_hgcontext(nexus_localprogressor(nxp)) ==
-    mercury_progressor_hgcontext(nexus_remoteprogressor(nxp));
+  sh->single_hgmode = (rt->memdst == NULL) &&
+    mercury_progressor_hgcontext(rt->localprogressor(rarg)) ==
+    mercury_progressor_hgcontext(rt->remoteprogressor(rarg));
   sh->grank = myrank;
-  for (lcv = 0 ; lcv < FLUSH_NTYPES ; lcv++) {
-    shufzero(&sh->cntflush[lcv]);
-  }
-  shufzero(&sh->cntflushwait);
-  shufzero(&sh->cntdblock);
-  shufzero(&sh->cntdeliver);
-  shufzero(&sh->cntdreqs[0]); shufzero(&sh->cntdreqs[1]);
-  shufzero(&sh->cntdwait[0]); shufzero(&sh->cntdwait[1]);
-  shufzero(&sh->cntdmaxwait);
-  shufzero(&sh->cntrpcinshm);
-  shufzero(&sh->cntrpcinnet);
-  shufzero(&sh->cntstranded);
-
-  sh->nxp = nxp;
+
+  sh->rt = rt;
+  sh->rtarg = rarg;
   sh->funname = strdup(funname);
   sh->seqsrc = acnt32_alloc();
-  if (!sh->funname || !sh->seqsrc)
+  sh->nhandlers = acnt32_alloc();
+  sh->dflush_count = acnt32_alloc();
+  sh->stats = acnt64_alloc(ST_NSTATS);
+  sh->dwaitlat = shuf_hist_alloc();
+  sh->dcblat = shuf_hist_alloc();
+  sh->e2elat = shuf_hist_alloc();
+  if (!sh->funname || !sh->seqsrc || !sh->nhandlers || !sh->dflush_count ||
+      !sh->stats || !sh->dwaitlat || !sh->dcblat || !sh->e2elat)
     goto err;
   sh->disablesend = 0;
   sh->boottime = shuftime();
+  sh->latstamp = (so->latstamp != 0);
+
+  /* switch router to a 2 hop mode before we iterate its peers */
+  sh->routing = so->routing;
+  if (sh->routing != SHUFFLE_ROUTE_3HOP &&
+      (rt->set_routing == NULL || rt->set_routing(rarg, sh->routing) != 0)) {
+    notify(SHUF_CRIT, "shuffle_init: router can't do routing mode %d",
+           sh->routing);
+    goto err;
+  }
+  sh->nreps = 1;
+  if (so->srcreps > 1 && sh->routing != SHUFFLE_ROUTE_NOSRCREP)
+    sh->nreps = (so->srcreps < SHUFFLE_MAXSRCREPS) ? so->srcreps :
+                SHUFFLE_MAXSRCREPS;
+  sh->repsel = so->repsel;
+  if (sh->nreps > 1 && (rt->set_srcreps == NULL || rt->srcreps == NULL ||
+                        rt->set_srcreps(rarg, sh->nreps) != 0)) {
+    notify(SHUF_CRIT, "shuffle_init: router can't do %d srcreps", sh->nreps);
+    goto err;
+  }
+  sh->nrails = 1;
+  if (so->remoterails > 1)
+    sh->nrails = (so->remoterails < SHUFFLE_MAXRAILS) ? so->remoterails :
+                 SHUFFLE_MAXRAILS;
 
-  nit = nexus_iter(nxp, 1);
-  if (nit == NULL) goto err;
   rv = shuffle_init_outset(&sh->local_orq, so->lomaxrpc, so->lobuftarget,
-                           so->localsenderlimit, sh, &sh->hgp_local, nit);
-  nexus_iter_free(&nit);
+                           so->localsenderlimit,
+                           (so->aimd & SHUFFLE_AIMD_LOCAL) != 0,
+                           so->aimdmaxrpc, so->aimdsenderlimit,
+                           sh, &sh->hgp_local, 1);
   if (rv < 0) goto err;
 
-  nit = nexus_iter(nxp, 1);
-  if (nit == NULL) goto err;
   rv = shuffle_init_outset(&sh->local_rlq, so->lrmaxrpc, so->lrbuftarget,
-                           0, sh, &sh->hgp_local, nit);
-  nexus_iter_free(&nit);
+                           0, (so->aimd & SHUFFLE_AIMD_LOCAL) != 0,
+                           so->aimdmaxrpc, 0, sh, &sh->hgp_local, 1);
   if (rv < 0) goto err;
 
-  nit = nexus_iter(nxp, 0);
-  if (nit == NULL) goto err;
   rv = shuffle_init_outset(&sh->remoteq, so->rmaxrpc, so->rbuftarget,
-                           so->remotesenderlimit, sh, &sh->hgp_remote, nit);
-  nexus_iter_free(&nit);
+                           so->remotesenderlimit,
+                           (so->aimd & SHUFFLE_AIMD_REMOTE) != 0,
+                           so->aimdmaxrpc, so->aimdsenderlimit,
+                           sh, &sh->hgp_remote, 0);
   if (rv < 0) goto err;
+  if (direct_init(sh, so) != 0) goto err;
   acnt32_set(sh->seqsrc, 0);
+  acnt32_set(sh->nhandlers, 0);
 
   /*
    * init hg progress state (but don't start yet).  allocs hg rpcid.
-   * since we are using nxp (nexus), it can't be shutdown before us.
-   * so it is safe to use nexus' progressor handle: no need to duphandle().
+   * since the router (e.g. nexus) can't be shutdown before us, it
+   * is safe to use its progressor handle: no need to duphandle().
    */
   rv = shuffle_init_hgprogress(sh, &sh->hgp_local,
-                               nexus_localprogressor(nxp), shuffle_rpchand);
+                               (rt->memdst) ? NULL : rt->localprogressor(rarg),
+                               shuffle_rpchand);
   if (rv < 0) goto err;
   rv = shuffle_init_hgprogress(sh, &sh->hgp_remote,
-                                nexus_remoteprogressor(nxp), shuffle_rpchand);
+                               (rt->memdst) ? NULL : rt->remoteprogressor(rarg),
+                               shuffle_rpchand);
   if (rv < 0) goto err;
+  for (lcv = 1 ; lcv < sh->nrails ; lcv++) {
+    rphand = NULL;
+    railctx = NULL;
+    if (!rt->memdst && (rphand = rail_create(sh, lcv, &railctx)) == NULL) {
+      notify(SHUF_CRIT, "shuffle_init: can't create rail %d context", lcv);
+      goto err;
+    }
+    rv = shuffle_init_hgprogress(sh, &sh->hgp_rails[lcv - 1], rphand,
+                                 shuffle_rpchand);
+    if (rv < 0) {
+      if (rphand) {
+        mercury_progressor_freehandle(rphand);
+        HG_Context_destroy(railctx);
+      }
+      goto err;
+    }
+    sh->hgp_rails[lcv - 1].railctx = railctx;
+    nrailok = lcv + 1;
+  }
 
   sh->deliverq_max = so->deliverq_max;
   sh->deliverq_threshold = so->deliverq_threshold;
   sh->delivercb = delivercb;
-  if (pthread_mutex_init(&sh->deliverlock, NULL) != 0)
+  sh->creditwin = (so->creditwin > 0) ? so->creditwin : 0;
+  if (sh->creditwin > 0) {
+    sh->crsize = worldsize;
+    sh->crheld = (int32_t *)calloc(worldsize, sizeof(sh->crheld[0]));
+    if (sh->crheld == NULL)
+      goto err;
+  }
+  if (delivery_init(sh, &sh->dlv, 0) != 0)
     goto err;
-  if (pthread_cond_init(&sh->delivercv, NULL) != 0) {
-    pthread_mutex_destroy(&sh->deliverlock);
+  if (pthread_mutex_init(&sh->hlock, NULL) != 0) {
+    delivery_destroy(&sh->dlv);
     goto err;
   }
-  sh->dflush_counter = 0;
-  sh->dshutdown = sh->drunning = 0;
 
   if (shuffle_init_flush(sh) != HG_SUCCESS) {
-    pthread_mutex_destroy(&sh->deliverlock);
-    pthread_cond_destroy(&sh->delivercv);
+    delivery_destroy(&sh->dlv);
+    pthread_mutex_destroy(&sh->hlock);
+    goto err;
+  }
+  if (shuffle_init_epoch(sh) != HG_SUCCESS) {
+    delivery_destroy(&sh->dlv);
+    pthread_mutex_destroy(&sh->hlock);
+    shuffle_flush_discard(sh);
+    goto err;
+  }
+  if (sampler_init(sh, so->sample_ms, so->samplefile) != 0) {
+    delivery_destroy(&sh->dlv);
+    pthread_mutex_destroy(&sh->hlock);
+    shuffle_flush_discard(sh);
+    shuffle_epoch_discard(sh);
+    goto err;
+  }
+  if (recorder_init(sh, so->recordfile) != 0) {
+    delivery_destroy(&sh->dlv);
+    pthread_mutex_destroy(&sh->hlock);
+    shuffle_flush_discard(sh);
+    shuffle_epoch_discard(sh);
+    sampler_destroy(&sh->smp);
+    goto err;
+  }
+  if (relay_init(sh, so->relayworkers) != 0) {
+    delivery_destroy(&sh->dlv);
+    pthread_mutex_destroy(&sh->hlock);
+    shuffle_flush_discard(sh);
+    shuffle_epoch_discard(sh);
+    sampler_destroy(&sh->smp);
+    recorder_destroy(&sh->rec);
+    goto err;
+  }
+  if (stage_init(sh, so->enqstage) != 0) {
+    delivery_destroy(&sh->dlv);
+    pthread_mutex_destroy(&sh->hlock);
+    shuffle_flush_discard(sh);
+    shuffle_epoch_discard(sh);
+    sampler_destroy(&sh->smp);
+    recorder_destroy(&sh->rec);
+    relay_destroy(sh);
     goto err;
   }
 
-  /* now start our three worker threads */
+  /* now start our worker threads */
   if (start_threads(sh) != 0) {
-    pthread_mutex_destroy(&sh->deliverlock);
-    pthread_cond_destroy(&sh->delivercv);
+    delivery_destroy(&sh->dlv);
+    pthread_mutex_destroy(&sh->hlock);
     shuffle_flush_discard(sh);
+    shuffle_epoch_discard(sh);
+    sampler_destroy(&sh->smp);
+    recorder_destroy(&sh->rec);
+    relay_destroy(sh);
+    stage_destroy(sh);
     goto err;
   }
 
   /* register data to enable service */
-  if (HG_Register_data(sh->hgp_local.mcls, sh->hgp_local.rpcid,
-                       &sh->hgp_local, NULL) != HG_SUCCESS ||
-      HG_Register_data(sh->hgp_remote.mcls, sh->hgp_remote.rpcid,
-                       &sh->hgp_remote, NULL) != HG_SUCCESS) {
+  rv = HG_SUCCESS;
+  for (lcv = 1 ; !rt->memdst && lcv < sh->nrails && rv == HG_SUCCESS ; lcv++) {
+    rv = HG_Register_data(sh->hgp_rails[lcv - 1].mcls,
+                          sh->hgp_rails[lcv - 1].rpcid,
+                          &sh->hgp_rails[lcv - 1], NULL);
+  }
+  if (!rt->memdst &&
+      (rv != HG_SUCCESS ||
+       HG_Register_data(sh->hgp_local.mcls, sh->hgp_local.rpcid,
+                        &sh->hgp_local, NULL) != HG_SUCCESS ||
+       HG_Register_data(sh->hgp_remote.mcls, sh->hgp_remote.rpcid,
+                        &sh->hgp_remote, NULL) != HG_SUCCESS)) {
 
     /*
      * HG_Register_data() unlikely to fail, since we have already
@@ -1093,10 +2188,20 @@ shuffle_t shuffle_init(nexus_ctx_t nxp, char *funname,
 
 err:
   mlog(SHUF_D1, "shuffle_init: FAILED!!!");
+  for (lcv = 1 ; lcv < nrailok ; lcv++)
+    rail_destroy(&sh->hgp_rails[lcv - 1]);
   shuffle_outset_discard(&sh->local_orq);     /* ensures maps are empty */
   shuffle_outset_discard(&sh->local_rlq);
   shuffle_outset_discard(&sh->remoteq);
+  direct_destroy(&sh->dir);
   if (sh->seqsrc) acnt32_free(&sh->seqsrc);
+  if (sh->nhandlers) acnt32_free(&sh->nhandlers);
+  if (sh->dflush_count) acnt32_free(&sh->dflush_count);
+  if (sh->stats) acnt64_free(&sh->stats);
+  if (sh->dwaitlat) shuf_hist_free(&sh->dwaitlat);
+  if (sh->dcblat) shuf_hist_free(&sh->dcblat);
+  if (sh->e2elat) shuf_hist_free(&sh->e2elat);
+  if (sh->crheld) free(sh->crheld);
   if (sh->funname) free(sh->funname);
   delete sh;
   shuffle_closelog();
@@ -1110,17 +2215,50 @@ err:
  * @return 0 on success, -1 on error
  */
 static int start_threads(struct shuffle *sh) {
-  int rv;
+  struct hgprogress *hgp;
+  int rv, lcv;
   mlog(SHUF_CALL, "start_threads called");
 
   /* start delivery thread */
-  rv = pthread_create(&sh->dtask, NULL, delivery_main, (void *)sh);
+  rv = pthread_create(&sh->dlv.dtask, NULL, delivery_main, (void *)&sh->dlv);
   if (rv != 0) {
     notify(SHUF_CRIT, "shuffle:start_threads: delivery_main failed");
     stop_threads(sh);
     return(-1);
   }
-  sh->drunning = 1;
+  sh->dlv.drunning = 1;
+
+  /* start relay workers before anything can hand them a batch */
+  for (lcv = 0 ; lcv < sh->nrelay ; lcv++) {
+    if (pthread_create(&sh->relayw[lcv].rwtask, NULL, relay_main,
+                       (void *)&sh->relayw[lcv]) != 0) {
+      notify(SHUF_CRIT, "shuffle:start_threads: relay_main failed");
+      stop_threads(sh);
+      return(-1);
+    }
+    sh->relayw[lcv].rwrunning = 1;
+  }
+
+  /* in-memory transport: start memx threads instead of mercury */
+  if (sh->hgp_local.memx) {
+    if (pthread_create(&sh->hgp_local.mqtask, NULL, memx_main,
+                       (void *)&sh->hgp_local) != 0) {
+      notify(SHUF_CRIT, "shuffle:start_threads: local memx_main failed");
+      stop_threads(sh);
+      return(-1);
+    }
+    sh->hgp_local.nrunning = 1;
+    for (lcv = 0 ; lcv < sh->nrails ; lcv++) {
+      hgp = shuffle_rail(sh, lcv);
+      if (pthread_create(&hgp->mqtask, NULL, memx_main, (void *)hgp) != 0) {
+        notify(SHUF_CRIT, "shuffle:start_threads: remote memx_main failed");
+        stop_threads(sh);
+        return(-1);
+      }
+      hgp->nrunning = 1;
+    }
+    goto sampler;
+  }
 
   /* start local na+sm processing */
   if (mercury_progressor_needed(sh->hgp_local.mphand) != HG_SUCCESS) {
@@ -1131,13 +2269,28 @@ static int start_threads(struct shuffle *sh) {
   }
   sh->hgp_local.nrunning = 1;
 
-  /* start remote network processing */
-  if (mercury_progressor_needed(sh->hgp_remote.mphand) != HG_SUCCESS) {
-     notify(SHUF_CRIT, "shuffle:start_threads: net main needed failed");
-     stop_threads(sh);
-     return(-1);
+  /* start remote network processing (on every rail) */
+  for (lcv = 0 ; lcv < sh->nrails ; lcv++) {
+    hgp = shuffle_rail(sh, lcv);
+    if (mercury_progressor_needed(hgp->mphand) != HG_SUCCESS) {
+       notify(SHUF_CRIT, "shuffle:start_threads: net main needed failed");
+       stop_threads(sh);
+       return(-1);
+    }
+    hgp->nrunning = 1;
+  }
+
+sampler:
+  /* start the sampler (if enabled) */
+  if (sh->smp.period_ms) {
+    rv = pthread_create(&sh->smp.stask, NULL, sampler_main, (void *)sh);
+    if (rv != 0) {
+      notify(SHUF_CRIT, "shuffle:start_threads: sampler_main failed");
+      stop_threads(sh);
+      return(-1);
+    }
+    sh->smp.srunning = 1;
   }
-  sh->hgp_remote.nrunning = 1;
 
   mlog(SHUF_CALL, "start_threads SUCCESS!");
   return(0);
@@ -1150,17 +2303,43 @@ static int start_threads(struct shuffle *sh) {
  * @param sh shuffle
  */
 static void stop_threads(struct shuffle *sh) {
-  int stranded;
+  struct delivery *dlvs[SHUFFLE_MAXHANDLERS+1];
+  struct hgprogress *hgp;
+  char railname[32];
+  int stranded, ndlv, lcv;
   mlog(SHUF_CALL, "stop_threads");
 
-  /* stop network */
-  if (sh->hgp_remote.nrunning) {
-    mlog(SHUF_D1, "idle remote");
-    sh->hgp_remote.nshutdown = 1;
-    mercury_progressor_idle(sh->hgp_remote.mphand);
-    mprogstats_print(sh->hgp_remote.mphand, "remote", -1);
-    sh->hgp_remote.nrunning = 0;
-    sh->hgp_remote.nshutdown = 0;
+  /* stop sampler first, so its last row shows the state at shutdown */
+  sampler_stop(&sh->smp);
+
+  /*
+   * drain relay workers while the network can still send what they
+   * route.  batches that arrive after this are run inline.
+   */
+  for (lcv = 0 ; lcv < sh->nrelay ; lcv++)
+    relay_stop(&sh->relayw[lcv]);
+
+  /* stop in-memory transport threads (drain their queues first) */
+  if (sh->hgp_remote.memx) {
+    for (lcv = 0 ; lcv < sh->nrails ; lcv++) {
+      rail_name(lcv, railname, sizeof(railname));
+      memx_stop(shuffle_rail(sh, lcv), railname);
+    }
+    memx_stop(&sh->hgp_local, "local");
+  }
+
+  /* stop network (every rail) */
+  for (lcv = 0 ; lcv < sh->nrails ; lcv++) {
+    hgp = shuffle_rail(sh, lcv);
+    if (!hgp->nrunning)
+      continue;
+    rail_name(lcv, railname, sizeof(railname));
+    mlog(SHUF_D1, "idle %s", railname);
+    hgp->nshutdown = 1;
+    mercury_progressor_idle(hgp->mphand);
+    mprogstats_print(hgp->mphand, railname, -1);
+    hgp->nrunning = 0;
+    hgp->nshutdown = 0;
   }
 
   /* stop na+sm */
@@ -1173,23 +2352,40 @@ static void stop_threads(struct shuffle *sh) {
     sh->hgp_local.nshutdown = 0;
   }
 
-  /* stop delivery */
-  if (sh->drunning) {
-    mlog(SHUF_D1, "join delivery");
-    pthread_mutex_lock(&sh->deliverlock);
-    sh->dshutdown = 1;
-    pthread_cond_broadcast(&sh->delivercv);
-    pthread_mutex_unlock(&sh->deliverlock);
-    pthread_join(sh->dtask, NULL);
-    sh->dshutdown = 0;
+  /* stop delivery (default and per-handler threads) */
+  ndlv = shuffle_deliveries(sh, dlvs);
+  for (lcv = 0 ; lcv < ndlv ; lcv++) {
+    delivery_stop(dlvs[lcv]);
   }
 
   /* look for stranded requests and warn about them */
-  stranded = purge_reqs(sh);
+  stranded = purge_reqs(sh) + stage_purge(sh);
   if (stranded > 0) {
     notify(SHUF_CRIT, "shuffle stop_threads: stranded %d reqs", stranded);
-    shufadd(&sh->cntstranded, stranded);
+    acnt64_add(sh->stats, ST_STRANDED, stranded);
+  }
+}
+
+/*
+ * memx_stop: stop a memx thread.  it processes whatever is still on
+ * its queue before exiting.  after this, new sends to us fail and
+ * replies to us are dropped.
+ *
+ * @param hgp the hgprogress to stop
+ * @param tag tag for log msg
+ */
+static void memx_stop(struct hgprogress *hgp, const char *tag) {
+  pthread_mutex_lock(&hgp->mqlock);
+  hgp->mqstop = 1;
+  pthread_cond_signal(&hgp->mqcv);
+  pthread_mutex_unlock(&hgp->mqlock);
+  if (hgp->nrunning) {
+    mlog(SHUF_D1, "stop memx %s", tag);
+    pthread_join(hgp->mqtask, NULL);
+    hgp->nrunning = 0;
   }
+  mlog(SHUF_INFO, "memx %s: processed %" PRIu64 " memrpcs", tag,
+       hgp->mqnproc);
 }
 
 /*
@@ -1202,36 +2398,61 @@ static void stop_threads(struct shuffle *sh) {
  * @return number of items that got purged
  */
 static int purge_reqs(struct shuffle *sh) {
+  int rv = 0;
+  struct delivery *dlvs[SHUFFLE_MAXHANDLERS+1];
+  int ndlv, lcv;
+  mlog(SHUF_CALL, "purge_reqs");
+
+  ndlv = shuffle_deliveries(sh, dlvs);
+  for (lcv = 0 ; lcv < ndlv ; lcv++) {
+    if (dlvs[lcv]->drunning) break;
+  }
+  if (lcv < ndlv || sh->hgp_local.nrunning || sh->hgp_remote.nrunning) {
+    notify(SHUF_CRIT, "ERROR!  purge_reqs called on active system?!!?");
+    abort();   /* should never happen */
+  }
+
+  /* clear delivery queues */
+  for (lcv = 0 ; lcv < ndlv ; lcv++) {
+    rv += purge_reqs_delivery(sh, dlvs[lcv]);
+  }
+
+  /* clear local and remote queeus */
+  rv += purge_reqs_outset(sh, &sh->local_orq);
+  rv += purge_reqs_outset(sh, &sh->local_rlq);
+  rv += purge_reqs_outset(sh, &sh->remoteq);
+
+  mlog(SHUF_D1, "purg_reqs => result = %d", rv);
+  return(rv);
+}
+
+/*
+ * purge_reqs_delivery: helper function purge_reqs() that clears a
+ * stopped delivery queue.
+ *
+ * @param sh the shuffle dlv belongs to
+ * @param dlv delivery to purge
+ * @return the number of stranded reqs in the delivery
+ */
+static int purge_reqs_delivery(struct shuffle *sh, struct delivery *dlv) {
   int rv = 0;
   struct request *req;
-  mlog(SHUF_CALL, "purge_reqs");
-
-  if (sh->drunning || sh->hgp_local.nrunning || sh->hgp_remote.nrunning) {
-    notify(SHUF_CRIT, "ERROR!  purge_reqs called on active system?!!?");
-    abort();   /* should never happen */
-  }
 
-  /* clear delivery queues */
-  while (!sh->dwaitq.empty()) {
-    req = sh->dwaitq.front();
-    sh->dwaitq.pop_front();
-    parent_dref_stopwait(sh, req->owner, 1);
+  while (!dlv->dwaitq.empty()) {
+    req = dlv->dwaitq.front();
+    dlv->dwaitq.pop_front();
+    if (req->owner)                 /* credited reqs have no owner */
+      parent_dref_stopwait(sh, req->owner, 1);
     free(req);
     rv++;
   }
-  while (!sh->deliverq.empty()) {
-    req = sh->deliverq.front();
-    sh->deliverq.pop_front();
+  while (!dlv->deliverq.empty()) {
+    req = dlv->deliverq.front();
+    dlv->deliverq.pop_front();
     free(req);
     rv++;
   }
 
-  /* clear local and remote queeus */
-  rv += purge_reqs_outset(sh, &sh->local_orq);
-  rv += purge_reqs_outset(sh, &sh->local_rlq);
-  rv += purge_reqs_outset(sh, &sh->remoteq);
-
-  mlog(SHUF_D1, "purg_reqs => result = %d", rv);
   return(rv);
 }
 
@@ -1250,25 +2471,32 @@ static int purge_reqs_outset(struct shuffle *sh, struct outset *oset) {
   struct outqueue *oq;
   struct request *req, *nxt;
   struct output *oput;
+  struct oqflusher *of;
   mlog(UTIL_CALL, "purge_reqs_outset type=%s", outset_typstr(oset->settype));
 
   /* need to purge each output queue in the set */
   for (it = oset->oqs.begin() ; it != oset->oqs.end() ; it++) {
     oq = it->second;
 
-   /* stop flushing */
-   if (oq->oqflushing) {
-     oq->oqflushing = 0;
-     oq->oqflush_waitcounter = 0;
-     oq->oqflush_output = NULL;
-     acnt32_decr(oset->oqflush_counter);
+   /* stop flushing, waking any shuffle_flush_dst() callers */
+   pthread_mutex_lock(&oq->oqlock);
+   while ((of = XTAILQ_FIRST(&oq->oqflushers)) != NULL) {
+     XTAILQ_REMOVE(&oq->oqflushers, of, ofq);
+     of->ofstate = OQF_CANCEL;
+     if (of->ofcv)
+       pthread_cond_broadcast(of->ofcv);
+     else
+       acnt32_decr(oset->oqflush_counter);
    }
+   pthread_mutex_unlock(&oq->oqlock);
 
    /* zap the wait queue */
     while (!oq->oqwaitq.empty()) {
       req = oq->oqwaitq.front();
       oq->oqwaitq.pop_front();
-      parent_dref_stopwait(sh, req->owner, 1);
+      oq->waitbytes -= req->datalen;
+      if (req->owner)               /* credited reqs have no owner */
+        parent_dref_stopwait(sh, req->owner, 1);
       free(req);
       rv++;
     }
@@ -1285,14 +2513,14 @@ static int purge_reqs_outset(struct shuffle *sh, struct outset *oset) {
       /*
        * XXX: what to do with outhand.  should we cancel it?  threads
        * are not running.   seems like we hold a ref we should drop
-       * at any rate.
+       * at any rate.  (an in-flight memrpc is owned by its dst now.)
        */
-      HG_Destroy(oput->outhand);
+      if (oput->outhand)
+        HG_Destroy(oput->outhand);
       free(oput);
     }
   }
 
-  oset->osetflushing = 0;
   mlog(UTIL_D1, "purge_reqs_outset type=%s =RET=> %d",
        outset_typstr(oset->settype), rv);
 
@@ -1305,25 +2533,30 @@ static int purge_reqs_outset(struct shuffle *sh, struct outset *oset) {
  * the delivery callback).   we need this thread because the final
  * delivery can block (e.g. for flow control) and we don't want to
  * block our network threads because of it (since it would stop
- * traffic that we are a REP for).
+ * traffic that we are a REP for).  each delivery queue has its own
+ * thread (the default one, plus one per SHUFFLE_HANDLER_THREAD handler).
  *
- * @param arg void* pointer to our shuffle
+ * @param arg void* pointer to our delivery
  */
 static void *delivery_main(void *arg) {
-  struct shuffle *sh = (struct shuffle *)arg;
+  struct delivery *dlv = (struct delivery *)arg;
+  struct shuffle *sh = dlv->dshuf;
   struct request *req;
   struct req_parent *parent;
+  struct dhandler *h;
+  uint32_t utype;
+  uint64_t t0, wnow;
   struct museprobe delivery_use;
-  mlog(DLIV_CALL, "delivery_main running");
+  mlog(DLIV_CALL, "delivery_main %d running", dlv->didx);
 
   museprobe_start(&delivery_use, MUSEPROBE_THREAD);
 
-  pthread_mutex_lock(&sh->deliverlock);
-  while (sh->dshutdown == 0) {
-    if (sh->deliverq.empty()) {
+  pthread_mutex_lock(&dlv->deliverlock);
+  while (dlv->dshutdown == 0) {
+    if (dlv->deliverq.empty()) {
       mlog(DLIV_D1, "queue empty, blocked");
-      shufcount(&sh->cntdblock);
-      (void)pthread_cond_wait(&sh->delivercv, &sh->deliverlock);
+      shufcount(&dlv->cntdblock);
+      (void)pthread_cond_wait(&dlv->delivercv, &dlv->deliverlock);
       mlog(DLIV_D1, "woke up after blocking");
       continue;
     }
@@ -1335,46 +2568,79 @@ static void *delivery_main(void *arg) {
      * it is safe to leave req at the front while we are running the
      * callback...
      */
-    req = sh->deliverq.front();
+    req = dlv->deliverq.front();
     if (!req) {
       notify(DLIV_CRIT, "notified with empty deliverq?  not possible");
       abort();   /* shouldn't ever happen */
     }
 
-    shufcount(&sh->cntdeliver);
-    pthread_mutex_unlock(&sh->deliverlock);
+    pthread_mutex_unlock(&dlv->deliverlock);
+
+    /* flush markers come here so that we can ack them (may block) */
+    if (req->hflags & REQ_HF_CTL) {
+      ctl_flushack(sh, req);
+      goto delivered;
+    }
+
+    shufcount(&dlv->cntdeliver);
+    acnt64_incr(sh->stats, ST_DELIVERS);
+    acnt64_add(sh->stats, ST_DELIVERBYTES, req->datalen);
     mlog(DLIV_D1, "deliver %d->%d t=%d, dl=%d req=%p",
          req->src, req->dst, req->type, req->datalen, req);
     /* note: may block in callback */
-    sh->delivercb(req->src, req->dst, req->type, req->data, req->datalen);
+    h = shuffle_handler_lookup(sh, req->type);
+    utype = req->type;
+    t0 = shuf_now_us();
+    SHUF_TRACE(SHUF_TR_DELIVER_B, sh->grank, req->src, utype, req->datalen);
+    if (h) {
+      h->fn(h->arg, req->src, req->dst, utype, req->data, req->datalen);
+    } else if (sh->delivercb) {
+      sh->delivercb(req->src, req->dst, utype, req->data, req->datalen);
+    } else {
+      mlog(DLIV_WARN, "deliver %d->%d t=%d: no callback, dropped",
+           req->src, req->dst, req->type);
+      shufcount(&dlv->cntdnocb);
+      acnt64_incr(sh->stats, ST_DNOCB);
+    }
+    shuf_hist_record(sh->dcblat, shuf_now_us() - t0);
+    SHUF_TRACE(SHUF_TR_DELIVER_E, sh->grank, req->src, utype, req->datalen);
+    if (req->hflags & REQ_HF_TSTAMP) {
+      wnow = shuf_wall_us();           /* clamp if clocks are skewed */
+      shuf_hist_record(sh->e2elat,
+                       (wnow > req->tstamp) ? wnow - req->tstamp : 0);
+    }
+    epoch_recv(sh, req, 1);
     mlog(DLIV_D1, "deliver %p complete", req);
-    pthread_mutex_lock(&sh->deliverlock);
+delivered:
+    pthread_mutex_lock(&dlv->deliverlock);
 
     /* see if anyone is waiting for us to flush */
-    if (sh->dflush_counter > 0) {
-      sh->dflush_counter--;
-      mlog(DLIV_D1, "drop dflush_counter to %d", sh->dflush_counter);
-      if (sh->dflush_counter == 0) {   /* droped to 0, wake up flusher */
-        if (sh->curflush)
-          pthread_cond_signal(&sh->curflush->flush_waitcv);
+    if (dlv->dflush_counter > 0) {
+      dlv->dflush_counter--;
+      mlog(DLIV_D1, "drop dflush_counter to %d", dlv->dflush_counter);
+      if (dlv->dflush_counter == 0) {   /* droped to 0, tell flusher */
+        pthread_mutex_unlock(&dlv->deliverlock);  /* lock order */
+        done_dlv_flush(sh);
+        pthread_mutex_lock(&dlv->deliverlock);
       }
     }
 
     /* dispose of the req we just delivered */
-    sh->deliverq.pop_front();
+    dlv->deliverq.pop_front();
     if (req->owner)        /* should never happen */
       notify(DLIV_CRIT, "delivery_main: freeing req with owner!?!");
     free(req);
     req = NULL;
 
     /* just made space in deliveryq, see if we can advance one from waitq */
-    if (sh->dwaitq.empty())
+    if (dlv->dwaitq.empty())
       continue;                 /* waitq empty, loop back up */
 
     /* move it to deliveryq */
-    req = sh->dwaitq.front();
-    sh->dwaitq.pop_front();
-    sh->deliverq.push_back(req); /* deliverq should be full again */
+    req = dlv->dwaitq.front();
+    dlv->dwaitq.pop_front();
+    shuf_hist_record(sh->dwaitlat, shuf_now_us() - req->qtime);
+    dlv->deliverq.push_back(req); /* deliverq should be full again */
     mlog(DLIV_D1, "promoted %p from dwaitq", req);
 
     /*
@@ -1386,23 +2652,27 @@ static void *delivery_main(void *arg) {
      *
      * XXX: be safe and drop deliverlock when calling parent_dref_stopwait().
      * normally parent_dref_stopwait() will just drop the reference count and
-     * if it drops to zero it will call HG_Reply (if parent->input !NULL)
-     * pthread_cond_signal (if parent->input == NULL).  the main worry
+     * if it drops to zero it will call HG_Reply (if parent_isrpc())
+     * pthread_cond_signal (if !parent_isrpc()).  the main worry
      * is HG_Reply() since that code is external to us and we can't
      * know what it (or any mercury NA layer under it) will do.
      */
     parent = req->owner;
     req->owner = NULL;
-    pthread_mutex_unlock(&sh->deliverlock);
+    if (parent == NULL) {         /* credited req, just return the credit */
+      credit_release(sh, req);
+      continue;
+    }
+    pthread_mutex_unlock(&dlv->deliverlock);
     parent_dref_stopwait(sh, parent, 0);
-    pthread_mutex_lock(&sh->deliverlock);
+    pthread_mutex_lock(&dlv->deliverlock);
   }
-  sh->drunning = 0;
-  pthread_mutex_unlock(&sh->deliverlock);
+  dlv->drunning = 0;
+  pthread_mutex_unlock(&dlv->deliverlock);
   museprobe_end(&delivery_use);
 
-  mlog(DLIV_CALL, "delivery_main exiting");
-  museprobe_print(&delivery_use, "delivery", -1);
+  mlog(DLIV_CALL, "delivery_main %d exiting", dlv->didx);
+  museprobe_print(&delivery_use, "delivery", (dlv->didx) ? dlv->didx : -1);
   return(NULL);
 }
 
@@ -1426,7 +2696,7 @@ static void parent_dref_stopwait(struct shuffle *sh, struct req_parent *parent,
 
   /* atomically drop the reference counter and get new value */
   nw = acnt32_decr(parent->nrefs);
-  if (parent->input)
+  if (parent_isrpc(parent))
     mlog(SHUF_CALL, "parent_dref_stopwait %p R%d-%d new-nref=%d", parent,
          parent->rpcin_forwrank, parent->rpcin_seq, nw);
   else
@@ -1458,7 +2728,7 @@ static void parent_stopwait(struct shuffle *sh, struct req_parent *parent,
   hg_return_t rv;
 
   mlog(SHUF_CALL, "parent_stopwait: %p input?=%d abort=%d", parent,
-       (parent && parent->input != NULL), abort);
+       (parent && parent_isrpc(parent)), abort);
 
   if (parent == NULL) {
     /* this should never happen */
@@ -1486,7 +2756,7 @@ static void parent_stopwait(struct shuffle *sh, struct req_parent *parent,
    * happen when sending with SRC == DST and the app is flow controlled).
    * the application will free the req_parent.
    */
-  if (parent->input == NULL) {
+  if (!parent_isrpc(parent)) {
     pthread_mutex_lock(&parent->pcvlock);
     if (parent->need_wakeup) {    /* prob. always true, check to be safe */
       parent->need_wakeup = 0;
@@ -1506,19 +2776,26 @@ static void parent_stopwait(struct shuffle *sh, struct req_parent *parent,
   reply.oseq = parent->rpcin_seq;
   reply.respondrank = sh->grank;
   reply.ret = parent->ret;
+  reply.credit = credit_avail(sh, parent->rpcin_forwrank);
 
   /* only respond if we are not aborting */
   if (!abort) {
     mlog(SHUF_D1, "parent_stopwait: RPC respond %d %p R%d-%d",
          reply.ret, parent, parent->rpcin_forwrank, parent->rpcin_seq);
-    rv = HG_Respond(parent->input, shuffle_respond_cb, parent, &reply);
+    if (parent->input.mrpc) {
+      rpc_reply(&parent->input, &reply);  /* can't fail, now owns mrpc */
+      parent->input.mrpc = NULL;
+      rv = HG_CANCELED;                   /* to do cleanup below now */
+    } else {
+      rv = HG_Respond(parent->input.hand, shuffle_respond_cb, parent, &reply);
+    }
   } else {
     rv = HG_CANCELED;
   }
 
   if (rv != HG_SUCCESS) {
     struct hg_cb_info cbi;   /* fake, for err/abort! */
-    if (!abort) {
+    if (!abort && parent->input.hand) {
       notify(SHUF_WARN, "parent_stopwait: %p reply failed %d!", parent, rv);
     }
     /* note: we know shuffle_respond_cb() only looks at cbi.arg */
@@ -1546,7 +2823,10 @@ static hg_return_t shuffle_respond_cb(const struct hg_cb_info *cbi) {
    * we could do it here...
    */
 
-  HG_Destroy(parent->input);
+  if (parent->input.hand)
+    HG_Destroy(parent->input.hand);
+  if (parent->input.mrpc)         /* aborted, drop it without a reply */
+    free(parent->input.mrpc);
   acnt32_free(&parent->nrefs);
   free(parent);
 
@@ -1569,14 +2849,14 @@ static hg_return_t shuffle_respond_cb(const struct hg_cb_info *cbi) {
  * @param sh the shuffle we are working with
  * @param parentp ptr to ptr to the req_parent to init
  * @param req the request that we are waiting on
- * @param input inbound RPC handle (NULL if we are an app shuffle_enqueue())
+ * @param input inbound RPC source (NULL if we are an app shuffle_enqueue())
  * @param rpcin inbound rpcin_t struct (only used if input != NULL)
  * @return status (normally success)
  */
 static hg_return_t req_parent_init(struct shuffle *sh,
                                    struct req_parent **parentp,
-                                   struct request *req, hg_handle_t input,
-                                   rpcin_t *rpcin) {
+                                   struct request *req,
+                                   struct rpcsrc *input, rpcin_t *rpcin) {
   struct req_parent *parent;
 
   parent = *parentp;
@@ -1657,7 +2937,12 @@ static hg_return_t req_parent_init(struct shuffle *sh,
   } else {
     parent->rpcin_seq = parent->rpcin_forwrank = -1;  /* inited, but !used */
   }
-  parent->input = input;
+  if (input) {
+    parent->input = *input;
+  } else {
+    parent->input.hand = NULL;
+    parent->input.mrpc = NULL;
+  }
   parent->timewstart = shuftime() - sh->boottime;
   parent->need_wakeup = 0;
   parent->onfq = 0;
@@ -1712,6 +2997,91 @@ void drop_reqs(struct request **reqp, struct request_queue *reqq,
 
 }
 
+/*
+ * credit_check: see if an inbound batch from "rank" fits in the sender's
+ * credit window (so its reqs can wait without holding the RPC reply).
+ * if it does, we reserve all nbytes in one atomic step so that
+ * concurrent handlers of the same sender (e.g. relay workers) cannot
+ * both pass the check.  the caller must later give back the reserved
+ * bytes of any reqs that did not end up on a waitq (credit_unreserve).
+ *
+ * @param sh our shuffle
+ * @param rank the sender's rank (rpcin forwardrank)
+ * @param nbytes total size of the reqs in the batch
+ * @return 1 if the batch fits (bytes reserved), 0 if not (or credits off)
+ */
+static int credit_check(struct shuffle *sh, int rank, int nbytes) {
+  int32_t held;
+
+  if (sh->creditwin < 1 || rank < 0 || rank >= sh->crsize)
+    return(0);
+  held = __atomic_add_fetch(&sh->crheld[rank], nbytes, __ATOMIC_RELAXED);
+  if (held <= sh->creditwin)
+    return(1);
+  __atomic_sub_fetch(&sh->crheld[rank], nbytes, __ATOMIC_RELAXED);
+  acnt64_incr(sh->stats, ST_CREDFALLBACK);
+  return(0);
+}
+
+/*
+ * credit_charge: a credited req is going on a waitq.  its bytes were
+ * reserved by credit_check, so we just move them from the batch's
+ * unclaimed reservation to the waitq (the waitq now owns them).
+ *
+ * @param rpcin the inbound batch the req came from
+ * @param req the request going on a waitq (crrank >= 0)
+ */
+static void credit_charge(rpcin_t *rpcin, struct request *req) {
+  rpcin->crleft -= req->datalen;
+}
+
+/*
+ * credit_unreserve: return reserved bytes that never went on a waitq
+ * (reqs of a credited batch that were sent, delivered, or dropped).
+ *
+ * @param sh our shuffle
+ * @param rank the sender's rank
+ * @param nbytes bytes to return
+ */
+static void credit_unreserve(struct shuffle *sh, int rank, int nbytes) {
+  if (nbytes > 0)
+    __atomic_sub_fetch(&sh->crheld[rank], nbytes, __ATOMIC_RELAXED);
+}
+
+/*
+ * credit_release: a credited req has left its waitq, return its bytes
+ * to the sender's window.
+ *
+ * @param sh our shuffle
+ * @param req the request that left the waitq
+ */
+static void credit_release(struct shuffle *sh, struct request *req) {
+  if (req->crrank < 0) {
+    /* should never happen */
+    notify(SHUF_CRIT, "credit_release: waitq req w/o owner or credit?!");
+    return;
+  }
+  __atomic_sub_fetch(&sh->crheld[req->crrank], req->datalen,
+                     __ATOMIC_RELAXED);
+  req->crrank = -1;
+}
+
+/*
+ * credit_avail: credit we advertise to "rank" in an RPC reply
+ *
+ * @param sh our shuffle
+ * @param rank the rank we are replying to
+ * @return bytes of credit left (>= 0), or CREDIT_NONE if off
+ */
+static int32_t credit_avail(struct shuffle *sh, int rank) {
+  int32_t rv;
+
+  if (sh->creditwin < 1 || rank < 0 || rank >= sh->crsize)
+    return(CREDIT_NONE);
+  rv = sh->creditwin - __atomic_load_n(&sh->crheld[rank], __ATOMIC_RELAXED);
+  return((rv > 0) ? rv : 0);
+}
+
 /*
  * sender_limit: check to see if we are at the outset's shufsend_rpclimit,
  * and if so block until we are allowed to go!   we add ourselves to the
@@ -1754,7 +3124,7 @@ hg_return_t sender_limit(struct shuffle *sh, struct outset *oset) {
   pthread_mutex_lock(&sw.sw_lock);
   sw.sw_status = SHUFSEND_WAIT;
   XTAILQ_INSERT_TAIL(&oset->shufsendq, &sw, sw_q);
-  shufcount(&oset->os_senderlimit);
+  acnt64_incr(oset->ostats, OST_SENDERLIMIT);
   pthread_mutex_unlock(&oset->os_rpclimitlock);
 
   while (sw.sw_status == SHUFSEND_WAIT) {
@@ -1772,11 +3142,426 @@ hg_return_t sender_limit(struct shuffle *sh, struct outset *oset) {
   return((sw.sw_status == SHUFSEND_OKGO) ? HG_SUCCESS : HG_CANCELED);
 }
 
+/*
+ * stage_init: set up per-thread enqueue staging (see enqstage opt).
+ * must be called after the outsets are init'd (we need noqs).
+ *
+ * @param sh the shuffle
+ * @param stagebytes merge a stageq at this many bytes (<= 0 means off)
+ * @return 0 on success, -1 on error
+ */
+static int stage_init(struct shuffle *sh, int stagebytes) {
+
+  sh->stagebytes = 0;
+  sh->stages = NULL;
+  if (stagebytes <= 0)
+    return(0);
+
+  if (pthread_mutex_init(&sh->stlock, NULL) != 0)
+    goto err;
+  if (pthread_key_create(&sh->stkey, stage_release) != 0) {
+    pthread_mutex_destroy(&sh->stlock);
+    goto err;
+  }
+  sh->stagebytes = stagebytes;
+  mlog(SHUF_INFO, "stage: %d bytes per thread per queue (%d queues)",
+       sh->stagebytes, sh->noqs);
+  return(0);
+
+err:
+  notify(SHUF_CRIT, "shuffle: stage_init failed");
+  return(-1);
+}
+
+/*
+ * stage_get: get the calling thread's stage, allocating one (or
+ * reusing one left behind by an exited thread) on first use.
+ *
+ * @param sh the shuffle
+ * @return the stage or NULL on error
+ */
+static struct enqstage *stage_get(struct shuffle *sh) {
+  struct enqstage *sg;
+  int lcv;
+
+  sg = (struct enqstage *)pthread_getspecific(sh->stkey);
+  if (sg)
+    return(sg);
+
+  pthread_mutex_lock(&sh->stlock);
+  for (sg = sh->stages ; sg != NULL ; sg = sg->sgnext) {
+    if (!sg->sgowned)
+      break;
+  }
+  if (sg == NULL) {
+    sg = (struct enqstage *)malloc(sizeof(*sg));
+    if (sg == NULL)
+      goto done;
+    sg->sgq = (struct stageq *)malloc(sh->noqs * sizeof(*sg->sgq));
+    sg->sgdirty = (int *)malloc(sh->noqs * sizeof(*sg->sgdirty));
+    if (!sg->sgq || !sg->sgdirty ||
+        pthread_mutex_init(&sg->sglock, NULL) != 0) {
+      if (sg->sgq) free(sg->sgq);
+      if (sg->sgdirty) free(sg->sgdirty);
+      free(sg);
+      sg = NULL;
+      goto done;
+    }
+    sg->sgshuf = sh;
+    for (lcv = 0 ; lcv < sh->noqs ; lcv++) {
+      sg->sgq[lcv].sqoq = NULL;
+      XSIMPLEQ_INIT(&sg->sgq[lcv].sqreqs);
+      sg->sgq[lcv].sqbytes = sg->sgq[lcv].sqcnt = 0;
+      sg->sgq[lcv].sqdirty = 0;
+    }
+    sg->sgndirty = 0;
+    sg->sgnext = sh->stages;
+    sh->stages = sg;
+    mlog(CLNT_D1, "stage_get: new stage %p", sg);
+  }
+  sg->sgowned = 1;
+  if (pthread_setspecific(sh->stkey, sg) != 0) {
+    sg->sgowned = 0;
+    sg = NULL;
+  }
+
+done:
+  pthread_mutex_unlock(&sh->stlock);
+  if (sg == NULL)
+    notify(CLNT_WARN, "shuffle: stage_get failed, not staging");
+  return(sg);
+}
+
+/*
+ * stage_merge: merge a stageq into its output queue.  we append
+ * reqs to the loading list under one oqlock until a batch is ready,
+ * send it, and repeat.  if the queue fills up, the rest of the reqs
+ * go on the oqwaitq under a single parent and we block until they
+ * have all been sent (like req_via_mercury() does for one req).
+ * caller holds the stage's sglock.
+ *
+ * @param sh the shuffle
+ * @param sq the stageq to merge (empty on return)
+ * @return status
+ */
+static hg_return_t stage_merge(struct shuffle *sh, struct stageq *sq) {
+  struct outqueue *oq = sq->sqoq;
+  struct outset *oset = oq->myset;
+  struct request_queue tosendq;
+  struct output *oput;
+  struct request *req;
+  struct req_parent parent_store, *parent = &parent_store;
+  int waiting = 0;
+  bool tosend;
+  hg_return_t rv = HG_SUCCESS, rv2;
+
+  if (XSIMPLEQ_EMPTY(&sq->sqreqs))
+    return(HG_SUCCESS);
+  mlog(CLNT_CALL, "stage_merge: rnk=[%d.%d] cnt=%d bytes=%d", oq->grank,
+       oq->subrank, sq->sqcnt, sq->sqbytes);
+  acnt64_incr(sh->stats, ST_STAGEMERGES);
+  acnt64_add(oset->ostats, OST_REQS, sq->sqcnt);
+  acnt64_add(oset->ostats, OST_BYTES, sq->sqbytes);
+  sq->sqbytes = sq->sqcnt = 0;
+
+  /* we may need to block if shufsend_rpclimit is set... */
+  if (oset->shufsend_rpclimit > 0) {
+    rv = sender_limit(sh, oset);    /* this may block! */
+    if (rv != HG_SUCCESS) {
+      drop_reqs(NULL, &sq->sqreqs, "stage_merge: sender_limit");
+      return(rv);
+    }
+  }
+
+  parent->nrefs = NULL;
+  while (!XSIMPLEQ_EMPTY(&sq->sqreqs)) {
+    tosend = false;
+    pthread_mutex_lock(&oq->oqlock);
+    while (!tosend && (req = XSIMPLEQ_FIRST(&sq->sqreqs)) != NULL) {
+      XSIMPLEQ_REMOVE_HEAD(&sq->sqreqs, next);
+      req->next.sqe_next = NULL;
+      shufcount(&oq->cntoqreqs[0]);
+
+      if (!oq_full(oset, oq)) {
+        tosend = append_req_to_locked_outqueue(oset, oq, req,
+                                               &tosendq, &oput, false);
+        continue;
+      }
+
+      /* full: this req and the ones after it wait under our parent */
+      shufcount(&oq->cntoqwaits[0]);
+      acnt64_incr(oset->ostats, OST_WAITS);
+      if (oq->nsending < oq->maxrpc) {
+        shufcount(&oq->cntoqcredwait);
+        acnt64_incr(oset->ostats, OST_CREDWAITS);
+      }
+      req->qtime = shuf_now_us();
+      if (!waiting) {
+        rv = req_parent_init(sh, &parent, req, NULL, NULL);
+        if (rv != HG_SUCCESS) {
+          notify(SHUF_CRIT, "shuffle: stage_merge parent init failed (%d)",
+                 rv);
+          drop_reqs(&req, &sq->sqreqs, "stage_merge");
+          break;
+        }
+        waiting = 1;
+      } else {
+        acnt32_incr(parent->nrefs);
+        req->owner = parent;
+      }
+      oq->oqwaitq.push_back(req);
+      oq->waitbytes += req->datalen;
+      oq_repdepth(oq);
+      shufmax(&oq->cntoqmaxwait, oq->oqwaitq.size());
+    }
+    pthread_mutex_unlock(&oq->oqlock);
+
+    if (tosend) {   /* have a batch ready to send? */
+      rv2 = forward_reqs_now(&tosendq, sh, oset, oq, oput);
+      if (rv2 != HG_SUCCESS && rv == HG_SUCCESS)
+        rv = rv2;
+    }
+  }
+
+  if (waiting)
+    app_parent_wait(sh, parent, "stage_merge");
+
+  return(rv);
+}
+
+/*
+ * stage_req: stage an app req for an output queue in the calling
+ * thread's stage, merging the queue's staged reqs if we have enough.
+ *
+ * @param sh the shuffle
+ * @param sg the calling thread's stage
+ * @param oq the output queue the req is going to
+ * @param req the req (we own it now)
+ * @return status (of the merge, if we did one)
+ */
+static hg_return_t stage_req(struct shuffle *sh, struct enqstage *sg,
+                             struct outqueue *oq, struct request *req) {
+  struct stageq *sq = &sg->sgq[oq->oqidx];
+  hg_return_t rv = HG_SUCCESS;
+
+  pthread_mutex_lock(&sg->sglock);
+  sq->sqoq = oq;
+  XSIMPLEQ_INSERT_TAIL(&sq->sqreqs, req, next);
+  sq->sqbytes += req->datalen;
+  sq->sqcnt++;
+  if (!sq->sqdirty) {
+    sq->sqdirty = 1;
+    sg->sgdirty[sg->sgndirty++] = oq->oqidx;
+  }
+  acnt64_incr(sh->stats, ST_STAGEREQS);
+  if (sq->sqbytes >= sh->stagebytes || sq->sqcnt >= SHUFFLE_STAGEMAXREQS)
+    rv = stage_merge(sh, sq);
+  pthread_mutex_unlock(&sg->sglock);
+
+  return(rv);
+}
+
+/*
+ * stage_drain: merge all the staged reqs in a stage.  caller holds
+ * the stage's sglock.
+ *
+ * @param sh the shuffle
+ * @param sg the stage to drain
+ * @return status
+ */
+static hg_return_t stage_drain(struct shuffle *sh, struct enqstage *sg) {
+  struct stageq *sq;
+  hg_return_t rv = HG_SUCCESS, rv2;
+  int lcv;
+
+  for (lcv = 0 ; lcv < sg->sgndirty ; lcv++) {
+    sq = &sg->sgq[sg->sgdirty[lcv]];
+    rv2 = stage_merge(sh, sq);
+    if (rv2 != HG_SUCCESS && rv == HG_SUCCESS)
+      rv = rv2;
+    sq->sqdirty = 0;
+  }
+  sg->sgndirty = 0;
+
+  return(rv);
+}
+
+/*
+ * stage_drainall: merge the staged reqs of every thread.  called
+ * before we flush output queues, so that the flush covers all msgs
+ * enqueued before it.  new stages may be added while we walk the
+ * list, but they are only ever added to the front of it.
+ *
+ * @param sh the shuffle
+ * @return status
+ */
+static hg_return_t stage_drainall(struct shuffle *sh) {
+  struct enqstage *sg;
+  hg_return_t rv = HG_SUCCESS, rv2;
+
+  if (sh->stagebytes == 0)
+    return(HG_SUCCESS);
+
+  pthread_mutex_lock(&sh->stlock);
+  sg = sh->stages;
+  pthread_mutex_unlock(&sh->stlock);
+
+  for ( ; sg != NULL ; sg = sg->sgnext) {
+    pthread_mutex_lock(&sg->sglock);
+    rv2 = stage_drain(sh, sg);
+    pthread_mutex_unlock(&sg->sglock);
+    if (rv2 != HG_SUCCESS && rv == HG_SUCCESS)
+      rv = rv2;
+  }
+
+  return(rv);
+}
+
+/*
+ * stage_drainself: merge the calling thread's staged reqs (if any),
+ * e.g. so that a broadcast does not pass our earlier msgs.
+ *
+ * @param sh the shuffle
+ * @return status
+ */
+static hg_return_t stage_drainself(struct shuffle *sh) {
+  struct enqstage *sg;
+  hg_return_t rv;
+
+  if (sh->stagebytes == 0 ||
+      (sg = (struct enqstage *)pthread_getspecific(sh->stkey)) == NULL)
+    return(HG_SUCCESS);
+
+  pthread_mutex_lock(&sg->sglock);
+  rv = stage_drain(sh, sg);
+  pthread_mutex_unlock(&sg->sglock);
+
+  return(rv);
+}
+
+/*
+ * stage_release: pthread key destructor for a thread's stage.  we
+ * drain it and leave it for reuse by another thread.  if we are
+ * shutting down we can't send, so we leave the reqs for stage_purge().
+ *
+ * @param arg the stage
+ */
+static void stage_release(void *arg) {
+  struct enqstage *sg = (struct enqstage *)arg;
+  struct shuffle *sh = sg->sgshuf;
+  hg_return_t rv = HG_SUCCESS;
+
+  pthread_mutex_lock(&sg->sglock);
+  if (!sh->disablesend)
+    rv = stage_drain(sh, sg);
+  pthread_mutex_unlock(&sg->sglock);
+  if (rv != HG_SUCCESS)
+    notify(CLNT_WARN, "shuffle: stage_release: drain failed (%d)", rv);
+
+  pthread_mutex_lock(&sh->stlock);
+  sg->sgowned = 0;
+  pthread_mutex_unlock(&sh->stlock);
+}
+
+/*
+ * stage_purge: free any reqs still staged (threads are stopped,
+ * so they can no longer be sent).
+ *
+ * @param sh the shuffle
+ * @return the number of reqs we freed
+ */
+static int stage_purge(struct shuffle *sh) {
+  struct enqstage *sg;
+  struct stageq *sq;
+  int rv = 0, lcv;
+
+  if (sh->stagebytes == 0)
+    return(0);
+
+  pthread_mutex_lock(&sh->stlock);
+  for (sg = sh->stages ; sg != NULL ; sg = sg->sgnext) {
+    pthread_mutex_lock(&sg->sglock);
+    for (lcv = 0 ; lcv < sg->sgndirty ; lcv++) {
+      sq = &sg->sgq[sg->sgdirty[lcv]];
+      rv += sq->sqcnt;
+      drop_reqs(NULL, &sq->sqreqs, NULL);
+      sq->sqbytes = sq->sqcnt = sq->sqdirty = 0;
+    }
+    sg->sgndirty = 0;
+    pthread_mutex_unlock(&sg->sglock);
+  }
+  pthread_mutex_unlock(&sh->stlock);
+
+  if (rv)
+    mlog(SHUF_WARN, "stage_purge: dropped %d staged reqs", rv);
+  return(rv);
+}
+
+/*
+ * stage_destroy: free all stages (after stage_purge).  threads
+ * that still have a stage will no longer call stage_release().
+ *
+ * @param sh the shuffle
+ */
+static void stage_destroy(struct shuffle *sh) {
+  struct enqstage *sg;
+
+  if (sh->stagebytes == 0)
+    return;
+
+  pthread_key_delete(sh->stkey);
+  while ((sg = sh->stages) != NULL) {
+    sh->stages = sg->sgnext;
+    pthread_mutex_destroy(&sg->sglock);
+    free(sg->sgq);
+    free(sg->sgdirty);
+    free(sg);
+  }
+  pthread_mutex_destroy(&sh->stlock);
+  sh->stagebytes = 0;
+}
+
 /*
  * shuffle_enqueue: start the sending of a message via the shuffle.
+ * we tag the message with the current epoch and count it for
+ * shuffle_epoch_end().
  */
 hg_return_t shuffle_enqueue(shuffle_t sh, int dst, uint32_t type,
                             void *d, uint32_t datalen) {
+  hg_return_t rv;
+  int e;
+
+  if (sh->rec.rfp)
+    recorder_log(&sh->rec, dst, type, datalen);
+  e = acnt32_get(sh->epoch);
+  rv = shuffle_enqueue_raw(sh, dst, type, REQ_HF_EPOCH, e, d, datalen);
+  if (rv == HG_SUCCESS) {
+    acnt32_incr(sh->esent[e & 1]);
+    acnt64_incr(sh->stats, ST_ENQUEUES);
+    acnt64_add(sh->stats, ST_ENQBYTES, datalen);
+  }
+
+  return(rv);
+}
+
+/*
+ * shuffle_enqueue_raw: send a message with the given type and header
+ * flags (no epoch accounting).  this is shuffle_enqueue() for
+ * internal use (e.g. broadcast copies and control messages).
+ *
+ * @param sh the shuffle to send with
+ * @param dst target to send to
+ * @param type message type
+ * @param hflags REQ_HF_* header flags (REQ_HF_TSTAMP is added here)
+ * @param epoch epoch number (with REQ_HF_EPOCH), or for a control msg
+ *        the index of the SRCREP to route through (-1 for the usual pick)
+ * @param d data buffer
+ * @param datalen length of data
+ * @return status (success if we've queued the data)
+ */
+static hg_return_t shuffle_enqueue_raw(shuffle_t sh, int dst, uint32_t type,
+                                       int hflags, int32_t epoch,
+                                       void *d, uint32_t datalen) {
   nexus_ret_t nexus;
   int rank;
   hg_addr_t dstaddr;
@@ -1786,15 +3571,17 @@ hg_return_t shuffle_enqueue(shuffle_t sh, int dst, uint32_t type,
   struct outset *oset;
   std::map<hg_addr_t, struct outqueue *>::iterator it;
   struct outqueue *oq;
+  struct enqstage *sg;
 
   mlog(CLNT_CALL, "shuffle_enqueue: dst=%d t=%d dl=%d", dst, type, datalen);
+  SHUF_TRACE(SHUF_TR_ENQUEUE, sh->grank, dst, type, datalen);
 
   /* first, check to see if send is generally disabled */
   if (sh->disablesend)
     return(HG_OTHER_ERROR);
 
   /* determine next hop */
-  nexus = nexus_next_hop(sh->nxp, dst, &rank, &dstaddr);
+  nexus = sh->rt->next_hop(sh->rtarg, dst, &rank, &dstaddr);
 
   /*
    * we always have to malloc and copy the data from the user to one
@@ -1821,9 +3608,17 @@ hg_return_t shuffle_enqueue(shuffle_t sh, int dst, uint32_t type,
   req->type = type;
   req->src = sh->grank;
   req->dst = dst;
+  req->hflags = hflags;
+  req->epoch = (hflags & REQ_HF_EPOCH) ? epoch : 0;
+  req->tstamp = 0;
+  if (sh->latstamp) {
+    req->hflags |= REQ_HF_TSTAMP;
+    req->tstamp = shuf_wall_us();
+  }
   req->data = (char *)req + sizeof(*req);
   memcpy(req->data, d, datalen);    /* DATA COPY HERE */
   req->owner = NULL;
+  req->crrank = -1;
   req->next.sqe_next = NULL;        /* to be safe */
 
   /* case 1: sending to ourselves */
@@ -1843,6 +3638,7 @@ hg_return_t shuffle_enqueue(shuffle_t sh, int dst, uint32_t type,
    *  NX_ISLOCAL: dst is on local machine, use na+sm to send it
    *  NX_SRCREP: dst is remote, use na+sm to send to remote's SRCREP
    *  NX_DESTREP: dst is remote, we are SRCREP, send over network
+   *              (with SHUFFLE_ROUTE_NOSRCREP every SRC is a SRCREP)
    */
   if (nexus != NX_ISLOCAL && nexus != NX_SRCREP && nexus != NX_DESTREP) {
     /* nexus doesn't know dst, return error */
@@ -1850,11 +3646,46 @@ hg_return_t shuffle_enqueue(shuffle_t sh, int dst, uint32_t type,
     return(HG_INVALID_PARAM);
   }
 
+  /* spread remote traffic over dst's SRCREPs if we have several */
+  if (nexus == NX_SRCREP && sh->nreps > 1)
+    srcrep_pick(sh, dst, (hflags & REQ_HF_CTL) ? epoch : -1, &rank, &dstaddr);
+
   /*
    * need to find correct output queue for dstaddr.  for the local
    * queues, shuffle_enqueue always goes to the origin (local_orq) outset.
+   * heavy remote dsts may have a direct queue (in remoteq) that skips
+   * the relays.  control and broadcast msgs always take the normal
+   * path (flush markers must follow the data they are flushing).
+   */
+  oq = NULL;
+  if (sh->dir.dmax && (nexus == NX_SRCREP ||
+      (nexus == NX_DESTREP && rank != dst)) &&
+      (hflags & REQ_HF_CTL) == 0 && (type & SHUFFLE_RTYPE_BCAST) == 0)
+    oq = direct_oq(sh, dst, datalen);
+  oset = (nexus == NX_DESTREP || oq) ? &sh->remoteq : &sh->local_orq;
+
+  if (oq) {
+    acnt64_incr(sh->stats, ST_DIRECTREQS);
+  } else if ((it = oset->oqs.find(dstaddr)) != oset->oqs.end()) {
+    oq = it->second;  /* now we have the correct output queue */
+  } else {
+    /*
+     * nexus knew the addr, but we couldn't find a a queue!
+     * this should not happen!!!
+     */
+    mlog(CLNT_ERR, "shuffle_enqueue: no route to dst %d", dst);
+    drop_reqs(&req, NULL, NULL);
+    return(HG_INVALID_PARAM);
+  }
+
+  /*
+   * app msgs go to the calling thread's stage if we are staging
+   * (flow control is applied when the stage is merged).
    */
-  oset = (nexus == NX_DESTREP) ? &sh->remoteq : &sh->local_orq;
+  if (sh->stagebytes &&
+      (hflags & REQ_HF_CTL) == 0 && (type & SHUFFLE_RTYPE_BCAST) == 0 &&
+      (sg = stage_get(sh)) != NULL)
+    return(stage_req(sh, sg, oq, req));
 
   /*
    * we may need to block if shufsend_rpclimit is set...
@@ -1867,18 +3698,6 @@ hg_return_t shuffle_enqueue(shuffle_t sh, int dst, uint32_t type,
     }
   }
 
-  it = oset->oqs.find(dstaddr);
-  if (it == oset->oqs.end()) {
-    /*
-     * nexus knew the addr, but we couldn't find a a queue!
-     * this should not happen!!!
-     */
-    mlog(CLNT_ERR, "shuffle_enqueue: no route to dst %d", dst);
-    return(HG_INVALID_PARAM);
-  }
-
-  oq = it->second;    /* now we have the correct output queue */
-
   parent = &parent_store;
   parent->nrefs = NULL;
   rv = req_via_mercury(sh, oset, oq, req, NULL, NULL, &parent); /* can block */
@@ -1896,28 +3715,75 @@ hg_return_t shuffle_enqueue(shuffle_t sh, int dst, uint32_t type,
  * all these RPCs are sent via shuffle_enqueue(), thus the normal
  * flow control rules apply to us (i.e. we may get blocked).
  *
- * we assume the shuffle will not be shutdown in the middle of our
- * operation, so it is safe to hold on to iterators and such while
- * calling shuffle_enqueue().  In the unlikely event of a failure,
- * it is possible for the broadcast to only partially complete.
- * (we'll print a warning if this happens...)
+ * we assume the shuffle will not be shutdown in the middle of our
+ * operation, so it is safe to hold on to iterators and such while
+ * calling shuffle_enqueue().  In the unlikely event of a failure,
+ * it is possible for the broadcast to only partially complete.
+ * (we'll print a warning if this happens...)
+ */
+hg_return_t shuffle_enqueue_broadcast(shuffle_t sh, uint32_t type, void *d,
+                                      uint32_t datalen, int flags) {
+    hg_return_t rv;
+    int e, nqueued;
+
+    if (sh->rec.rfp)
+      recorder_log(&sh->rec, (flags & SHUFFLE_BCAST_SELF) ?
+                   SHUFFLE_REC_BCASTSELF : SHUFFLE_REC_BCAST, type, datalen);
+
+    /* keep our staged msgs ahead of the broadcast */
+    rv = stage_drainself(sh);
+    if (rv != HG_SUCCESS)
+      return(rv);
+
+    /*
+     * only count the copies we queued (a failed copy is never recv'd).
+     * ranks that replicate our copies count theirs in shuffle_bcast_dup.
+     */
+    e = acnt32_get(sh->epoch);
+    rv = shuffle_bcast_raw(sh, type, REQ_HF_EPOCH, e, d, datalen, flags,
+                           &nqueued);
+    acnt32_add(sh->esent[e & 1], nqueued);
+    acnt64_incr(sh->stats, ST_BCASTS);
+
+    return(rv);
+}
+
+/*
+ * shuffle_bcast_raw: the body of shuffle_enqueue_broadcast() without
+ * type checks or epoch accounting (for internal use).
+ *
+ * @param sh the shuffle to send with
+ * @param type message type
+ * @param hflags REQ_HF_* header flags
+ * @param epoch epoch number (only used with REQ_HF_EPOCH)
+ * @param d data buffer
+ * @param datalen length of data
+ * @param flags currently we have bcast_self
+ * @param nqueued if !NULL, set to the number of copies we queued
+ * @return status (success if we've queued all the copies)
  */
-hg_return_t shuffle_enqueue_broadcast(shuffle_t sh, uint32_t type, void *d,
-                                      uint32_t datalen, int flags) {
+static hg_return_t shuffle_bcast_raw(shuffle_t sh, uint32_t type,
+                                     int hflags, int32_t epoch, void *d,
+                                     uint32_t datalen, int flags,
+                                     int *nqueued) {
     hg_return_t rv0, rv;
     struct outset *oset[2];
     unsigned int lcv;
     std::map<hg_addr_t, struct outqueue *>::iterator it;
     struct outqueue *oq;
+    int nq;
 
     rv0 = rv = HG_SUCCESS;
+    nq = 0;
     if ((flags & SHUFFLE_BCAST_SELF) != 0) {
-        rv = shuffle_enqueue(sh, sh->grank, type|SHUFFLE_RTYPE_BCAST,
-                             d, datalen);
+        rv = shuffle_enqueue_raw(sh, sh->grank, type|SHUFFLE_RTYPE_BCAST,
+                                 hflags, epoch, d, datalen);
         if (rv != HG_SUCCESS) {
           notify(SHUF_CRIT,
                  "enqueue_broadcast: self enq failed (%d)!  Data lost.", rv);
           rv0 = rv;
+        } else {
+          nq++;
         }
     }
 
@@ -1926,22 +3792,104 @@ hg_return_t shuffle_enqueue_broadcast(shuffle_t sh, uint32_t type, void *d,
     for (lcv = 0 ; lcv < sizeof(oset)/sizeof(*oset) ; lcv++) {
         for (it = oset[lcv]->oqs.begin() ; it != oset[lcv]->oqs.end() ; it++) {
             oq = it->second;
-            if (oq->grank == sh->grank)
-                continue;       /* already handled us */
-            rv = shuffle_enqueue(sh, oq->grank, type|SHUFFLE_RTYPE_BCAST,
-                                 d, datalen);
+            if (oq->grank == sh->grank || oq->direct ||
+                (lcv && !srcrep_primary(sh, oq->grank)))
+                continue;       /* already handled us (or not a peer) */
+            rv = shuffle_enqueue_raw(sh, oq->grank, type|SHUFFLE_RTYPE_BCAST,
+                                     hflags, epoch, d, datalen);
             if (rv != HG_SUCCESS) {
               notify(SHUF_CRIT,
                      "enqueue_broadcast: enq to %d failed (%d)!  Data lost.",
                      oq->grank, rv);
               rv0 = rv;
+            } else {
+              nq++;
             }
         }
     }
 
+    if (nqueued)
+        *nqueued = nq;
     return(rv0);
 }
 
+/*
+ * shuffle_register_handler_flags: register a delivery callback for a
+ * range of types.  the handler table is append-only: we fill in the
+ * new entry and then publish it by bumping nhandlers, so the lookup
+ * in the delivery path does not need to take hlock.
+ */
+hg_return_t shuffle_register_handler_flags(shuffle_t sh, uint32_t type_lo,
+                                           uint32_t type_hi,
+                                           shuffle_handlerfn_t fn, void *arg,
+                                           int flags) {
+  hg_return_t rv = HG_SUCCESS;
+  struct dhandler *h;
+  struct delivery *dlv;
+  int n, lcv;
+
+  mlog(CLNT_CALL, "shuffle_register_handler: types=%u-%u flags=%d",
+       type_lo, type_hi, flags);
+
+  if (fn == NULL || type_lo > type_hi ||
+      (type_hi & ~SHUFFLE_RTYPE_USRBITS) != 0) {
+    mlog(CLNT_ERR, "shuffle_register_handler: bad args");
+    return(HG_INVALID_PARAM);
+  }
+
+  pthread_mutex_lock(&sh->hlock);
+  if (sh->disablesend) {
+    rv = HG_CANCELED;
+    goto done;
+  }
+  n = acnt32_get(sh->nhandlers);
+  if (n >= SHUFFLE_MAXHANDLERS) {
+    mlog(CLNT_ERR, "shuffle_register_handler: table full (%d)", n);
+    rv = HG_NOMEM_ERROR;
+    goto done;
+  }
+  for (lcv = 0 ; lcv < n ; lcv++) {
+    h = &sh->handlers[lcv];
+    if (type_lo <= h->type_hi && h->type_lo <= type_hi) {
+      mlog(CLNT_ERR, "shuffle_register_handler: %u-%u overlaps %u-%u",
+           type_lo, type_hi, h->type_lo, h->type_hi);
+      rv = HG_INVALID_PARAM;
+      goto done;
+    }
+  }
+
+  if (flags & SHUFFLE_HANDLER_THREAD) {
+    dlv = new delivery;    /* aborts w/std::bad_alloc on failure */
+    if (delivery_init(sh, dlv, n + 1) != 0) {
+      delete dlv;
+      rv = HG_NOMEM_ERROR;
+      goto done;
+    }
+    if (pthread_create(&dlv->dtask, NULL, delivery_main, (void *)dlv) != 0) {
+      notify(CLNT_CRIT, "shuffle_register_handler: delivery_main failed");
+      delivery_destroy(dlv);
+      delete dlv;
+      rv = HG_OTHER_ERROR;
+      goto done;
+    }
+    dlv->drunning = 1;
+  } else {
+    dlv = &sh->dlv;
+  }
+
+  h = &sh->handlers[n];
+  h->type_lo = type_lo;
+  h->type_hi = type_hi;
+  h->fn = fn;
+  h->arg = arg;
+  h->dlv = dlv;
+  acnt32_incr(sh->nhandlers);   /* publish it */
+
+done:
+  pthread_mutex_unlock(&sh->hlock);
+  return(rv);
+}
+
 /*
  * req_to_self: sending/forward a req to ourself via the delivery thread.
  *
@@ -1974,18 +3922,18 @@ hg_return_t shuffle_enqueue_broadcast(shuffle_t sh, uint32_t type, void *d,
  *
  * @param sh the shuffle involved
  * @param req the request to send/forward to self
- * @param input the inbound handle that generated the req
+ * @param input the inbound RPC that generated the req (NULL if app)
  * @param rpcin ptr to the rcpin value of the inbound req (input != NULL case)
  * @param parentp parent ptr (will allocate a new one if needed)
  * @return status
  */
 static hg_return_t req_to_self(struct shuffle *sh, struct request *req,
-                               hg_handle_t input, rpcin_t *rpcin,
+                               struct rpcsrc *input, rpcin_t *rpcin,
                                struct req_parent **parentp) {
   hg_return_t rv = HG_SUCCESS;
   int qsize, needwait;
-  struct req_parent *parent;
-  struct cond_timedwait ctw;
+  struct dhandler *h;
+  struct delivery *dlv;
 
   if (rpcin)
     mlog(SHUF_CALL, "req_to_self req=%p, handle=%p R%d-%d", req, input,
@@ -1993,84 +3941,129 @@ static hg_return_t req_to_self(struct shuffle *sh, struct request *req,
   else
     mlog(SHUF_CALL, "req_to_self req=%p, handle=%p CLI", req, input);
 
+  /*
+   * control msgs are for the shuffle itself, not the delivery thread.
+   * the exception is a flush marker: it goes through the default
+   * deliverq (behind the msgs it flushes) and the delivery thread
+   * acks it (we can't send from here).
+   */
+  if ((req->hflags & REQ_HF_CTL) != 0 && ctl_recv(sh, req) == 0) {
+    free(req);
+    return(rv);
+  }
+
   /* this allows delivery to be turned off for debugging... */
   if (sh->deliverq_max < 0) {
     mlog(SHUF_D1, "req_to_self: req=%p discarded (delivery disabled)", req);
+    epoch_recv(sh, req, 1);
     free(req);
     return(rv);
   }
 
-  pthread_mutex_lock(&sh->deliverlock);
-  qsize = sh->deliverq.size();
+  /* handlers with their own thread have a private delivery queue */
+  h = ((req->hflags & REQ_HF_CTL) == 0) ?
+      shuffle_handler_lookup(sh, req->type) : NULL;
+  dlv = (h) ? h->dlv : &sh->dlv;
+  acnt64_incr(sh->stats, ST_DREQS);
+
+  pthread_mutex_lock(&dlv->deliverlock);
+  qsize = dlv->deliverq.size();
   needwait = (qsize >= sh->deliverq_max); /* wait if no room in deliverq */
-  shufcount(&sh->cntdreqs[input != NULL]);
+  shufcount(&dlv->cntdreqs[input != NULL]);
 
   if (!needwait) {
 
     /* easy!  just queue and wake delivery thread (if needed) */
     mlog(SHUF_D1, "req_to_self: deliverq req=%p qsize=%d", req, qsize);
-    sh->deliverq.push_back(req);
+    dlv->deliverq.push_back(req);
     /* crossed threshold if the queue size before push_back == threshold */
     if (qsize == sh->deliverq_threshold) {
       mlog(SHUF_D1, "req_to_self: need to wake delivery thread");
-      pthread_cond_signal(&sh->delivercv);  /* wake blocked thread */
+      pthread_cond_signal(&dlv->delivercv);  /* wake blocked thread */
     }
 
   } else {
 
     /* sad!  we need to block on the waitq for delivery ... */
-    shufcount(&sh->cntdwait[input != NULL]);
+    shufcount(&dlv->cntdwait[input != NULL]);
+    acnt64_incr(sh->stats, ST_DWAITS);
+    req->qtime = shuf_now_us();
+    if (req->crrank >= 0) {
+      /* within sender's credit: no need to hold the RPC reply */
+      credit_charge(rpcin, req);
+      mlog(SHUF_D1, "req_to_self: dwaitq! req=%p credit", req);
+      dlv->dwaitq.push_back(req);
+      shufmax(&dlv->cntdmaxwait, dlv->dwaitq.size());
+      needwait = 0;        /* nothing to wait for */
+      goto unlock;
+    }
     rv = req_parent_init(sh, parentp, req, input, rpcin);
 
     if (rv == HG_SUCCESS) {
       mlog(SHUF_D1, "req_to_self: dwaitq! req=%p parent=%p", req, req->owner);
-      sh->dwaitq.push_back(req); /* add req to wait queue */
-      shufmax(&sh->cntdmaxwait, sh->dwaitq.size());
+      dlv->dwaitq.push_back(req); /* add req to wait queue */
+      shufmax(&dlv->cntdmaxwait, dlv->dwaitq.size());
     } else {
       notify(SHUF_CRIT, "shuffle: req_to_self parent init failed (%d)", rv);
       drop_reqs(&req, NULL, "req_to_self"); /* error means we can't send it */
     }
 
   }
-  pthread_mutex_unlock(&sh->deliverlock);
+unlock:
+  pthread_mutex_unlock(&dlv->deliverlock);
 
   /*
    * if we are sending (!input) and need to wait, we'll block here.
    */
   if (!input && needwait && rv == HG_SUCCESS) {   /* wait now if needed */
-    parent = *parentp;
+    app_parent_wait(sh, *parentp, "req_to_self");
+    mlog(CLNT_D1, "req_to_self: req=%p complete", req);
+  }
 
-    pthread_mutex_lock(&parent->pcvlock);
-    /*
-     * drop extra parent ref created by req_parent_init() before waiting.
-     * watch out: if other side finishes early, this may be the last ref.
-     */
-    if (acnt32_decr(parent->nrefs) < 1) {
-      mlog(CLNT_D1, "req_to_self: NO block, req=%p, parent=%p", req, parent);
-    } else {
-      init_cond_timedwait(&ctw, SHUFFLE_TIMEOUT, 1, "req_to_self");
-      parent->need_wakeup = 1;    /* protected by pcvlock */
-      while (parent->need_wakeup) {
-        mlog(CLNT_D1, "req_to_self: blocked! req=%p, parent=%p", req, parent);
-        do_cond_timedwait(sh, &parent->pcv, &parent->pcvlock, &ctw); /*BLOCK*/
-        mlog(CLNT_D1, "req_to_self: UNblocked! req=%p, parent=%p", req, parent);
-      }
-    }
-    pthread_mutex_unlock(&parent->pcvlock);
+  /* done! */
+  return(rv);
+}
 
-    /*
-     * we are done now, since the thread that completed the req
-     * also should have pulled our req off the dwaitq and put it in
-     * the delivery queue.
-     */
+/*
+ * app_parent_wait: block an app thread until the reqs it put on
+ * a waitq (oqwaitq or dwaitq) under its (stack) parent have left it,
+ * then tear the parent down.  we drop the extra ref req_parent_init() made for us.
+ *
+ * @param sh the shuffle we are sending with
+ * @param parent the app's parent (input == NULL)
+ * @param who caller name for log msgs
+ */
+static void app_parent_wait(struct shuffle *sh, struct req_parent *parent,
+                            const char *who) {
+  struct cond_timedwait ctw;
 
-    acnt32_free(&parent->nrefs);
-    pthread_cond_destroy(&parent->pcv);
-    pthread_mutex_destroy(&parent->pcvlock);
+  pthread_mutex_lock(&parent->pcvlock);
+  /*
+   * drop extra parent ref created by req_parent_init() before waiting.
+   * watch out: if other side finishes early, this may be the last ref.
+   */
+  if (acnt32_decr(parent->nrefs) < 1) {
+    mlog(CLNT_D1, "%s: NO block, parent=%p", who, parent);
+  } else {
+    init_cond_timedwait(&ctw, SHUFFLE_TIMEOUT, 1, who);
+    parent->need_wakeup = 1;    /* protected by pcvlock */
+    while (parent->need_wakeup) {
+      mlog(CLNT_D1, "%s: blocking parent=%p", who, parent);
+      do_cond_timedwait(sh, &parent->pcv, &parent->pcvlock, &ctw); /*BLOCK*/
+      mlog(CLNT_D1, "%s: UNblock parent=%p", who, parent);
+    }
   }
+  pthread_mutex_unlock(&parent->pcvlock);
 
-  /* done! */
-  return(rv);
+  /*
+   * we are done now, since the thread that completed the reqs
+   * also should have pulled them off the waitq and set them
+   * up for sending.
+   */
+
+  acnt32_free(&parent->nrefs);
+  pthread_cond_destroy(&parent->pcv);
+  pthread_mutex_destroy(&parent->pcvlock);
 }
 
 /*
@@ -2085,22 +4078,20 @@ static hg_return_t req_to_self(struct shuffle *sh, struct request *req,
  * @param oset the output queue set we are using
  * @param oq the output queue to use
  * @param req the request to send
- * @param input input RPC handle (null if via app shuffle_enqueue call)
+ * @param input input RPC source (null if via app shuffle_enqueue call)
  * @param rpcin ptr to the rcpin value of the inbound req (input != NULL case)
  * @param parentp parent ptr (will allocate a new one if needed)
  * @return status, normally success
  */
 static hg_return_t req_via_mercury(struct shuffle *sh, struct outset *oset,
                                    struct outqueue *oq, struct request *req,
-                                   hg_handle_t input, rpcin_t *rpcin,
+                                   struct rpcsrc *input, rpcin_t *rpcin,
                                    struct req_parent **parentp) {
   hg_return_t rv = HG_SUCCESS;
   int needwait;
   bool tosend;
   struct request_queue tosendq;
   struct output *oput;
-  struct req_parent *parent;
-  struct cond_timedwait ctw;
 
   if (rpcin)
     mlog(SHUF_CALL, "req_via_mercury: req=%p type=%s r=[%d.%d] dst=%p R%d-%d",
@@ -2110,8 +4101,11 @@ static hg_return_t req_via_mercury(struct shuffle *sh, struct outset *oset,
     mlog(SHUF_CALL, "req_via_mercury: req=%p type=%s rnk=[%d.%d] dst=%p CLI",
          req, outset_typstr(oset->settype), oq->grank, oq->subrank, oq->dst);
 
+  acnt64_incr(oset->ostats, OST_REQS);
+  acnt64_add(oset->ostats, OST_BYTES, req->datalen);
+
   pthread_mutex_lock(&oq->oqlock);
-  needwait = (oq->nsending >= oset->maxoqrpc);
+  needwait = oq_full(oset, oq);
   tosend = false;
   shufcount(&oq->cntoqreqs[input != NULL]);
 
@@ -2126,12 +4120,31 @@ static hg_return_t req_via_mercury(struct shuffle *sh, struct outset *oset,
 
     /* sad!  we need to block on the output queue till it clears some */
     shufcount(&oq->cntoqwaits[input != NULL]);
+    acnt64_incr(oset->ostats, OST_WAITS);
+    req->qtime = shuf_now_us();
+    if (oq->nsending < oq->maxrpc) {
+      shufcount(&oq->cntoqcredwait);    /* held back by credit, not maxrpc */
+      acnt64_incr(oset->ostats, OST_CREDWAITS);
+    }
+    if (req->crrank >= 0) {
+      /* within sender's credit: no need to hold the RPC reply */
+      credit_charge(rpcin, req);
+      mlog(SHUF_D1, "req_via_mercury: oqwaitq, req=%p, credit", req);
+      oq->oqwaitq.push_back(req);
+      oq->waitbytes += req->datalen;
+      oq_repdepth(oq);
+      shufmax(&oq->cntoqmaxwait, oq->oqwaitq.size());
+      pthread_mutex_unlock(&oq->oqlock);
+      return(rv);
+    }
     rv = req_parent_init(sh, parentp, req, input, rpcin);
 
     if (rv == HG_SUCCESS) {
       mlog(SHUF_D1, "req_via_mercury: oqwaitq, req=%p, parent=%p",
            req, req->owner);
       oq->oqwaitq.push_back(req); /* add req to oq's waitq */
+      oq->waitbytes += req->datalen;
+      oq_repdepth(oq);
       shufmax(&oq->cntoqmaxwait, oq->oqwaitq.size());
     } else {
       notify(SHUF_CRIT, "shuffle: req_via_mercury parent init failed (%d)",
@@ -2147,38 +4160,7 @@ static hg_return_t req_via_mercury(struct shuffle *sh, struct outset *oset,
     rv = forward_reqs_now(&tosendq, sh, oset, oq, oput);
 
   } else if (!input && needwait && rv == HG_SUCCESS) { /* wait now if needed */
-    parent = *parentp;
-
-    pthread_mutex_lock(&parent->pcvlock);
-    /*
-     * drop extra parent ref created by req_parent_init() before waiting.
-     * watch out: if other side finishes early, this may be the last ref.
-     */
-    if (acnt32_decr(parent->nrefs) < 1) {
-      mlog(CLNT_D1, "req_via_mercury: NO block, req=%p, parent=%p",
-           req, parent);
-    } else {
-      init_cond_timedwait(&ctw, SHUFFLE_TIMEOUT, 1, "req_via_mercury");
-      parent->need_wakeup = 1;    /* protected by pcvlock */
-      while (parent->need_wakeup) {
-        mlog(CLNT_D1, "req_via_mercury: blocking req=%p, parent=%p",
-             req, parent);
-        do_cond_timedwait(sh, &parent->pcv, &parent->pcvlock, &ctw); /*BLOCK*/
-        mlog(CLNT_D1, "req_via_mercury: UNblock req=%p, parent=%p",
-             req, parent);
-      }
-    }
-    pthread_mutex_unlock(&parent->pcvlock);
-
-    /*
-     * we are done now, since the thread that completed the req
-     * also should have pulled our req off the waitq and set it
-     * up for sending.
-     */
-
-    acnt32_free(&parent->nrefs);
-    pthread_cond_destroy(&parent->pcv);
-    pthread_mutex_destroy(&parent->pcvlock);
+    app_parent_wait(sh, *parentp, "req_via_mercury");
     mlog(CLNT_D1, "req_via_mercury: req=%p complete", req);
   }
 
@@ -2186,6 +4168,26 @@ static hg_return_t req_via_mercury(struct shuffle *sh, struct outset *oset,
   return(rv);
 }
 
+/*
+ * oq_full: check if a locked output queue can take another req without
+ * waiting.  new reqs must wait if we are at maxrpc, if others are
+ * already waiting (to keep order), or if the bytes we have in flight
+ * have used up the credit the dst last gave us.  with nothing in flight
+ * we always allow a send so that we get a fresh credit back.
+ *
+ * @param oset the output set that our outq belongs to
+ * @param oq the locked output queue
+ * @return non-zero if a new req must go on the waitq
+ */
+static int oq_full(struct outset *oset, struct outqueue *oq) {
+  (void)oset;
+  if (oq->nsending >= oq->maxrpc || !oq->oqwaitq.empty())
+    return(1);
+  if (oq->crwin >= 0 && oq->nsending > 0 && oq->crinflight >= oq->crwin)
+    return(1);
+  return(0);
+}
+
 /*
  * append_req_to_locked_outqueue: append a req to a locked output
  * queue.  this may result in a message that we need to forward
@@ -2214,24 +4216,35 @@ static bool append_req_to_locked_outqueue(struct outset *oset,
                                           struct request_queue *tosend,
                                           struct output **newoutputp,
                                           bool flushnow) {
-  int newloadsize;
+  int newloadsize, newloadcnt, reason;
   struct output *newoutput;
   mlog(SHUF_CALL, "append_to_locked: req=%p, dst=%p, flush=%d",
        req, oq->dst, flushnow == true);
 
   /* what is new loadsize?  it may not change if req is null */
   newloadsize = (req) ? oq->loadsize + req->datalen : oq->loadsize;
+  newloadcnt = (req) ? oq->loadcnt + 1 : oq->loadcnt;
+  reason = (newloadsize >= oset->buftarget) ? SHUFFLE_SEND_BUFTARGET
+                                            : SHUFFLE_SEND_FLUSH;
+
+  /* control msgs are small and latency sensitive, never buffer them */
+  if (req && (req->hflags & REQ_HF_CTL) != 0) {
+    flushnow = true;
+    reason = SHUFFLE_SEND_CTL;
+  }
 
   /*
    * see if there is enough space in loading for us to just queue
    * the req (if not NULL) and return without doing anything else.
    * if we are flushing then we have to send now if we have anything.
    */
-  if (newloadsize == 0 ||
+  if (newloadcnt == 0 ||
       (newloadsize < oset->buftarget && !flushnow) ) {
     if (req) {
       XSIMPLEQ_INSERT_TAIL(&oq->loading, req, next);
       oq->loadsize = newloadsize;
+      oq->loadcnt = newloadcnt;
+      oq_repdepth(oq);
     }
     mlog(SHUF_D1, "append_to_locked: still room dst=%p, sz=%d, targ=%d",
          oq->dst, oq->loadsize, oset->buftarget);
@@ -2251,7 +4264,8 @@ static bool append_req_to_locked_outqueue(struct outset *oset,
     mlog(SHUF_ERR, "append_to_locked malloc failed!  data likely lost!");
     if (flushnow) {
       drop_reqs(&req, &oq->loading, "append_to_locked (f)");
-      oq->loadsize = 0;
+      oq->loadsize = oq->loadcnt = 0;
+      oq_repdepth(oq);
     } else {
       drop_reqs(&req, NULL, "append_to_locked");
     }
@@ -2261,8 +4275,14 @@ static bool append_req_to_locked_outqueue(struct outset *oset,
   /* init output and put on the oq */
   newoutput->oqp = oq;
   newoutput->outhand = NULL;
+  newoutput->outmem = NULL;
   newoutput->ostep = OSTEP_PREP;    /* preparing, not sent yet */
   newoutput->outseq = -1;           /* not available yet */
+  newoutput->tstart_us = 0;
+  newoutput->ortt = -1;             /* no RTT sample yet */
+  newoutput->ofailed = 0;
+  newoutput->obytes = newloadsize;
+  newoutput->ocredit = CREDIT_NOREPLY;
   XTAILQ_INSERT_TAIL(&oq->outs, newoutput, q);
   *newoutputp = newoutput;
 
@@ -2276,17 +4296,342 @@ static bool append_req_to_locked_outqueue(struct outset *oset,
     XSIMPLEQ_INSERT_TAIL(tosend, req, next);
   }
   /* note: "CONCAT" re-init's &oq->loading to empty */
-  oq->loadsize = 0;
+  oq->loadsize = oq->loadcnt = 0;
   oq->nsending++;
+  oq->crinflight += newoutput->obytes;
+  oq_repdepth(oq);
   shufcount(&oq->cntoqsends);
-  if (req == NULL && flushnow)
+  acnt64_incr(oset->ostats, OST_SENDS);
+  acnt64_add(oset->ostats, OST_SENDBYTES, newoutput->obytes);
+  acnt64_incr(oset->ostats, OST_SENDREASON + reason);
+  shuf_hist_record(oset->obreqs, newloadcnt);
+  shuf_hist_record(oset->obbytes, newloadsize);
+  if (req == NULL && flushnow) {
     shufcount(&oq->cntoqflushsend);  /* sent early due to flush */
+    acnt64_incr(oset->ostats, OST_FLUSHSENDS);
+  }
 
   mlog(SHUF_D1, "append_to_locked: send NOW dst=%p nsending=%d",
        oq->dst, oq->nsending);
   return(true);
 }
 
+/*
+ * memx_create: in-memory transport version of HG_Create().  find
+ * the dst shuffle for an outqueue and allocate a memrpc for it.
+ *
+ * @param sh the shuffle we are sending with
+ * @param oset the output queue set we are working with
+ * @param oq the output queue we are sending on
+ * @param mrpcp the new memrpc is placed here
+ * @param dsthgpp the dst hgprogress to send it to is placed here
+ * @return status
+ */
+static hg_return_t memx_create(struct shuffle *sh, struct outset *oset,
+                               struct outqueue *oq, struct memrpc **mrpcp,
+                               struct hgprogress **dsthgpp) {
+  struct shuffle *dsh;
+  struct memrpc *mrpc;
+
+  dsh = sh->rt->memdst(sh->rtarg, oq->dst);
+  if (dsh == NULL) {
+    mlog(SHUF_ERR, "memx_create: no dst shuffle for [%d.%d]", oq->grank,
+         oq->subrank);
+    return(HG_INVALID_PARAM);
+  }
+  mrpc = (struct memrpc *)malloc(sizeof(*mrpc));
+  if (mrpc == NULL)
+    return(HG_NOMEM_ERROR);
+  XSIMPLEQ_INIT(&mrpc->in.inreqs);
+  mrpc->isreply = 0;
+  mrpc->oput = NULL;
+  mrpc->srchgp = oq->oqhgp;
+  *mrpcp = mrpc;
+  if (oset != &sh->remoteq)
+    *dsthgpp = &dsh->hgp_local;
+  else    /* same rail on the dst side (all ranks have the same #rails) */
+    *dsthgpp = shuffle_rail(dsh, (oq->oqhgp->rail < dsh->nrails) ?
+                                  oq->oqhgp->rail : 0);
+  return(HG_SUCCESS);
+}
+
+/*
+ * memx_forward: in-memory transport version of HG_Forward().  we
+ * move the reqs from "in" to the memrpc and queue it to the dst.
+ * nothing is moved if we fail.
+ *
+ * @param dsthgp the dst hgprogress (from memx_create)
+ * @param mrpc the memrpc (already installed in an output)
+ * @param in the batch we are sending
+ * @return status
+ */
+static hg_return_t memx_forward(struct hgprogress *dsthgp,
+                                struct memrpc *mrpc, rpcin_t *in) {
+  pthread_mutex_lock(&dsthgp->mqlock);
+  if (dsthgp->mqstop || !dsthgp->nrunning) {
+    pthread_mutex_unlock(&dsthgp->mqlock);
+    return(HG_CANCELED);
+  }
+  mrpc->in.iseq = in->iseq;
+  mrpc->in.forwardrank = in->forwardrank;
+  XSIMPLEQ_CONCAT(&mrpc->in.inreqs, &in->inreqs);
+  XSIMPLEQ_INSERT_TAIL(&dsthgp->memq, mrpc, mnext);
+  pthread_cond_signal(&dsthgp->mqcv);
+  pthread_mutex_unlock(&dsthgp->mqlock);
+  return(HG_SUCCESS);
+}
+
+/*
+ * memx_main: in-memory transport thread, stands in for a mercury
+ * progress thread.  inbound batches go to shuffle_rpcin() and
+ * replies to our own sends complete the output (like forw_cb).
+ *
+ * @param arg our hgprogress
+ * @return NULL
+ */
+static void *memx_main(void *arg) {
+  struct hgprogress *hgp = (struct hgprogress *)arg;
+  struct shuffle *sh = hgp->hgshuf;
+  int islocal = (hgp == &sh->hgp_local);
+  struct memrpc *mrpc;
+  struct rpcsrc input;
+
+  mlog(SHUF_CALL, "memx_main: start (local=%d)", islocal);
+  pthread_mutex_lock(&hgp->mqlock);
+  while (1) {
+    mrpc = XSIMPLEQ_FIRST(&hgp->memq);
+    if (mrpc == NULL) {
+      if (hgp->mqstop)
+        break;
+      pthread_cond_wait(&hgp->mqcv, &hgp->mqlock);
+      continue;
+    }
+    XSIMPLEQ_REMOVE_HEAD(&hgp->memq, mnext);
+    hgp->mqnproc++;
+    pthread_mutex_unlock(&hgp->mqlock);
+
+    if (mrpc->isreply) {
+      forw_done(mrpc->oput, HG_SUCCESS, &mrpc->out);  /* frees mrpc */
+    } else if (sh->disablesend) {
+      mlog(SHUF_WARN, "memx_main: drop req due to disablesend");
+      drop_reqs(NULL, &mrpc->in.inreqs, NULL);
+      free(mrpc);
+    } else {
+      acnt64_incr(sh->stats, (islocal) ? ST_RPCINSHM : ST_RPCINNET);
+      input.hand = NULL;
+      input.mrpc = mrpc;
+      rpcin_handoff(hgp, &input, &mrpc->in);   /* replies w/rpc_reply */
+    }
+
+    pthread_mutex_lock(&hgp->mqlock);
+  }
+  pthread_mutex_unlock(&hgp->mqlock);
+  mlog(SHUF_CALL, "memx_main: exit (local=%d)", islocal);
+  return(NULL);
+}
+
+/*
+ * relay_init: allocate relay worker state (threads are started later
+ * by start_threads()).
+ *
+ * @param sh the shuffle we are setting up
+ * @param nworkers number of workers wanted (<= 0 means none)
+ * @return 0 on success, -1 on error
+ */
+static int relay_init(struct shuffle *sh, int nworkers) {
+  struct relayworker *rw;
+  int lcv, rlcv;
+
+  sh->nrelay = 0;
+  sh->relayw = NULL;
+  if (nworkers <= 0)
+    return(0);
+  if (nworkers > SHUFFLE_MAXRELAYWORKERS)
+    nworkers = SHUFFLE_MAXRELAYWORKERS;
+
+  sh->relayw = new relayworker[nworkers];   /* aborts on failure */
+  for (lcv = 0 ; lcv < nworkers ; lcv++) {
+    rw = &sh->relayw[lcv];
+    rw->rwshuf = sh;
+    rw->rwidx = lcv;
+    XSIMPLEQ_INIT(&rw->rwq);
+    rw->rwqlen = rw->rwmaxq = 0;
+    rw->rwactive = 0;
+    XSIMPLEQ_INIT(&rw->rwfree);
+    for (rlcv = 0 ; rlcv < RELAY_NRESERVE ; rlcv++) {
+      rw->rwreserve[rlcv].rwreserved = 1;
+      XSIMPLEQ_INSERT_TAIL(&rw->rwfree, &rw->rwreserve[rlcv], rwnext);
+    }
+    rw->rwstop = rw->rwexited = rw->rwrunning = 0;
+    rw->rwnproc = 0;
+    if (pthread_mutex_init(&rw->rwlock, NULL) != 0)
+      goto err;
+    if (pthread_cond_init(&rw->rwcv, NULL) != 0) {
+      pthread_mutex_destroy(&rw->rwlock);
+      goto err;
+    }
+    sh->nrelay++;
+  }
+  mlog(SHUF_INFO, "relay: %d worker threads", sh->nrelay);
+  return(0);
+
+err:
+  notify(SHUF_CRIT, "shuffle: relay_init failed");
+  relay_destroy(sh);
+  return(-1);
+}
+
+/*
+ * relay_destroy: free stopped relay worker state
+ *
+ * @param sh the shuffle
+ */
+static void relay_destroy(struct shuffle *sh) {
+  int lcv;
+
+  for (lcv = 0 ; lcv < sh->nrelay ; lcv++) {
+    pthread_mutex_destroy(&sh->relayw[lcv].rwlock);
+    pthread_cond_destroy(&sh->relayw[lcv].rwcv);
+  }
+  delete [] sh->relayw;
+  sh->relayw = NULL;
+  sh->nrelay = 0;
+}
+
+/*
+ * rpcin_handoff: process an inbound batch, either by handing it to
+ * a relay worker or (if we don't have workers or the sender's worker
+ * has exited) by calling shuffle_rpcin() ourselves.  a worker only
+ * exits once its queue is empty, so running inline then keeps the
+ * sender's order.  we never wait for a worker (we are usually on a
+ * progress thread): if malloc fails we take a work item from the
+ * worker's reserve.  if that is empty too we run inline, which may
+ * pass batches of the sender that are still on the worker's queue.
+ * "in" is copied, so the caller's copy is free to go when we return.
+ *
+ * @param inhgp the hgprogress we got the batch on
+ * @param input where the batch came from (for the reply)
+ * @param in the decoded batch
+ */
+static void rpcin_handoff(struct hgprogress *inhgp, struct rpcsrc *input,
+                          rpcin_t *in) {
+  struct shuffle *sh = inhgp->hgshuf;
+  struct relayworker *rw;
+  struct relaywork *work;
+  int busy;
+
+  if (sh->nrelay == 0)
+    goto inline_rpcin;
+  rw = &sh->relayw[(uint32_t)in->forwardrank % sh->nrelay];
+  work = (struct relaywork *)malloc(sizeof(*work));
+  if (work)
+    work->rwreserved = 0;
+
+  pthread_mutex_lock(&rw->rwlock);
+  if (!rw->rwrunning || rw->rwexited) {     /* no worker, rwq is empty */
+    pthread_mutex_unlock(&rw->rwlock);
+    if (work)
+      free(work);
+    goto inline_rpcin;
+  }
+  if (work == NULL && (work = XSIMPLEQ_FIRST(&rw->rwfree)) != NULL)
+    XSIMPLEQ_REMOVE_HEAD(&rw->rwfree, rwnext);
+  if (work == NULL) {
+    busy = (rw->rwqlen > 0 || rw->rwactive);
+    pthread_mutex_unlock(&rw->rwlock);
+    if (busy)
+      notify(SHUF_CRIT, "rpcin_handoff: no memory, batch from %d run "
+             "ahead of worker %d's queue", in->forwardrank, rw->rwidx);
+    goto inline_rpcin;
+  }
+  work->rwhgp = inhgp;
+  work->rwinput = *input;
+  work->rwin.iseq = in->iseq;
+  work->rwin.forwardrank = in->forwardrank;
+  XSIMPLEQ_INIT(&work->rwin.inreqs);
+  XSIMPLEQ_CONCAT(&work->rwin.inreqs, &in->inreqs);
+  XSIMPLEQ_INSERT_TAIL(&rw->rwq, work, rwnext);
+  rw->rwqlen++;
+  if (rw->rwqlen > rw->rwmaxq)
+    rw->rwmaxq = rw->rwqlen;
+  if (rw->rwqlen == 1)
+    pthread_cond_signal(&rw->rwcv);
+  pthread_mutex_unlock(&rw->rwlock);
+  acnt64_incr(sh->stats, ST_RELAYBATCHES);
+  return;
+
+inline_rpcin:
+  shuffle_rpcin(inhgp, input, in);
+}
+
+/*
+ * relay_main: relay worker thread.  we run each batch we are handed
+ * through shuffle_rpcin(), which routes it and replies.  at shutdown
+ * we drain our queue before exiting (rpcin_handoff keeps queuing to
+ * us until we mark ourself exited).
+ *
+ * @param arg our relayworker
+ * @return NULL
+ */
+static void *relay_main(void *arg) {
+  struct relayworker *rw = (struct relayworker *)arg;
+  struct relaywork *work;
+  int reserved;
+
+  mlog(SHUF_CALL, "relay_main: start (worker=%d)", rw->rwidx);
+  pthread_mutex_lock(&rw->rwlock);
+  while (1) {
+    work = XSIMPLEQ_FIRST(&rw->rwq);
+    if (work == NULL) {
+      if (rw->rwstop)
+        break;
+      pthread_cond_wait(&rw->rwcv, &rw->rwlock);
+      continue;
+    }
+    XSIMPLEQ_REMOVE_HEAD(&rw->rwq, rwnext);
+    rw->rwqlen--;
+    rw->rwnproc++;
+    rw->rwactive = 1;
+    pthread_mutex_unlock(&rw->rwlock);
+
+    shuffle_rpcin(work->rwhgp, &work->rwinput, &work->rwin);
+    reserved = work->rwreserved;
+    if (!reserved)
+      free(work);
+
+    pthread_mutex_lock(&rw->rwlock);
+    rw->rwactive = 0;
+    if (reserved)
+      XSIMPLEQ_INSERT_TAIL(&rw->rwfree, work, rwnext);
+  }
+  rw->rwexited = 1;
+  pthread_mutex_unlock(&rw->rwlock);
+  mlog(SHUF_CALL, "relay_main: exit (worker=%d)", rw->rwidx);
+  return(NULL);
+}
+
+/*
+ * relay_stop: drain a relay worker's queue and join its thread.
+ * after this rpcin_handoff() runs batches inline.
+ *
+ * @param rw the relay worker to stop
+ */
+static void relay_stop(struct relayworker *rw) {
+  pthread_mutex_lock(&rw->rwlock);
+  rw->rwstop = 1;
+  pthread_cond_signal(&rw->rwcv);
+  pthread_mutex_unlock(&rw->rwlock);
+  if (rw->rwrunning) {
+    mlog(SHUF_D1, "stop relay worker %d", rw->rwidx);
+    pthread_join(rw->rwtask, NULL);
+    pthread_mutex_lock(&rw->rwlock);
+    rw->rwrunning = 0;
+    pthread_mutex_unlock(&rw->rwlock);
+  }
+  mlog(SHUF_INFO, "relay worker %d: processed %" PRIu64 " batches, maxq=%d",
+       rw->rwidx, rw->rwnproc, rw->rwmaxq);
+}
+
 /*
  * forward_reqs_now: actually send a batch of requests now.  oq->nsending
  * has already been bumped up and an output struct has been allocated
@@ -2306,6 +4651,8 @@ static hg_return_t forward_reqs_now(struct request_queue *tosend,
                                     struct outqueue *oq, struct output *oput) {
   hg_return_t rv = HG_SUCCESS;
   hg_handle_t newhand = NULL;
+  struct memrpc *mrpc = NULL;
+  struct hgprogress *dsthgp = NULL;
   rpcin_t in;
   struct request *rp, *nrp;
   int cnt;
@@ -2316,8 +4663,20 @@ static hg_return_t forward_reqs_now(struct request_queue *tosend,
   XSIMPLEQ_INIT(&in.inreqs);
   XSIMPLEQ_CONCAT(&in.inreqs, tosend);
 
-  /* allocate new handle */
-  rv = HG_Create(oset->myhgp->mctx, oq->dst, oset->myhgp->rpcid, &newhand);
+  /* allocate new handle (or memrpc for the in-memory transport) */
+  if (oq->oqhgp->memx) {
+    rv = memx_create(sh, oset, oq, &mrpc, &dsthgp);
+  } else {
+    rv = HG_Create(oq->oqhgp->mctx, oq->dst, oq->oqhgp->rpcid, &newhand);
+    /* extra rails: target the same rail (context id) on the dst */
+    if (rv == HG_SUCCESS && oq->oqhgp->rail != 0) {
+      rv = HG_Set_target_id(newhand, oq->oqhgp->rail);
+      if (rv != HG_SUCCESS) {
+        HG_Destroy(newhand);
+        newhand = NULL;
+      }
+    }
+  }
   mlog(SHUF_CALL, "forward_now: output=%p rnk=[%d.%d] %s dst=%p hand=%p",
        oput, oq->grank, oq->subrank, outset_typstr(oq->myset->settype),
        oq->dst, newhand);
@@ -2327,14 +4686,22 @@ static hg_return_t forward_reqs_now(struct request_queue *tosend,
     pthread_mutex_lock(&oq->oqlock);
     switch (oput->ostep) {
       case OSTEP_CANCEL:
-        HG_Destroy(newhand);
+        if (newhand)
+          HG_Destroy(newhand);
+        free(mrpc);
         rv = HG_CANCELED;
         break;
       case OSTEP_PREP:
         oput->outhand = newhand;
+        oput->outmem = mrpc;
+        if (mrpc)
+          mrpc->oput = oput;      /* so the reply can find us */
         oput->ostep = OSTEP_SEND;
         oput->outseq = acnt32_incr(sh->seqsrc);
         oput->timestart = shuftime() - sh->boottime;
+        oput->tstart_us = shuf_now_us();
+        SHUF_TRACE(SHUF_TR_SEND, sh->grank, oq->grank, oput->outseq,
+                   oput->obytes);
 
         /* also init "in" since we are going to forward now */
         in.iseq = oput->outseq;
@@ -2357,7 +4724,10 @@ static hg_return_t forward_reqs_now(struct request_queue *tosend,
 
     mlog(SHUF_D1, "forward_now: HG_Forward R%d-%d to [%d.%d] dst=%p cnt=%d",
          in.forwardrank, in.iseq, oq->grank, oq->subrank, oq->dst, cnt);
-    rv = HG_Forward(oput->outhand, forw_cb, oput, &in);   /* SEND HERE! */
+    if (mrpc)
+      rv = memx_forward(dsthgp, mrpc, &in);                /* SEND HERE! */
+    else
+      rv = HG_Forward(oput->outhand, forw_cb, oput, &in);  /* SEND HERE! */
 
     if (rv != HG_SUCCESS) {   /* failure to launch, walk back outset_nrpcs */
       pthread_mutex_lock(&oset->os_rpclimitlock);
@@ -2379,6 +4749,7 @@ static hg_return_t forward_reqs_now(struct request_queue *tosend,
   } else {
 
     /* success!  the data was copied to the handle, so we can free reqs */
+    /* (memx_forward moved them, so in.inreqs is empty in that case) */
     XSIMPLEQ_FOREACH_SAFE(rp, &in.inreqs, next, nrp) {
       free(rp);
     }
@@ -2400,41 +4771,74 @@ static hg_return_t forward_reqs_now(struct request_queue *tosend,
  */
 static hg_return_t forw_cb(const struct hg_cb_info *cbi) {
   struct output *oput = (struct output *)cbi->arg;
-  struct outset *oset = oput->oqp->myset;
   hg_handle_t hand;
   rpcout_t out;
 
   mlog(SHUF_CALL, "forw_cb: oput=%p success=%d", oput, cbi->ret == HG_SUCCESS);
-  pthread_mutex_lock(&oset->os_rpclimitlock);
-  oset->outset_nrpcs--;
-  pthread_mutex_unlock(&oset->os_rpclimitlock);
 
   if (cbi->type != HG_CB_FORWARD) {
     notify(SHUF_CRIT, "cbi->type != FORWARD, impossible!");
     abort();
   }
-  if (cbi->ret != HG_SUCCESS) {
-    notify(SHUF_CRIT, "shuffle: forw_cb() failed (%d) - lost data?", cbi->ret);
-  }
   hand = cbi->info.forward.handle;
 
   if (hand && cbi->ret == HG_SUCCESS) {
     if (HG_Get_output(hand, &out) != HG_SUCCESS) {
       /* shouldn't ever happen, output is just 3 numbers */
       notify(SHUF_CRIT, "shuffle: forw_cb: get output failed");
+      forw_done(oput, cbi->ret, NULL);
     } else {
-      if (out.ret != HG_SUCCESS) {
-        notify(SHUF_CRIT, "shuffle: forw_cb: RPC %d failed (%d)",
-          out.oseq, out.ret);
-      }
+      forw_done(oput, cbi->ret, &out);
       HG_Free_output(hand, &out);
     }
+  } else {
+    forw_done(oput, cbi->ret, NULL);
+  }
+
+  return(HG_SUCCESS);
+}
+
+/*
+ * forw_done: an output's RPC has completed (forw_cb() or a reply
+ * from the in-memory transport).  record its stats and reply, and
+ * then start the next one.
+ *
+ * @param oput the output that completed
+ * @param ret status of the send
+ * @param out the reply (NULL if we didn't get one)
+ */
+static void forw_done(struct output *oput, hg_return_t ret, rpcout_t *out) {
+  struct outset *oset = oput->oqp->myset;
+  uint64_t now;
+
+  now = shuf_now_us();
+  oput->ortt = (int)(now - oput->tstart_us);
+  oput->ofailed = (ret != HG_SUCCESS);
+  shuf_hist_record(oset->orttlat, oput->ortt);
+  SHUF_TRACE(SHUF_TR_FORWCB, oset->shuf->grank, oput->oqp->grank,
+             oput->outseq, oput->obytes);
+
+  if (ret != HG_SUCCESS) {
+    notify(SHUF_CRIT, "shuffle: forw_cb() failed (%d) - lost data?", ret);
+  }
+  if (out) {
+    if (out->ret != HG_SUCCESS) {
+      notify(SHUF_CRIT, "shuffle: forw_cb: RPC %d failed (%d)",
+        out->oseq, out->ret);
+      oput->ofailed = 1;
+    }
+    oput->ocredit = out->credit;    /* forw_start_next installs it */
   }
 
+  pthread_mutex_lock(&oset->os_rpclimitlock);
+  oset->outset_nrpcs--;
+  if (oset->adaptive && oset->settype != SHUFFLE_RELAY_QUEUES)
+    oset->shufsend_rpclimit = aimd_update(&oset->osaimd, oput->ortt,
+                                          oput->ofailed, now);
+  pthread_mutex_unlock(&oset->os_rpclimitlock);
+
   /* destroy handle, drop nsending, and start next req */
   forw_start_next(oput->oqp, oput);
-
-  return(HG_SUCCESS);
 }
 
 /*
@@ -2449,7 +4853,12 @@ static void forw_progress_shufsendq(struct outset *oset) {
 
   pthread_mutex_lock(&oset->os_rpclimitlock);
   cando = oset->shufsend_rpclimit - oset->outset_nrpcs;
-  while (cando > 0) {
+  /*
+   * with several app threads, a sender we wake may only add to a
+   * loading list and not start an rpc.  if nothing is in flight there
+   * will be no forw_cb to wake the rest, so let them all go.
+   */
+  while (cando > 0 || oset->outset_nrpcs == 0) {
     sw = XTAILQ_FIRST(&oset->shufsendq);
     if (!sw) break;
     XTAILQ_REMOVE(&oset->shufsendq, sw, sw_q);
@@ -2475,7 +4884,8 @@ static void forw_start_next(struct outqueue *oq, struct output *oput) {
   struct outset *oset;
   bool tosend, flush_done, flushloadingnow, empty_outs;
   struct request_queue tosendq;
-  struct output *nxtoput;
+  struct output *nxtoput, *lastout;
+  struct oqflusher *of, *nof;
   struct req_parent *fq, **fq_end, *parent, *nparent;
   struct request *req;
 
@@ -2492,11 +4902,15 @@ static void forw_start_next(struct outqueue *oq, struct output *oput) {
     HG_Destroy(oput->outhand);
     oput->outhand = NULL;
   }
+  if (oput->outmem) {
+    free(oput->outmem);       /* the reply we just processed */
+    oput->outmem = NULL;
+  }
 
   /* now lock the queue so we can drop nsending and advance */
   pthread_mutex_lock(&oq->oqlock);
 
-  if (oq->oqflushing && oset->shuf->curflush == NULL) {
+  if (OQF_ACTIVE(&oq->oqsetflush) && oset->oflush.curflush == NULL) {
       notify(SHUF_CRIT, "shuffle: forw_start_next: flush sanity check fail!");
       notify(SHUF_CRIT, "shuffle: oq=%p [%d.%d]", oq, oq->grank, oq->subrank);
       shuffle_statedump(oset->shuf, 0);
@@ -2505,121 +4919,156 @@ static void forw_start_next(struct outqueue *oq, struct output *oput) {
 
   flush_done = false;
 
-  /* flushing?  see if we finished everying at and before oqflush_output */
-  if (oq->oqflushing && oput == oq->oqflush_output) {
+  /* flushing?  see if we finished everying at and before ofoutput */
+  XTAILQ_FOREACH_SAFE(of, &oq->oqflushers, ofq, nof) {
+    if (of->ofstate != OQF_OUTS || oput != of->ofoutput)
+      continue;
 
     if (oput == XTAILQ_FIRST(&oq->outs)) {  /* nothing before us? */
-      flush_done = true; /* so we call done_oq_flush() after unlock */
-      oq->oqflushing = 0;
-      oq->oqflush_output = NULL;
-      mlog(SHUF_D1, "forw_start_next: flush done!");
+      /* outset flush: we call done_oq_flush() after unlock */
+      if (oqflusher_done(oq, of))
+        flush_done = true;
+      mlog(SHUF_D1, "forw_start_next: flush %p done!", of);
     } else {
-      /* set oqflush_output to pending earlier request */
-      oq->oqflush_output = XTAILQ_PREV(oput, sending_outputs, q);
-      mlog(SHUF_D1, "forw_start_next: flush update to %p",
-           oq->oqflush_output);
+      /* set ofoutput to pending earlier request */
+      of->ofoutput = XTAILQ_PREV(oput, sending_outputs, q);
+      mlog(SHUF_D1, "forw_start_next: flush %p update to %p", of,
+           of->ofoutput);
       shufcount(&oq->cntoqflushorder);
     }
-
   }
 
   XTAILQ_REMOVE(&oq->outs, oput, q);
-  mlog(SHUF_D1, "forw_start_next: done with output=%p, oseq=%d",
-       oput, oput->outseq);
+  mlog(SHUF_D1, "forw_start_next: done with output=%p, oseq=%d, cr=%d",
+       oput, oput->outseq, oput->ocredit);
+  oq->crinflight -= oput->obytes;
+  oq_repdepth(oq);
+  if (oput->ocredit != CREDIT_NOREPLY)
+    oq->crwin = oput->ocredit;
+  if (oset->adaptive) {
+    if (oput->ortt >= 0)
+      oq->maxrpc = aimd_update(&oq->oqaimd, oput->ortt, oput->ofailed,
+                               oput->tstart_us + oput->ortt);
+    else    /* never launched (forward failed), count as a failure */
+      oq->maxrpc = aimd_update(&oq->oqaimd, 0, 1, shuf_now_us());
+  }
   free(oput);
   oput = NULL;
   if (oq->nsending > 0) oq->nsending--;
   mlog(SHUF_D1, "forw_start_next: dst=%p nsending=%d", oq->dst, oq->nsending);
 
-  tosend = false;
-  flushloadingnow = false;
-  XSIMPLEQ_INIT(&tosendq);   /* to be safe */
-  fq = NULL;
-  fq_end = &fq;
-  while (!oq->oqwaitq.empty() && tosend == false) {
-    req = oq->oqwaitq.front();
-    oq->oqwaitq.pop_front();
-
-    /* if flushing, see if we pulled the last req of interest */
-    if (oq->oqflushing && oq->oqflush_waitcounter > 0) {
-      oq->oqflush_waitcounter--;
-      if (oq->oqflush_waitcounter == 0) {
-        mlog(SHUF_D1, "forw_start_next: dst=%p cleared waitcount", oq->dst);
-        flushloadingnow = true;   /* done first phase of flush */
+  /*
+   * drain the waitq.  we keep starting batches until it is empty or
+   * we hit our window (maxrpc, which may have grown) or the dst's
+   * credit.  we drop the lock to forward each batch.
+   */
+  for (;;) {
+    tosend = false;
+    flushloadingnow = false;
+    XSIMPLEQ_INIT(&tosendq);   /* to be safe */
+    fq = NULL;
+    fq_end = &fq;
+    while (!oq->oqwaitq.empty() && tosend == false) {
+      /* stop if our window is full or dst has not given us enough credit */
+      if (oq->nsending >= oq->maxrpc)
+        break;
+      if (oq->crwin >= 0 && oq->nsending > 0 && oq->crinflight >= oq->crwin)
+        break;
+      req = oq->oqwaitq.front();
+      oq->oqwaitq.pop_front();
+      oq->waitbytes -= req->datalen;
+      oq_repdepth(oq);
+      shuf_hist_record(oset->owaitlat, shuf_now_us() - req->qtime);
+
+      /* if flushing, see if we pulled the last req of interest */
+      XTAILQ_FOREACH(of, &oq->oqflushers, ofq) {
+        if (of->ofstate == OQF_WAITQ && of->ofwaitcounter > 0 &&
+            --of->ofwaitcounter == 0) {
+          mlog(SHUF_D1, "forw_start_next: dst=%p %p cleared waitcount",
+               oq->dst, of);
+          flushloadingnow = true;   /* done first phase of flush */
+        }
       }
-    }
-
-    parent = req->owner;
-    req->owner = NULL;      /* detach req from owner now it is unblocked */
-    if (parent == NULL) {
 
-      /* should never happen */
-      notify(SHUF_CRIT, "shuffle: forw_cb: waitq req w/o owner?!?!");
-
-    } else if (acnt32_decr(parent->nrefs) < 1) {   /* drop reference */
+      parent = req->owner;
+      req->owner = NULL;      /* detach req from owner now it is unblocked */
+      if (parent == NULL) {
 
-      if (parent->onfq) {               /* onfq is a sanity check */
-        /* should never happen */
-        notify(SHUF_CRIT, "shuffle_forw_cb: failed onfq sanity check!!!");
-      } else {
-        /* done with parent, put on a list for stopwait()... */
-        *fq_end = parent;
-        fq_end = &parent->fqnext;
-        parent->onfq = 1;              /* now on an fq list */
-      }
+        /* credited req, return its bytes to the sender's window */
+        credit_release(oset->shuf, req);
 
-    }
+      } else if (acnt32_decr(parent->nrefs) < 1) {   /* drop reference */
 
-    /* this bumps nsending back up if it returns a "tosend" list */
-    mlog(SHUF_D1, "forw_start_next: dst=%p, pull req=%p from waitq",
-         oq->dst, req);
-    tosend = append_req_to_locked_outqueue(oset, oq, req,
-                                           &tosendq, &nxtoput, false);
-  }
+        if (parent->onfq) {               /* onfq is a sanity check */
+          /* should never happen */
+          notify(SHUF_CRIT, "shuffle_forw_cb: failed onfq sanity check!!!");
+        } else {
+          /* done with parent, put on a list for stopwait()... */
+          *fq_end = parent;
+          fq_end = &parent->fqnext;
+          parent->onfq = 1;              /* now on an fq list */
+        }
 
-  /* if flushing, ensure our req got pushed out */
-  if (flushloadingnow && !tosend) {
-    mlog(SHUF_D1, "forw_start_next: dst=%p need to push output queue", oq->dst);
-    tosend = append_req_to_locked_outqueue(oset, oq, NULL,
-                                           &tosendq, &nxtoput, true);
-    mlog(SHUF_D1, "forw_start_next: after push dst=%p tosend=%d",
-         oq->dst, tosend == true);
-  }
-  pthread_mutex_unlock(&oq->oqlock);
+      }
 
-  /*
-   * now we can stopwait() any parent whose nrefs dropped to zero.
-   * (we've saved them all on the "fq" list so we could delay the
-   * actual calls to stopwait() until after we've released the oqlock.)
-   */
-  if (fq)
-    mlog(SHUF_D1, "forw_start_next: dst=%p stopwait new zero refs", oq->dst);
-  for (parent = fq ; parent != NULL ; parent = nparent) {
-    nparent = parent->fqnext;  /* save copy, we are going to free parent */
-    parent_stopwait(oset->shuf, parent, 0);   /* might HG_Respond, etc. */
-  }
+      /* this bumps nsending back up if it returns a "tosend" list */
+      mlog(SHUF_D1, "forw_start_next: dst=%p, pull req=%p from waitq",
+           oq->dst, req);
+      tosend = append_req_to_locked_outqueue(oset, oq, req,
+                                             &tosendq, &nxtoput, false);
+    }
 
-  /* if waitq gave us enough to start sending, do it now */
-  if (tosend) {
+    /* if flushing, ensure our req got pushed out */
+    if (flushloadingnow && !tosend) {
+      mlog(SHUF_D1, "forw_start_next: dst=%p need to push output queue", oq->dst);
+      tosend = append_req_to_locked_outqueue(oset, oq, NULL,
+                                             &tosendq, &nxtoput, true);
+      mlog(SHUF_D1, "forw_start_next: after push dst=%p tosend=%d",
+           oq->dst, tosend == true);
+    }
+    pthread_mutex_unlock(&oq->oqlock);
+
+    /*
+     * now we can stopwait() any parent whose nrefs dropped to zero.
+     * (we've saved them all on the "fq" list so we could delay the
+     * actual calls to stopwait() until after we've released the oqlock.)
+     */
+    if (fq)
+      mlog(SHUF_D1, "forw_start_next: dst=%p stopwait new zero refs", oq->dst);
+    for (parent = fq ; parent != NULL ; parent = nparent) {
+      nparent = parent->fqnext;  /* save copy, we are going to free parent */
+      parent_stopwait(oset->shuf, parent, 0);   /* might HG_Respond, etc. */
+    }
 
     /* if flushing and drained oqwaitq, start output tracking before send */
     if (flushloadingnow) {
-      pthread_mutex_lock(&oq->oqlock);
-      oq->oqflush_output = XTAILQ_LAST(&oq->outs, sending_outputs);
-      empty_outs = (oq->oqflush_output == NULL);
-      mlog(SHUF_D1, "forw_start_next: dst=%p set oqflush_output=%p, e=%d",
-           oq->dst, oq->oqflush_output, empty_outs == true);
-      if (empty_outs) {     /* unlikely, but possible */
-        oq->oqflushing = 0;
-        flush_done = true;  /* trigger call to done_oq_flush, below */
-      }
-      pthread_mutex_unlock(&oq->oqlock);
-
+        pthread_mutex_lock(&oq->oqlock);
+        lastout = XTAILQ_LAST(&oq->outs, sending_outputs);
+        empty_outs = (lastout == NULL);
+        XTAILQ_FOREACH_SAFE(of, &oq->oqflushers, ofq, nof) {
+          if (of->ofstate != OQF_WAITQ || of->ofwaitcounter != 0)
+            continue;
+          mlog(SHUF_D1, "forw_start_next: dst=%p %p set ofoutput=%p, e=%d",
+               oq->dst, of, lastout, empty_outs == true);
+          if (empty_outs) {     /* unlikely, but possible */
+            if (oqflusher_done(oq, of))
+              flush_done = true;  /* trigger call to done_oq_flush, below */
+          } else {
+            of->ofoutput = lastout;
+            of->ofstate = OQF_OUTS;
+          }
+        }
+        pthread_mutex_unlock(&oq->oqlock);
     }
 
+    /* if waitq gave us enough to start sending, do it now */
+    if (!tosend)
+      break;
+
     /* this will print an warning on failure */
     mlog(SHUF_D1, "forw_start_next: dst=%p, sending next", oq->dst);
     (void) forward_reqs_now(&tosendq, oset->shuf, oset, oq, nxtoput);
+    pthread_mutex_lock(&oq->oqlock);
   }
 
   /* if we finished the flush, pass that info upward */
@@ -2651,6 +5100,11 @@ static void forw_start_next(struct outqueue *oq, struct output *oput) {
  *   [3] req input islocal and req->src is not on local node: in this
  *       case we are the recv side of the third hop, so we do not need
  *       to make copies of the req at all.
+ * the 2 hop routing modes skip one of these steps: for NOSRCREP the
+ * SRC itself sends to the DSTREP of every remote node (no [2]), for
+ * NODSTREP the SRCREP sends to every rank on its remote nodes (no [1]).
+ * for shuffle_epoch_end() we count the copies we make as sent (the
+ * origin only counts the copies it queued itself).
  *
  * @param sh the shuffle we are using
  * @param req the inbound request received from a RPC request
@@ -2666,6 +5120,7 @@ void shuffle_bcast_dup(struct shuffle *sh, struct request *req,
     std::map<hg_addr_t, struct outqueue *>::iterator it;
     struct outqueue *oq;
     struct request *newrq;
+    int ndup;
 
     /*
      * sanity check: the qp should be empty when we get called since
@@ -2677,9 +5132,13 @@ void shuffle_bcast_dup(struct shuffle *sh, struct request *req,
         notify(SHUF_WARN, "bcast_dup: warning: called w/non-empty eq?");
     }
 
+    if ((islocal && sh->routing == SHUFFLE_ROUTE_NOSRCREP) ||
+        (!islocal && sh->routing == SHUFFLE_ROUTE_NODSTREP))
+       return;                 /* 2 hop: sender already covered this */
+
     if (islocal) {
        /* use nexus to determine if req->src is on local node or not */
-       nexus = nexus_next_hop(sh->nxp, req->src, &rank, &daddr);
+       nexus = sh->rt->next_hop(sh->rtarg, req->src, &rank, &daddr);
        if (nexus != NX_ISLOCAL) {
            if (nexus != NX_DESTREP && nexus != NX_SRCREP)
                notify(SHUF_WARN, "bcast_dup: nexus_err=%d for rank=%d",
@@ -2694,30 +5153,35 @@ void shuffle_bcast_dup(struct shuffle *sh, struct request *req,
     /*
      * now replicate the req as-per the selected outset.
      */
+    ndup = 0;
     for (it = oset->oqs.begin() ; it != oset->oqs.end() ; it++) {
         oq = it->second;
-        if (oq->grank == sh->grank)
+        if (oq->grank == sh->grank || oq->direct)
             continue;       /* don't make a copy for us, we already got it */
+        if (oset == &sh->remoteq && !srcrep_primary(sh, oq->grank))
+            continue;       /* another SRCREP covers that node */
 
         newrq = shuffle_req_dup(req);
         if (!newrq) {
             notify(SHUF_CRIT, "broadcast dup failed!  data likely lost!");
             drop_reqs(NULL, qp, "shuffle_bcast_dup");
+            ndup = 0;
             break;
         } else {
             newrq->dst = oq->grank;  /* update dst to next rank in bcast */
             XSIMPLEQ_INSERT_TAIL(qp, newrq, next);
+            ndup++;
         }
     }
 
+    if (ndup && epoch_recv(sh, req, 0))
+        acnt32_add(sh->esent[req->epoch & 1], ndup);
+
 }
 
 /*
- * shuffle_rpchand: mercury callback when we recv an RPC.  we need to
- * unpack the requests in the batch and use nexus to forward them on
- * to their next hop.  we'll allocate a req_parent to own any req that
- * gets placed on a waitq.  being placed on a waitq will cause our
- * HG_Respond() to be delayed until everything clears the wait queue.
+ * shuffle_rpchand: mercury callback when we recv an RPC.  we decode
+ * the batch and pass it to shuffle_rpcin() to route.
  *
  * @param handle the handle from the RPC request
  * @return success
@@ -2725,19 +5189,11 @@ void shuffle_bcast_dup(struct shuffle *sh, struct request *req,
 static hg_return_t shuffle_rpchand(hg_handle_t handle) {
   const struct hg_info *hgi;
   struct hgprogress *inhgp;
-  struct outset *outoset;
   struct shuffle *sh;
-  int islocal, isbcastq, rank;
+  int islocal;
   hg_return_t ret;
   rpcin_t in;
-  struct request_queue bcast_inreqs;
-  struct request *req;
-  nexus_ret_t nexus;
-  hg_addr_t dstaddr;
-  struct req_parent *parent = NULL;
-  std::map<hg_addr_t, struct outqueue *>::iterator it;
-  struct outqueue *oq;
-  rpcout_t reply;
+  struct rpcsrc input;
 
   mlog(SHUF_CALL, "rpchand: rpc recv'd.  handle=%p", handle);
 
@@ -2756,10 +5212,7 @@ static hg_return_t shuffle_rpchand(hg_handle_t handle) {
   sh = inhgp->hgshuf;
   islocal = (inhgp == &sh->hgp_local);
   mlog(SHUF_D1, "rpchand: got request hand=%p local=%d", handle, islocal);
-  if (islocal)
-    shufcount(&sh->cntrpcinshm);
-  else
-    shufcount(&sh->cntrpcinnet);
+  acnt64_incr(sh->stats, (islocal) ? ST_RPCINSHM : ST_RPCINNET);
 
   /* if sending is disabled, we don't want new requests */
   if (sh->disablesend) {
@@ -2775,9 +5228,60 @@ static hg_return_t shuffle_rpchand(hg_handle_t handle) {
     HG_Destroy(handle);
     return(ret);
   }
-  XSIMPLEQ_INIT(&bcast_inreqs);
   mlog(SHUF_D1, "rpchand: hand=%p is R%d-%d", handle, in.forwardrank, in.iseq);
 
+  input.hand = handle;
+  input.mrpc = NULL;
+  rpcin_handoff(inhgp, &input, &in);
+
+  mlog(SHUF_CALL, "rpchand: DONE.  handle=%p", handle);
+  return(HG_SUCCESS);
+}
+
+/*
+ * shuffle_rpcin: process an inbound batch (from mercury or the
+ * in-memory transport).  we use the router to forward each req on
+ * to its next hop.  we'll allocate a req_parent to own any req that
+ * gets placed on a waitq.  being placed on a waitq will cause our
+ * reply to be delayed until everything clears the wait queue.
+ *
+ * @param inhgp the hgprogress we got the batch on
+ * @param input where the batch came from (for the reply)
+ * @param in the decoded batch
+ */
+static void shuffle_rpcin(struct hgprogress *inhgp, struct rpcsrc *input,
+                          rpcin_t *in) {
+  struct outset *outoset;
+  struct shuffle *sh = inhgp->hgshuf;
+  int islocal, isbcastq, rank;
+  hg_return_t ret = HG_SUCCESS;
+  struct request_queue bcast_inreqs;
+  struct request *req;
+  nexus_ret_t nexus;
+  hg_addr_t dstaddr;
+  struct req_parent *parent = NULL;
+  std::map<hg_addr_t, struct outqueue *>::iterator it;
+  struct outqueue *oq;
+  rpcout_t reply;
+  int nbytes, credited;
+
+  islocal = (inhgp == &sh->hgp_local);
+
+  XSIMPLEQ_INIT(&bcast_inreqs);
+
+  /*
+   * if the whole batch fits in the sender's credit window, then any of
+   * its reqs that have to wait can do so without a req_parent and we
+   * can respond now.  otherwise fall back to holding the reply.
+   */
+  nbytes = 0;
+  XSIMPLEQ_FOREACH(req, &in->inreqs, next) {
+    nbytes += req->datalen;
+  }
+  credited = credit_check(sh, in->forwardrank, nbytes);
+  in->crleft = (credited) ? nbytes : 0;
+  SHUF_TRACE(SHUF_TR_RPCIN, sh->grank, in->forwardrank, in->iseq, nbytes);
+
   /*
    * now we've got a list of reqs to either deliver local or forward
    * to their next hop...   if any requests get put on a wait queue,
@@ -2796,15 +5300,17 @@ static hg_return_t shuffle_rpchand(hg_handle_t handle) {
     if ((req = XSIMPLEQ_FIRST(&bcast_inreqs)) != NULL) {
         XSIMPLEQ_REMOVE_HEAD(&bcast_inreqs, next);
         isbcastq = 1;
-    } else if ((req = XSIMPLEQ_FIRST(&in.inreqs)) != NULL) {
-        XSIMPLEQ_REMOVE_HEAD(&in.inreqs, next);
+    } else if ((req = XSIMPLEQ_FIRST(&in->inreqs)) != NULL) {
+        XSIMPLEQ_REMOVE_HEAD(&in->inreqs, next);
         isbcastq = 0;
+        if (credited)
+          req->crrank = in->forwardrank;
     } else {
         break;     /* no requests left, break the while loop, we are done */
     }
 
     /* determine next hop */
-    nexus = nexus_next_hop(sh->nxp, req->dst, &rank, &dstaddr);
+    nexus = sh->rt->next_hop(sh->rtarg, req->dst, &rank, &dstaddr);
     mlog(SHUF_D1, "rpchand: new req=%p bcastq=%d dst=%d nexus=%d", req,
          isbcastq, req->dst, nexus);
 
@@ -2822,7 +5328,7 @@ static hg_return_t shuffle_rpchand(hg_handle_t handle) {
       }
 
       mlog(SHUF_D1, "rpchand: req=%p to_self", req);
-      ret = req_to_self(sh, req, handle, &in, &parent);
+      ret = req_to_self(sh, req, input, in, &parent);
 
       continue;
     }
@@ -2848,7 +5354,7 @@ static hg_return_t shuffle_rpchand(hg_handle_t handle) {
       notify(SHUF_ERR, "rpchand: nexus PANIC!  "
                        "%d: %d->%d len=%d code=%d, l=%d, R%d-%d", sh->grank,
                        req->src, req->dst, req->datalen, nexus, islocal,
-                       in.forwardrank, in.iseq);
+                       in->forwardrank, in->iseq);
       drop_reqs(&req, NULL, NULL);  /* no msg, we already printed one */
       continue;
     }
@@ -2861,7 +5367,7 @@ static hg_return_t shuffle_rpchand(hg_handle_t handle) {
       notify(SHUF_ERR, "rpchand: forwarding broadcast request  "
                        "%d: %d->%d len=%d code=%d, l=%d, R%d-%d", sh->grank,
                        req->src, req->dst, req->datalen, nexus, islocal,
-                       in.forwardrank, in.iseq);
+                       in->forwardrank, in->iseq);
       drop_reqs(&req, NULL, NULL);  /* no msg, we already printed one */
       continue;
     }
@@ -2880,10 +5386,14 @@ static hg_return_t shuffle_rpchand(hg_handle_t handle) {
     }
 
     oq = it->second;    /* now we have the correct output queue */
+    if (nexus == NX_DESTREP) {
+      acnt64_incr(sh->stats, ST_REPREQS);
+      acnt64_add(sh->stats, ST_REPBYTES, req->datalen);
+    }
 
     mlog(SHUF_D1, "rpchand: req=%p via mercury [%d.%d] oq=%p", req,
          oq->grank, oq->subrank, oq);
-    ret = req_via_mercury(sh, outoset, oq, req, handle, &in, &parent);
+    ret = req_via_mercury(sh, outoset, oq, req, input, in, &parent);
 
   } /* while (1) */
 
@@ -2903,26 +5413,66 @@ static hg_return_t shuffle_rpchand(hg_handle_t handle) {
    * on the other hand, if we did not malloc a req_parent then the
    * RPC is done and we can respond right now.
    */
+  /* give back reserved credit of reqs that did not have to wait */
+  if (credited)
+    credit_unreserve(sh, in->forwardrank, in->crleft);
+
   if (parent != NULL) {
-    mlog(SHUF_D1, "rpchand: flowctrl handle=%p, new parent=%p", handle,
-         parent);
-    (void) HG_Free_input(handle, &in);
-    parent_dref_stopwait(sh, parent, 0);
+    mlog(SHUF_D1, "rpchand: flowctrl R%d-%d, new parent=%p", in->forwardrank,
+         in->iseq, parent);
+    if (input->hand)
+      (void) HG_Free_input(input->hand, in);
+    parent_dref_stopwait(sh, parent, 0);  /* in may be gone after this */
   } else {
-    mlog(SHUF_D1, "rpchand: done! handle=%p, ret=%d", handle, ret);
-    reply.oseq = in.iseq;
+    mlog(SHUF_D1, "rpchand: done! R%d-%d, ret=%d", in->forwardrank,
+         in->iseq, ret);
+    reply.oseq = in->iseq;
     reply.respondrank = sh->grank;
     reply.ret = ret;
-    (void) HG_Free_input(handle, &in);
-    ret = HG_Respond(handle, shuffle_desthand_cb, handle, &reply);
+    reply.credit = credit_avail(sh, in->forwardrank);
+    if (input->hand)
+      (void) HG_Free_input(input->hand, in);
+    rpc_reply(input, &reply);
+  }
+}
+
+/*
+ * rpc_reply: send the reply for an inbound RPC.  for mercury we
+ * HG_Respond() and drop the handle in shuffle_desthand_cb(), for
+ * the in-memory transport we queue the memrpc back to the sender
+ * (who frees it).
+ *
+ * @param input the inbound RPC we are replying to
+ * @param reply the reply
+ */
+static void rpc_reply(struct rpcsrc *input, rpcout_t *reply) {
+  struct memrpc *mrpc = input->mrpc;
+  struct hgprogress *hgp;
+  hg_return_t ret;
+
+  if (mrpc == NULL) {
+    ret = HG_Respond(input->hand, shuffle_desthand_cb, input->hand, reply);
     if (ret != HG_SUCCESS)
-      HG_Destroy(handle);
+      HG_Destroy(input->hand);
+    return;
   }
 
-  mlog(SHUF_CALL, "rpchand: DONE.  handle=%p", handle);
-  return(HG_SUCCESS);
+  mrpc->out = *reply;
+  mrpc->isreply = 1;
+  hgp = mrpc->srchgp;
+  pthread_mutex_lock(&hgp->mqlock);
+  if (hgp->mqstop) {        /* sender shutdown, purge_reqs freed oput */
+    pthread_mutex_unlock(&hgp->mqlock);
+    mlog(SHUF_WARN, "rpc_reply: sender stopped, drop memx reply");
+    free(mrpc);
+    return;
+  }
+  XSIMPLEQ_INSERT_TAIL(&hgp->memq, mrpc, mnext);
+  pthread_cond_signal(&hgp->mqcv);
+  pthread_mutex_unlock(&hgp->mqlock);
 }
 
+
 /*
  * shuffle_desthand_cb: sent reply, drop the handle
  *
@@ -2937,254 +5487,725 @@ static hg_return_t shuffle_desthand_cb(const struct hg_cb_info *cbi) {
 }
 
 /*
- * aquire_flush: flush operations are serialized.  this function
- * blocks until a flush can run...  flush type is one of localq,
- * remoteq, or deliver.
- *
- * for localq/remoteq if we are successful we set osetflushing=1
- * and init the oqflush_counter to 1 (to hold it until the caller
- * can sleep).
+ * flush_target_of: map a SHUFFLE_*_QUEUES value to its flush target
  *
  * @param sh the shuffle we are using
- * @param fop the op that needs to flush, has not been init'd
- * @param type the type of flush we are planning to run (FLUSH_*)
- * @param oset the output set (if type is localq or remoteq)
- * @return status (normally success after waiting)
+ * @param whichqs the queues to flush
+ * @return the flush target or NULL if whichqs is invalid
  */
-static hg_return_t aquire_flush(struct shuffle *sh, struct flush_op *fop,
-                                int type, struct outset *oset) {
-  hg_return_t rv = HG_SUCCESS;
-  struct cond_timedwait ctw;
-  mlog(CLNT_CALL, "aquire_flush: type=%d fop=%p oset=%p", type, fop, oset);
+static struct flush_target *flush_target_of(struct shuffle *sh,
+                                            int whichqs) {
+  switch (whichqs) {
+    case SHUFFLE_REMOTE_QUEUES:
+      return(&sh->remoteq.oflush);
+    case SHUFFLE_ORIGIN_QUEUES:
+      return(&sh->local_orq.oflush);
+    case SHUFFLE_RELAY_QUEUES:
+      return(&sh->local_rlq.oflush);
+    case SHUFFLE_DELIVERY_QUEUES:
+      return(&sh->dflush);
+  }
+  return(NULL);
+}
+
+/*
+ * shuffle_flush_start: start an asynchronous flush.   the flush
+ * covers all requests in the specified queues at the time it starts
+ * running.   flushes of the same queues are run one at a time
+ * (later ones are queued), but flushes of different queues run
+ * concurrently.  note that merging staged reqs may block here (we
+ * can't defer that to flush_run, it may run in a callback).
+ */
+hg_return_t shuffle_flush_start(shuffle_t sh, int whichqs,
+                                shuffle_flush_t *fhp) {
+  struct flush_target *ft;
+  struct flush_op *fop;
+  hg_return_t rv;
+  int run;
+  mlog(CLNT_CALL, "shuffle_flush_start: type=%s", outset_typstr(whichqs));
+
+  ft = flush_target_of(sh, whichqs);
+  if (ft == NULL) {
+    mlog(CLNT_ERR, "shuffle_flush_start(%d): bad whichqs", whichqs);
+    return(HG_OTHER_ERROR);
+  }
+
+  /* no point trying to flush output queues if we can't send */
+  if (ft->foset && sh->disablesend)
+    return(HG_CANCELED);
+
+  /* app msgs staged before the flush must be covered by it */
+  if (ft->foset && ft->foset != &sh->local_rlq) {
+    rv = stage_drainall(sh);
+    if (rv != HG_SUCCESS)
+      return(rv);
+  }
 
-  /* first init the flush operation's CV */
+  fop = (struct flush_op *)malloc(sizeof(*fop));
+  if (fop == NULL)
+    return(HG_NOMEM_ERROR);
+  if (pthread_mutex_init(&fop->flush_oplock, NULL) != 0) {
+    notify(CLNT_CRIT, "shuffle: flush lock init failed!");
+    free(fop);
+    return(HG_OTHER_ERROR);
+  }
   if (pthread_cond_init(&fop->flush_waitcv, NULL) != 0) {
     notify(CLNT_CRIT, "shuffle: flush cv init failed!");
+    pthread_mutex_destroy(&fop->flush_oplock);
+    free(fop);
     return(HG_OTHER_ERROR);
   }
+  fop->ftarget = ft;
+  fop->nrefs = 2;                   /* app's handle + target */
+  if (ft->foset)
+    acnt64_incr(ft->foset->ostats, OST_FLUSHES);
+  else
+    acnt64_incr(sh->stats, ST_DFLUSHES);
 
   pthread_mutex_lock(&sh->flushlock);
-  fop->status = (sh->curflush != NULL) ? FLUSHQ_PENDING : FLUSHQ_READY;
-  shufcount(&sh->cntflush[type]);
-  if (fop->status == FLUSHQ_PENDING) shufcount(&sh->cntflushwait);
-
-  /* if flush is busy, our op needs to wait for it */
-  if (fop->status == FLUSHQ_PENDING) {
-    XSIMPLEQ_INSERT_TAIL(&sh->fpending, fop, fq);
-    init_cond_timedwait(&ctw, SHUFFLE_TIMEOUT, 1, "aquire_flush");
-    while (fop->status == FLUSHQ_PENDING) {
-     mlog(CLNT_D1, "aquire_flush: blocking fop=%p", fop);
-     do_cond_timedwait(sh, &fop->flush_waitcv, &sh->flushlock, &ctw); /*BLOCK*/
-     mlog(CLNT_D1, "aquire_flush: UNblocking fop=%p", fop);
-    }
-
-    /* wakeup removed us from pending queue, see if we were canceled */
-    if (fop->status == FLUSHQ_CANCEL) {
-      notify(CLNT_CRIT, "shuffle: aqflush: cancel while waiting");
-      pthread_cond_destroy(&fop->flush_waitcv);
-      return(HG_CANCELED);
-    }
+  run = (ft->curflush == NULL);
+  if (run) {
+    fop->status = FLUSHQ_READY;
+    ft->curflush = fop;
+  } else {
+    fop->status = FLUSHQ_PENDING;   /* will be run by flush_finish() */
+    XSIMPLEQ_INSERT_TAIL(&ft->fpending, fop, fq);
+    acnt64_incr(sh->stats, ST_FLUSHWAITS);
   }
-  mlog(CLNT_D1, "aquire_flush: got flush for fop=%p", fop);
+  pthread_mutex_unlock(&sh->flushlock);
+
+  *fhp = fop;         /* set before run, fop may complete in flush_run */
+  if (run)
+    flush_run(sh, ft);
+
+  mlog(CLNT_D1, "shuffle_flush_start: fop=%p, run=%d", fop, run);
+  return(HG_SUCCESS);
+}
+
+/*
+ * shuffle_flush_test: check if an asynchronous flush has finished.
+ */
+hg_return_t shuffle_flush_test(shuffle_t sh, shuffle_flush_t fh,
+                               int *donep) {
+  (void)sh;
+  pthread_mutex_lock(&fh->flush_oplock);
+  *donep = (fh->status == FLUSHQ_DONE || fh->status == FLUSHQ_CANCEL);
+  pthread_mutex_unlock(&fh->flush_oplock);
+  return(HG_SUCCESS);
+}
 
-  /* setup state for this flush */
-  sh->curflush = fop;
-  sh->flushdone = 0;
-  sh->flushtype = type;
-  sh->flushoset = oset;
+/*
+ * shuffle_flush_wait: wait for an asynchronous flush to finish and
+ * release its handle.  the op is canceled (and never blocks us) once
+ * shuffle_shutdown() has started, so we only touch sh while it is
+ * still valid.
+ */
+hg_return_t shuffle_flush_wait(shuffle_t sh, shuffle_flush_t fh) {
+  hg_return_t rv;
+  struct cond_timedwait ctw;
+  int nrefs;
+  mlog(CLNT_CALL, "shuffle_flush_wait: fop=%p", fh);
 
-  /* if we have an oset, then additional work todo while holding flushlock */
-  if (oset) {
-    oset->osetflushing = 1;
-    acnt32_set(oset->oqflush_counter, 1);
+  pthread_mutex_lock(&fh->flush_oplock);
+  init_cond_timedwait(&ctw, SHUFFLE_TIMEOUT, 1, "flush_wait");
+  while (fh->status == FLUSHQ_PENDING || fh->status == FLUSHQ_READY) {
+    do_cond_timedwait(sh, &fh->flush_waitcv, &fh->flush_oplock, &ctw);
+  }
+  rv = (fh->status == FLUSHQ_CANCEL) ? HG_CANCELED : HG_SUCCESS;
+  nrefs = --fh->nrefs;
+  pthread_mutex_unlock(&fh->flush_oplock);
+
+  if (nrefs == 0) {
+    pthread_cond_destroy(&fh->flush_waitcv);
+    pthread_mutex_destroy(&fh->flush_oplock);
+    free(fh);
   }
+  mlog(CLNT_D1, "shuffle_flush_wait: done rv=%d", rv);
+  return(rv);
+}
 
-  pthread_mutex_unlock(&sh->flushlock);
+/*
+ * shuffle_flush_delivery: flush the delivery queues.  this function
+ * blocks until all requests currently in the delivery queues (both
+ * deliverq and dwaitq) are delivered.
+ */
+hg_return_t shuffle_flush_delivery(shuffle_t sh) {
+  return(shuffle_flush_qs(sh, SHUFFLE_DELIVERY_QUEUES));
+}
+
+/*
+ * shuffle_flush_qs: flush either local or remote output queues.
+ * this function blocks until all requests currently in the specified
+ * output queues are delivered. We make no claims about requests that
+ * arrive after the flush has been started.
+ */
+hg_return_t shuffle_flush_qs(shuffle_t sh, int whichqs) {
+  shuffle_flush_t fh;
+  hg_return_t rv;
+  mlog(CLNT_CALL, "shuffle_flush_qs: type=%s", outset_typstr(whichqs));
 
-  /* make sure we are still running or we might block forever... */
-  if (( (type == FLUSH_LOCAL_ORQ || type == FLUSH_LOCAL_RLQ)  &&
-        (sh->hgp_local.nshutdown  != 0 || sh->hgp_local.nrunning  == 0)) ||
-      (type == FLUSH_REMOTEQ &&
-        (sh->hgp_remote.nshutdown != 0 || sh->hgp_remote.nrunning == 0)) ||
-      (type == FLUSH_DELIVER && (sh->dshutdown != 0 || sh->drunning == 0)) ) {
+  rv = shuffle_flush_start(sh, whichqs, &fh);
+  if (rv == HG_SUCCESS)
+    rv = shuffle_flush_wait(sh, fh);                /* may BLOCK here */
 
-    drop_curflush(sh);
-    rv = HG_CANCELED;
+  mlog(CLNT_D1, "shuffle_flush_qs: done! type=%s rv=%d!",
+       outset_typstr(whichqs), rv);
+  return(rv);
+}
+
+/*
+ * shuffle_flush_dst: flush the path to dst and wait for dst to ack.
+ * if dst has a direct queue we first flush it with a private flusher
+ * (so we do not serialize behind, or block, outset flushes).  then we
+ * send a flush marker control msg to dst along the normal path.
+ * control msgs are never buffered in a loading list, so the marker
+ * pushes out the batch holding earlier reqs for dst at every hop
+ * (origin, relay, remote).  with REPSEL_DEPTH earlier reqs may have
+ * gone through any of dst's SRCREPs, so we send a marker via each.
+ * dst's delivery thread acks a marker after delivering the reqs ahead
+ * of it (ctl_flushack), and ctl_recv wakes us.  with enqstage, all
+ * staged msgs (not just dst's) are merged first.
+ */
+hg_return_t shuffle_flush_dst(shuffle_t sh, int dst) {
+  nexus_ret_t nexus;
+  int rank, nmark, lcv, seq0, rc;
+  int ranks[SHUFFLE_MAXSRCREPS];
+  hg_addr_t dstaddr, addrs[SHUFFLE_MAXSRCREPS];
+  struct outqueue *oq;
+  struct ctlmsg cm;
+  struct oqflusher of;
+  pthread_cond_t ofcv;
+  struct cond_timedwait ctw;
+  hg_return_t rv;
+  mlog(CLNT_CALL, "shuffle_flush_dst: dst=%d", dst);
+
+  /* no point trying to flush if we can't send */
+  if (sh->disablesend)
+    return(HG_CANCELED);
+
+  nexus = sh->rt->next_hop(sh->rtarg, dst, &rank, &dstaddr);
+  if (nexus == NX_DONE || dst == sh->grank)
+    return(HG_SUCCESS);       /* to self: no output queue on the path */
+  if (nexus != NX_ISLOCAL && nexus != NX_SRCREP && nexus != NX_DESTREP) {
+    mlog(CLNT_ERR, "shuffle_flush_dst: bogus nexus value %d", nexus);
+    return(HG_INVALID_PARAM);
+  }
+  nmark = 1;
+  if (nexus == NX_SRCREP && sh->nreps > 1 &&
+      sh->repsel == SHUFFLE_REPSEL_DEPTH) {
+    nmark = sh->rt->srcreps(sh->rtarg, dst, ranks, addrs);
+    if (nmark > SHUFFLE_MAXSRCREPS)
+      nmark = SHUFFLE_MAXSRCREPS;
+    if (nmark < 1)
+      nmark = 1;
+  }
+
+  /* the marker must follow any staged app msgs (we merge them all) */
+  rv = stage_drainall(sh);
+  if (rv != HG_SUCCESS)
+    return(rv);
+  acnt64_incr(sh->stats, ST_DSTFLUSHES);
+
+  /* direct reqs skip the relays, so they must be at dst first */
+  oq = (sh->dir.dmax) ? __atomic_load_n(&sh->dir.doq[dst], __ATOMIC_ACQUIRE)
+                      : NULL;
+  if (oq) {
+    if (pthread_cond_init(&ofcv, NULL) != 0)
+      return(HG_OTHER_ERROR);
+    of.ofstate = OQF_IDLE;
+    of.ofwaitcounter = 0;
+    of.ofoutput = NULL;
+    of.ofcv = &ofcv;
+    if (start_qflush(sh, &sh->remoteq, oq, &of, NULL)) {
+      pthread_mutex_lock(&oq->oqlock);
+      shufcount(&oq->cntoqdstflushes);
+      init_cond_timedwait(&ctw, SHUFFLE_TIMEOUT, 1, "flush_dst");
+      while (OQF_ACTIVE(&of)) {
+        do_cond_timedwait(sh, &ofcv, &oq->oqlock, &ctw); /*BLOCK*/
+      }
+      pthread_mutex_unlock(&oq->oqlock);
+    }
+    pthread_cond_destroy(&ofcv);
+    if (of.ofstate == OQF_CANCEL)
+      return(HG_CANCELED);
+  }
+
+  /* send the markers, each with its own seq# for the ack */
+  pthread_mutex_lock(&sh->fdlock);
+  seq0 = sh->fdseq;
+  sh->fdseq += nmark;
+  for (lcv = 0 ; lcv < nmark ; lcv++)
+    sh->fdpending.insert(seq0 + lcv);
+  pthread_mutex_unlock(&sh->fdlock);
+
+  memset(&cm, 0, sizeof(cm));
+  cm.op = CTL_FLUSHMARK;
+  for (lcv = 0 ; lcv < nmark && rv == HG_SUCCESS ; lcv++) {
+    cm.wave = seq0 + lcv;
+    rv = shuffle_enqueue_raw(sh, dst, 0, REQ_HF_CTL, (nmark > 1) ? lcv : -1,
+                             &cm, sizeof(cm));
   }
 
-  mlog(CLNT_D1, "aquire_flush: fop=%p, return=%d", fop, rv);
+  /* wait for the acks (timing out is an error, but not fatal) */
+  pthread_mutex_lock(&sh->fdlock);
+  init_cond_timedwait(&ctw, SHUFFLE_TIMEOUT, 0, "flush_dst ack");
+  for (lcv = 0 ; lcv < nmark && rv == HG_SUCCESS ; lcv++) {
+    while (sh->fdpending.count(seq0 + lcv) != 0) {
+      rc = pthread_cond_timedwait(&sh->fdcv, &sh->fdlock,
+                                  &ctw.ctw_abstime);           /*BLOCK*/
+      if (rc == ETIMEDOUT) {
+        notify(SHUF_WARN, "shuffle: flush_dst: no ack from %d", dst);
+        rv = HG_TIMEOUT;
+        break;
+      }
+    }
+  }
+  for (lcv = 0 ; lcv < nmark ; lcv++)
+    sh->fdpending.erase(seq0 + lcv);
+  pthread_mutex_unlock(&sh->fdlock);
+
+  mlog(CLNT_D1, "shuffle_flush_dst: dst=%d done rv=%d", dst, rv);
   return(rv);
 }
 
 /*
- * drop_curflush: we are the flusher, but we are done with it.  drop it
- * and wake up anyone waiting on the pending list to flush.
+ * epoch_flushall: start flushes of all three output queue sets and
+ * wait for them.  used by each wave of shuffle_epoch_end() to push
+ * buffered data of the epoch along the 3 hop path.
  *
  * @param sh the shuffle we are using
+ * @return status
  */
-static void drop_curflush(struct shuffle *sh) {
-  struct flush_op *nxtfop;
-  mlog(CLNT_CALL, "drop_curflush");
+static hg_return_t epoch_flushall(struct shuffle *sh) {
+  int whichqs[3] = { SHUFFLE_ORIGIN_QUEUES, SHUFFLE_RELAY_QUEUES,
+                     SHUFFLE_REMOTE_QUEUES };
+  shuffle_flush_t fh[3];
+  hg_return_t rv, rv0 = HG_SUCCESS;
+  int lcv, nstarted;
+
+  for (nstarted = 0 ; nstarted < 3 ; nstarted++) {
+    rv0 = shuffle_flush_start(sh, whichqs[nstarted], &fh[nstarted]);
+    if (rv0 != HG_SUCCESS)
+      break;
+  }
+  for (lcv = 0 ; lcv < nstarted ; lcv++) {
+    rv = shuffle_flush_wait(sh, fh[lcv]);
+    if (rv != HG_SUCCESS && rv0 == HG_SUCCESS)
+      rv0 = rv;
+  }
 
-  pthread_mutex_lock(&sh->flushlock);
-  if (sh->curflush) {
-    pthread_cond_destroy(&sh->curflush->flush_waitcv);
-    sh->curflush = NULL;
-    sh->flushtype = FLUSH_NONE;   /* to be safe */
-    if (sh->flushoset) {
-      sh->flushoset->osetflushing = 0;
-      /* no need to set oqflush_counter */
-      sh->flushoset = NULL;
-    }
-  } else {
-    notify(CLNT_CRIT, "drop_curflush: drop, but no flush in progress!?!");
-    abort();    /* this shouldn't happen */
+  return(rv0);
+}
+
+/*
+ * epoch_recv: check the epoch of an app msg we received and count it
+ * as delivered for shuffle_epoch_end().  a msg whose epoch is already
+ * globally done can only be a late msg of an aborted epoch.  it is
+ * still delivered, but must not be counted or it would throw off
+ * the counters of the later epoch that reuses its parity.  edone is
+ * only written under eplock, we just need an atomic read of it here.
+ *
+ * @param sh the shuffle we are using
+ * @param req the request (any type)
+ * @param count if set, count req in erecv (if it is current)
+ * @return 1 if req is counted for its epoch, 0 if it is late or
+ *         not an app msg
+ */
+static int epoch_recv(struct shuffle *sh, struct request *req, int count) {
+
+  if ((req->hflags & REQ_HF_EPOCH) == 0)
+    return(0);
+  if (req->epoch < __atomic_load_n(&sh->edone, __ATOMIC_RELAXED)) {
+    mlog(SHUF_D1, "epoch_recv: late msg %d->%d of epoch %d", req->src,
+         req->dst, req->epoch);
+    return(0);
   }
+  if (count)
+    acnt32_incr(sh->erecv[req->epoch & 1]);
+  return(1);
+}
 
-  nxtfop = XSIMPLEQ_FIRST(&sh->fpending);
-  if (nxtfop != NULL) {
-    XSIMPLEQ_REMOVE_HEAD(&sh->fpending, fq);
-    nxtfop->status = FLUSHQ_READY;
-    pthread_cond_signal(&nxtfop->flush_waitcv);
+/*
+ * ctl_recv: handle an inbound control message.  this may run
+ * in a progress thread, so we only update state and wake the thread
+ * in shuffle_epoch_end() or shuffle_flush_dst() (we never send from
+ * here).  flush markers need an ack, so we pass them on to the
+ * delivery thread.
+ *
+ * @param sh the shuffle we are using
+ * @param req the control request
+ * @return 1 if req is a flush marker for the delivery thread,
+ *         otherwise 0 (caller frees req)
+ */
+static int ctl_recv(struct shuffle *sh, struct request *req) {
+  struct ctlmsg em;
+
+  if (req->datalen != sizeof(em)) {
+    notify(SHUF_WARN, "shuffle: ctl_recv: bad msg len %d from %d",
+           req->datalen, req->src);
+    return(0);
   }
-  pthread_mutex_unlock(&sh->flushlock);
+  memcpy(&em, req->data, sizeof(em));
+  mlog(SHUF_D1, "ctl_recv: op=%d e=%d w=%d from %d", em.op, em.epoch,
+       em.wave, req->src);
+
+  if (em.op == CTL_FLUSHMARK)
+    return(1);
+
+  if (em.op == CTL_FLUSHACK) {
+    pthread_mutex_lock(&sh->fdlock);
+    if (sh->fdpending.erase(em.wave) != 0)
+      pthread_cond_broadcast(&sh->fdcv);
+    pthread_mutex_unlock(&sh->fdlock);
+    return(0);
+  }
+
+  pthread_mutex_lock(&sh->eplock);
+  switch (em.op) {
+    case CTL_EPOCH_QUERY:
+      if (em.epoch > sh->eqepoch ||
+          (em.epoch == sh->eqepoch && em.wave > sh->eqwave)) {
+        sh->eqepoch = em.epoch;
+        sh->eqwave = em.wave;
+        pthread_cond_broadcast(&sh->epcv);
+      }
+      break;
+    case CTL_EPOCH_REPORT:
+      /* ignore stale reports (e.g. from an older wave) */
+      if (em.epoch == acnt32_get(sh->epoch) && em.wave == sh->ewave) {
+        sh->esum[0] += em.sent;
+        sh->esum[1] += em.recv;
+        sh->ereports++;
+        pthread_cond_broadcast(&sh->epcv);
+      }
+      break;
+    case CTL_EPOCH_DONE:
+    case CTL_EPOCH_ABORT:
+      if (em.epoch >= sh->edone) {
+        __atomic_store_n(&sh->edone, em.epoch + 1, __ATOMIC_RELAXED);
+        if (em.op == CTL_EPOCH_ABORT)
+          sh->efailed = em.epoch;
+        pthread_cond_broadcast(&sh->epcv);
+      }
+      break;
+    default:
+      notify(SHUF_WARN, "shuffle: ctl_recv: bad op %d from %d", em.op,
+             req->src);
+  }
+  pthread_mutex_unlock(&sh->eplock);
+  return(0);
 }
 
 /*
- * shuffle_flush_delivery: flush the delivery queue.  this function
- * blocks until all requests currently in the delivery queues (both
- * deliverq and dwaitq) are delivered.
+ * ctl_flushack: ack a flush marker that reached the delivery thread.
+ * every msg ahead of the marker in the deliverq has been delivered.
+ * called from the delivery thread, so we may block sending the ack.
+ *
+ * @param sh the shuffle we are using
+ * @param req the flush marker (caller frees)
  */
-hg_return_t shuffle_flush_delivery(shuffle_t sh) {
-  struct flush_op fop;
+static void ctl_flushack(struct shuffle *sh, struct request *req) {
+  struct ctlmsg cm;
   hg_return_t rv;
-  struct cond_timedwait ctw;
-  mlog(CLNT_CALL, "shuffle_flush_delivery");
 
-  rv = aquire_flush(sh, &fop, FLUSH_DELIVER, NULL);    /* may BLOCK here */
+  memcpy(&cm, req->data, sizeof(cm));    /* ctl_recv checked the size */
+  cm.op = CTL_FLUSHACK;
+  mlog(SHUF_D1, "ctl_flushack: seq=%d to %d", cm.wave, req->src);
+  rv = shuffle_enqueue_raw(sh, req->src, 0, REQ_HF_CTL, -1, &cm, sizeof(cm));
   if (rv != HG_SUCCESS)
-    return(rv);
-  mlog(CLNT_D1, "shuffle_flush_delivery: aquired flush");
+    notify(SHUF_WARN, "shuffle: flush ack to %d failed (%d)", req->src, rv);
+}
+
+/*
+ * shuffle_epoch_end: end the current epoch.   global rank 0 runs
+ * waves: it sends a QUERY to every rank, flushes its own queues, and
+ * collects a REPORT of the per-epoch sent/delivered counters from
+ * every other rank (ranks only answer once they have called
+ * shuffle_epoch_end and flushed their queues).  the epoch is done
+ * when two consecutive waves have the same totals and the number of
+ * msgs sent equals the number delivered (the "four counter" method).
+ * msgs are tagged with their epoch (counted by the epoch's parity) so
+ * that msgs from the next epoch are not counted, thus ranks can start
+ * sending again as soon as they return.  if the totals do not converge within SHUFFLE_TIMEOUT
+ * (e.g. msgs were dropped) rank 0 sends an ABORT instead of a DONE and
+ * every rank ends the epoch with HG_TIMEOUT.
+ */
+hg_return_t shuffle_epoch_end(shuffle_t sh) {
+  struct ctlmsg em;
+  hg_return_t rv = HG_SUCCESS;
+  int e, p, nranks, wave, answered, havprev, failed;
+  uint32_t s, r, ps, pr;
+  uint64_t tstart;
+  struct cond_timedwait ctw;
+
+  e = acnt32_get(sh->epoch);
+  p = e & 1;
+  nranks = sh->rt->global_size(sh->rtarg);
+  mlog(CLNT_CALL, "shuffle_epoch_end: epoch=%d", e);
+
+  if (sh->disablesend)
+    return(HG_CANCELED);
+
+  if (sh->grank == 0) {                           /* coordinator */
+    havprev = failed = 0;
+    ps = pr = 0;
+    tstart = shuf_now_us();
+    for (wave = 1 ; ; wave++) {
+      pthread_mutex_lock(&sh->eplock);
+      sh->ewave = wave;
+      sh->ereports = 0;
+      sh->esum[0] = sh->esum[1] = 0;
+      pthread_mutex_unlock(&sh->eplock);
+
+      if (nranks > 1) {
+        em.op = CTL_EPOCH_QUERY;
+        em.epoch = e;
+        em.wave = wave;
+        em.sent = em.recv = 0;
+        rv = shuffle_bcast_raw(sh, 0, REQ_HF_CTL, -1, &em, sizeof(em), 0,
+                               NULL);
+        if (rv != HG_SUCCESS) goto done;
+      }
+      rv = epoch_flushall(sh);
+      if (rv != HG_SUCCESS) goto done;
+
+      pthread_mutex_lock(&sh->eplock);
+      sh->esum[0] += acnt32_get(sh->esent[p]);
+      sh->esum[1] += acnt32_get(sh->erecv[p]);
+      init_cond_timedwait(&ctw, SHUFFLE_TIMEOUT, 1,
+                          "epoch_end: ranks did not REPORT (lost ctl msg?)");
+      while (sh->ereports < nranks - 1) {
+        do_cond_timedwait(sh, &sh->epcv, &sh->eplock, &ctw);    /* BLOCK */
+      }
+      s = sh->esum[0];
+      r = sh->esum[1];
+      sh->ewave = 0;
+      pthread_mutex_unlock(&sh->eplock);
+
+      mlog(CLNT_D1, "shuffle_epoch_end: e=%d wave=%d sent=%u recv=%u",
+           e, wave, s, r);
+      if (s == r && havprev && s == ps && r == pr)
+        break;                                   /* terminated! */
+      if (shuf_now_us() - tstart > SHUFFLE_TIMEOUT * 1000000ULL) {
+        notify(SHUF_CRIT, "shuffle_epoch_end: e=%d no convergence after "
+               "%d waves (sent=%u recv=%u), giving up", e, wave, s, r);
+        failed = 1;
+        break;
+      }
+      ps = s;
+      pr = r;
+      havprev = 1;
+    }
+
+    if (nranks > 1) {
+      em.op = (failed) ? CTL_EPOCH_ABORT : CTL_EPOCH_DONE;
+      em.epoch = e;
+      em.wave = wave;
+      em.sent = em.recv = 0;
+      rv = shuffle_bcast_raw(sh, 0, REQ_HF_CTL, -1, &em, sizeof(em), 0,
+                             NULL);
+      if (rv != HG_SUCCESS) goto done;
+    }
+    pthread_mutex_lock(&sh->eplock);
+    if (e >= sh->edone)
+      __atomic_store_n(&sh->edone, e + 1, __ATOMIC_RELAXED);
+    if (failed)
+      sh->efailed = e;
+    pthread_mutex_unlock(&sh->eplock);
+
+  } else {                                        /* participant */
+    answered = 0;
+    pthread_mutex_lock(&sh->eplock);
+    while (1) {
+      /* rank 0 queries well within each timeout, unless it is gone */
+      init_cond_timedwait(&ctw, SHUFFLE_TIMEOUT, 1,
+                          "epoch_end: no QUERY or verdict from rank 0");
+      while (sh->edone <= e &&
+             (sh->eqepoch != e || sh->eqwave <= answered)) {
+        do_cond_timedwait(sh, &sh->epcv, &sh->eplock, &ctw);    /* BLOCK */
+      }
+      if (sh->edone > e)
+        break;
+      wave = sh->eqwave;
+      pthread_mutex_unlock(&sh->eplock);
+
+      rv = epoch_flushall(sh);
+      if (rv == HG_SUCCESS) {
+        em.op = CTL_EPOCH_REPORT;
+        em.epoch = e;
+        em.wave = wave;
+        em.sent = acnt32_get(sh->esent[p]);
+        em.recv = acnt32_get(sh->erecv[p]);
+        rv = shuffle_enqueue_raw(sh, 0, 0, REQ_HF_CTL, -1, &em, sizeof(em));
+      }
+      if (rv != HG_SUCCESS) goto done;
+
+      pthread_mutex_lock(&sh->eplock);
+      answered = wave;
+    }
+    pthread_mutex_unlock(&sh->eplock);
+  }
 
   /*
-   * we now own the current flush operation, set counter and wait.
-   * counter is dropped after we deliver a req with the callback
-   * and will send us a cond_signal when it drops from 1 to zero.
+   * on ABORT all ranks still end the epoch (so they stay in step),
+   * but we report the failure.  late msgs of this epoch are still
+   * delivered, but epoch_recv() keeps them out of epoch e+2's counts.
    */
-  pthread_mutex_lock(&sh->deliverlock);
-  sh->dflush_counter = sh->deliverq.size() + sh->dwaitq.size();
-  mlog(CLNT_D1, "shuffle_flush_delivery: count=%d", sh->dflush_counter);
-  init_cond_timedwait(&ctw, SHUFFLE_TIMEOUT, 1, "flush_delivery");
-  while (sh->dflush_counter > 0 && fop.status == FLUSHQ_READY) {
-    pthread_cond_signal(&sh->delivercv);  /* flush always wakes thread */
-    do_cond_timedwait(sh, &fop.flush_waitcv, &sh->deliverlock, &ctw); /*BLOCK*/
-  }
-  sh->dflush_counter = 0;
-  pthread_mutex_unlock(&sh->deliverlock);
+  pthread_mutex_lock(&sh->eplock);
+  if (sh->efailed == e)
+    rv = HG_TIMEOUT;
+  pthread_mutex_unlock(&sh->eplock);
 
-  drop_curflush(sh);
+  /*
+   * every msg of epoch e has been delivered, so it is safe to reuse
+   * its parity's counters (epoch e+2 can't start until all ranks
+   * have returned from epoch e+1).
+   */
+  acnt32_set(sh->esent[p], 0);
+  acnt32_set(sh->erecv[p], 0);
+  acnt32_incr(sh->epoch);
+  acnt64_incr(sh->stats, ST_EPOCHS);
 
-  rv = (fop.status == FLUSHQ_CANCEL) ? HG_CANCELED : HG_SUCCESS;
-  mlog(CLNT_D1, "shuffle_flush_delivery: done rv=%d", rv);
+done:
+  mlog(CLNT_D1, "shuffle_epoch_end: epoch=%d rv=%d", e, rv);
   return(rv);
 }
 
-/*
- * shuffle_flush_qs: flush either local or remote output queues.
- * this function blocks until all requests currently in the specified
- * output queues are delivered. We make no claims about requests that
- * arrive after the flush has been started.
+/*
+ * flush_run: run the flush op that just became the target's curflush.
+ * we start flushing each queue in the target, holding an extra
+ * reference on the target's counter while we are starting.  if
+ * dropping that reference finishes the flush we finish it here and
+ * go on to run the next pending op, otherwise the final done_oq_flush
+ * or done_dlv_flush call finishes it.   caller must not hold any locks.
+ *
+ * we work from the target rather than the op: once an op is canceled
+ * by shuffle_flush_discard the app may free it at any time.
+ *
+ * @param sh the shuffle we are using
+ * @param ft the flush target to run (its curflush is FLUSHQ_READY)
  */
-hg_return_t shuffle_flush_qs(shuffle_t sh, int whichqs) {
-  struct flush_op fop;
-  hg_return_t rv;
-  int ftype, r;
+static void flush_run(struct shuffle *sh, struct flush_target *ft) {
   struct outset *oset;
   std::map<hg_addr_t, struct outqueue *>::iterator it;
-  struct outqueue *oq;
-  struct cond_timedwait ctw;
-  mlog(CLNT_CALL, "shuffle_flush_qs: type=%s", outset_typstr(whichqs));
+  struct delivery *dlvs[SHUFFLE_MAXHANDLERS+1], *dlv;
+  int ndlv, lcv, r, stopped;
 
-  /* no point trying to flush if we can't send */
-  if (sh->disablesend)
-    return(HG_CANCELED);
+  do {
+    oset = ft->foset;
+    mlog(UTIL_CALL, "flush_run: type=%d", ft->ftype);
+    SHUF_TRACE(SHUF_TR_FLUSH_B, sh->grank, -1, ft->ftype, 0);
 
-  switch (whichqs) {
-    case SHUFFLE_REMOTE_QUEUES:
-      oset = &sh->remoteq;
-      ftype = FLUSH_REMOTEQ;
-      break;
-    case SHUFFLE_ORIGIN_QUEUES:
-      oset = &sh->local_orq;
-      ftype = FLUSH_LOCAL_ORQ;
-      break;
-    case SHUFFLE_RELAY_QUEUES:
-      oset = &sh->local_rlq;
-      ftype = FLUSH_LOCAL_RLQ;
-      break;
-    default:
-      mlog(CLNT_ERR, "shuffle_flush_qs(%d): bad whichqs", whichqs);
-      return(HG_OTHER_ERROR);
-  }
+    /* make sure we are still running or we might block forever... */
+    if (oset) {
+      stopped = (oset->myhgp->nshutdown != 0 || oset->myhgp->nrunning == 0);
+    } else {
+      stopped = (sh->dlv.dshutdown != 0 || sh->dlv.drunning == 0);
+    }
+    if (stopped)
+      continue;       /* canceled by the while test below */
 
-  rv = aquire_flush(sh, &fop, ftype, oset);         /* may BLOCK here */
-  if (rv != HG_SUCCESS) {
-    return(rv);
-  }
-  mlog(CLNT_D1, "shuffle_flush_qs: type=%s AQUIRED!", outset_typstr(whichqs));
+    if (oset) {
+      /*
+       * if we start a queue flush on oq, this will activate oqsetflush
+       * and add one to oset->oqflush_counter (all while holding oqlock).
+       */
+      acnt32_set(oset->oqflush_counter, 1);
+      for (it = oset->oqs.begin() ; it != oset->oqs.end() ; it++) {
+        start_qflush(sh, oset, it->second, &it->second->oqsetflush,
+                     oset->oqflush_counter);
+      }
+      r = acnt32_decr(oset->oqflush_counter);  /* drop our reference */
+    } else {
+      /*
+       * counter is dropped after we deliver a req with the callback
+       * and done_dlv_flush() is called when it drops from 1 to zero.
+       */
+      acnt32_set(sh->dflush_count, 1);
+      ndlv = shuffle_deliveries(sh, dlvs);
+      for (lcv = 0 ; lcv < ndlv ; lcv++) {
+        dlv = dlvs[lcv];
+        pthread_mutex_lock(&dlv->deliverlock);
+        if (dlv->drunning && dlv->dflush_counter == 0) {
+          dlv->dflush_counter = dlv->deliverq.size() + dlv->dwaitq.size();
+          if (dlv->dflush_counter > 0) {
+            acnt32_incr(sh->dflush_count);
+            pthread_cond_signal(&dlv->delivercv);  /* flush wakes thread */
+          }
+        }
+        mlog(UTIL_D1, "flush_run: dlv=%d count=%d", dlv->didx,
+             dlv->dflush_counter);
+        pthread_mutex_unlock(&dlv->deliverlock);
+      }
+      r = acnt32_decr(sh->dflush_count);       /* drop our reference */
+    }
 
-  /*
-   * we've aquired the flush, including setting osetflushing and
-   * oqflush_counter both to 1.  (initing oqflush_counter to 1
-   * rather than 0 keeps the flush active while we are setting
-   * it up -- we'll drop the extra reference before we block).
-   * now we need to look for output queues to be flushed. ...
-   */
-  for (it = oset->oqs.begin() ; it != oset->oqs.end() ; it++) {
-    oq = it->second;
+    if (r != 0)
+      return;          /* flush in progress, last done call finishes it */
 
-    /*
-     * if we start a queue flush on oq, this will set oq->oqflushing==1
-     * and add one to oset->oqflush_counter (all while holding oqlock).
-     */
-    start_qflush(sh, oset, oq);
-  }
+  } while (flush_finish(sh, ft, (stopped) ? FLUSHQ_CANCEL : FLUSHQ_DONE));
+}
 
-  /*
-   * now wait for the flush to finish ... we use the flushlock here,
-   * since the outset structure doesn't have a lock
-   */
-  pthread_mutex_lock(&sh->flushlock); /* blks cond_signal in done_oq_flush */
-  r = acnt32_decr(oset->oqflush_counter);  /* drop our reference */
-  if (r == 0)
-    oset->osetflushing = 0;  /* nothing left to wait for */
+/*
+ * flush_finish: the target's current flush op is done (or canceled).
+ * wake its waiters and promote the next pending op (if any).  the
+ * caller must not hold any locks and must flush_run() the target if
+ * we return 1.
+ *
+ * @param sh the shuffle we are using
+ * @param ft the flush target
+ * @param status FLUSHQ_DONE or FLUSHQ_CANCEL
+ * @return 1 if the next pending op is now running, otherwise 0
+ */
+static int flush_finish(struct shuffle *sh, struct flush_target *ft,
+                        int status) {
+  struct flush_op *nxtfop;
 
-  mlog(CLNT_D1, "shuffle_flush_qs: waiting... type=%s osetflushing=%d!",
-       outset_typstr(whichqs), oset->osetflushing);
-  init_cond_timedwait(&ctw, SHUFFLE_TIMEOUT, 1, "flush_qs");
-  while (oset->osetflushing != 0 && fop.status == FLUSHQ_READY) {
-    do_cond_timedwait(sh, &fop.flush_waitcv, &sh->flushlock, &ctw); /*BLOCK*/
+  pthread_mutex_lock(&sh->flushlock);
+  if (ft->curflush == NULL) {       /* canceled by shuffle_flush_discard */
+    pthread_mutex_unlock(&sh->flushlock);
+    return(0);
   }
-  /*
-   * clear osetflushing (may be >0 if fop.status != READY [cancel?]).
-   * this prevents callbacks from trying to pthread_cond_signal us
-   * after we've left the above while loop...
-   */
-  oset->osetflushing = 0;
+  mlog(UTIL_CALL, "flush_finish: fop=%p, type=%d, status=%d",
+       ft->curflush, ft->ftype, status);
+  SHUF_TRACE(SHUF_TR_FLUSH_E, sh->grank, -1, ft->ftype, 0);
+  flush_opdone(ft->curflush, status);
+
+  nxtfop = XSIMPLEQ_FIRST(&ft->fpending);
+  if (nxtfop != NULL) {
+    XSIMPLEQ_REMOVE_HEAD(&ft->fpending, fq);
+    pthread_mutex_lock(&nxtfop->flush_oplock);
+    nxtfop->status = FLUSHQ_READY;
+    pthread_mutex_unlock(&nxtfop->flush_oplock);
+  }
+  ft->curflush = nxtfop;
   pthread_mutex_unlock(&sh->flushlock);
-  mlog(CLNT_D1, "shuffle_flush_qs: wait done!");
 
-  /*
-   * done!   drop the flush and return...
-   */
-  if (fop.status == FLUSHQ_CANCEL) {
-    clean_qflush(sh, oset);    /* clear out state of cancel'd flush */
+  return(nxtfop != NULL);
+}
+
+/*
+ * flush_opdone: set the final status of a flush op that its target
+ * is done with, wake its waiter, and drop the target's reference.
+ * caller holds flushlock (the op's lock nests inside it).
+ *
+ * @param fop the flush op (no longer on its target)
+ * @param status FLUSHQ_DONE or FLUSHQ_CANCEL
+ */
+static void flush_opdone(struct flush_op *fop, int status) {
+  int nrefs;
+
+  pthread_mutex_lock(&fop->flush_oplock);
+  fop->status = status;
+  pthread_cond_broadcast(&fop->flush_waitcv);
+  nrefs = --fop->nrefs;
+  pthread_mutex_unlock(&fop->flush_oplock);
+
+  if (nrefs == 0) {        /* app released its handle first (defensive) */
+    pthread_cond_destroy(&fop->flush_waitcv);
+    pthread_mutex_destroy(&fop->flush_oplock);
+    free(fop);
   }
-  drop_curflush(sh);
-  rv = (fop.status == FLUSHQ_CANCEL) ? HG_CANCELED : HG_SUCCESS;
-  mlog(CLNT_D1, "shuffle_flush_qs: done! type=%s rv=%d!",
-       outset_typstr(whichqs), rv);
-  return(rv);
 }
 
 /*
@@ -3196,36 +6217,45 @@ hg_return_t shuffle_flush_qs(shuffle_t sh, int whichqs) {
  * need to wait for all sending_outputs on oq->outs at the time of the
  * flush to finish.   depending on the state of the queue we may be
  * able to skip some or all of these steps (e.g. if the queue is empty,
- * then we're done!).   if we do start a flush, we'll set oq->oqflushing
- * and add one to oset->oqflush_counter (while holding the oqlock).
+ * then we're done!).   if we do start a flush, we'll put the flusher
+ * on oq->oqflushers and add one to counter (if not NULL) while holding
+ * the oqlock.
  *
  * @param sh the shuffle we are using
  * @param oset the output set being flushed
  * @param oq the output queue to flush
+ * @param of the flusher to use (must not be active)
+ * @param counter counter to bump if flush is pending (may be NULL)
+ * @return 1 if flush is pending, otherwise zero
  */
-static void start_qflush(struct shuffle *sh, struct outset *oset,
-                        struct outqueue *oq) {
+static int start_qflush(struct shuffle *sh, struct outset *oset,
+                        struct outqueue *oq, struct oqflusher *of,
+                        acnt32_t counter) {
   bool tosend;
   struct request_queue tosendq;
   struct output *oput;
-  mlog(UTIL_CALL, "start_qflush: oset=%p, oq=%p rnk=[%d.%d]", oset, oq,
-       oq->grank, oq->subrank);
+  int pending;
+  mlog(UTIL_CALL, "start_qflush: oset=%p, oq=%p rnk=[%d.%d] of=%p", oset, oq,
+       oq->grank, oq->subrank, of);
 
   pthread_mutex_lock(&oq->oqlock);
 
-  if (oq->oqflushing) {
-    notify(UTIL_CRIT, "shuffle: start_qflush: oq->flushing already set?!");
+  if (OQF_ACTIVE(of)) {
+    notify(UTIL_CRIT, "shuffle: start_qflush: flusher already active?!");
     abort();    /* this shouldn't happen */
   }
+  of->ofstate = OQF_IDLE;
 
   /* first, look for waiting requests in the oq->waitq */
   if (!oq->oqwaitq.empty()) {
-    oq->oqflush_waitcounter = oq->oqwaitq.size();
-    oq->oqflush_output = NULL;   /* to be safe */
-    oq->oqflushing = 1;
-    acnt32_incr(oset->oqflush_counter);
+    of->ofwaitcounter = oq->oqwaitq.size();
+    of->ofoutput = NULL;   /* to be safe */
+    of->ofstate = OQF_WAITQ;
+    XTAILQ_INSERT_TAIL(&oq->oqflushers, of, ofq);
+    if (counter)
+      acnt32_incr(counter);
     mlog(UTIL_D1, "start_qflush: WAITQ: oset=%p, oq=%p, waitqcnt=%d",
-         oset, oq, oq->oqflush_waitcounter);
+         oset, oq, of->ofwaitcounter);
     goto done;
   }
 
@@ -3247,32 +6277,53 @@ static void start_qflush(struct shuffle *sh, struct outset *oset,
 
   /* third, check oq->outs */
   if (XTAILQ_FIRST(&oq->outs) != NULL) {
-    oq->oqflush_waitcounter = 0;
-    oq->oqflush_output = XTAILQ_LAST(&oq->outs, sending_outputs);
-    oq->oqflushing = 1;
-    acnt32_incr(oset->oqflush_counter);
+    of->ofwaitcounter = 0;
+    of->ofoutput = XTAILQ_LAST(&oq->outs, sending_outputs);
+    of->ofstate = OQF_OUTS;
+    XTAILQ_INSERT_TAIL(&oq->oqflushers, of, ofq);
+    if (counter)
+      acnt32_incr(counter);
     mlog(UTIL_D1, "start_qflush: SENDERS: oset=%p, oq=%p, waitfor=%p",
-         oset, oq, oq->oqflush_output);
+         oset, oq, of->ofoutput);
   }
 
 done:
-  if (oq->oqflushing != 0)
+  pending = OQF_ACTIVE(of);
+  if (pending)
     shufcount(&oq->cntoqflushes);
   mlog(UTIL_D1, "start_qflush: oset=%p, oq=%p, flushpending=%d", oset, oq,
-       oq->oqflushing);
+       pending);
   pthread_mutex_unlock(&oq->oqlock);
 
-  return;
+  return(pending);
+}
+
+/*
+ * oqflusher_done: a flusher on oq has finished.  take it off the
+ * list and wake its waiter.  caller holds oqlock.
+ *
+ * @param oq the output queue
+ * @param of the flusher that is done
+ * @return true if this was the outset flusher (need done_oq_flush)
+ */
+static bool oqflusher_done(struct outqueue *oq, struct oqflusher *of) {
+  XTAILQ_REMOVE(&oq->oqflushers, of, ofq);
+  of->ofstate = OQF_DONE;
+  of->ofoutput = NULL;
+  if (of->ofcv) {
+    pthread_cond_broadcast(of->ofcv);
+    return(false);
+  }
+  return(true);
 }
 
 /*
  * clean_qflush: clean out state of a flush that has been canceled.
- * we own the flush so it is safe to clear out oset once all the
- * output queues have been reset...
+ * called from shuffle_flush_discard before the flush op is dropped.
+ * only the outset's flushers are removed (dst flushes are left alone).
  *
  * @param sh the shuffle we are using
  * @param oset the output set being flushed
- * @return 1 if flush is pending, otherwise zero
  */
 static void clean_qflush(struct shuffle *sh, struct outset *oset) {
   std::map<hg_addr_t, struct outqueue *>::iterator it;
@@ -3283,121 +6334,282 @@ static void clean_qflush(struct shuffle *sh, struct outset *oset) {
     oq = it->second;
 
     pthread_mutex_lock(&oq->oqlock);
-    oq->oqflushing = 0;
-    oq->oqflush_waitcounter = 0;
-    oq->oqflush_output = NULL;
+    if (OQF_ACTIVE(&oq->oqsetflush))
+      XTAILQ_REMOVE(&oq->oqflushers, &oq->oqsetflush, ofq);
+    oq->oqsetflush.ofstate = OQF_IDLE;
+    oq->oqsetflush.ofwaitcounter = 0;
+    oq->oqsetflush.ofoutput = NULL;
     pthread_mutex_unlock(&oq->oqlock);
   }
 
-  if (oset->osetflushing != 0) {  /* prev. cleared in shuffle_flush_qs */
-    notify(UTIL_CRIT, "clean_flushq called with nonzero osetflushing?");
-    abort();
-  }
   acnt32_set(oset->oqflush_counter, 0); /* shouldn't matter */
 }
 
 /*
  * done_oq_flush: finished flushing an outqueue.  need to update the
- * outset and signal flusher if we dropped the ref to zero!
+ * outset and finish the flush if we dropped the ref to zero!
+ * caller must not hold any locks.
  *
  * @param oq the output queue we just finished flushing
  */
 static void done_oq_flush(struct outqueue *oq) {
   struct outset *oset = oq->myset;
-  struct shuffle *sh = oset->shuf;
   int r;
 
   r = acnt32_decr(oset->oqflush_counter);
   mlog(UTIL_CALL, "done_oq_flush: oq=%p, newrefcnt=%d", oq, r);
 
-  /* signal main flusher if we dropped the last reference */
+  /* finish the flush if we dropped the last reference */
   if (r == 0) {
     mlog(UTIL_CALL, "done_oq_flush: dropped last oq ref, flush done!");
-    pthread_mutex_lock(&sh->flushlock);  /* protects oqflushing */
-    /*
-     * we check osetflushing != 0 to ensure flusher is blocked on flush_waitcv
-     * before sending a wakeup on flush_waitcv
-     */
-    if (oset->osetflushing != 0) {
-      assert(sh->curflush != NULL);
-      oset->osetflushing = 0;
-      pthread_cond_broadcast(&sh->curflush->flush_waitcv);
-    }
-    pthread_mutex_unlock(&sh->flushlock);
+    if (flush_finish(oset->shuf, &oset->oflush, FLUSHQ_DONE))
+      flush_run(oset->shuf, &oset->oflush);
+  }
+}
+
+/*
+ * done_dlv_flush: a delivery finished its part of a delivery flush.
+ * finish the flush if it was the last one.  caller must not hold
+ * any locks.
+ *
+ * @param sh the shuffle we are using
+ */
+static void done_dlv_flush(struct shuffle *sh) {
+  int r;
+
+  r = acnt32_decr(sh->dflush_count);
+  mlog(UTIL_CALL, "done_dlv_flush: newrefcnt=%d", r);
+
+  if (r == 0) {
+    if (flush_finish(sh, &sh->dflush, FLUSHQ_DONE))
+      flush_run(sh, &sh->dflush);
   }
 }
 
+/*
+ * histnames: short names of the SHUFFLE_HIST_* histograms (for dumps)
+ */
+static const char *histnames[SHUFFLE_NHIST] = { "rtt_origin", "rtt_relay",
+  "rtt_remote", "oqwait_origin", "oqwait_relay", "oqwait_remote",
+  "dwait", "delivercb", "e2e", "breqs_origin", "breqs_relay",
+  "breqs_remote", "bbytes_origin", "bbytes_relay", "bbytes_remote" };
+
 /*
  * dumpstats: dump stats to mlog NOTE
  *
  * @param sh the shuffle to dump
  */
 static void dumpstats(shuffle_t sh) {
-#ifdef SHUFFLE_COUNT
-  std::map<hg_addr_t,struct outqueue *>::iterator oqit;
   const char *names[3] = { "local_origin", "local_relay", "remote" };
   struct outset *o[3] = { &sh->local_orq, &sh->local_rlq, &sh->remoteq }, *os;
-  struct outqueue *oq;
+  struct shuffle_stats st;
+  struct shuffle_outset_stats *ost[3];
+  struct shuffle_hist hst;
+  struct hgprogress *hgp;
+  char railname[32];
   int lcv;
+#ifdef SHUFFLE_COUNT
+  std::map<hg_addr_t,struct outqueue *>::iterator oqit;
+  struct outqueue *oq;
+  struct delivery *dlvs[SHUFFLE_MAXHANDLERS+1], *dlv;
+  int ndlv;
+#endif
 
+  shuffle_get_stats(sh, &st);
+  ost[0] = &st.local_origin;
+  ost[1] = &st.local_relay;
+  ost[2] = &st.remote;
   mlog(SHUF_NOTE, "stat counter dump follows");
-  mlog(SHUF_NOTE, "deliver-thread: dblock=%d, delivery=%d", sh->cntdblock,
-       sh->cntdeliver);
-  mlog(SHUF_NOTE, "deliver: reqs=%d/%d, waits=%d/%d, mxwait=%d",
-       sh->cntdreqs[0], sh->cntdreqs[1], sh->cntdwait[0], sh->cntdwait[1],
-       sh->cntdmaxwait);
-  mlog(SHUF_NOTE, "recvs: local=%d, network=%d", sh->cntrpcinshm,
-       sh->cntrpcinnet);
-  mlog(SHUF_NOTE,
-       "flush: rem=%d, loc_o=%d, loc_r=%d dlvr=%d, waits=%d, strand=%d",
-       sh->cntflush[FLUSH_REMOTEQ], sh->cntflush[FLUSH_LOCAL_ORQ],
-       sh->cntflush[FLUSH_LOCAL_RLQ], sh->cntflush[FLUSH_DELIVER],
-       sh->cntflushwait, sh->cntstranded);
-  mlog(SHUF_NOTE, "oset-size: local_or=%ld, local_rl=%ld, remote=%ld",
-       sh->local_orq.oqs.size(), sh->local_rlq.oqs.size(),
-       sh->remoteq.oqs.size());
-  mlog(SHUF_NOTE, "oset-hitlimit: local_or=%d, local_rl=%d, remote=%d",
-       sh->local_orq.os_senderlimit, sh->local_rlq.os_senderlimit,
-       sh->remoteq.os_senderlimit);
-  mlog(SHUF_NOTE, "local_hgp: nprogress=%" PRIu64 ", ntrigger=%" PRIu64,
-       mercury_progressor_nprogress(sh->hgp_local.mphand),
-       mercury_progressor_ntrigger(sh->hgp_local.mphand));
-  mlog(SHUF_NOTE, "remote_hgp: nprogress=%" PRIu64 ", ntrigger=%" PRIu64,
-       mercury_progressor_nprogress(sh->hgp_remote.mphand),
-       mercury_progressor_ntrigger(sh->hgp_remote.mphand));
+  mlog(SHUF_NOTE, "enqueue: msgs=%" PRIu64 ", bytes=%" PRIu64
+       ", bcasts=%" PRIu64 ", epochs=%" PRIu64, st.enqueues, st.enqbytes,
+       st.bcasts, st.epochs);
+  mlog(SHUF_NOTE, "recvs: local=%" PRIu64 ", network=%" PRIu64
+       ", credfallback=%" PRIu64, st.rpcin_local, st.rpcin_remote,
+       st.credfallback);
+  mlog(SHUF_NOTE, "deliver: reqs=%" PRIu64 ", waits=%" PRIu64
+       ", delivers=%" PRIu64 ", bytes=%" PRIu64 ", nocb=%" PRIu64,
+       st.dreqs, st.dwaits, st.delivers, st.deliverbytes, st.dnocb);
+  mlog(SHUF_NOTE, "flush: rem=%" PRIu64 ", loc_o=%" PRIu64 ", loc_r=%"
+       PRIu64 " dlvr=%" PRIu64 ", dst=%" PRIu64 ", waits=%" PRIu64
+       ", strand=%" PRIu64, st.remote.flushes, st.local_origin.flushes,
+       st.local_relay.flushes, st.dflushes, st.dstflushes, st.flushwaits,
+       st.stranded);
+  if (sh->dir.dmax)
+    mlog(SHUF_NOTE, "direct: queues=%" PRIu64 "/%d, reqs=%" PRIu64,
+         st.directqs, sh->dir.dmax, st.directreqs);
+  mlog(SHUF_NOTE, "srcrep: nreps=%d, reqs=%" PRIu64 ", bytes=%" PRIu64,
+       sh->nreps, st.srcrepreqs, st.srcrepbytes);
+  if (sh->nrelay)
+    mlog(SHUF_NOTE, "relay: workers=%d, batches=%" PRIu64, sh->nrelay,
+         st.relaybatches);
+  if (sh->stagebytes)
+    mlog(SHUF_NOTE, "stage: bytes=%d, reqs=%" PRIu64 ", merges=%" PRIu64,
+         sh->stagebytes, st.stagereqs, st.stagemerges);
+  for (lcv = 0 ; lcv < 3 ; lcv++) {
+    os = o[lcv];
+    mlog(SHUF_NOTE, "oset[%s]: size=%ld, reqs=%" PRIu64 ", bytes=%" PRIu64
+         ", snds=%" PRIu64 ", sndbytes=%" PRIu64 ", flsnd=%" PRIu64
+         ", waits=%" PRIu64 "/%" PRIu64 ", hitlimit=%" PRIu64, names[lcv],
+         os->oqs.size(), ost[lcv]->reqs, ost[lcv]->bytes, ost[lcv]->sends,
+         ost[lcv]->sendbytes, ost[lcv]->flushsends, ost[lcv]->waits,
+         ost[lcv]->credwaits, ost[lcv]->senderlimit);
+    mlog(SHUF_NOTE, "oset[%s]: send-reason: buftarget=%" PRIu64 ", flush=%"
+         PRIu64 ", ctl=%" PRIu64, names[lcv],
+         ost[lcv]->sendreason[SHUFFLE_SEND_BUFTARGET],
+         ost[lcv]->sendreason[SHUFFLE_SEND_FLUSH],
+         ost[lcv]->sendreason[SHUFFLE_SEND_CTL]);
+  }
+  for (lcv = 0 ; lcv < SHUFFLE_NHIST ; lcv++) {
+    shuffle_get_hist(sh, lcv, &hst, 0);
+    if (hst.count == 0)
+      continue;
+    mlog(SHUF_NOTE, "hist[%s]: n=%" PRIu64 ", avg=%" PRIu64 ", p50=%"
+         PRIu64 ", p99=%" PRIu64 ", max=%" PRIu64, histnames[lcv], hst.count,
+         hst.sum / hst.count, shuffle_hist_percentile(&hst, 50.0),
+         shuffle_hist_percentile(&hst, 99.0), hst.max);
+  }
+  if (sh->hgp_local.memx) {
+    mlog(SHUF_NOTE, "memx: local nproc=%" PRIu64 ", remote nproc=%" PRIu64,
+         sh->hgp_local.mqnproc, sh->hgp_remote.mqnproc);
+    for (lcv = 1 ; lcv < sh->nrails ; lcv++) {
+      rail_name(lcv, railname, sizeof(railname));
+      mlog(SHUF_NOTE, "memx: %s nproc=%" PRIu64, railname,
+           shuffle_rail(sh, lcv)->mqnproc);
+    }
+  } else {
+    mlog(SHUF_NOTE, "local_hgp: nprogress=%" PRIu64 ", ntrigger=%" PRIu64,
+         mercury_progressor_nprogress(sh->hgp_local.mphand),
+         mercury_progressor_ntrigger(sh->hgp_local.mphand));
+    for (lcv = 0 ; lcv < sh->nrails ; lcv++) {
+      hgp = shuffle_rail(sh, lcv);
+      rail_name(lcv, railname, sizeof(railname));
+      mlog(SHUF_NOTE, "%s_hgp: nprogress=%" PRIu64 ", ntrigger=%" PRIu64,
+           railname, mercury_progressor_nprogress(hgp->mphand),
+           mercury_progressor_ntrigger(hgp->mphand));
+    }
+  }
+
+#ifdef SHUFFLE_COUNT
+  ndlv = shuffle_deliveries(sh, dlvs);
+  for (lcv = 0 ; lcv < ndlv ; lcv++) {
+    dlv = dlvs[lcv];
+    mlog(SHUF_NOTE, "deliver-thread[%d]: dblock=%d, delivery=%d, nocb=%d",
+         dlv->didx, dlv->cntdblock, dlv->cntdeliver, dlv->cntdnocb);
+    mlog(SHUF_NOTE, "deliver[%d]: reqs=%d/%d, waits=%d/%d, mxwait=%d",
+         dlv->didx, dlv->cntdreqs[0], dlv->cntdreqs[1], dlv->cntdwait[0],
+         dlv->cntdwait[1], dlv->cntdmaxwait);
+  }
   for (lcv = 0; lcv < 3 ; lcv++) {
     mlog(SHUF_NOTE, "outqueue-stats: %s", names[lcv]);
     os = o[lcv];
     for (oqit = os->oqs.begin() ; oqit != os->oqs.end() ; oqit++) {
       oq = oqit->second;
       mlog(SHUF_NOTE, "oq[%d.%d]: reqs=%d/%d, snds=%d, flsnd=%d, "
-                      "waits=%d/%d, fl=%d, mxwait=%d, order=%d",
+                      "waits=%d/%d, fl=%d/%d, mxwait=%d, order=%d, crwait=%d",
       oq->grank, oq->subrank, oq->cntoqreqs[0], oq->cntoqreqs[1],
       oq->cntoqsends, oq->cntoqflushsend, oq->cntoqwaits[0], oq->cntoqwaits[1],
-      oq->cntoqflushes, oq->cntoqmaxwait, oq->cntoqflushorder);
+      oq->cntoqflushes, oq->cntoqdstflushes, oq->cntoqmaxwait,
+      oq->cntoqflushorder, oq->cntoqcredwait);
     }
   }
 #endif
 }
 
+/*
+ * get_oset_stats: helper fn for shuffle_get_stats
+ */
+static void get_oset_stats(struct outset *oset,
+                           struct shuffle_outset_stats *ost) {
+  int lcv;
+
+  ost->reqs = acnt64_get(oset->ostats, OST_REQS);
+  ost->bytes = acnt64_get(oset->ostats, OST_BYTES);
+  ost->sends = acnt64_get(oset->ostats, OST_SENDS);
+  ost->sendbytes = acnt64_get(oset->ostats, OST_SENDBYTES);
+  ost->flushsends = acnt64_get(oset->ostats, OST_FLUSHSENDS);
+  ost->waits = acnt64_get(oset->ostats, OST_WAITS);
+  ost->credwaits = acnt64_get(oset->ostats, OST_CREDWAITS);
+  ost->senderlimit = acnt64_get(oset->ostats, OST_SENDERLIMIT);
+  ost->flushes = acnt64_get(oset->ostats, OST_FLUSHES);
+  for (lcv = 0 ; lcv < SHUFFLE_SEND_NREASONS ; lcv++)
+    ost->sendreason[lcv] = acnt64_get(oset->ostats, OST_SENDREASON + lcv);
+}
+
+/*
+ * shuffle_get_stats: take a snapshot of the shuffle's counters.
+ */
+hg_return_t shuffle_get_stats(shuffle_t sh, struct shuffle_stats *st) {
+  if (sh == NULL || st == NULL)
+    return(HG_INVALID_PARAM);
+
+  st->enqueues = acnt64_get(sh->stats, ST_ENQUEUES);
+  st->enqbytes = acnt64_get(sh->stats, ST_ENQBYTES);
+  st->bcasts = acnt64_get(sh->stats, ST_BCASTS);
+  st->rpcin_local = acnt64_get(sh->stats, ST_RPCINSHM);
+  st->rpcin_remote = acnt64_get(sh->stats, ST_RPCINNET);
+  st->credfallback = acnt64_get(sh->stats, ST_CREDFALLBACK);
+  st->dreqs = acnt64_get(sh->stats, ST_DREQS);
+  st->dwaits = acnt64_get(sh->stats, ST_DWAITS);
+  st->delivers = acnt64_get(sh->stats, ST_DELIVERS);
+  st->deliverbytes = acnt64_get(sh->stats, ST_DELIVERBYTES);
+  st->dnocb = acnt64_get(sh->stats, ST_DNOCB);
+  st->dflushes = acnt64_get(sh->stats, ST_DFLUSHES);
+  st->flushwaits = acnt64_get(sh->stats, ST_FLUSHWAITS);
+  st->dstflushes = acnt64_get(sh->stats, ST_DSTFLUSHES);
+  st->epochs = acnt64_get(sh->stats, ST_EPOCHS);
+  st->stranded = acnt64_get(sh->stats, ST_STRANDED);
+  st->directqs = acnt64_get(sh->stats, ST_DIRECTQS);
+  st->directreqs = acnt64_get(sh->stats, ST_DIRECTREQS);
+  st->srcrepreqs = acnt64_get(sh->stats, ST_REPREQS);
+  st->srcrepbytes = acnt64_get(sh->stats, ST_REPBYTES);
+  st->relaybatches = acnt64_get(sh->stats, ST_RELAYBATCHES);
+  st->stagereqs = acnt64_get(sh->stats, ST_STAGEREQS);
+  st->stagemerges = acnt64_get(sh->stats, ST_STAGEMERGES);
+  get_oset_stats(&sh->local_orq, &st->local_origin);
+  get_oset_stats(&sh->local_rlq, &st->local_relay);
+  get_oset_stats(&sh->remoteq, &st->remote);
+
+  return(HG_SUCCESS);
+}
+
+/*
+ * shuffle_get_hist: copy out one of the shuffle's latency histograms
+ */
+hg_return_t shuffle_get_hist(shuffle_t sh, int which,
+                             struct shuffle_hist *h, int reset) {
+  shuf_hist_t hists[SHUFFLE_NHIST];
+
+  if (sh == NULL || h == NULL || which < 0 || which >= SHUFFLE_NHIST)
+    return(HG_INVALID_PARAM);
+
+  hists[SHUFFLE_HIST_RTT_ORIGIN] = sh->local_orq.orttlat;
+  hists[SHUFFLE_HIST_RTT_RELAY] = sh->local_rlq.orttlat;
+  hists[SHUFFLE_HIST_RTT_REMOTE] = sh->remoteq.orttlat;
+  hists[SHUFFLE_HIST_OQWAIT_ORIGIN] = sh->local_orq.owaitlat;
+  hists[SHUFFLE_HIST_OQWAIT_RELAY] = sh->local_rlq.owaitlat;
+  hists[SHUFFLE_HIST_OQWAIT_REMOTE] = sh->remoteq.owaitlat;
+  hists[SHUFFLE_HIST_DWAIT] = sh->dwaitlat;
+  hists[SHUFFLE_HIST_DELIVERCB] = sh->dcblat;
+  hists[SHUFFLE_HIST_E2E] = sh->e2elat;
+  hists[SHUFFLE_HIST_BREQS_ORIGIN] = sh->local_orq.obreqs;
+  hists[SHUFFLE_HIST_BREQS_RELAY] = sh->local_rlq.obreqs;
+  hists[SHUFFLE_HIST_BREQS_REMOTE] = sh->remoteq.obreqs;
+  hists[SHUFFLE_HIST_BBYTES_ORIGIN] = sh->local_orq.obbytes;
+  hists[SHUFFLE_HIST_BBYTES_RELAY] = sh->local_rlq.obbytes;
+  hists[SHUFFLE_HIST_BBYTES_REMOTE] = sh->remoteq.obbytes;
+  shuf_hist_snap(hists[which], h, reset);
+
+  return(HG_SUCCESS);
+}
+
 /*
  * shuffle_send_stats: report number of rpcs sent.
  */
 hg_return_t shuffle_send_stats(shuffle_t sh, hg_uint64_t* local_origin,
                                 hg_uint64_t* local_relay, hg_uint64_t* remote) {
-  *local_origin = *local_relay = *remote = 0;
-#ifdef SHUFFLE_COUNT
-  std::map<hg_addr_t,struct outqueue *>::iterator oqit;
-  struct outset *o[3] = { &sh->local_orq, &sh->local_rlq, &sh->remoteq };
-
-  for (oqit = o[0]->oqs.begin() ; oqit != o[0]->oqs.end() ; oqit++)
-    *local_origin += static_cast<hg_uint64_t>(oqit->second->cntoqsends);
-  for (oqit = o[1]->oqs.begin() ; oqit != o[1]->oqs.end() ; oqit++)
-    *local_relay += static_cast<hg_uint64_t>(oqit->second->cntoqsends);
-  for (oqit = o[2]->oqs.begin() ; oqit != o[2]->oqs.end() ; oqit++)
-    *remote += static_cast<hg_uint64_t>(oqit->second->cntoqsends);
-
-#endif
+  *local_origin = acnt64_get(sh->local_orq.ostats, OST_SENDS);
+  *local_relay = acnt64_get(sh->local_rlq.ostats, OST_SENDS);
+  *remote = acnt64_get(sh->remoteq.ostats, OST_SENDS);
   return(HG_SUCCESS);
 }
 
@@ -3406,13 +6618,119 @@ hg_return_t shuffle_send_stats(shuffle_t sh, hg_uint64_t* local_origin,
  */
 hg_return_t shuffle_recv_stats(shuffle_t sh, hg_uint64_t* local,
                                 hg_uint64_t* remote) {
-#ifdef SHUFFLE_COUNT
-  *local = static_cast<hg_uint64_t>(sh->cntrpcinshm);
-  *remote = static_cast<hg_uint64_t>(sh->cntrpcinnet);
-#endif
+  *local = acnt64_get(sh->stats, ST_RPCINSHM);
+  *remote = acnt64_get(sh->stats, ST_RPCINNET);
   return(HG_SUCCESS);
 }
 
+/*
+ * sampler_oset: helper fn for sampler_row, append one outset's columns
+ *
+ * @param fp the CSV file
+ * @param oset the outset to sample
+ * @param ost the outset's counters
+ */
+static void sampler_oset(FILE *fp, struct outset *oset,
+                         struct shuffle_outset_stats *ost) {
+  std::map<hg_addr_t,struct outqueue *>::iterator oqit;
+  struct outqueue *oq;
+  long nsending, loadsz;
+  size_t wq, wqmax, n;
+  int nrpcs;
+
+  pthread_mutex_lock(&oset->os_rpclimitlock);
+  nrpcs = oset->outset_nrpcs;
+  pthread_mutex_unlock(&oset->os_rpclimitlock);
+
+  nsending = loadsz = 0;
+  wq = wqmax = 0;
+  for (oqit = oset->oqs.begin() ; oqit != oset->oqs.end() ; oqit++) {
+    oq = oqit->second;
+    pthread_mutex_lock(&oq->oqlock);
+    nsending += oq->nsending;
+    loadsz += oq->loadsize;
+    n = oq->oqwaitq.size();
+    pthread_mutex_unlock(&oq->oqlock);
+    wq += n;
+    if (n > wqmax)
+      wqmax = n;
+  }
+
+  fprintf(fp, ",%d,%ld,%ld,%zu,%zu,%" PRIu64 ",%" PRIu64 ",%" PRIu64,
+          nrpcs, nsending, loadsz, wq, wqmax, ost->reqs, ost->sends,
+          ost->sendbytes);
+}
+
+/*
+ * sampler_row: append one row of queue depths and counters to the
+ * sampler's CSV file (see sampler_init for the columns)
+ *
+ * @param sh the shuffle
+ */
+static void sampler_row(struct shuffle *sh) {
+  struct delivery *dlvs[SHUFFLE_MAXHANDLERS+1];
+  FILE *fp = sh->smp.sfp;
+  struct shuffle_stats st;
+  size_t dq, dw;
+  int ndlv, lcv;
+
+  shuffle_get_stats(sh, &st);
+  fprintf(fp, "%" PRIu64, (shuf_now_us() - sh->smp.t0) / 1000);
+  sampler_oset(fp, &sh->local_orq, &st.local_origin);
+  sampler_oset(fp, &sh->local_rlq, &st.local_relay);
+  sampler_oset(fp, &sh->remoteq, &st.remote);
+
+  dq = dw = 0;
+  ndlv = shuffle_deliveries(sh, dlvs);
+  for (lcv = 0 ; lcv < ndlv ; lcv++) {
+    pthread_mutex_lock(&dlvs[lcv]->deliverlock);
+    dq += dlvs[lcv]->deliverq.size();
+    dw += dlvs[lcv]->dwaitq.size();
+    pthread_mutex_unlock(&dlvs[lcv]->deliverlock);
+  }
+
+  fprintf(fp, ",%zu,%zu,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64
+          ",%" PRIu64 ",%" PRIu64 "\n", dq, dw, st.enqueues, st.enqbytes,
+          st.rpcin_local, st.rpcin_remote, st.delivers, st.deliverbytes);
+  fflush(fp);
+}
+
+/*
+ * sampler_main: main routine for the sampler thread.  we write a row
+ * every period_ms and a final one when we are told to shutdown.
+ *
+ * @param arg the shuffle
+ * @return NULL
+ */
+static void *sampler_main(void *arg) {
+  struct shuffle *sh = (struct shuffle *)arg;
+  struct sampler *smp = &sh->smp;
+  struct timespec abstime;
+  int rv;
+
+  mlog(SHUF_CALL, "sampler_main: start, period=%dms", smp->period_ms);
+  pthread_mutex_lock(&smp->slock);
+  while (!smp->sshutdown) {
+    clock_gettime(CLOCK_REALTIME, &abstime);
+    abstime.tv_sec += smp->period_ms / 1000;
+    abstime.tv_nsec += (smp->period_ms % 1000) * 1000000L;
+    if (abstime.tv_nsec >= 1000000000L) {
+      abstime.tv_sec++;
+      abstime.tv_nsec -= 1000000000L;
+    }
+    rv = 0;
+    while (!smp->sshutdown && rv != ETIMEDOUT) {
+      rv = pthread_cond_timedwait(&smp->scv, &smp->slock, &abstime);
+    }
+    pthread_mutex_unlock(&smp->slock);
+    sampler_row(sh);
+    pthread_mutex_lock(&smp->slock);
+  }
+  pthread_mutex_unlock(&smp->slock);
+  mlog(SHUF_CALL, "sampler_main: exiting");
+  return(NULL);
+}
+
 /*
  * statedump_oset: helper fn for shuffle statedump
  */
@@ -3426,19 +6744,49 @@ static void statedump_oset(shuffle_t sh, int lvl, const char *name,
   int lck_rv, ql, idx, lsz;
   struct output *out;
   int32_t rtime;
+  struct oqflusher *of;
+  int nfl;
+  struct shuffle_hist hreqs, hbytes;
 
-  notify(lvl, "oset %s: run/shut=%d/%d, fl=%d, flcnt=%d, nrpcs=%d", name,
-         oset->myhgp->nrunning, oset->myhgp->nshutdown, oset->osetflushing,
+  notify(lvl, "oset %s: run/shut=%d/%d, fl=%p, flcnt=%d, nrpcs=%d", name,
+         oset->myhgp->nrunning, oset->myhgp->nshutdown, oset->oflush.curflush,
          acnt32_get(oset->oqflush_counter), oset->outset_nrpcs);
+  if (oset->adaptive)
+    notify(lvl, "oset %s: aimd limit=%d/%d, base=%dus, incr=%d, cut=%d", name,
+           oset->shufsend_rpclimit, oset->osaimd.winmax,
+           oset->osaimd.basertt, oset->osaimd.nincr, oset->osaimd.ncut);
+  shuf_hist_snap(oset->obreqs, &hreqs, 0);
+  shuf_hist_snap(oset->obbytes, &hbytes, 0);
+  if (hreqs.count > 0)
+    notify(lvl, "oset %s: batches=%" PRIu64 ", reqs/b avg=%" PRIu64
+           " p50=%" PRIu64 " max=%" PRIu64 ", bytes/b avg=%" PRIu64
+           " p50=%" PRIu64 " (fill=%" PRIu64 "%%), why=%" PRId64 "/%"
+           PRId64 "/%" PRId64 " (buftarget/flush/ctl)", name, hreqs.count,
+           hreqs.sum / hreqs.count, shuffle_hist_percentile(&hreqs, 50.0),
+           hreqs.max, hbytes.sum / hbytes.count,
+           shuffle_hist_percentile(&hbytes, 50.0), (oset->buftarget > 0) ?
+           (hbytes.sum * 100 / hbytes.count) / oset->buftarget : 0,
+           acnt64_get(oset->ostats, OST_SENDREASON + SHUFFLE_SEND_BUFTARGET),
+           acnt64_get(oset->ostats, OST_SENDREASON + SHUFFLE_SEND_FLUSH),
+           acnt64_get(oset->ostats, OST_SENDREASON + SHUFFLE_SEND_CTL));
 
   for (oqit = oset->oqs.begin() ; oqit != oset->oqs.end() ; oqit++) {
     oq = oqit->second;
     lck_rv = pthread_mutex_trylock(&oq->oqlock);
 
     ql = oq->oqwaitq.size();
-    notify(lvl, "[%d.%d] waslck=%d, loadsz=%d, nsend=%d, nwait=%d, fl=%d/%d",
-           oq->grank, oq->subrank, lck_rv != 0, oq->loadsize, oq->nsending,
-           ql, oq->oqflushing, oq->oqflush_waitcounter);
+    nfl = 0;
+    XTAILQ_FOREACH(of, &oq->oqflushers, ofq) {
+      nfl++;
+    }
+    notify(lvl, "[%d.%d] waslck=%d, loadsz=%d/%d, nsend=%d/%d, nwait=%d, "
+           "fl=%d/%d, nfl=%d, cr=%d/%d", oq->grank, oq->subrank, lck_rv != 0,
+           oq->loadsize, oq->loadcnt, oq->nsending, oq->maxrpc, ql, oq->oqsetflush.ofstate,
+           oq->oqsetflush.ofwaitcounter, nfl, oq->crinflight, oq->crwin);
+    if (oset->adaptive)
+      notify(lvl, "[%d.%d] aimd maxrpc=%d/%d, base=%dus, incr=%d, cut=%d",
+             oq->grank, oq->subrank, oq->maxrpc, oq->oqaimd.winmax,
+             oq->oqaimd.basertt, oq->oqaimd.nincr, oq->oqaimd.ncut);
 
     for (idx = 0, reqit = oq->oqwaitq.begin() ;
          reqit != oq->oqwaitq.end() ; reqit++, idx++) {
@@ -3446,7 +6794,8 @@ static void statedump_oset(shuffle_t sh, int lvl, const char *name,
       parent = req->owner;
 
       if (parent == NULL) {
-        mlog(SHUF_INFO, "oqwaitq[%d] req %p with NULL PARENT?", idx, req);
+        mlog(SHUF_INFO, "oqwaitq[%d], %d->%d, credit R%d", idx, req->src,
+             req->dst, req->crrank);
         continue;
       }
       if (sh->boottime)
@@ -3457,13 +6806,13 @@ static void statedump_oset(shuffle_t sh, int lvl, const char *name,
         mlog(SHUF_INFO,
              "oqwaitq[%d], %d->%d, CLI, refs=%d, hand?=%d, time=%d",
                 idx, req->src, req->dst, acnt32_get(parent->nrefs),
-                parent->input != NULL, rtime);
+                parent_isrpc(parent), rtime);
       else
         mlog(SHUF_INFO,
              "oqwaitq[%d], %d->%d, R%d-%d, refs=%d, hand?=%d, time=%d",
                 idx, req->src, req->dst, parent->rpcin_forwrank,
                 parent->rpcin_seq, acnt32_get(parent->nrefs),
-                parent->input != NULL, rtime);
+                parent_isrpc(parent), rtime);
     }
 
     /* sanity checks */
@@ -3503,10 +6852,13 @@ static void statedump_oset(shuffle_t sh, int lvl, const char *name,
  * shuffle_statedump: dump out current state of shuffle for diagnostics
  */
 void shuffle_statedump(shuffle_t sh, int tostderr) {
-  int lvl, lck_rv, qsz, wsz, idx, rtime;
+  int lvl, lck_rv, qsz, wsz, idx, rtime, ndlv, lcv;
+  int32_t cheld;
   std::deque<request *>::iterator reqit;
   struct request *req;
   struct req_parent *parent;
+  struct delivery *dlvs[SHUFFLE_MAXHANDLERS+1], *dlv;
+  struct dhandler *h;
 
   dumpstats(sh);   /* dump stats first */
 
@@ -3516,61 +6868,338 @@ void shuffle_statedump(shuffle_t sh, int tostderr) {
   notify(lvl, "rank=%d, disablesend=%d, seqsrc=%d", sh->grank,
          sh->disablesend, acnt32_get(sh->seqsrc));
 
-  lck_rv = pthread_mutex_trylock(&sh->deliverlock);
-  qsz = sh->deliverq.size();
-  wsz = sh->dwaitq.size();
-  notify(lvl, "dlvr: waslck=%d, wait=%d, inprog=%d, flcnt=%d, run/shut=%d/%d",
-         lck_rv != 0, qsz, wsz, sh->dflush_counter,
-         sh->drunning, sh->dshutdown);
+  for (lcv = 0 ; lcv < sh->crsize ; lcv++) {
+    cheld = __atomic_load_n(&sh->crheld[lcv], __ATOMIC_RELAXED);
+    if (cheld)
+      notify(lvl, "credit: R%d holds %d of %d", lcv, cheld, sh->creditwin);
+  }
 
-  for (idx = 0, reqit = sh->dwaitq.begin() ;
-       reqit != sh->dwaitq.end() ; reqit++, idx++) {
-    req = *reqit;
-    parent = req->owner;
+  for (lcv = 0 ; lcv < acnt32_get(sh->nhandlers) ; lcv++) {
+    h = &sh->handlers[lcv];
+    notify(lvl, "handler[%d]: types=%u-%u, dlvr=%d", lcv, h->type_lo,
+           h->type_hi, h->dlv->didx);
+  }
 
-    if (parent == NULL) {
-      mlog(SHUF_INFO, "dwaitq[%d] req %p with NULL PARENT?", idx, req);
-      continue;
-    }
-    if (sh->boottime)
-      rtime = (shuftime() - sh->boottime) - parent->timewstart;
-    else
-      rtime = 0;
-   if (parent->rpcin_forwrank == -1 && parent->rpcin_seq == -1)
+  ndlv = shuffle_deliveries(sh, dlvs);
+  for (lcv = 0 ; lcv < ndlv ; lcv++) {
+    dlv = dlvs[lcv];
+    lck_rv = pthread_mutex_trylock(&dlv->deliverlock);
+    qsz = dlv->deliverq.size();
+    wsz = dlv->dwaitq.size();
+    notify(lvl, "dlvr[%d]: waslck=%d, wait=%d, inprog=%d, flcnt=%d, "
+           "run/shut=%d/%d", dlv->didx, lck_rv != 0, qsz, wsz,
+           dlv->dflush_counter, dlv->drunning, dlv->dshutdown);
+
+    for (idx = 0, reqit = dlv->dwaitq.begin() ;
+         reqit != dlv->dwaitq.end() ; reqit++, idx++) {
+      req = *reqit;
+      parent = req->owner;
+
+      if (parent == NULL) {
+        mlog(SHUF_INFO, "dwaitq[%d], %d->%d, credit R%d", idx, req->src,
+             req->dst, req->crrank);
+        continue;
+      }
+      if (sh->boottime)
+        rtime = (shuftime() - sh->boottime) - parent->timewstart;
+      else
+        rtime = 0;
+      if (parent->rpcin_forwrank == -1 && parent->rpcin_seq == -1)
         mlog(SHUF_INFO,
              "dwaitq[%d], %d->%d, CLI, refs=%d, hand?=%d, time=%d",
                 idx, req->src, req->dst, acnt32_get(parent->nrefs),
-                parent->input != NULL, rtime);
+                parent_isrpc(parent), rtime);
       else
         mlog(SHUF_INFO,
              "dwaitq[%d], %d->%d, R%d-%d, refs=%d, hand?=%d, time=%d",
                 idx, req->src, req->dst, parent->rpcin_forwrank,
                 parent->rpcin_seq, acnt32_get(parent->nrefs),
-                parent->input != NULL, rtime);
+                parent_isrpc(parent), rtime);
+    }
 
+    if (lck_rv == 0) pthread_mutex_unlock(&dlv->deliverlock);
   }
 
-  if (lck_rv == 0) pthread_mutex_unlock(&sh->deliverlock);
-
-  notify(lvl, "flsh: cur=%p, typ=%d, done=%d", sh->curflush, sh->flushtype,
-         sh->flushdone);
+  notify(lvl, "flsh: deliver cur=%p, cnt=%d", sh->dflush.curflush,
+         acnt32_get(sh->dflush_count));
+  notify(lvl, "epoch: cur=%d, done<%d, q=%d.%d, wave=%d/%d, sent/recv=%d/%d",
+         acnt32_get(sh->epoch), sh->edone, sh->eqepoch, sh->eqwave,
+         sh->ewave, sh->ereports,
+         acnt32_get(sh->esent[acnt32_get(sh->epoch) & 1]),
+         acnt32_get(sh->erecv[acnt32_get(sh->epoch) & 1]));
   statedump_oset(sh, lvl, "local_orgin", &sh->local_orq);
   statedump_oset(sh, lvl, "local_relay", &sh->local_rlq);
   statedump_oset(sh, lvl, "remote", &sh->remoteq);
 }
 
+/*
+ * statedump_json_ostats: helper fn for shuffle_statedump_json, print
+ * one outset's counters as a JSON object
+ *
+ * @param fp file to print to
+ * @param ost the counters
+ */
+static void statedump_json_ostats(FILE *fp,
+                                  struct shuffle_outset_stats *ost) {
+  fprintf(fp, "{\"reqs\":%" PRIu64 ",\"bytes\":%" PRIu64 ",\"sends\":%"
+          PRIu64 ",\"sendbytes\":%" PRIu64 ",\"flushsends\":%" PRIu64
+          ",\"waits\":%" PRIu64 ",\"credwaits\":%" PRIu64
+          ",\"senderlimit\":%" PRIu64 ",\"flushes\":%" PRIu64
+          ",\"sendreason\":{\"buftarget\":%" PRIu64 ",\"flush\":%"
+          PRIu64 ",\"ctl\":%" PRIu64 "}}", ost->reqs, ost->bytes,
+          ost->sends, ost->sendbytes, ost->flushsends, ost->waits,
+          ost->credwaits, ost->senderlimit, ost->flushes,
+          ost->sendreason[SHUFFLE_SEND_BUFTARGET],
+          ost->sendreason[SHUFFLE_SEND_FLUSH],
+          ost->sendreason[SHUFFLE_SEND_CTL]);
+}
+
+/*
+ * statedump_json_oset: helper fn for shuffle_statedump_json, print
+ * an outset and all its output queues as a JSON object.  like
+ * statedump_oset, we only trylock the queues (we may be called when
+ * the shuffle is hung) and report if a lock was held by someone else.
+ *
+ * @param sh the shuffle
+ * @param fp file to print to
+ * @param oset the outset
+ * @param now shuf_now_us() at the start of the dump
+ */
+static void statedump_json_oset(shuffle_t sh, FILE *fp, struct outset *oset,
+                                uint64_t now) {
+  std::map<hg_addr_t,struct outqueue *>::iterator oqit;
+  struct outqueue *oq;
+  struct output *out;
+  struct oqflusher *of;
+  int lck_rv, nfl, first, firstout;
+  int64_t oldest;
+
+  (void)sh;
+  fprintf(fp, "{\"running\":%d,\"shutdown\":%d,"
+          "\"flushing\":%d,\"flushcnt\":%d,\"nrpcs\":%d,\"rpclimit\":%d,"
+          "\"maxoqrpc\":%d,\"buftarget\":%d,\"adaptive\":%d,"
+          "\"nqueues\":%zu,\"outqueues\":[",
+          oset->myhgp->nrunning,
+          oset->myhgp->nshutdown, oset->oflush.curflush != NULL,
+          acnt32_get(oset->oqflush_counter), oset->outset_nrpcs,
+          oset->shufsend_rpclimit, oset->maxoqrpc, oset->buftarget,
+          oset->adaptive, oset->oqs.size());
+
+  first = 1;
+  for (oqit = oset->oqs.begin() ; oqit != oset->oqs.end() ; oqit++) {
+    oq = oqit->second;
+    lck_rv = pthread_mutex_trylock(&oq->oqlock);
+
+    nfl = 0;
+    XTAILQ_FOREACH(of, &oq->oqflushers, ofq) {
+      nfl++;
+    }
+    oldest = (oq->oqwaitq.empty()) ? -1 :
+             (int64_t)(now - oq->oqwaitq.front()->qtime);
+    fprintf(fp, "%s\n{\"grank\":%d,\"subrank\":%d,\"waslck\":%d,"
+            "\"loadsize\":%d,\"loadcnt\":%d,\"nsending\":%d,"
+            "\"maxrpc\":%d,\"nwait\":%zu,\"oldestwait_us\":%" PRId64
+            ",\"flstate\":%d,\"flwait\":%d,\"nflushers\":%d,"
+            "\"crinflight\":%d,\"crwin\":%d", (first) ? "" : ",",
+            oq->grank, oq->subrank, lck_rv != 0, oq->loadsize, oq->loadcnt,
+            oq->nsending, oq->maxrpc, oq->oqwaitq.size(), oldest,
+            oq->oqsetflush.ofstate, oq->oqsetflush.ofwaitcounter, nfl,
+            oq->crinflight, oq->crwin);
+    first = 0;
+    if (oq->direct)
+      fprintf(fp, ",\"direct\":1");
+    if (oq->oqhgp->rail)
+      fprintf(fp, ",\"rail\":%d", oq->oqhgp->rail);
+    if (oset->adaptive)
+      fprintf(fp, ",\"aimd\":{\"win\":%d,\"winmax\":%d,\"basertt\":%d,"
+              "\"incr\":%d,\"cut\":%d}", oq->maxrpc, oq->oqaimd.winmax,
+              oq->oqaimd.basertt, oq->oqaimd.nincr, oq->oqaimd.ncut);
+
+    fprintf(fp, ",\"outs\":[");
+    firstout = 1;
+    XTAILQ_FOREACH(out, &oq->outs, q) {
+      fprintf(fp, "%s{\"seq\":%d,\"ostep\":%d,\"bytes\":%d,"
+              "\"age_us\":%" PRId64 "}", (firstout) ? "" : ",",
+              out->outseq, out->ostep, out->obytes, (out->tstart_us) ?
+              (int64_t)(now - out->tstart_us) : (int64_t)-1);
+      firstout = 0;
+    }
+    fprintf(fp, "]");
+
+#ifdef SHUFFLE_COUNT
+    fprintf(fp, ",\"counts\":{\"reqs\":[%d,%d],\"sends\":%d,"
+            "\"flushsends\":%d,\"waits\":[%d,%d],\"maxwait\":%u,"
+            "\"flushes\":%d,\"dstflushes\":%d,\"flushorder\":%d,"
+            "\"credwait\":%d}", oq->cntoqreqs[0], oq->cntoqreqs[1],
+            oq->cntoqsends, oq->cntoqflushsend, oq->cntoqwaits[0],
+            oq->cntoqwaits[1], oq->cntoqmaxwait, oq->cntoqflushes,
+            oq->cntoqdstflushes, oq->cntoqflushorder, oq->cntoqcredwait);
+#endif
+    fprintf(fp, "}");
+
+    if (lck_rv == 0) pthread_mutex_unlock(&oq->oqlock);
+  }
+  fprintf(fp, "]}");
+}
+
+/*
+ * shuffle_statedump_json: dump current state of shuffle as JSON
+ */
+void shuffle_statedump_json(shuffle_t sh, FILE *fp) {
+  const char *onames[3] = { "local_origin", "local_relay", "remote" };
+  struct outset *o[3] = { &sh->local_orq, &sh->local_rlq, &sh->remoteq };
+  struct delivery *dlvs[SHUFFLE_MAXHANDLERS+1], *dlv;
+  struct shuffle_outset_stats *ost[3];
+  struct shuffle_stats st;
+  struct shuffle_hist hst;
+  struct dhandler *h;
+  int lck_rv, ndlv, lcv, first, ep;
+  int32_t cheld;
+  int64_t oldest;
+  uint64_t now;
+
+  now = shuf_now_us();
+  shuffle_get_stats(sh, &st);
+  ost[0] = &st.local_origin;
+  ost[1] = &st.local_relay;
+  ost[2] = &st.remote;
+
+  fprintf(fp, "{\"rank\":%d,\"disablesend\":%d,\"seqsrc\":%d,"
+          "\"latstamp\":%d,\"routing\":%d,\"srcreps\":%d,\"repsel\":%d,"
+          "\"rails\":%d,\"enqstage\":%d,", sh->grank, sh->disablesend,
+          acnt32_get(sh->seqsrc), sh->latstamp, sh->routing, sh->nreps,
+          sh->repsel, sh->nrails, sh->stagebytes);
+
+  /* relay workers */
+  fprintf(fp, "\n\"relay\":[");
+  for (lcv = 0 ; lcv < sh->nrelay ; lcv++) {
+    pthread_mutex_lock(&sh->relayw[lcv].rwlock);
+    fprintf(fp, "%s{\"qlen\":%d,\"maxq\":%d,\"nproc\":%" PRIu64 "}",
+            (lcv) ? "," : "", sh->relayw[lcv].rwqlen, sh->relayw[lcv].rwmaxq,
+            sh->relayw[lcv].rwnproc);
+    pthread_mutex_unlock(&sh->relayw[lcv].rwlock);
+  }
+  fprintf(fp, "],");
+
+  /* counters */
+  fprintf(fp, "\n\"stats\":{\"enqueues\":%" PRIu64 ",\"enqbytes\":%"
+          PRIu64 ",\"bcasts\":%" PRIu64 ",\"rpcin_local\":%" PRIu64
+          ",\"rpcin_remote\":%" PRIu64 ",\"credfallback\":%" PRIu64
+          ",\"dreqs\":%" PRIu64 ",\"dwaits\":%" PRIu64 ",\"delivers\":%"
+          PRIu64 ",\"deliverbytes\":%" PRIu64 ",\"dnocb\":%" PRIu64
+          ",\"dflushes\":%" PRIu64 ",\"flushwaits\":%" PRIu64
+          ",\"dstflushes\":%" PRIu64 ",\"epochs\":%" PRIu64
+          ",\"stranded\":%" PRIu64 ",\"directqs\":%" PRIu64
+          ",\"directreqs\":%" PRIu64 ",\"srcrepreqs\":%" PRIu64
+          ",\"srcrepbytes\":%" PRIu64 ",\"relaybatches\":%" PRIu64
+          ",\"stagereqs\":%" PRIu64 ",\"stagemerges\":%" PRIu64,
+          st.enqueues, st.enqbytes, st.bcasts, st.rpcin_local,
+          st.rpcin_remote, st.credfallback, st.dreqs, st.dwaits,
+          st.delivers, st.deliverbytes, st.dnocb, st.dflushes,
+          st.flushwaits, st.dstflushes, st.epochs, st.stranded, st.directqs,
+          st.directreqs, st.srcrepreqs, st.srcrepbytes, st.relaybatches,
+          st.stagereqs, st.stagemerges);
+  for (lcv = 0 ; lcv < 3 ; lcv++) {
+    fprintf(fp, ",\"%s\":", onames[lcv]);
+    statedump_json_ostats(fp, ost[lcv]);
+  }
+  fprintf(fp, "},");
+
+  /* histogram summaries */
+  fprintf(fp, "\n\"hist\":{");
+  for (lcv = 0 ; lcv < SHUFFLE_NHIST ; lcv++) {
+    shuffle_get_hist(sh, lcv, &hst, 0);
+    fprintf(fp, "%s\"%s\":{\"n\":%" PRIu64 ",\"avg\":%" PRIu64
+            ",\"p50\":%" PRIu64 ",\"p99\":%" PRIu64 ",\"max\":%" PRIu64
+            "}", (lcv) ? "," : "", histnames[lcv], hst.count,
+            (hst.count) ? hst.sum / hst.count : 0,
+            shuffle_hist_percentile(&hst, 50.0),
+            shuffle_hist_percentile(&hst, 99.0), hst.max);
+  }
+  fprintf(fp, "},");
+
+  /* credits held by senders on our waitqs */
+  fprintf(fp, "\n\"credit\":{\"window\":%d,\"held\":[", sh->creditwin);
+  first = 1;
+  for (lcv = 0 ; lcv < sh->crsize ; lcv++) {
+    cheld = __atomic_load_n(&sh->crheld[lcv], __ATOMIC_RELAXED);
+    if (cheld == 0)
+      continue;
+    fprintf(fp, "%s{\"rank\":%d,\"bytes\":%d}", (first) ? "" : ",",
+            lcv, cheld);
+    first = 0;
+  }
+  fprintf(fp, "]},");
+
+  /* handlers and delivery queues */
+  fprintf(fp, "\n\"handlers\":[");
+  for (lcv = 0 ; lcv < acnt32_get(sh->nhandlers) ; lcv++) {
+    h = &sh->handlers[lcv];
+    fprintf(fp, "%s{\"type_lo\":%u,\"type_hi\":%u,\"dlvr\":%d}",
+            (lcv) ? "," : "", h->type_lo, h->type_hi, h->dlv->didx);
+  }
+  fprintf(fp, "],");
+
+  fprintf(fp, "\n\"deliveries\":[");
+  ndlv = shuffle_deliveries(sh, dlvs);
+  for (lcv = 0 ; lcv < ndlv ; lcv++) {
+    dlv = dlvs[lcv];
+    lck_rv = pthread_mutex_trylock(&dlv->deliverlock);
+    oldest = (dlv->dwaitq.empty()) ? -1 :
+             (int64_t)(now - dlv->dwaitq.front()->qtime);
+    fprintf(fp, "%s{\"didx\":%d,\"waslck\":%d,\"deliverq\":%zu,"
+            "\"dwaitq\":%zu,\"oldestwait_us\":%" PRId64 ",\"flcnt\":%d,"
+            "\"running\":%d,\"shutdown\":%d", (lcv) ? ",\n" : "",
+            dlv->didx, lck_rv != 0, dlv->deliverq.size(), dlv->dwaitq.size(),
+            oldest, dlv->dflush_counter, dlv->drunning, dlv->dshutdown);
+#ifdef SHUFFLE_COUNT
+    fprintf(fp, ",\"counts\":{\"dblock\":%d,\"delivers\":%d,"
+            "\"reqs\":[%d,%d],\"waits\":[%d,%d],\"maxwait\":%u,"
+            "\"nocb\":%d}", dlv->cntdblock, dlv->cntdeliver,
+            dlv->cntdreqs[0], dlv->cntdreqs[1], dlv->cntdwait[0],
+            dlv->cntdwait[1], dlv->cntdmaxwait, dlv->cntdnocb);
+#endif
+    fprintf(fp, "}");
+    if (lck_rv == 0) pthread_mutex_unlock(&dlv->deliverlock);
+  }
+  fprintf(fp, "],");
+
+  /* flush and epoch state */
+  fprintf(fp, "\n\"flush\":{\"deliver_busy\":%d,\"deliver_cnt\":%d},",
+          sh->dflush.curflush != NULL, acnt32_get(sh->dflush_count));
+  ep = acnt32_get(sh->epoch);
+  fprintf(fp, "\n\"epoch\":{\"cur\":%d,\"done\":%d,\"qepoch\":%d,"
+          "\"qwave\":%d,\"wave\":%d,\"reports\":%d,\"sent\":%d,"
+          "\"recv\":%d},", ep, sh->edone, sh->eqepoch, sh->eqwave,
+          sh->ewave, sh->ereports, acnt32_get(sh->esent[ep & 1]),
+          acnt32_get(sh->erecv[ep & 1]));
+
+  /* output queues */
+  fprintf(fp, "\n\"outsets\":{");
+  for (lcv = 0 ; lcv < 3 ; lcv++) {
+    fprintf(fp, "%s\"%s\":", (lcv) ? ",\n" : "", onames[lcv]);
+    statedump_json_oset(sh, fp, o[lcv], now);
+  }
+  fprintf(fp, "}}\n");
+  fflush(fp);
+}
+
 /*
  * shuffle_shutdown: stop all threads, release all memory.
  * does not shutdown mercury (since we didn't start it, nexus did),
  * but mercury should not be restarted once we call this.
  */
 hg_return_t shuffle_shutdown(shuffle_t sh) {
-  int cnt;
+  int cnt, lcv;
   mlog(CLNT_CALL, "shuffer_shutdown");
 
   /*  switch off inbound RPC by killing registered data */
-  HG_Register_data(sh->hgp_local.mcls, sh->hgp_local.rpcid, NULL, NULL);
-  HG_Register_data(sh->hgp_remote.mcls, sh->hgp_remote.rpcid, NULL, NULL);
+  if (!sh->hgp_local.memx) {
+    HG_Register_data(sh->hgp_local.mcls, sh->hgp_local.rpcid, NULL, NULL);
+    for (lcv = 0 ; lcv < sh->nrails ; lcv++)
+      HG_Register_data(shuffle_rail(sh, lcv)->mcls,
+                       shuffle_rail(sh, lcv)->rpcid, NULL, NULL);
+  }
 
   /* stop all new inbound requests */
   sh->disablesend = 1;
@@ -3587,18 +7216,48 @@ hg_return_t shuffle_shutdown(shuffle_t sh) {
     notify(CLNT_CRIT, "shuffle: shutdown warning: %d orphans", cnt);
   }
 
-  /* dump counters */
+  /* dump counters and trace (threads are stopped, rings are stable) */
   dumpstats(sh);
+  shuffle_closetrace(sh->grank);
 
   /* now free remaining structure */
   shuffle_outset_discard(&sh->local_orq);     /* ensures maps are empty */
   shuffle_outset_discard(&sh->local_rlq);
   shuffle_outset_discard(&sh->remoteq);
+  direct_destroy(&sh->dir);
   if (sh->funname) free(sh->funname);
   if (sh->seqsrc) acnt32_free(&sh->seqsrc);
-  pthread_mutex_destroy(&sh->deliverlock);
-  pthread_cond_destroy(&sh->delivercv);
+  for (lcv = 0 ; lcv < acnt32_get(sh->nhandlers) ; lcv++) {
+    if (sh->handlers[lcv].dlv != &sh->dlv) {
+      delivery_destroy(sh->handlers[lcv].dlv);
+      delete sh->handlers[lcv].dlv;
+    }
+  }
+  acnt32_free(&sh->nhandlers);
+  acnt32_free(&sh->dflush_count);
+  acnt64_free(&sh->stats);
+  shuf_hist_free(&sh->dwaitlat);
+  shuf_hist_free(&sh->dcblat);
+  shuf_hist_free(&sh->e2elat);
+  shuffle_epoch_discard(sh);
+  sampler_destroy(&sh->smp);
+  recorder_destroy(&sh->rec);
+  relay_destroy(sh);
+  stage_destroy(sh);
+  delivery_destroy(&sh->dlv);
+  pthread_mutex_destroy(&sh->hlock);
   pthread_mutex_destroy(&sh->flushlock);
+  if (sh->crheld) free(sh->crheld);
+  if (sh->hgp_local.memx) {
+    pthread_mutex_destroy(&sh->hgp_local.mqlock);
+    pthread_cond_destroy(&sh->hgp_local.mqcv);
+    for (lcv = 0 ; lcv < sh->nrails ; lcv++) {
+      pthread_mutex_destroy(&shuffle_rail(sh, lcv)->mqlock);
+      pthread_cond_destroy(&shuffle_rail(sh, lcv)->mqcv);
+    }
+  }
+  for (lcv = 1 ; lcv < sh->nrails ; lcv++)
+    rail_destroy(&sh->hgp_rails[lcv - 1]);
   delete sh;
   mlog(CLNT_CALL, "shuffer_shutdown: DONE closing log...");
   shuffle_closelog();
@@ -37,11 +37,14 @@
  * internal data structures for the 3 hop shuffle.
  */
 
+#include <stdio.h>
 #include <time.h>
 
 #include <map>
+#include <set>
 #include <deque>
 #include "acnt_wrap.h"
+#include "shuf_hist.h"
 #include "xqueue.h"
 
 struct req_parent;                  /* forward decl, see below */
@@ -50,9 +53,11 @@ struct hgprogress;                  /* forward decl, see below */
 
 /*
  * request: a structure to describe a single write request.
- * it has a fixed sized header (first four fields), and a
- * variable length data buffer.   we always allocate the header
- * and the data together.   data will be null if datalen == 0.
+ * it has a fixed sized header (first five fields, plus epoch and
+ * tstamp if the matching hflags bits are set), and a variable length
+ * data buffer.   we always allocate the header and the data together.
+ * data will be null if datalen == 0.  hflags holds the shuffle's own
+ * per-request bits so that the app keeps the whole type space.
  */
 struct request {
   /* fields that are transmitted over the wire */
@@ -60,6 +65,12 @@ struct request {
   uint32_t type;                    /* message type (0=normal) */
   int32_t src;                      /* SRC rank */
   int32_t dst;                      /* DST rank */
+  uint8_t hflags;                   /* internal header flags (see below) */
+#define REQ_HF_EPOCH   0x01         /* app msg, counted in "epoch" */
+#define REQ_HF_CTL     0x02         /* shuffle control msg */
+#define REQ_HF_TSTAMP  0x04         /* req carries a tstamp */
+  int32_t epoch;                    /* epoch number (if REQ_HF_EPOCH) */
+  uint64_t tstamp;                  /* enqueue time (usec, if REQ_HF_TSTAMP) */
   void *data;                       /* request data */
 
   /* internal fields (not sent over the wire) */
@@ -70,6 +81,14 @@ struct request {
    * a non-null owner or "next" linkage, lock the req's waitq.
    */
   struct req_parent *owner;         /* waiter that generated the request */
+  /*
+   * reqs from an inbound RPC that fit in the sender's credit window
+   * wait on a waitq with a NULL owner (the RPC has already been
+   * responded to).  crrank is the rank we charged the bytes to
+   * while waiting, or -1 if the req is not using credits.
+   */
+  int32_t crrank;                   /* rank charged for credit, or -1 */
+  uint64_t qtime;                   /* when we put req on a waitq (usec) */
   XSIMPLEQ_ENTRY(request) next;     /* next request in a queue of requests */
 };
 
@@ -88,6 +107,7 @@ typedef struct {
   int32_t iseq;                     /* seq# (echoed back), for debugging */
   int32_t forwardrank;              /* rank of proc that initiated rpc */
   struct request_queue inreqs;      /* list of malloc'd requests */
+  int32_t crleft;                   /* reserved credit not on a waitq (int) */
 } rpcin_t;
 
 /*
@@ -97,13 +117,29 @@ typedef struct {
   int32_t oseq;                     /* seq# (echoed back), for debugging */
   int32_t respondrank;              /* rank of proc sending response */
   int32_t ret;                      /* return value */
+  int32_t credit;                   /* bytes sender may have in flight */
 } rpcout_t;
 
+/* special credit values */
+#define CREDIT_NONE    (-1)         /* receiver does not use credits */
+#define CREDIT_NOREPLY (-2)         /* no valid reply (internal only) */
+
+/*
+ * rpcsrc: the source of an inbound RPC (what we reply to).  this is
+ * a mercury handle, or a memrpc if the in-memory transport is in use.
+ * exactly one of the two is set.
+ */
+struct memrpc;
+struct rpcsrc {
+  hg_handle_t hand;                 /* mercury input handle (or NULL) */
+  struct memrpc *mrpc;              /* in-memory transport rpc (or NULL) */
+};
+
 /*
  * req_parent: a structure to describe the owner of a group of
  * one or more waiting requests.  the owner is either the main
  * application thread (via shuffle_enqueue()) or it is an
- * hg_handle_t from an inbound rpc request.   we use this
+ * inbound rpc request (struct rpcsrc).   we use this
  * to track when all requests have been processed and the caller
  * can continue or the rpc can be responded to (this is for flow
  * control).
@@ -120,7 +156,7 @@ struct req_parent {
   hg_return_t ret;                  /* return status (HG_SUCCESS, normally) */
   int32_t rpcin_seq;                /* saved copy of rpcin.seq */
   int32_t rpcin_forwrank;           /* saved copy of rpcin.forwardrank */
-  hg_handle_t input;                /* RPC input, or NULL for app input */
+  struct rpcsrc input;              /* RPC input, all NULL for app input */
   int32_t timewstart;               /* time wait started */
   /* next three only used if input == NULL (thus via shuffle_enqueue()) */
   pthread_mutex_t pcvlock;          /* lock for pcv */
@@ -131,6 +167,30 @@ struct req_parent {
   struct req_parent *fqnext;        /* free queue next */
 };
 
+/* is a req_parent an inbound RPC (rather than the app)? */
+#define parent_isrpc(P) ((P)->input.hand != NULL || (P)->input.mrpc != NULL)
+
+/*
+ * aimd: state for an adaptive window of outstanding RPCs.  the window
+ * grows by one each time a full window of RPCs completes with a flat
+ * round trip time, and is cut in half when an RPC fails or its round
+ * trip time spikes past AIMD_SPIKE times the baseline.   we cut at most
+ * once per baseline RTT (with a floor of AIMD_MINCOOL usec) so a burst
+ * of slow replies from one congestion event only counts once.
+ */
+struct aimd {
+  int win;                          /* current window (1 <= win <= winmax) */
+  int winmax;                       /* window ceiling */
+  int acks;                         /* good completions since last grow */
+  int basertt;                      /* baseline RTT (usec, 0=none yet) */
+  uint64_t lastcut;                 /* time of last cut (usec) */
+  int nincr;                        /* number of times we grew */
+  int ncut;                         /* number of times we cut */
+};
+
+#define AIMD_SPIKE    3             /* rtt > AIMD_SPIKE*basertt is a spike */
+#define AIMD_MINCOOL  1000          /* min usec between cuts */
+
 /*
  * output: a single output that has been started with HG_Forward()
  * but has not yet completed (i.e. RPC request has been sent, but
@@ -140,9 +200,15 @@ struct req_parent {
 struct output {
   struct outqueue *oqp;             /* owning output queue */
   hg_handle_t outhand;              /* out handle used with HG_Forward() */
+  struct memrpc *outmem;            /* in-memory transport rpc (or NULL) */
   int ostep;                        /* output step */
   int32_t outseq;                   /* output seq# to use for this output */
   int32_t timestart;                /* time we started output */
+  uint64_t tstart_us;               /* time we forwarded it (usec) */
+  int ortt;                         /* RTT (usec) from forw_cb, or -1 */
+  int ofailed;                      /* non-zero if RPC failed */
+  int obytes;                       /* #bytes of req data in this output */
+  int32_t ocredit;                  /* credit from reply (or NOREPLY) */
 #define OSTEP_PREP 0                /* prepare, not at forward_reqs_now yet */
 #define OSTEP_SEND 1                /* forward_reqs_now sending */
 #define OSTEP_CANCEL (-1)           /* trying to cancel request */
@@ -154,6 +220,33 @@ struct output {
  */
 XTAILQ_HEAD(sending_outputs, output);
 
+/*
+ * oqflusher: a flush in progress on an output queue.  the flush
+ * first waits for the reqs on oqwaitq at the time of the flush to be
+ * pulled off (ofwaitcounter), then for all outputs up to and including
+ * ofoutput to finish.  an outqueue can have several flushers active
+ * at once (e.g. an outset flush and a shuffle_flush_dst()).  locked
+ * with the outqueue's oqlock.
+ */
+struct oqflusher {
+  int ofstate;                      /* see below */
+#define OQF_CANCEL     -1           /* flush was canceled */
+#define OQF_IDLE        0           /* not flushing */
+#define OQF_WAITQ       1           /* waiting for waitq reqs to drain */
+#define OQF_OUTS        2           /* waiting for ofoutput to finish */
+#define OQF_DONE        3           /* flush completed */
+#define OQF_ACTIVE(OF) ((OF)->ofstate == OQF_WAITQ || (OF)->ofstate == OQF_OUTS)
+  int ofwaitcounter;                /* #of waitq reqs flush is waiting on */
+  struct output *ofoutput;          /* output flush is waiting on */
+  pthread_cond_t *ofcv;             /* signal when done (NULL=outset flush) */
+  XTAILQ_ENTRY(oqflusher) ofq;      /* linkage on oq's oqflushers list */
+};
+
+/*
+ * oqflusher_list: list of active flushers on an outqueue
+ */
+XTAILQ_HEAD(oqflusher_list, oqflusher);
+
 /*
  * outqueue: an output queue to a mercury endpoint (either na+sm or
  * network).  we append a request to "loading" each time we get an
@@ -167,20 +260,31 @@ struct outqueue {
   /* the next two are cached from nexus for debug output */
   int grank;                        /* global rank of endpoint */
   int subrank;                      /* local rank or node number */
+  int direct;                       /* direct (one hop) queue? see direct */
+  struct hgprogress *oqhgp;         /* progressor (rail) that sends for us */
+  int oqidx;                        /* index over all outsets (for stages) */
 
   pthread_mutex_t oqlock;           /* output queue lock */
   struct request_queue loading;     /* list of requests we are loading */
   int loadsize;                     /* size of loading, send when buftarget */
+  int loadcnt;                      /* number of reqs in loading */
 
   struct sending_outputs outs;      /* outputs currently being sent to dst */
   int nsending;                     /* #of outputs alloc'd for dst */
+  int maxrpc;                       /* live max# of outputs (see oqaimd) */
+  struct aimd oqaimd;               /* adaptive maxrpc (if oset adaptive) */
 
   std::deque<request *> oqwaitq;    /* if queue full, waitq of reqs */
+  int waitbytes;                    /* data bytes on oqwaitq */
+
+  /* credit flow control (sender side) */
+  int crwin;                        /* last credit from dst (or NONE) */
+  int crinflight;                   /* bytes in outputs not yet replied */
+  int repdepth;                     /* load+wait+crinflight (atomic) */
 
   /* fields for flushing an output queue */
-  int oqflushing;                   /* 1 if oq is flushing */
-  int oqflush_waitcounter;          /* #of waitq reqs flush is waiting on */
-  struct output *oqflush_output;    /* output flush is waiting on */
+  struct oqflusher oqsetflush;      /* flusher used by the outset's flush */
+  struct oqflusher_list oqflushers; /* active flushers (oqsetflush, dst) */
 
 #ifdef SHUFFLE_COUNT
   /* index 0 is for input==NULL (local reqs), 1 for forwarded reqs */
@@ -190,7 +294,9 @@ struct outqueue {
   int cntoqwaits[2];                /* number of reqs that go on oqwaitq */
   unsigned int cntoqmaxwait;        /* max wait queue size */
   int cntoqflushes;                 /* number of flushes on non-empty oq */
+  int cntoqdstflushes;              /* number of shuffle_flush_dst() calls */
   int cntoqflushorder;              /* flush rpc finished in different order */
+  int cntoqcredwait;                /* reqs that waited due to no credit */
 #endif
 };
 
@@ -214,6 +320,91 @@ struct shufsend_waiter {
  */
 XTAILQ_HEAD(sendwaiterlist, shufsend_waiter);
 
+/*
+ * flush_op: a flush operation.  may be on a target's pending list
+ * waiting to run, may be currently running, or may be finished.
+ * allocated by shuffle_flush_start() (it is the shuffle_flush_t
+ * handle).  the op is self-contained: status is locked with its own
+ * flush_oplock (not the shuffle's flushlock) and it holds two refs,
+ * one for the app's handle (dropped by shuffle_flush_wait) and one
+ * for its flush target (dropped when the op finishes or is canceled).
+ * this keeps handles valid after shuffle_shutdown().
+ */
+struct flush_op {
+  struct flush_target *ftarget;     /* what we are flushing */
+  pthread_mutex_t flush_oplock;     /* locks status and nrefs */
+  pthread_cond_t flush_waitcv;      /* wait here for flush done */
+  int nrefs;                        /* handle ref + target ref */
+  int status;                       /* see below */
+/* status values */
+#define FLUSHQ_PENDING  0           /* flush is on pending list waiting */
+#define FLUSHQ_READY    1           /* flush is running */
+#define FLUSHQ_DONE     2           /* flush has completed */
+#define FLUSHQ_CANCEL  -1           /* flush has been canceled */
+  XSIMPLEQ_ENTRY(flush_op) fq; /* linkage */
+};
+
+/*
+ * flush_queue: queue of flush operations (e.g. pending ops)
+ */
+XSIMPLEQ_HEAD(flush_queue, flush_op);
+
+/*
+ * flush_target: something that can be flushed (an outset or the
+ * set of delivery queues).  flushes of the same target are run one
+ * at a time in FIFO order, but flushes of different targets run
+ * concurrently.  locked with flushlock.
+ */
+struct flush_target {
+  int ftype;                        /* FLUSH_* type of this target */
+  struct outset *foset;             /* outset to flush (NULL for deliver) */
+  struct flush_op *curflush;        /* currently running flush (or NULL) */
+  struct flush_queue fpending;      /* queue of pending flush ops */
+};
+
+/*
+ * always-on statistics.  these live in acnt64_t counter arrays (64 bit
+ * atomics, one per cache line) and are compiled in regardless of
+ * SHUFFLE_COUNT.  shuffle_get_stats() copies them out.  the per-queue
+ * SHUFFLE_COUNT ints below are still available for detailed dumps.
+ */
+#define OST_REQS          0         /* reqs queued on our outqueues */
+#define OST_BYTES         1         /* data bytes of those reqs */
+#define OST_SENDS         2         /* batches (RPCs) sent */
+#define OST_SENDBYTES     3         /* data bytes sent in batches */
+#define OST_FLUSHSENDS    4         /* batches sent early due to flush */
+#define OST_WAITS         5         /* reqs that went on an oqwaitq */
+#define OST_CREDWAITS     6         /* ... of those, waiting on credit */
+#define OST_SENDERLIMIT   7         /* #times we hit shufsend_rpclimit */
+#define OST_FLUSHES       8         /* flush ops started on this outset */
+#define OST_SENDREASON    9         /* batches sent, by SHUFFLE_SEND_* */
+#define OST_NSTATS        (OST_SENDREASON + SHUFFLE_SEND_NREASONS)
+
+#define ST_ENQUEUES       0         /* shuffle_enqueue() calls */
+#define ST_ENQBYTES       1         /* data bytes enqueued */
+#define ST_BCASTS         2         /* shuffle_enqueue_broadcast() calls */
+#define ST_RPCINSHM       3         /* rpcs in on na+sm */
+#define ST_RPCINNET       4         /* rpcs in on network */
+#define ST_CREDFALLBACK   5         /* rpcs over credit (used req_parent) */
+#define ST_DREQS          6         /* reqs input to delivery */
+#define ST_DWAITS         7         /* reqs that went on a dwaitq */
+#define ST_DELIVERS       8         /* delivery callbacks made */
+#define ST_DELIVERBYTES   9         /* data bytes delivered */
+#define ST_DNOCB         10         /* reqs dropped due to no callback */
+#define ST_DFLUSHES      11         /* delivery flush ops started */
+#define ST_FLUSHWAITS    12         /* flush ops that had to queue */
+#define ST_DSTFLUSHES    13         /* shuffle_flush_dst() calls */
+#define ST_EPOCHS        14         /* shuffle_epoch_end() completions */
+#define ST_STRANDED      15         /* stranded reqs (@shutdown) */
+#define ST_DIRECTQS      16         /* direct queues bound to a dst */
+#define ST_DIRECTREQS    17         /* reqs sent on direct queues */
+#define ST_REPREQS       18         /* reqs we relayed as a SRCREP */
+#define ST_REPBYTES      19         /* data bytes of those reqs */
+#define ST_RELAYBATCHES  20         /* batches handed to relay workers */
+#define ST_STAGEREQS     21         /* reqs staged by app threads */
+#define ST_STAGEMERGES   22         /* staged lists merged into outqueues */
+#define ST_NSTATS        23         /* number of shuffle stats */
+
 /*
  * outset: a set of local or remote output queues
  */
@@ -223,6 +414,7 @@ struct outset {
   int buftarget;                    /* target size of an RPC (in bytes) */
   int settype;                      /* remote, origin, or relay */
   int shufsend_rpclimit;            /* block shuffle_enqueue() if past limit */
+  int adaptive;                     /* adapt maxrpc/rpclimit w/AIMD */
 
   /* general state */
   shuffle_t shuf;                   /* shuffle that owns us */
@@ -232,40 +424,184 @@ struct outset {
   pthread_mutex_t os_rpclimitlock;  /* locks next two items */
   int outset_nrpcs;                 /* total# of RPCs running in mercury */
   struct sendwaiterlist shufsendq;  /* list of waiting shuffle_send() ops */
-#ifdef SHUFFLE_COUNT
-  int os_senderlimit;               /* #of times we hit shufsend_rpclimit */
-#endif
+  struct aimd osaimd;               /* adaptive shufsend_rpclimit */
 
   /* a map of all the output queues we known about */
   std::map<hg_addr_t,struct outqueue *> oqs;
 
-  /* state for tracking a flush op (locked w/"flushlock") */
-  int osetflushing;                 /* flushing, want signal on flush_waitcv */
-  acnt32_t oqflush_counter;         /* #qs flushing (hold flushlock to init) */
+  /* state for tracking a flush op */
+  struct flush_target oflush;       /* flush state (locked w/"flushlock") */
+  acnt32_t oqflush_counter;         /* #qs flushing (+1 while starting) */
+
+  acnt64_t ostats;                  /* always-on stats (OST_* indexes) */
+  shuf_hist_t orttlat;              /* batch RTT histogram */
+  shuf_hist_t owaitlat;             /* time on oqwaitq histogram */
+  shuf_hist_t obreqs;               /* reqs per batch histogram */
+  shuf_hist_t obbytes;              /* bytes per batch histogram */
 };
 
 /*
- * flush_op: a flush opearion.  may be on pending list waiting to
- * run or may be currently running.   typically stack allocated by
- * caller...   locked with flushlock.
+ * ctlmsg: payload of a REQ_HF_CTL message.  used for epoch
+ * termination detection (rank 0 sends QUERY waves, other ranks
+ * answer with a REPORT of their per-epoch counters, and rank 0 sends
+ * DONE once two consecutive waves agree and sent == delivered, or
+ * ABORT if they do not within SHUFFLE_TIMEOUT) and
+ * as a flush marker for shuffle_flush_dst() (which dst acks).
  */
-struct flush_op {
-  pthread_cond_t flush_waitcv;      /* wait here for our turn or flush done */
-  int status;                       /* see below */
-/* status values */
-#define FLUSHQ_PENDING  0           /* flush is on pending list waiting */
-#define FLUSHQ_READY    1           /* flush is running */
-#define FLUSHQ_CANCEL  -1           /* flush has been canceled */
-  XSIMPLEQ_ENTRY(flush_op) fq; /* linkage */
+struct ctlmsg {
+  uint32_t op;                      /* see below */
+#define CTL_EPOCH_QUERY     1       /* coordinator asks for counts */
+#define CTL_EPOCH_REPORT    2       /* reply to query */
+#define CTL_EPOCH_DONE      3       /* epoch is globally done */
+#define CTL_FLUSHMARK       4       /* push batches along path (no-op) */
+#define CTL_EPOCH_ABORT     5       /* epoch is done, but counts failed */
+#define CTL_FLUSHACK        6       /* dst delivered up to a flush marker */
+  int32_t epoch;                    /* epoch number */
+  int32_t wave;                     /* wave (query/report), seq# (flush) */
+  uint32_t sent;                    /* #msgs sent in epoch (report) */
+  uint32_t recv;                    /* #msgs delivered in epoch (report) */
 };
 
 /*
- * flush_queue: queue of flush operations (e.g. pending ops)
+ * delivery: a delivery queue and the thread that drains it.  every
+ * shuffle has a default delivery (sh->dlv).  handlers registered with
+ * SHUFFLE_HANDLER_THREAD get a private one so that a slow consumer
+ * of one type range cannot stall delivery of the other types.
  */
-XSIMPLEQ_HEAD(flush_queue, flush_op);
+struct delivery {
+  struct shuffle *dshuf;            /* shuffle that owns us */
+  int didx;                         /* 0 for default, else handler# + 1 */
+
+  pthread_mutex_t deliverlock;      /* locks this block of fields */
+  pthread_cond_t delivercv;         /* deliver thread blocks on this */
+  std::deque<request *> deliverq;   /* acked reqs being delivered */
+  std::deque<request *> dwaitq;     /* unacked reqs waiting for deliver */
+  int dflush_counter;               /* #of req's flush is waiting for */
+  int dshutdown;                    /* to signal dtask to shutdown */
+  int drunning;                     /* dtask is valid and running */
+  pthread_t dtask;                  /* delivery thread */
+
+#ifdef SHUFFLE_COUNT
+  /* lock by deliverlock */
+  int cntdblock;                    /* number of times deliver blocks */
+  int cntdeliver;                   /* number of times delivery cb called */
+  int cntdreqs[2];                  /* number of reqs input */
+  int cntdwait[2];                  /* number of reqs on delivery wait q*/
+  unsigned int cntdmaxwait;         /* max waitq size */
+  int cntdnocb;                     /* reqs dropped due to no callback */
+#endif
+};
+
+/*
+ * dhandler: a delivery callback registered for a range of request
+ * types with shuffle_register_handler().  entries are append-only
+ * and are never changed once published (see nhandlers).
+ */
+struct dhandler {
+  uint32_t type_lo;                 /* first type in range (usr bits) */
+  uint32_t type_hi;                 /* last type in range (inclusive) */
+  shuffle_handlerfn_t fn;           /* callback function */
+  void *arg;                        /* user context passed to fn */
+  struct delivery *dlv;             /* delivery that runs us */
+};
+
+#define SHUFFLE_MAXHANDLERS 16      /* max# of registered handlers */
+
+/*
+ * memrpc: a batch sent with the in-memory transport (router memdst
+ * set).  the sender moves its reqs into the memrpc (no encoding) and
+ * queues it on the dst's hgprogress, whose memx thread runs it
+ * through rpchand.  the reply is sent by queuing the same memrpc
+ * back on the sender's hgprogress, where it completes the output
+ * like forw_cb() would.
+ */
+struct memrpc {
+  rpcin_t in;                       /* the batch (reqs moved from sender) */
+  rpcout_t out;                     /* the reply */
+  int isreply;                      /* on the way back to sender? */
+  struct output *oput;              /* sender's output */
+  struct hgprogress *srchgp;        /* sender's hgprogress (for reply) */
+  XSIMPLEQ_ENTRY(memrpc) mnext;     /* next in memq */
+};
+
+XSIMPLEQ_HEAD(memrpc_queue, memrpc);
+
+/*
+ * relaywork: an inbound batch handed off by rpchand (or memx) to a
+ * relay worker.  "in" owns the decoded reqs.
+ */
+struct relaywork {
+  struct hgprogress *rwhgp;         /* hgprogress the batch came in on */
+  struct rpcsrc rwinput;            /* where it came from (for reply) */
+  rpcin_t rwin;                     /* the decoded batch */
+  int rwreserved;                   /* from rwreserve[] (not malloced) */
+  XSIMPLEQ_ENTRY(relaywork) rwnext; /* next in rwq or rwfree */
+};
+
+XSIMPLEQ_HEAD(relaywork_queue, relaywork);
+
+#define RELAY_NRESERVE 4            /* relaywork reserve for malloc fails */
+
+/*
+ * relayworker: a thread that routes inbound batches (shuffle_rpcin)
+ * so that the progress threads only have to progress and trigger.
+ * batches from a sender always go to the same worker (by forwardrank)
+ * so that they are processed in order.  the progress thread never
+ * waits for a worker: if malloc fails it uses a work item from the
+ * worker's reserve.
+ */
+struct relayworker {
+  struct shuffle *rwshuf;           /* shuffle that owns us */
+  int rwidx;                        /* our index in shuffle's relayw[] */
+  pthread_mutex_t rwlock;           /* locks this block of fields */
+  pthread_cond_t rwcv;              /* worker waits here for work */
+  struct relaywork_queue rwq;       /* batches to process */
+  int rwqlen;                       /* #batches on rwq */
+  int rwactive;                     /* worker is processing a batch */
+  int rwmaxq;                       /* max rwqlen seen (stats) */
+  struct relaywork rwreserve[RELAY_NRESERVE];  /* for malloc failures */
+  struct relaywork_queue rwfree;    /* free entries of rwreserve[] */
+  int rwstop;                       /* tell worker to drain and exit */
+  int rwexited;                     /* worker drained rwq and exited */
+  int rwrunning;                    /* rwtask is valid and running */
+  pthread_t rwtask;                 /* worker thread */
+  uint64_t rwnproc;                 /* #batches processed (stats) */
+};
+
+/*
+ * stageq: an app thread's staged reqs for one output queue
+ */
+struct stageq {
+  struct outqueue *sqoq;            /* queue the reqs are for */
+  struct request_queue sqreqs;      /* staged reqs, in enqueue order */
+  int sqbytes;                      /* data bytes in sqreqs */
+  int sqcnt;                        /* #reqs in sqreqs */
+  int sqdirty;                      /* oqidx is on the stage's sgdirty */
+};
 
 /*
- * hgprogress: state for a mercury progress/trigger thread
+ * enqstage: per-thread staging for shuffle_enqueue() (see enqstage
+ * opt).  reqs are staged per output queue and merged into the queue
+ * in batches, so app threads take each oqlock once per batch rather
+ * than once per msg.  the owning thread holds sglock while staging
+ * (normally uncontended), flushes take it to drain the stage.  stages
+ * are only freed at shutdown: when a thread exits its stage is drained
+ * and left for the next new thread to reuse.
+ */
+struct enqstage {
+  struct shuffle *sgshuf;           /* shuffle that owns us */
+  pthread_mutex_t sglock;           /* locks the following fields */
+  struct stageq *sgq;               /* staged reqs, indexed by oqidx */
+  int *sgdirty;                     /* oqidx's that have staged reqs */
+  int sgndirty;                     /* #entries in sgdirty */
+
+  int sgowned;                      /* a thread is using us (stlock) */
+  struct enqstage *sgnext;          /* next in shuffle's list (stlock) */
+};
+
+/*
+ * hgprogress: state for a mercury progress/trigger thread.  with the
+ * in-memory transport we have our own thread and queue instead.
  */
 struct hgprogress {
   struct shuffle *hgshuf;           /* shuffle that owns us */
@@ -273,8 +609,67 @@ struct hgprogress {
   hg_class_t *mcls;                 /* mercury class (cached from phand) */
   hg_context_t *mctx;               /* mercury context (cached from phand) */
   hg_id_t rpcid;                    /* id of this RPC */
+  int rail;                         /* remote rail# (0 for local/remote) */
+  hg_context_t *railctx;            /* ctx we made for rails 1.. (or NULL) */
   int nshutdown;                    /* network shutdown in progress? */
   int nrunning;                     /* network/progessor valid and running? */
+  /* in-memory transport (memx) */
+  int memx;                         /* using the in-memory transport? */
+  pthread_mutex_t mqlock;           /* protects memq, mqstop */
+  pthread_cond_t mqcv;              /* memx thread waits here */
+  struct memrpc_queue memq;         /* rpcs and replies to process */
+  int mqstop;                       /* tell memx thread to exit */
+  pthread_t mqtask;                 /* memx thread */
+  uint64_t mqnproc;                 /* #memrpcs processed (stats) */
+};
+
+/*
+ * sampler: optional thread that appends a row of queue depths and
+ * counters to a per-rank CSV file every period_ms (for watching a
+ * long run evolve).  it only takes each queue lock long enough to
+ * read a few sizes.
+ */
+struct sampler {
+  int period_ms;                    /* sample period (0 = disabled) */
+  FILE *sfp;                        /* CSV output file */
+  uint64_t t0;                      /* shuf_now_us() at init */
+  pthread_mutex_t slock;            /* locks sshutdown (for scv) */
+  pthread_cond_t scv;               /* sampler sleeps on this */
+  int sshutdown;                    /* to signal stask to shutdown */
+  int srunning;                     /* stask is valid and running */
+  pthread_t stask;                  /* sampler thread */
+};
+
+/*
+ * recorder: optional per-rank log of the app's enqueue calls (a
+ * shuffle_rec per call, see shuffle_api.h).  records are small, so
+ * we just let stdio buffer them under rlock.
+ */
+struct recorder {
+  FILE *rfp;                        /* record file (NULL = disabled) */
+  pthread_mutex_t rlock;            /* serializes writers */
+  uint64_t tlast;                   /* shuf_now_us() of last record */
+  uint64_t nrec;                    /* #records written */
+};
+
+/*
+ * direct: optional one hop network queues for heavy src/dst pairs.
+ * the SRC counts the bytes it sends to each remote dst.  once a dst
+ * passes "dbytes" we bind one of "dmax" spare remote outqueues to it
+ * and send its msgs straight there, skipping both relay hops.  the
+ * spare queues are made at init time (with private placeholder addrs
+ * as keys) so that remoteq's oqs map never changes after init.  dslots
+ * and dnbound are locked with dlock.  doq[] is written once per dst
+ * under dlock and read without it.
+ */
+struct direct {
+  int dmax;                         /* max# of direct queues (0=off) */
+  uint64_t dbytes;                  /* bytes to a dst before going direct */
+  pthread_mutex_t dlock;            /* serializes binding queues */
+  int dnbound;                      /* #of dslots bound so far */
+  struct outqueue **dslots;         /* spare queues (dmax of them) */
+  struct outqueue **doq;            /* direct queue by dst rank (or NULL) */
+  uint64_t *dcount;                 /* bytes sent by dst rank */
 };
 
 /*
@@ -282,16 +677,34 @@ struct hgprogress {
  */
 struct shuffle {
   /* general config */
-  nexus_ctx_t nxp;                  /* routing table */
+  const struct shuffle_router *rt;  /* routing functions */
+  void *rtarg;                      /* routing state (e.g. nexus ctx) */
   int single_hgmode;                /* same hgctx for both local and remote? */
   int grank;                        /* my global rank */
   char *funname;                    /* strdup'd copy of mercury func. name */
   int disablesend;                  /* disable new sends (for shutdown) */
   time_t boottime;                  /* time we started */
+  int latstamp;                     /* stamp reqs w/enqueue time? */
+  int routing;                      /* SHUFFLE_ROUTE_* mode */
+  int nreps;                        /* #SRCREPs per remote node */
+  int repsel;                       /* SHUFFLE_REPSEL_* */
 
   /* mercury progressor linkage */
   struct hgprogress hgp_local;      /* local progress (na+sm) */
   struct hgprogress hgp_remote;     /* network progress (bmi+tcp, etc.) */
+  int nrails;                       /* #network rails (hgp_remote is 0) */
+  struct hgprogress hgp_rails[SHUFFLE_MAXRAILS-1];  /* rails 1 to nrails-1 */
+
+  /* relay workers (optional, nrelay == 0 means rpchand does the work) */
+  int nrelay;                       /* #relay worker threads */
+  struct relayworker *relayw;       /* array of nrelay workers */
+
+  /* per-thread enqueue staging (optional, stagebytes == 0 means off) */
+  int noqs;                         /* #output queues (in all outsets) */
+  int stagebytes;                   /* merge a stageq at this many bytes */
+  pthread_key_t stkey;              /* the calling thread's enqstage */
+  pthread_mutex_t stlock;           /* locks stage list and sgowned */
+  struct enqstage *stages;          /* all stages (in use or not) */
 
   /* output queues */
   struct outset local_orq;          /* for origin/client na+sm to local procs */
@@ -302,25 +715,25 @@ struct shuffle {
   /* delivery queue cfg */
   int deliverq_max;                 /* max #reqs we queue before blocking */
   int deliverq_threshold;           /* wake dlvr when #reqs on q > threshold */
-  shuffle_deliverfn_t delivercb;    /* callback function ptr */
+  shuffle_deliverfn_t delivercb;    /* default callback function ptr */
 
-  /* delivery thread and queue itself */
-  pthread_mutex_t deliverlock;      /* locks this block of fields */
-  pthread_cond_t delivercv;         /* deliver thread blocks on this */
-  std::deque<request *> deliverq;   /* acked reqs being delivered */
-  std::deque<request *> dwaitq;     /* unacked reqs waiting for deliver */
-  int dflush_counter;               /* #of req's flush is waiting for */
-  int dshutdown;                    /* to signal dtask to shutdown */
-  int drunning;                     /* dtask is valid and running */
-  pthread_t dtask;                  /* delivery thread */
+  /* credit flow control (receiver side) */
+  int creditwin;                    /* per-sender credit window (0=off) */
+  int crsize;                       /* #entries in crheld (global size) */
+  int32_t *crheld;                  /* reserved bytes, by sender (atomic) */
 
-  /* flush operation management - flush ops are serialized */
-  pthread_mutex_t flushlock;        /* locks the following fields */
-  struct flush_queue fpending;      /* queue of pending flush ops */
-  struct flush_op *curflush;        /* currently running flush (or NULL) */
-  int flushdone;                    /* set when current op done */
-  int flushtype;                    /* current flush's type (for diag/logs) */
-  struct outset *flushoset;         /* flush outset if local/remote */
+  /* default delivery thread and queue */
+  struct delivery dlv;
+
+  /* per-type delivery handlers */
+  pthread_mutex_t hlock;            /* serializes handler registration */
+  struct dhandler handlers[SHUFFLE_MAXHANDLERS];
+  acnt32_t nhandlers;               /* #of published entries in handlers[] */
+
+  /* flush operation management - serialized per-target (oflush/dflush) */
+  pthread_mutex_t flushlock;        /* locks flush targets and ops */
+  struct flush_target dflush;       /* delivery queue flush target */
+  acnt32_t dflush_count;            /* #deliveries flushing (+1 starting) */
 /* possible flush types */
 #define FLUSH_NONE       0
 #define FLUSH_LOCAL_ORQ  1          /* flushing local origin na+sm queues */
@@ -329,23 +742,32 @@ struct shuffle {
 #define FLUSH_DELIVER    4          /* flushing delivery queue */
 #define FLUSH_NTYPES     5          /* number of types */
 
-#ifdef SHUFFLE_COUNT
-  /* lock by flushlock */
-  int cntflush[FLUSH_NTYPES];       /* number of flush reqs by type */
-  int cntflushwait;                 /* number of blocked flush reqs */
-
-  /* lock by deliverlock */
-  int cntdblock;                    /* number of times deliver blocks */
-  int cntdeliver;                   /* number of times delivery cb called */
-  int cntdreqs[2];                  /* number of reqs input */
-  int cntdwait[2];                  /* number of reqs on delivery wait q*/
-  unsigned int cntdmaxwait;         /* max waitq size */
-
-  /* only accessed by one thread */
-  int cntrpcinshm;                  /* #rpcs in on na+sm */
-  int cntrpcinnet;                  /* #rpcs in on network */
-
-  int cntstranded;                  /* number of stranded reqs (@shutdown) */
-#endif
-
+  /* shuffle_flush_dst() acks (see ctl_recv) */
+  pthread_mutex_t fdlock;           /* locks the following fields */
+  pthread_cond_t fdcv;              /* flush_dst waits for acks here */
+  int32_t fdseq;                    /* next marker seq# */
+  std::set<int32_t> fdpending;      /* seq#s of markers not acked yet */
+
+  /* epoch termination detection (see shuffle_epoch_end) */
+  acnt32_t epoch;                   /* current epoch (set by epoch_end) */
+  acnt32_t esent[2];                /* #msgs sent, by epoch parity */
+  acnt32_t erecv[2];                /* #msgs delivered, by epoch parity */
+  pthread_mutex_t eplock;           /* locks the following fields */
+  pthread_cond_t epcv;              /* epoch_end waits here */
+  int eqepoch;                      /* epoch of latest query recv'd */
+  int eqwave;                       /* wave of latest query recv'd */
+  int edone;                        /* epochs < edone are globally done */
+  int efailed;                      /* latest epoch coordinator gave up on */
+  int ewave;                        /* coordinator: wave being collected */
+  int ereports;                     /* coordinator: #reports for ewave */
+  uint32_t esum[2];                 /* coordinator: sent/recv sums */
+
+  acnt64_t stats;                   /* always-on stats (ST_* indexes) */
+  shuf_hist_t dwaitlat;             /* time on dwaitq histogram */
+  shuf_hist_t dcblat;               /* delivery callback time histogram */
+  shuf_hist_t e2elat;               /* enqueue-to-delivery histogram */
+
+  struct sampler smp;               /* time-series sampler (optional) */
+  struct recorder rec;              /* enqueue recorder (optional) */
+  struct direct dir;                /* direct queues (optional) */
 };
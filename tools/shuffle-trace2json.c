@@ -0,0 +1,187 @@
+/*
+ * Copyright (c) 2017, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * shuffle-trace2json.c  convert shuffle binary trace dumps to JSON
+ */
+
+/*
+ * usage: shuffle-trace2json trace-file ... > trace.json
+ *
+ * reads one or more dumps written by shuffle_trace_dump() (e.g. one
+ * per rank) and writes them to stdout in the chrome trace event
+ * format (load it with chrome://tracing or perfetto).  each rank
+ * is a "process" and each trace ring is a "thread."  batches are
+ * shown as async spans from send to completion, deliveries as
+ * duration spans, and everything else as instant events.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shuf_trace.h"
+
+static const char *flushnames[] = { "flush-none", "flush-origin",
+  "flush-relay", "flush-remote", "flush-deliver" };
+#define NFLUSHNAMES (sizeof(flushnames) / sizeof(flushnames[0]))
+
+static int nout = 0;       /* #events written so far (for commas) */
+
+/*
+ * flushname: get the name of a flush type
+ */
+static const char *flushname(int ftype) {
+  if (ftype < 0 || ftype >= (int)NFLUSHNAMES)
+    return("flush");
+  return(flushnames[ftype]);
+}
+
+/*
+ * emit: print the common start of an event
+ */
+static void emit(const struct shuf_trace_rec *r, const char *name,
+                 const char *cat, const char *ph) {
+  printf("%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%s\","
+         "\"ts\":%llu.%03llu,\"pid\":%d,\"tid\":%u", (nout++) ? "," : "",
+         name, cat, ph, (unsigned long long)(r->ts / 1000),
+         (unsigned long long)(r->ts % 1000), r->me, r->tid);
+}
+
+/*
+ * dorec: convert one record
+ */
+static void dorec(const struct shuf_trace_rec *r) {
+  switch (r->event) {
+  case SHUF_TR_ENQUEUE:
+    emit(r, "enqueue", "client", "i");
+    printf(",\"s\":\"t\",\"args\":{\"dst\":%d,\"type\":%d,\"size\":%u}}",
+           r->peer, r->seq, r->size);
+    break;
+  case SHUF_TR_SEND:
+  case SHUF_TR_FORWCB:
+    emit(r, "batch", "rpc", (r->event == SHUF_TR_SEND) ? "b" : "e");
+    printf(",\"id\":%d,\"args\":{\"dst\":%d,\"size\":%u}}",
+           r->seq, r->peer, r->size);
+    break;
+  case SHUF_TR_RPCIN:
+    emit(r, "rpcin", "rpc", "i");
+    printf(",\"s\":\"t\",\"args\":{\"from\":%d,\"seq\":%d,\"size\":%u}}",
+           r->peer, r->seq, r->size);
+    break;
+  case SHUF_TR_DELIVER_B:
+  case SHUF_TR_DELIVER_E:
+    emit(r, "deliver", "deliver", (r->event == SHUF_TR_DELIVER_B) ? "B" : "E");
+    printf(",\"args\":{\"src\":%d,\"type\":%d,\"size\":%u}}",
+           r->peer, r->seq, r->size);
+    break;
+  case SHUF_TR_FLUSH_B:
+  case SHUF_TR_FLUSH_E:
+    emit(r, flushname(r->seq), "flush",
+         (r->event == SHUF_TR_FLUSH_B) ? "b" : "e");
+    printf(",\"id\":%d}", r->seq);
+    break;
+  default:
+    fprintf(stderr, "shuffle-trace2json: skipping unknown event %d\n",
+            r->event);
+  }
+}
+
+/*
+ * dofile: convert one dump file
+ *
+ * @param file the file to read
+ * @return 0 on success, -1 on error
+ */
+static int dofile(const char *file) {
+  FILE *fp;
+  struct shuf_trace_hdr hdr;
+  struct shuf_trace_ringhdr rh;
+  struct shuf_trace_rec rec;
+  uint32_t ring, lcv;
+  int rv = -1;
+
+  fp = fopen(file, "r");
+  if (fp == NULL) {
+    perror(file);
+    return(-1);
+  }
+  if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+      hdr.magic != SHUF_TRACE_MAGIC) {
+    fprintf(stderr, "%s: not a shuffle trace file\n", file);
+    goto done;
+  }
+  if (hdr.version != SHUF_TRACE_VERSION || hdr.recsize != sizeof(rec)) {
+    fprintf(stderr, "%s: unsupported version %u (recsize %u)\n", file,
+            hdr.version, hdr.recsize);
+    goto done;
+  }
+
+  for (ring = 0 ; ring < hdr.nrings ; ring++) {
+    if (fread(&rh, sizeof(rh), 1, fp) != 1)
+      goto short_read;
+    for (lcv = 0 ; lcv < rh.nrec ; lcv++) {
+      if (fread(&rec, sizeof(rec), 1, fp) != 1)
+        goto short_read;
+      dorec(&rec);
+    }
+  }
+  rv = 0;
+  goto done;
+
+short_read:
+  fprintf(stderr, "%s: short read (truncated file?)\n", file);
+done:
+  fclose(fp);
+  return(rv);
+}
+
+/*
+ * main program
+ */
+int main(int argc, char **argv) {
+  int lcv, rv;
+
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s trace-file ... > trace.json\n", argv[0]);
+    exit(1);
+  }
+
+  rv = 0;
+  printf("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+  for (lcv = 1 ; lcv < argc ; lcv++) {
+    if (dofile(argv[lcv]) < 0)
+      rv = 1;
+  }
+  printf("\n]}\n");
+
+  exit(rv);
+}